@@ -0,0 +1,900 @@
+#include "Analysis.h"
+#include "Opcodes.h"
+#include "Helpers.h"
+#include "Memory.h"
+#include "Sandbox.h"
+#include "VM.h"
+
+#include <algorithm>
+
+// What a register is known to hold
+struct StackVal
+{
+  enum Kind : uint8_t
+  {
+    OTHER, // anything but a stack pointer we can follow
+    FP,    // R10 + off
+  } kind;
+  int64_t off;
+
+  bool operator==(const StackVal& o) const
+  {
+    return kind == o.kind && (kind == OTHER || off == o.off);
+  };
+};
+
+struct StackState
+{
+  bool reached;
+  StackVal r[11];
+};
+
+static unsigned Reg(unsigned num)
+{
+  return (num <= 10) ? num : 0;
+}
+
+// Merge a predecessor's state into that of pc, false if the two
+// disagree on a stack pointer
+static bool Join(StackState& into, const StackState& from)
+{
+  if (!into.reached)
+  {
+    into = from;
+    return true;
+  }
+
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    if (!(into.r[i] == from.r[i]))
+    {
+      if (into.r[i].kind == StackVal::FP || from.r[i].kind == StackVal::FP)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Deepest byte an access of size bytes at R10 + off reaches. Accesses
+// that miss the stack fault and use none of it.
+static int64_t Depth(int64_t off, int64_t size)
+{
+  return (off < 0 && off >= -MAX_BPF_STACK && off + size <= 0) ? -off : 0;
+}
+
+static int64_t AccessSize(uint8_t op)
+{
+  switch (op)
+  {
+    case BPF_LDXB: case BPF_STB: case BPF_STXB:
+      return 1;
+    case BPF_LDXH: case BPF_STH: case BPF_STXH:
+      return 2;
+    case BPF_LDXW: case BPF_STW: case BPF_STXW: case BPF_ATOMIC_W:
+      return 4;
+    default:
+      return 8;
+  }
+}
+
+uint32_t StackUsage(const std::vector<uint64_t>& program)
+{
+  const uint32_t unknown = MAX_BPF_STACK;
+  size_t size = program.size();
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  // one pass in program order sees every predecessor of an instruction
+  // before the instruction itself, except over back edges: those have
+  // to agree with the state the loop was entered with, which then
+  // holds for every iteration
+  std::vector<StackState> states(size + 1);
+  for (StackState& s : states)
+  {
+    s.reached = false;
+  }
+  StackState& entry = states[0];
+  entry.reached = true;
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    entry.r[i].kind = StackVal::OTHER;
+    entry.r[i].off = 0;
+  }
+  entry.r[10].kind = StackVal::FP;
+
+  int64_t depth = 0;
+
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    if (!states[pc].reached)
+    {
+      continue;
+    }
+    StackState s = states[pc];
+
+    uint64_t instr = program[pc];
+    uint8_t op = instr & OP_MASK;
+    unsigned dst = Reg((instr & DST_MASK) >> SHL_DST);
+    unsigned src = Reg((instr & SRC_MASK) >> SHL_SRC);
+    int16_t off = (int16_t)((instr & OFF_MASK) >> SHL_OFF);
+    uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+    bool useSrc = (op & 0x08) != 0;
+    StackVal& d = s.r[dst];
+    const StackVal& sv = s.r[src];
+
+    if (WritesFramePointer(instr))
+    {
+      return unknown;
+    }
+    if (op == BPF_LDDW && src == BPF_PSEUDO_FUNC)
+    {
+      // callbacks take frames of their own below, as deep as they nest
+      return VM_STACK_SIZE;
+    }
+
+    // successors, running off the end counts as an exit
+    bool next = true;
+    bool jump = false;
+    size_t target = 0;
+
+    switch (op & 0x07)
+    {
+      case 0x07: // ALU64
+      case 0x04: // ALU32 and byteswap
+        if (op == BPF_MOV_SRC)
+        {
+          d = sv;
+        }
+        else if (op == BPF_ADD_IMM && d.kind == StackVal::FP)
+        {
+          d.off += imm;
+        }
+        else if (op == BPF_SUB_IMM && d.kind == StackVal::FP)
+        {
+          d.off -= imm;
+        }
+        else if (d.kind == StackVal::FP || (useSrc && sv.kind == StackVal::FP))
+        {
+          // lost track of a stack pointer
+          return unknown;
+        }
+        else
+        {
+          d.kind = StackVal::OTHER;
+        }
+        break;
+
+      case 0x01: // LDX
+        if (sv.kind == StackVal::FP)
+        {
+          depth = std::max(depth, Depth(sv.off + off, AccessSize(op)));
+        }
+        d.kind = StackVal::OTHER;
+        break;
+
+      case 0x02: // ST
+      case 0x03: // STX, atomics
+        if (useSrc && (op & 0x07) == 0x03 && sv.kind == StackVal::FP)
+        {
+          // stored away, could come back through any load
+          return unknown;
+        }
+        if (d.kind == StackVal::FP)
+        {
+          depth = std::max(depth, Depth(d.off + off, AccessSize(op)));
+        }
+        if (op == BPF_ATOMIC_W || op == BPF_ATOMIC_DW)
+        {
+          if (imm == BPF_ATOMIC_CMPXCHG)
+          {
+            s.r[0].kind = StackVal::OTHER;
+          }
+          else if (imm & BPF_ATOMIC_FETCH)
+          {
+            s.r[src].kind = StackVal::OTHER;
+          }
+        }
+        break;
+
+      case 0x00: // LDDW, packet loads
+        (op == BPF_LDDW ? d : s.r[0]).kind = StackVal::OTHER;
+        break;
+
+      case 0x05: // jumps
+        if (op == BPF_EXIT)
+        {
+          next = false;
+        }
+        else if (op == BPF_CALL_IMM)
+        {
+          if (imm == BPF_FUNC_tail_call)
+          {
+            return unknown;
+          }
+          // helpers may read or write from where a pointer argument
+          // points up to the top of the stack
+          for (unsigned i = 1; i <= 5; i++)
+          {
+            if (s.r[i].kind == StackVal::FP)
+            {
+              depth = std::max(depth, Depth(s.r[i].off, 1));
+            }
+          }
+          for (unsigned i = 0; i <= 5; i++)
+          {
+            s.r[i].kind = StackVal::OTHER;
+          }
+        }
+        else
+        {
+          int64_t t = (int64_t)pc + 1 + off;
+          if (t < 0 || (t <= (int64_t)pc && !states[t].reached))
+          {
+            return unknown;
+          }
+          target = std::min<int64_t>(t, size);
+          jump = true;
+          next = (op != BPF_JA);
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    if (jump && !Join(states[target], s))
+    {
+      return unknown;
+    }
+    if (next && !Join(states[pc + 1], s))
+    {
+      return unknown;
+    }
+  }
+
+  return std::min<uint32_t>((depth + 7) & ~7LL, MAX_BPF_STACK);
+}
+
+/* ------------------------- Loops ------------------------------ */
+
+static bool IsJump(uint8_t op)
+{
+  return (op & 0x07) == 0x05 && op != BPF_CALL_IMM && op != BPF_EXIT;
+}
+
+static int64_t JumpTarget(uint64_t instr, size_t pc)
+{
+  return (int64_t)pc + 1 + (int16_t)((instr & OFF_MASK) >> SHL_OFF);
+}
+
+static bool IsPseudoFunc(uint64_t instr)
+{
+  return (instr & OP_MASK) == BPF_LDDW
+          && ((instr & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC;
+}
+
+// Whether instr may change register reg
+static bool Writes(uint64_t instr, unsigned reg)
+{
+  uint8_t op = instr & OP_MASK;
+  unsigned dst = Reg((instr & DST_MASK) >> SHL_DST);
+  unsigned src = Reg((instr & SRC_MASK) >> SHL_SRC);
+  uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+
+  switch (op & 0x07)
+  {
+    case 0x07: // ALU64
+    case 0x04: // ALU32 and byteswap
+    case 0x01: // LDX
+      return dst == reg;
+    case 0x00: // LDDW, packet loads
+      return (op == BPF_LDDW ? dst : 0) == reg;
+    case 0x03: // STX, atomics
+      if (op == BPF_ATOMIC_W || op == BPF_ATOMIC_DW)
+      {
+        return (imm == BPF_ATOMIC_CMPXCHG) ? reg == 0
+             : (imm & BPF_ATOMIC_FETCH) && src == reg;
+      }
+      return false;
+    case 0x05: // helpers clobber R0-R5
+      return op == BPF_CALL_IMM && reg <= 5;
+    default:
+      return false;
+  }
+}
+
+// Outcome of a conditional jump, as VM::Eval has it
+static bool Cond(uint8_t op, uint64_t d, uint64_t s)
+{
+  switch (op & 0xf0)
+  {
+    case 0x10: return d == s;
+    case 0x20: return d > s;
+    case 0x30: return d >= s;
+    case 0x40: return (d & s) != 0;
+    case 0x50: return d != s;
+    case 0x60: return (int64_t)d > (int64_t)s;
+    default:   return (int64_t)d >= (int64_t)s;
+  }
+}
+
+// Registers known to hold a constant before an instruction
+struct ConstState
+{
+  bool reached;
+  bool known[11];
+  uint64_t v[11];
+};
+
+static void Forget(ConstState& s)
+{
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    s.known[i] = false;
+  }
+}
+
+static void Join(ConstState& into, const ConstState& from)
+{
+  if (!into.reached)
+  {
+    into = from;
+    return;
+  }
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    into.known[i] = into.known[i] && from.known[i] && into.v[i] == from.v[i];
+  }
+}
+
+// Constants on entry to every instruction, following jumps forward.
+// Entering a loop header, registers written anywhere in the loop are
+// forgotten; entry keeps the state the loop is entered with.
+static std::vector<ConstState> Constants(const std::vector<uint64_t>& program,
+                                         const std::vector<LoopBound>& loops,
+                                         std::vector<ConstState>& entry)
+{
+  size_t size = program.size();
+  std::vector<ConstState> states(size + 1);
+  for (ConstState& s : states)
+  {
+    s.reached = false;
+    Forget(s);
+  }
+  entry = states;
+
+  // the program and its callbacks start with nothing known
+  states[0].reached = true;
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    int64_t t = (int64_t)pc + 1 + (int32_t)((program[pc] & IMM_MASK) >> SHL_IMM);
+    if (IsPseudoFunc(program[pc]) && t >= 0 && (size_t)t < size)
+    {
+      states[t].reached = true;
+    }
+  }
+
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    if (!states[pc].reached)
+    {
+      continue;
+    }
+    for (const LoopBound& l : loops)
+    {
+      if (l.header == pc)
+      {
+        entry[pc] = states[pc];
+        for (size_t i = l.header; i <= l.latch; i++)
+        {
+          for (unsigned r = 0; r <= 10; r++)
+          {
+            states[pc].known[r] = states[pc].known[r] && !Writes(program[i], r);
+          }
+        }
+      }
+    }
+    ConstState s = states[pc];
+
+    uint64_t instr = program[pc];
+    uint8_t op = instr & OP_MASK;
+    unsigned dst = Reg((instr & DST_MASK) >> SHL_DST);
+    unsigned src = Reg((instr & SRC_MASK) >> SHL_SRC);
+    uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+
+    bool known = false;
+    uint64_t v = 0;
+    switch (op)
+    {
+      case BPF_MOV_IMM:
+        known = true;
+        v = imm;
+        break;
+      case BPF_MOV_SRC:
+        known = s.known[src];
+        v = s.v[src];
+        break;
+      case BPF_ADD_IMM:
+        known = s.known[dst];
+        v = s.v[dst] + imm;
+        break;
+      case BPF_SUB_IMM:
+        known = s.known[dst];
+        v = s.v[dst] - imm;
+        break;
+      case BPF_LDDW:
+        known = true;
+        v = IsPseudoFunc(instr) ? pc + 1 + (int32_t)imm : imm;
+        break;
+      default:
+        break;
+    }
+    for (unsigned r = 0; r <= 10; r++)
+    {
+      s.known[r] = s.known[r] && !Writes(instr, r);
+    }
+    if (known)
+    {
+      s.known[dst] = true;
+      s.v[dst] = v;
+    }
+
+    // successors, back edges are left to the loop headers
+    if (IsJump(op))
+    {
+      int64_t t = JumpTarget(instr, pc);
+      if (t > (int64_t)pc)
+      {
+        Join(states[std::min<size_t>(t, size)], s);
+      }
+    }
+    if (op != BPF_JA && op != BPF_EXIT)
+    {
+      Join(states[pc + 1], s);
+    }
+  }
+
+  return states;
+}
+
+// Loops of program with their trip counts, and the constants on entry
+// to each instruction. False if a backward jump is not a loop that can
+// be bounded.
+static bool FindLoops(const std::vector<uint64_t>& program,
+                      std::vector<LoopBound>& loops,
+                      std::vector<ConstState>& consts)
+{
+  size_t size = program.size();
+  loops.clear();
+
+  // one back edge per loop, a conditional jump comparing a register
+  // with a constant
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    uint64_t instr = program[pc];
+    uint8_t op = instr & OP_MASK;
+    int64_t t = JumpTarget(instr, pc);
+    if (!IsJump(op) || t > (int64_t)pc)
+    {
+      continue;
+    }
+    if (op == BPF_JA || (op & 0x08) || t < 0)
+    {
+      return false;
+    }
+    for (const LoopBound& l : loops)
+    {
+      if (l.header == (size_t)t)
+      {
+        return false;
+      }
+    }
+    LoopBound l = {(size_t)t, pc, 0};
+    loops.push_back(l);
+  }
+
+  // loops nest and are only entered at their header
+  for (const LoopBound& a : loops)
+  {
+    for (const LoopBound& b : loops)
+    {
+      if (a.header < b.header && b.header <= a.latch && a.latch < b.latch)
+      {
+        return false;
+      }
+    }
+    for (size_t pc = 0; pc < size; pc++)
+    {
+      uint64_t instr = program[pc];
+      int64_t t = IsJump(instr & OP_MASK) ? JumpTarget(instr, pc)
+                : IsPseudoFunc(instr) ? (int64_t)pc + 1 + (int32_t)((instr & IMM_MASK) >> SHL_IMM)
+                : -1;
+      bool inside = pc >= a.header && pc <= a.latch && !IsPseudoFunc(instr);
+      if (t > (int64_t)a.header && t <= (int64_t)a.latch && !inside)
+      {
+        return false;
+      }
+    }
+  }
+
+  std::vector<ConstState> entry;
+  consts = Constants(program, loops, entry);
+
+  // the compared register changes only once per iteration, by a
+  // constant, just before the back edge
+  for (LoopBound& l : loops)
+  {
+    uint64_t latch = program[l.latch];
+    unsigned reg = Reg((latch & DST_MASK) >> SHL_DST);
+    uint32_t limit = (latch & IMM_MASK) >> SHL_IMM;
+
+    size_t step = l.latch;
+    for (size_t pc = l.header; pc < l.latch; pc++)
+    {
+      if (Writes(program[pc], reg))
+      {
+        if (step != l.latch)
+        {
+          return false;
+        }
+        step = pc;
+      }
+    }
+    uint8_t stepOp = program[step] & OP_MASK;
+    uint32_t delta = (program[step] & IMM_MASK) >> SHL_IMM;
+    if ((stepOp != BPF_ADD_IMM && stepOp != BPF_SUB_IMM) || delta == 0)
+    {
+      return false;
+    }
+    for (size_t pc = step + 1; pc < l.latch; pc++)
+    {
+      if (IsJump(program[pc] & OP_MASK) || (program[pc] & OP_MASK) == BPF_EXIT)
+      {
+        return false;
+      }
+    }
+    for (size_t pc = 0; pc < size; pc++)
+    {
+      int64_t t = JumpTarget(program[pc], pc);
+      if (IsJump(program[pc] & OP_MASK) && t > (int64_t)step && t <= (int64_t)l.latch)
+      {
+        return false;
+      }
+    }
+
+    // run the counter until the back edge is no longer taken
+    const ConstState& in = entry[l.header];
+    if (!in.reached || !in.known[reg])
+    {
+      return false;
+    }
+    uint64_t v = in.v[reg];
+    do
+    {
+      if (++l.trips > VM_LOOP_BUDGET)
+      {
+        return false;
+      }
+      v = (stepOp == BPF_ADD_IMM) ? v + delta : v - delta;
+    } while (Cond(latch & OP_MASK, v, limit));
+  }
+
+  // inner loops first
+  std::sort(loops.begin(), loops.end(), [](const LoopBound& a, const LoopBound& b)
+  {
+    return a.latch - a.header < b.latch - b.header;
+  });
+  return true;
+}
+
+bool BoundLoops(const std::vector<uint64_t>& program,
+                std::vector<LoopBound>* loops)
+{
+  std::vector<LoopBound> found;
+  std::vector<ConstState> consts;
+  bool ok = FindLoops(program, found, consts);
+  if (loops)
+  {
+    *loops = found;
+  }
+  return ok;
+}
+
+/* ------------------------- Cost ------------------------------- */
+
+// Helpers are the same code whichever engine calls them
+static void SetHelperCosts(CostModel& m)
+{
+  for (uint32_t& c : m.helper)
+  {
+    c = m.helperDefault;
+  }
+  m.helper[BPF_FUNC_map_lookup_elem] = 60;
+  m.helper[BPF_FUNC_map_update_elem] = 90;
+  m.helper[BPF_FUNC_map_delete_elem] = 70;
+  m.helper[BPF_FUNC_get_smp_processor_id] = 5;
+  m.helper[BPF_FUNC_tail_call] = 30;
+  m.helper[BPF_FUNC_ringbuf_output] = 120;
+  m.helper[BPF_FUNC_ringbuf_reserve] = 60;
+  m.helper[BPF_FUNC_ringbuf_submit] = 40;
+  m.helper[BPF_FUNC_ringbuf_discard] = 30;
+}
+
+static CostModel InterpreterCost()
+{
+  CostModel m;
+  m.alu = 34;
+  m.mul = 30;
+  m.div = 45;
+  m.load = 26;
+  m.store = 25;
+  m.atomic = 27;
+  m.jump = 26;
+  m.exit = 114;
+  m.call = 28;
+  m.helperDefault = 100;
+  SetHelperCosts(m);
+  return m;
+}
+
+static CostModel NativeCost()
+{
+  CostModel m;
+  m.alu = 1;
+  m.mul = 3;
+  m.div = 13;
+  m.load = 1;
+  m.store = 1;
+  m.atomic = 17;
+  m.jump = 1;
+  m.exit = 221;
+  m.call = 26;
+  m.helperDefault = 100;
+  SetHelperCosts(m);
+  return m;
+}
+
+const CostModel interpreterCost = InterpreterCost();
+const CostModel nativeCost = NativeCost();
+
+static uint64_t InsnCost(uint64_t instr, const CostModel& m)
+{
+  uint8_t op = instr & OP_MASK;
+  uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+
+  switch (op & 0x07)
+  {
+    case 0x07: // ALU64
+    case 0x04: // ALU32 and byteswap
+      switch (op & 0xf0)
+      {
+        case 0x20: return m.mul;
+        case 0x30: case 0x90: return m.div;
+        default: return m.alu;
+      }
+    case 0x01:
+      return m.load;
+    case 0x02:
+    case 0x03:
+      return (op == BPF_ATOMIC_W || op == BPF_ATOMIC_DW) ? m.atomic : m.store;
+    case 0x00:
+      return (op == BPF_LDDW) ? m.alu : m.load;
+    case 0x05:
+      if (op == BPF_CALL_IMM)
+      {
+        return m.call + (imm < MAX_HELPERS ? m.helper[imm] : m.helperDefault);
+      }
+      return (op == BPF_EXIT) ? m.exit : m.jump;
+    default:
+      return m.alu;
+  }
+}
+
+// The most expensive way on from an instruction
+struct Path
+{
+  bool valid; // false if there is none
+  uint64_t insns;
+  uint64_t cycles;
+};
+
+static uint64_t SatAdd(uint64_t a, uint64_t b)
+{
+  return (a + b < a) ? UINT64_MAX : a + b;
+}
+
+static uint64_t SatMul(uint64_t a, uint64_t b)
+{
+  return (b != 0 && a > UINT64_MAX / b) ? UINT64_MAX : a * b;
+}
+
+static Path Longer(const Path& a, const Path& b)
+{
+  if (!a.valid || !b.valid)
+  {
+    return a.valid ? a : b;
+  }
+  Path p = {true, std::max(a.insns, b.insns), std::max(a.cycles, b.cycles)};
+  return p;
+}
+
+// Worst paths through a program whose loops are bounded. A loop adds
+// its trip count times its most expensive iteration at its header,
+// where the path leaving it (as if the back edge were never taken)
+// goes on; bpf_loop adds its callback as often as it is asked to.
+// Bodies are walked when the walk of the program reaches their header,
+// after everything behind them, callbacks included.
+struct CostWalk
+{
+  const std::vector<uint64_t>& program;
+  const CostModel& model;
+  const std::vector<LoopBound>& loops;
+  const std::vector<ConstState>& consts;
+  std::vector<Path> exits;  // to an exit, from each instruction
+  std::vector<Path> bodies; // one iteration, by loop
+  std::vector<bool> walked; // bodies filled in so far
+  bool bounded;
+  bool tailCalls;
+
+  CostWalk(const std::vector<uint64_t>& program, const CostModel& model,
+           const std::vector<LoopBound>& loops,
+           const std::vector<ConstState>& consts)
+  : program(program), model(model), loops(loops), consts(consts),
+    bounded(true), tailCalls(false)
+  {
+    Path none = {false, 0, 0};
+    exits.assign(program.size() + 1, none);
+    exits[program.size()].valid = true; // running off the end exits
+    bodies.assign(loops.size(), none);
+    walked.assign(loops.size(), false);
+    Path entry;
+    Walk(0, program.size() - 1, nullptr, entry);
+  };
+
+  // Fills in the paths of [lo, hi] from its end. Within a loop body,
+  // paths end at its back edge and those leaving it do not count.
+  void Walk(size_t lo, size_t hi, const LoopBound* loop, Path& first)
+  {
+    std::vector<Path> local(loop ? hi - lo + 1 : 0);
+    std::vector<Path>& paths = loop ? local : exits;
+    size_t base = loop ? lo : 0;
+    Path none = {false, 0, 0};
+    Path end = {true, 0, 0};
+
+    for (size_t pc = hi + 1; pc-- > lo;)
+    {
+      uint64_t instr = program[pc];
+      uint8_t op = instr & OP_MASK;
+      uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+
+      // the way on from each successor
+      Path on = none;
+      if (op == BPF_EXIT)
+      {
+        on = end;
+      }
+      else
+      {
+        int64_t succ[2] = {(op == BPF_JA) ? -1 : (int64_t)pc + 1,
+                           IsJump(op) ? JumpTarget(instr, pc) : -1};
+        for (int64_t t : succ)
+        {
+          if (t < 0)
+          {
+            continue;
+          }
+          if (loop && pc == loop->latch && (size_t)t == loop->header)
+          {
+            on = Longer(on, end);
+          }
+          else if (t > (int64_t)pc && (size_t)t <= hi)
+          {
+            on = Longer(on, paths[t - base]);
+          }
+          else if (t > (int64_t)pc && !loop)
+          {
+            on = Longer(on, end);
+          }
+          // back edges of inner loops are counted at their header
+        }
+      }
+
+      Path p = none;
+      if (on.valid)
+      {
+        p.valid = true;
+        p.insns = SatAdd(on.insns, 1);
+        p.cycles = SatAdd(on.cycles, InsnCost(instr, model));
+      }
+
+      if (op == BPF_CALL_IMM && imm == BPF_FUNC_tail_call)
+      {
+        tailCalls = true;
+      }
+      if (op == BPF_CALL_IMM && imm == BPF_FUNC_loop && p.valid)
+      {
+        // callbacks come after their caller, so their paths are known
+        const ConstState& s = consts[pc];
+        if (s.reached && s.known[1] && s.known[2] && s.v[2] > pc
+                && s.v[2] < program.size() && exits[s.v[2]].valid)
+        {
+          uint64_t n = std::min<uint64_t>(s.v[1], BPF_MAX_LOOPS);
+          p.insns = SatAdd(p.insns, SatMul(n, exits[s.v[2]].insns));
+          p.cycles = SatAdd(p.cycles, SatMul(n, exits[s.v[2]].cycles));
+        }
+        else if (s.reached)
+        {
+          bounded = false;
+        }
+      }
+
+      for (size_t i = 0; i < loops.size() && p.valid; i++)
+      {
+        if (loops[i].header != pc || &loops[i] == loop)
+        {
+          continue;
+        }
+        if (!walked[i])
+        {
+          walked[i] = true;
+          Walk(loops[i].header, loops[i].latch, &loops[i], bodies[i]);
+        }
+        if (bodies[i].valid)
+        {
+          p.insns = SatAdd(p.insns, SatMul(loops[i].trips, bodies[i].insns));
+          p.cycles = SatAdd(p.cycles, SatMul(loops[i].trips, bodies[i].cycles));
+        }
+      }
+
+      paths[pc - base] = p;
+    }
+
+    first = paths[lo - base];
+  };
+};
+
+ProgramCost WorstCaseCost(const std::vector<uint64_t>& program,
+                          const CostModel& model)
+{
+  ProgramCost cost = {0, 0, false, true};
+  if (program.empty())
+  {
+    return cost;
+  }
+
+  std::vector<LoopBound> loops;
+  std::vector<ConstState> consts;
+  if (!FindLoops(program, loops, consts))
+  {
+    // counted without their back edges
+    std::vector<ConstState> entry;
+    cost.bounded = false;
+    loops.clear();
+    consts = Constants(program, loops, entry);
+  }
+
+  CostWalk walk(program, model, loops, consts);
+  cost.insns = walk.exits[0].insns;
+  cost.cycles = walk.exits[0].cycles;
+  cost.tailCalls = walk.tailCalls;
+  cost.bounded = cost.bounded && walk.bounded;
+  return cost;
+}
+
+bool Admit(const std::vector<uint64_t>& program, const CostBudget& budget,
+           const CostModel& model, ProgramCost* cost)
+{
+  ProgramCost c = WorstCaseCost(program, model);
+  if (cost)
+  {
+    *cost = c;
+  }
+
+  return (budget.insns == 0 || (c.bounded && c.insns <= budget.insns))
+          && (budget.cycles == 0 || (c.bounded && c.cycles <= budget.cycles))
+          && !(budget.noTailCalls && c.tailCalls);
+}
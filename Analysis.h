@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Helpers.h"
+
+// Static analysis of programs, ahead of running them.
+
+// Bytes of stack the program uses below R10, rounded up to 8.
+//
+// Follows every register holding R10 plus a constant along all paths
+// and takes the deepest stack access made through one, helper
+// arguments included. Whenever that is not enough to know (a pointer
+// into the stack escapes to memory, has a variable added, is combined
+// at a join with a different offset, R10 is written, or the program
+// tail calls into others sharing the stack), the result is
+// MAX_BPF_STACK. Programs with bpf_loop callbacks, which run in frames
+// of their own below, get VM_STACK_SIZE. Accesses through addresses
+// built without R10 are not followed: they are still bounds checked
+// against the region, so a stack sized to this only turns them into
+// faults.
+uint32_t StackUsage(const std::vector<uint64_t>& program);
+
+// Estimated cycles of each kind of instruction on one engine. Helper
+// calls cost call plus the entry of their id, unknown ids helperDefault.
+struct CostModel
+{
+  uint32_t alu;      // ALU and byteswap other than the below, lddw
+  uint32_t mul;
+  uint32_t div;      // division and modulo
+  uint32_t load;
+  uint32_t store;
+  uint32_t atomic;
+  uint32_t jump;     // conditional or not, taken or not
+  uint32_t exit;
+  uint32_t call;
+  uint32_t helper[MAX_HELPERS];
+  uint32_t helperDefault;
+};
+
+// Instruction fields as ebpf_bench -m fits them at 3 GHz, exit taking
+// the cost of starting a run too; helper costs are estimates. Rerun it
+// to check them, hosts with other hardware or helpers fill in their own
+extern const CostModel interpreterCost;
+extern const CostModel nativeCost;
+
+// A loop: the instructions [header, latch], repeated while the
+// conditional jump at latch back to header is taken
+struct LoopBound
+{
+  size_t header;
+  size_t latch;
+  uint64_t trips; // times the body runs, at most
+};
+
+// Find the loops of program and bound them, inner loops first.
+//
+// A loop is accepted when its back edge compares a register with a
+// constant, that register is changed exactly once per iteration by
+// adding or subtracting a constant right before the back edge, its
+// value on entry is a known constant, and the back edge stops being
+// taken within VM_LOOP_BUDGET trips. Loops have to nest and may only
+// be entered at their header. Returns false if some backward jump is
+// not such a loop; the VM still ends those when the loop budget of the
+// run is used up.
+bool BoundLoops(const std::vector<uint64_t>& program,
+                std::vector<LoopBound>* loops = nullptr);
+
+// Upper bound on what a single run of a program costs
+struct ProgramCost
+{
+  uint64_t insns;  // most instructions any path executes
+  uint64_t cycles; // estimated cycles of the most expensive path
+  bool tailCalls;  // the program may tail call, whose targets are not
+                   // included: they can be replaced at any time
+  bool bounded;    // false if a loop (see BoundLoops) or a bpf_loop
+                   // call could not be bounded; they count once then
+};
+
+// Worst case over every path from the entry to an exit, helpers
+// included. Loops count their trip count times their most expensive
+// iteration, bpf_loop calls with a constant count and callback that
+// many runs of the callback. The bound is exact for the model on
+// loop-free programs: some input may well take that path.
+ProgramCost WorstCaseCost(const std::vector<uint64_t>& program,
+                          const CostModel& model = interpreterCost);
+
+// Limits a program has to stay within to be run, 0 for none
+struct CostBudget
+{
+  uint64_t insns;
+  uint64_t cycles;
+  bool noTailCalls; // reject programs that tail call, their cost is open
+};
+
+// Whether program is within budget, filling in cost if given. Programs
+// that are not bounded only pass budgets without limits.
+bool Admit(const std::vector<uint64_t>& program, const CostBudget& budget,
+           const CostModel& model = interpreterCost, ProgramCost* cost = nullptr);
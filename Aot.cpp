@@ -0,0 +1,984 @@
+#include "Aot.h"
+#include "VM.h"
+#include "Opcodes.h"
+#include "Helpers.h"
+#include "Sandbox.h"
+#include "Layout.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+// Loaded programs by bytecode, so a tail call can go straight to the
+// target's code. Open addressing, lookups are lock free; slots are
+// never reused for another program, only their entry is cleared.
+#define AOT_REGISTRY_SIZE 1024
+
+struct AotSlot
+{
+  std::atomic<const std::vector<uint64_t>*> key;
+  std::atomic<const AotProgram*> entry;
+};
+
+static AotSlot registry[AOT_REGISTRY_SIZE];
+
+static size_t RegistryHash(const std::vector<uint64_t>* key)
+{
+  uint64_t h = reinterpret_cast<uintptr_t>(key);
+  h ^= h >> 17;
+  h *= 0xed5ad4bbU;
+  h ^= h >> 11;
+  return h % AOT_REGISTRY_SIZE;
+}
+
+static bool RegistrySet(const std::vector<uint64_t>* key, const AotProgram* entry)
+{
+  size_t i = RegistryHash(key);
+  for (size_t n = 0; n < AOT_REGISTRY_SIZE; n++, i = (i + 1) % AOT_REGISTRY_SIZE)
+  {
+    const std::vector<uint64_t>* cur = registry[i].key.load();
+    if (cur == nullptr)
+    {
+      // claim the free slot, unless another thread got there first
+      if (!registry[i].key.compare_exchange_strong(cur, key) && cur != key)
+      {
+        continue;
+      }
+    }
+    else if (cur != key)
+    {
+      continue;
+    }
+
+    registry[i].entry.store(entry, std::memory_order_release);
+    return true;
+  }
+
+  return false;
+}
+
+static const AotProgram* RegistryFind(const std::vector<uint64_t>* key)
+{
+  size_t i = RegistryHash(key);
+  for (size_t n = 0; n < AOT_REGISTRY_SIZE; n++, i = (i + 1) % AOT_REGISTRY_SIZE)
+  {
+    const std::vector<uint64_t>* cur = registry[i].key.load(std::memory_order_acquire);
+    if (cur == key)
+    {
+      return registry[i].entry.load(std::memory_order_acquire);
+    }
+    if (cur == nullptr)
+    {
+      break;
+    }
+  }
+
+  return nullptr;
+}
+
+// FNV-1a over the bytecode, embedded in the shared object so a stale
+// build is never run against a changed program
+static uint64_t ProgramHash(const std::vector<uint64_t>& program)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint64_t instr : program)
+  {
+    for (int i = 0; i < 8; i++)
+    {
+      h ^= (instr >> (i * 8)) & 0xff;
+      h *= 0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+/* ------------------------ Translation ------------------------- */
+
+static const char* AluOperator(uint8_t opcode)
+{
+  switch (opcode & 0xf0)
+  {
+    case 0x00: return "+";
+    case 0x10: return "-";
+    case 0x20: return "*";
+    case 0x30: return "/";
+    case 0x40: return "|";
+    case 0x50: return "&";
+    case 0x60: return "<<";
+    case 0x70: return ">>";
+    case 0x90: return "%";
+    case 0xa0: return "^";
+    default: return nullptr;
+  }
+}
+
+static const char* JmpCondition(uint8_t opcode)
+{
+  switch (opcode & 0xf0)
+  {
+    case 0x10: return "==";
+    case 0x20: return ">";
+    case 0x30: return ">=";
+    case 0x40: return "&";
+    case 0x50: return "!=";
+    case 0x60: return ">";
+    case 0x70: return ">=";
+    default: return nullptr;
+  }
+}
+
+// GCC/Clang builtin implementing an atomic operation (imm)
+static const char* AtomicBuiltin(uint32_t op)
+{
+  switch (op)
+  {
+    case BPF_ATOMIC_ADD: case BPF_ATOMIC_ADD | BPF_ATOMIC_FETCH:
+      return "__atomic_fetch_add";
+    case BPF_ATOMIC_OR: case BPF_ATOMIC_OR | BPF_ATOMIC_FETCH:
+      return "__atomic_fetch_or";
+    case BPF_ATOMIC_AND: case BPF_ATOMIC_AND | BPF_ATOMIC_FETCH:
+      return "__atomic_fetch_and";
+    case BPF_ATOMIC_XOR: case BPF_ATOMIC_XOR | BPF_ATOMIC_FETCH:
+      return "__atomic_fetch_xor";
+    case BPF_ATOMIC_XCHG:
+      return "__atomic_exchange_n";
+    case BPF_ATOMIC_CMPXCHG:
+      return "__atomic_compare_exchange_n";
+    default: return nullptr;
+  }
+}
+
+// Translate one instruction at index pc into C++ statements.
+// With fpDirect, accesses relative to R10 go straight to the guarded
+// stack at fp instead of through the region table. With profile,
+// conditional jumps are counted.
+static void TranslateInsn(std::ostringstream& out, uint64_t instr,
+                          size_t pc, size_t size, bool fpDirect, bool profile)
+{
+  uint8_t opcode = (instr & OP_MASK);
+  unsigned dst   = (instr & DST_MASK) >> SHL_DST;
+  unsigned src   = (instr & SRC_MASK) >> SHL_SRC;
+  int16_t off    = (instr & OFF_MASK) >> SHL_OFF;
+  uint32_t imm   = (instr & IMM_MASK) >> SHL_IMM;
+
+  char d[8], s[32];
+  snprintf(d, sizeof(d), "r%u", dst);
+  bool useSrc = (opcode & 0x08) != 0;
+  if (useSrc)
+  {
+    snprintf(s, sizeof(s), "r%u", src);
+  }
+  else
+  {
+    snprintf(s, sizeof(s), "0x%xULL", imm);
+  }
+
+  // branch target, anything past the end exits like running off it
+  // would; backward jumps pay for the iteration first
+  int64_t target = (int64_t)pc + 1 + off;
+  std::ostringstream go;
+  if (target < 0 || (size_t)target >= size)
+  {
+    go << "goto I_end;";
+  }
+  else if (off < 0)
+  {
+    go << "{ LOOP(" << pc << "); goto I" << target << "; }";
+  }
+  else
+  {
+    go << "goto I" << target << ";";
+  }
+  std::string label = go.str();
+
+  // division by zero ends the run as it does in the interpreter
+  bool divides = (opcode & 0xf0) == 0x30 || (opcode & 0xf0) == 0x90;
+  if (divides && ((opcode & 0x07) == 0x07 || (opcode & 0x07) == 0x04))
+  {
+    if (!useSrc && imm == 0)
+    {
+      out << "  STOP(" << pc << ", " << AOT_DIVZERO << ");\n";
+      return;
+    }
+    if (useSrc)
+    {
+      out << "  if (" << ((opcode & 0x07) == 0x04 ? "(uint32_t)" : "") << s
+          << " == 0) STOP(" << pc << ", " << AOT_DIVZERO << ");\n";
+    }
+  }
+
+  switch (opcode)
+  {
+    // 64-bit ALU
+    case BPF_ADD_IMM: case BPF_ADD_SRC: case BPF_SUB_IMM: case BPF_SUB_SRC:
+    case BPF_MUL_IMM: case BPF_MUL_SRC: case BPF_DIV_IMM: case BPF_DIV_SRC:
+    case BPF_OR_IMM:  case BPF_OR_SRC:  case BPF_AND_IMM: case BPF_AND_SRC:
+    case BPF_MOD_IMM: case BPF_MOD_SRC: case BPF_XOR_IMM: case BPF_XOR_SRC:
+      out << "  " << d << " = " << d << " " << AluOperator(opcode)
+          << " " << s << ";\n";
+      break;
+    case BPF_LSH_IMM: case BPF_LSH_SRC: case BPF_RSH_IMM: case BPF_RSH_SRC:
+      out << "  " << d << " = " << d << " " << AluOperator(opcode)
+          << " (" << s << " & 63);\n";
+      break;
+    case BPF_ARSH_IMM: case BPF_ARSH_SRC:
+      out << "  " << d << " = (uint64_t)((int64_t)" << d
+          << " >> (" << s << " & 63));\n";
+      break;
+    case BPF_NEG:
+      out << "  " << d << " = -" << d << ";\n";
+      break;
+    case BPF_MOV_IMM: case BPF_MOV_SRC:
+      out << "  " << d << " = " << s << ";\n";
+      break;
+
+    // 32-bit ALU
+    case BPF_ADD32_IMM: case BPF_ADD32_SRC: case BPF_SUB32_IMM: case BPF_SUB32_SRC:
+    case BPF_MUL32_IMM: case BPF_MUL32_SRC: case BPF_DIV32_IMM: case BPF_DIV32_SRC:
+    case BPF_OR32_IMM:  case BPF_OR32_SRC:  case BPF_AND32_IMM: case BPF_AND32_SRC:
+    case BPF_MOD32_IMM: case BPF_MOD32_SRC: case BPF_XOR32_IMM: case BPF_XOR32_SRC:
+      out << "  " << d << " = (uint32_t)((uint32_t)" << d << " "
+          << AluOperator(opcode) << " (uint32_t)" << s << ");\n";
+      break;
+    case BPF_LSH32_IMM: case BPF_LSH32_SRC: case BPF_RSH32_IMM: case BPF_RSH32_SRC:
+      out << "  " << d << " = (uint32_t)((uint32_t)" << d << " "
+          << AluOperator(opcode) << " ((uint32_t)" << s << " & 31));\n";
+      break;
+    case BPF_ARSH32_IMM: case BPF_ARSH32_SRC:
+      out << "  " << d << " = (uint32_t)((int32_t)(uint32_t)" << d
+          << " >> ((uint32_t)" << s << " & 31));\n";
+      break;
+    case BPF_NEG32:
+      out << "  " << d << " = (uint32_t)-(uint32_t)" << d << ";\n";
+      break;
+    case BPF_MOV32_IMM: case BPF_MOV32_SRC:
+      out << "  " << d << " = (uint32_t)" << s << ";\n";
+      break;
+
+    // Byteswap
+    case BPF_LE:
+    case BPF_BE:
+    {
+      const char* endian = (opcode == BPF_LE) ? "le" : "be";
+      unsigned bits = (imm == 16 || imm == 32) ? imm : 64;
+      const char* cast = (bits == 16) ? "(uint16_t)" : (bits == 32) ? "(uint32_t)" : "";
+      out << "  " << d << " = hto" << endian << bits << "(" << cast << d << ");\n";
+      break;
+    }
+
+    // Jumps
+    case BPF_JA:
+      out << "  " << label << "\n";
+      break;
+    case BPF_JEQ_IMM: case BPF_JEQ_SRC: case BPF_JGT_IMM: case BPF_JGT_SRC:
+    case BPF_JGE_IMM: case BPF_JGE_SRC: case BPF_JSET_IMM: case BPF_JSET_SRC:
+    case BPF_JNE_IMM: case BPF_JNE_SRC:
+    case BPF_JSGT_IMM: case BPF_JSGT_SRC: case BPF_JSGE_IMM: case BPF_JSGE_SRC:
+    {
+      const char* cast = (opcode & 0xf0) >= 0x60 ? "(int64_t)" : "";
+      out << "  if (" << cast << d << " " << JmpCondition(opcode) << " "
+          << cast << s << ")";
+      if (profile)
+      {
+        out << " { BRANCH(" << pc << ", 1); " << label << " }\n"
+            << "  BRANCH(" << pc << ", 0);\n";
+      }
+      else
+      {
+        out << " " << label << "\n";
+      }
+      break;
+    }
+
+    case BPF_CALL_IMM:
+      if (imm == BPF_FUNC_loop)
+      {
+        // callbacks of this program re-enter the code here, one
+        // iteration counted per call and on a frame of their own below
+        // this one, as VM::Callback does
+        out << "  if (r4 == 0 && r1 <= " << BPF_MAX_LOOPS << "ULL && IsCallback(r2))\n"
+            << "  {\n"
+            << "    AotContext cb = *ctx;\n"
+            << "    uint64_t i = 0;\n"
+            << "    while (i < r1)\n"
+            << "    {\n"
+            << "      LOOP(" << pc << ");\n"
+            << "      if ((r10 & 0x" << std::hex << MEM_OFFSET_MASK << std::dec
+            << "ULL) < " << 2 * MAX_BPF_STACK << ") FAULT(" << pc << ");\n"
+            << "      cb.regs[1] = i; cb.regs[2] = r3;\n"
+            << "      cb.regs[10] = r10 - " << MAX_BPF_STACK << ";\n"
+            << "      cb.fp = fp - " << MAX_BPF_STACK << ";\n"
+            << "      cb.entry = r2; cb.loops = loops;\n"
+            << "      uint32_t st = ebpf_aot_entry(&cb);\n"
+            << "      loops = cb.loops;\n"
+            << "      if (st != " << AOT_EXIT << ")\n"
+            << "      {\n"
+            << "        SPILL(); ctx->faultPc = cb.faultPc; return st;\n"
+            << "      }\n"
+            << "      i++;\n"
+            << "      if (cb.regs[0]) break;\n"
+            << "    }\n"
+            << "    r0 = i;\n"
+            << "  }\n"
+            << "  else\n";
+      }
+      out << "  {\n"
+          << "  ctx->regs[1] = r1; ctx->regs[2] = r2; ctx->regs[3] = r3;\n"
+          << "  ctx->regs[4] = r4; ctx->regs[5] = r5; ctx->regs[10] = r10;\n"
+          << "  ctx->loops = loops;\n"
+          << "  uint32_t st = ctx->call(ctx, " << imm << "U);\n"
+          << "  r0 = ctx->regs[0];\n"
+          << "  loops = ctx->loops;\n"
+          << "  if (st != " << AOT_CONTINUE << ")\n"
+          << "  {\n"
+          << "    SPILL(); ctx->faultPc = " << pc << ";\n"
+          << "    return st;\n"
+          << "  }\n"
+          << "  }\n";
+      break;
+    case BPF_EXIT:
+      out << "  SPILL();\n"
+          << "  return " << AOT_EXIT << ";\n";
+      break;
+
+    // Memory, through the region table as in VM::Eval
+    case BPF_LDDW:
+      if (src == BPF_PSEUDO_FUNC)
+      {
+        out << "  " << d << " = " << (int64_t)pc + 1 + (int32_t)imm << "ULL;\n";
+        break;
+      }
+      out << "  " << d << " = 0x" << std::hex << imm << std::dec << "ULL;\n";
+      break;
+    case BPF_LDXW: case BPF_LDXH: case BPF_LDXB: case BPF_LDXDW:
+    {
+      const char* type = (opcode == BPF_LDXW) ? "uint32_t"
+                       : (opcode == BPF_LDXH) ? "uint16_t"
+                       : (opcode == BPF_LDXB) ? "uint8_t" : "uint64_t";
+      if (fpDirect && src == 10)
+      {
+        out << "  { const uint8_t* p = fp + " << (int16_t)off << "; ";
+      }
+      else
+      {
+        out << "  { const uint8_t* p = MemLoadPtr(regions, r" << src << " + (int64_t)"
+            << (int16_t)off << ", sizeof(" << type << ")); if (!p) FAULT(" << pc
+            << "); ";
+      }
+      out << type << " v; memcpy(&v, p, sizeof(v)); " << d << " = v; }\n";
+      break;
+    }
+    case BPF_STW: case BPF_STH: case BPF_STB: case BPF_STDW:
+    case BPF_STXW: case BPF_STXH: case BPF_STXB: case BPF_STXDW:
+    {
+      const char* type = (opcode == BPF_STW || opcode == BPF_STXW) ? "uint32_t"
+                       : (opcode == BPF_STH || opcode == BPF_STXH) ? "uint16_t"
+                       : (opcode == BPF_STB || opcode == BPF_STXB) ? "uint8_t" : "uint64_t";
+      // ST has imm in place of src, hence s
+      bool stx = (opcode & 0x07) == 0x03;
+      if (fpDirect && dst == 10)
+      {
+        out << "  { uint8_t* p = fp + " << (int16_t)off << "; ";
+      }
+      else
+      {
+        out << "  { uint8_t* p = MemStorePtr(regions, " << d << " + (int64_t)"
+            << (int16_t)off << ", sizeof(" << type << ")); if (!p) FAULT(" << pc
+            << "); ";
+      }
+      out << type << " v = (" << type << ")";
+      if (stx)
+      {
+        out << "r" << src;
+      }
+      else
+      {
+        out << "0x" << std::hex << imm << std::dec << "U";
+      }
+      out << "; memcpy(p, &v, sizeof(v)); }\n";
+      break;
+    }
+    case BPF_ATOMIC_W: case BPF_ATOMIC_DW:
+    {
+      const char* type = (opcode == BPF_ATOMIC_W) ? "uint32_t" : "uint64_t";
+      const char* fn = AtomicBuiltin(imm);
+      if (!fn)
+      {
+        out << "  STOP(" << pc << ", " << AOT_BADOP << ");\n";
+        break;
+      }
+      // atomics also need natural alignment, fp is page aligned so
+      // that of frame pointer accesses is known here
+      if (fpDirect && dst == 10)
+      {
+        out << "  { uint8_t* a = fp + " << (int16_t)off << "; ";
+        if ((int16_t)off % (int)(opcode == BPF_ATOMIC_W ? 4 : 8))
+        {
+          out << "FAULT(" << pc << "); ";
+        }
+      }
+      else
+      {
+        out << "  { uint8_t* a = MemStorePtr(regions, " << d << " + (int64_t)"
+            << (int16_t)off << ", sizeof(" << type << ")); "
+            << "if (!a || (uintptr_t)a % sizeof(" << type << ")) FAULT(" << pc << "); ";
+      }
+      out << type << "* p = (" << type << "*)a; ";
+      if (imm == BPF_ATOMIC_CMPXCHG)
+      {
+        out << type << " e = (" << type << ")r0; "
+            << fn << "(p, &e, (" << type << ")r" << src
+            << ", false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); r0 = e; }\n";
+        break;
+      }
+      if (imm & BPF_ATOMIC_FETCH)
+      {
+        out << "r" << src << " = ";
+      }
+      out << fn << "(p, (" << type << ")r" << src << ", __ATOMIC_SEQ_CST); }\n";
+      break;
+    }
+
+    // legacy packet loads (LDABS, LDIND) are unknown here too
+    default:
+      out << "  STOP(" << pc << ", " << AOT_BADOP << ");\n";
+      break;
+  }
+}
+
+// Branch targets need a label, everything else flows straight through
+static std::set<size_t> JumpTargets(const std::vector<uint64_t>& program)
+{
+  std::set<size_t> targets;
+
+  for (size_t pc = 0; pc < program.size(); pc++)
+  {
+    uint8_t opcode = (program[pc] & OP_MASK);
+    int16_t off = (program[pc] & OFF_MASK) >> SHL_OFF;
+    int64_t target = (int64_t)pc + 1 + off;
+    bool isJump = (opcode & 0x07) == 0x05
+            && opcode != BPF_CALL_IMM && opcode != BPF_EXIT;
+    if (isJump && target >= 0 && (size_t)target < program.size())
+    {
+      targets.insert(target);
+    }
+  }
+
+  return targets;
+}
+
+// Where callbacks start, also entry points of the generated code
+static std::set<size_t> Callbacks(const std::vector<uint64_t>& program)
+{
+  std::set<size_t> callbacks;
+
+  for (size_t pc = 0; pc < program.size(); pc++)
+  {
+    uint64_t instr = program[pc];
+    int64_t target = (int64_t)pc + 1 + (int32_t)((instr & IMM_MASK) >> SHL_IMM);
+    if ((instr & OP_MASK) == BPF_LDDW
+            && ((instr & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC
+            && target > 0 && (size_t)target < program.size())
+    {
+      callbacks.insert(target);
+    }
+  }
+
+  return callbacks;
+}
+
+std::string AotTranslate(const std::vector<uint64_t>& program, bool sandbox,
+                         bool profile)
+{
+  std::ostringstream out;
+  std::set<size_t> callbacks = Callbacks(program);
+
+  // the frame pointer is only known to be R10 if nothing changes it
+  bool fpDirect = sandbox;
+  for (uint64_t instr : program)
+  {
+    fpDirect = fpDirect && !WritesFramePointer(instr);
+  }
+
+  out << "// Generated by AotTranslate() from " << program.size()
+      << " instructions - do not edit\n"
+      << "#include <cstdint>\n"
+      << "#include <cstring>\n"
+      << "#include <endian.h>\n\n"
+      << STR(MEM_REGION_DEF) << ";\n\n"
+      << STR(MEM_TRANSLATE_DEF) << "\n\n"
+      << STR(AOT_CONTEXT_DEF) << ";\n\n"
+      << "#define SPILL() do { \\\n"
+      << "  ctx->regs[0] = r0; ctx->regs[1] = r1; ctx->regs[2] = r2; \\\n"
+      << "  ctx->regs[3] = r3; ctx->regs[4] = r4; ctx->regs[5] = r5; \\\n"
+      << "  ctx->regs[6] = r6; ctx->regs[7] = r7; ctx->regs[8] = r8; \\\n"
+      << "  ctx->regs[9] = r9; ctx->regs[10] = r10; ctx->loops = loops; } while (0)\n\n"
+      << "#define STOP(pc, status) do { \\\n"
+      << "  SPILL(); ctx->faultPc = pc; return status; } while (0)\n\n"
+      << "#define FAULT(pc) STOP(pc, " << AOT_FAULT << ")\n\n"
+      << "#define BRANCH(pc, taken) do { \\\n"
+      << "  if (branches) branches[2 * (pc) + (taken)]++; } while (0)\n\n"
+      << "#define LOOP(pc) do { \\\n"
+      << "  if (loops == 0) STOP(pc, " << AOT_LOOP << "); \\\n"
+      << "  loops--; } while (0)\n\n"
+      << "extern \"C\" const uint32_t ebpf_aot_abi = " << AOT_ABI_VERSION << ";\n"
+      << "extern \"C\" const uint64_t ebpf_aot_hash = 0x" << std::hex
+      << ProgramHash(program) << std::dec << "ULL;\n"
+      << "extern \"C\" const uint32_t ebpf_aot_sandbox = " << fpDirect << ";\n\n"
+      << "static bool IsCallback(uint64_t pc)\n"
+      << "{\n"
+      << "  return false";
+  for (size_t pc : callbacks)
+  {
+    out << " || pc == " << pc;
+  }
+  out << ";\n"
+      << "}\n\n"
+      << "extern \"C\" uint32_t ebpf_aot_entry(AotContext* ctx)\n"
+      << "{\n"
+      << "  uint64_t r0 = ctx->regs[0], r1 = ctx->regs[1], r2 = ctx->regs[2];\n"
+      << "  uint64_t r3 = ctx->regs[3], r4 = ctx->regs[4], r5 = ctx->regs[5];\n"
+      << "  uint64_t r6 = ctx->regs[6], r7 = ctx->regs[7], r8 = ctx->regs[8];\n"
+      << "  uint64_t r9 = ctx->regs[9], r10 = ctx->regs[10];\n"
+      << "  const MemRegion* regions = ctx->regions;\n"
+      << "  uint8_t* fp = ctx->fp;\n"
+      << "  uint64_t* branches = ctx->branches;\n"
+      << "  uint64_t loops = ctx->loops;\n\n"
+      << "  switch (ctx->entry)\n"
+      << "  {\n";
+  for (size_t pc : callbacks)
+  {
+    out << "    case " << pc << ": goto I" << pc << ";\n";
+  }
+  out << "    default: break;\n"
+      << "  }\n\n";
+
+  std::set<size_t> targets = JumpTargets(program);
+  targets.insert(callbacks.begin(), callbacks.end());
+  for (size_t pc = 0; pc < program.size(); pc++)
+  {
+    if (targets.count(pc))
+    {
+      out << "I" << pc << ":\n";
+    }
+    TranslateInsn(out, program[pc], pc, program.size(), fpDirect, profile);
+  }
+
+  out << "I_end:\n"
+      << "  SPILL();\n"
+      << "  return " << AOT_EXIT << ";\n"
+      << "}\n";
+
+  return out.str();
+}
+
+/* ------------------------- Building --------------------------- */
+
+// Owned by this user and writable by no one else
+static bool Private(const struct stat& st)
+{
+  return st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Only this user (or root) can change what the directories leading to
+// the absolute path path hold: they are owned by either, and writable by
+// others only when sticky, as /tmp, where others cannot replace our files
+static bool SafePath(const std::string& path)
+{
+  std::string dir = path;
+  for (;;)
+  {
+    size_t slash = dir.rfind('/');
+    dir = (slash == 0) ? "/" : dir.substr(0, slash);
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)
+            || (st.st_uid != geteuid() && st.st_uid != 0)
+            || ((st.st_mode & (S_IWGRP | S_IWOTH)) && !(st.st_mode & S_ISVTX)))
+    {
+      return false;
+    }
+    if (dir == "/")
+    {
+      return true;
+    }
+  }
+}
+
+// Create path, which must not exist, readable by this user only
+static bool WriteFile(const std::string& path, const std::string& text)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+  if (fd < 0)
+  {
+    return false;
+  }
+  size_t done = 0;
+  while (done < text.size())
+  {
+    ssize_t n = write(fd, text.data() + done, text.size() - done);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      close(fd);
+      return false;
+    }
+    done += n;
+  }
+  return close(fd) == 0;
+}
+
+// Run args[0] found on the PATH and wait for it to succeed
+static bool RunCompiler(const std::vector<std::string>& args)
+{
+  std::vector<char*> argv;
+  for (const std::string& arg : args)
+  {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    return false;
+  }
+  if (pid == 0)
+  {
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Make dir unless it exists, then check it is ours
+static bool PrivateDir(const std::string& dir)
+{
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+  {
+    return false;
+  }
+  struct stat st;
+  return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && Private(st);
+}
+
+std::string AotCacheDir()
+{
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  std::string cache;
+  if (xdg && *xdg == '/')
+  {
+    cache = xdg;
+  }
+  else if (home && *home == '/')
+  {
+    cache = std::string(home) + "/.cache";
+  }
+
+  if (!cache.empty() && PrivateDir(cache) && PrivateDir(cache + "/ebpf"))
+  {
+    return cache + "/ebpf";
+  }
+
+  // no usable cache: a directory of this process's own
+  char tmp[] = "/tmp/ebpf_aot.XXXXXX";
+  return mkdtemp(tmp) ? tmp : "";
+}
+
+/* ------------------------- Runtime ---------------------------- */
+
+// Helper trampoline for generated code. R1-R5 and R10 have been
+// written to ctx->regs, the result is left in ctx->regs[0].
+static uint32_t AotCall(AotContext* ctx, uint32_t id)
+{
+  VM& vm = *static_cast<VM*>(ctx->vm);
+
+  Helper fn = GetHelper(id);
+  if (!fn)
+  {
+    return AOT_BADOP;
+  }
+
+  // helpers running callbacks (bpf_loop) interpret them and count
+  // against the same loop budget
+  uint32_t tailCalls = vm.GetTailCallCnt();
+  vm.SetLoops(ctx->loops);
+  vm.GetReg(10).Write64(ctx->regs[10]);
+  if (ctx->entry)
+  {
+    vm.EnterCallback();
+  }
+  ctx->regs[0] = CallHelper(fn, vm, ctx->regs[1], ctx->regs[2], ctx->regs[3],
+                            ctx->regs[4], ctx->regs[5]);
+  if (ctx->entry)
+  {
+    vm.LeaveCallback();
+  }
+  ctx->loops = vm.GetLoops();
+
+  if (vm.GetError() != VM_OK)
+  {
+    return AOT_ABORT;
+  }
+  return (vm.GetTailCallCnt() != tailCalls) ? AOT_TAILCALL : AOT_CONTINUE;
+}
+
+// Where code built with profiling counts the jumps of program on vm
+static uint64_t* BranchCounts(const VM& vm, const std::vector<uint64_t>* program)
+{
+  BranchProfile* profile = vm.GetProfile();
+  return (profile && profile->program == program) ? profile->counts.data() : nullptr;
+}
+
+AotProgram::AotProgram(bool tailCallTarget)
+: source(nullptr), handle(nullptr), entry(nullptr), sandboxed(false),
+  tailCallTarget(tailCallTarget)
+{
+
+}
+
+AotProgram::~AotProgram()
+{
+  Unload();
+}
+
+bool AotProgram::Compile(const std::vector<uint64_t>& program,
+                         const std::string& soPath, bool sandbox, bool profile,
+                         std::string* error)
+{
+  std::string unused;
+  error = error ? error : &unused;
+
+  // start from fresh files of our own, not ones another user left (or
+  // linked) there
+  std::string srcPath = soPath + ".cpp";
+  unlink(srcPath.c_str());
+  unlink(soPath.c_str());
+  if (!WriteFile(srcPath, AotTranslate(program, sandbox, profile)))
+  {
+    *error = "could not write " + srcPath + ": " + strerror(errno);
+    return false;
+  }
+
+  // the paths go to the compiler as they are, never through a shell
+  const char* cxx = getenv("CXX");
+  std::vector<std::string> args;
+  std::istringstream words(cxx && *cxx ? cxx : "c++");
+  for (std::string word; words >> word;)
+  {
+    args.push_back(word);
+  }
+  args.insert(args.end(), {"-O2", "-fPIC", "-shared", "-w", "-o", soPath, srcPath});
+  if (!RunCompiler(args) || chmod(soPath.c_str(), 0700) != 0)
+  {
+    *error = args[0] + " could not build " + soPath;
+    return false;
+  }
+
+  return Load(program, soPath, error);
+}
+
+bool AotProgram::Load(const std::vector<uint64_t>& program,
+                      const std::string& soPath, std::string* error)
+{
+  std::string unused;
+  error = error ? error : &unused;
+  Unload();
+
+  // dlopen runs the object's constructors, so only load files of this
+  // user, from where no one else can swap another file in after the
+  // check. Loaded by their own path: glibc hands back the object
+  // already loaded under a name.
+  char* resolved = realpath(soPath.c_str(), nullptr);
+  std::string path = resolved ? resolved : "";
+  free(resolved);
+  if (path.empty())
+  {
+    *error = "could not open " + soPath + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || !Private(st)
+          || !SafePath(path))
+  {
+    *error = soPath + " is not private to this user";
+    return false;
+  }
+
+  // RTLD_LOCAL: every program exports the same symbol names
+  void* so = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!so)
+  {
+    *error = dlerror();
+    return false;
+  }
+
+  const uint32_t* abi = static_cast<const uint32_t*>(dlsym(so, "ebpf_aot_abi"));
+  const uint64_t* hash = static_cast<const uint64_t*>(dlsym(so, "ebpf_aot_hash"));
+  AotEntry fn = reinterpret_cast<AotEntry>(dlsym(so, "ebpf_aot_entry"));
+  if (!abi || !hash || !fn || *abi != AOT_ABI_VERSION
+          || *hash != ProgramHash(program))
+  {
+    *error = soPath + " was not built from this program";
+    dlclose(so);
+    return false;
+  }
+
+  const uint32_t* sbx = static_cast<const uint32_t*>(dlsym(so, "ebpf_aot_sandbox"));
+  source = &program;
+  handle = so;
+  entry = fn;
+  sandboxed = sbx && *sbx;
+
+  if (tailCallTarget && !RegistrySet(&program, this))
+  {
+    *error = "too many AOT programs loaded";
+    Unload();
+    return false;
+  }
+
+  return true;
+}
+
+void AotProgram::Unload()
+{
+  if (source && tailCallTarget)
+  {
+    RegistrySet(source, nullptr);
+  }
+  if (handle)
+  {
+    dlclose(handle);
+  }
+
+  source = nullptr;
+  handle = nullptr;
+  entry = nullptr;
+  sandboxed = false;
+}
+
+// Runs ctx from entry, following tail calls into native code
+struct AotRun
+{
+  AotContext* ctx;
+  const AotProgram* prog;
+  VM* vm;
+  uint32_t status;
+};
+
+void AotProgram::Enter(void* arg)
+{
+  AotRun& run = *static_cast<AotRun*>(arg);
+  VM& vm = *run.vm;
+
+  // tail calls return here and continue with one indirect call into
+  // the target's code
+  const AotProgram* prog = run.prog;
+  while ((run.status = prog->entry(run.ctx)) == AOT_TAILCALL)
+  {
+    prog = RegistryFind(vm.GetProgram());
+    if (!prog || !prog->entry || !prog->CanRun(vm, run.ctx->regs[10]))
+    {
+      break;
+    }
+    run.ctx->branches = BranchCounts(vm, prog->source);
+  }
+}
+
+// Unchecked frame pointer accesses need the guarded stack, and R10 at
+// its top as it would be had the program started there
+bool AotProgram::CanRun(const VM& vm, uint64_t r10) const
+{
+  if (!sandboxed)
+  {
+    return true;
+  }
+
+  const MemRegion& stack = vm.GetRegions()[MEM_REGION_STACK];
+  return vm.IsSandboxed() && r10 == MemAddr(MEM_REGION_STACK, stack.writeSize);
+}
+
+uint64_t AotProgram::Run(VM& vm) const
+{
+  vm.Load(*source);
+
+  AotContext ctx;
+  vm.GetRegs(ctx.regs);
+  if (!CanRun(vm, ctx.regs[10]))
+  {
+    return vm.Resume();
+  }
+  ctx.regions = vm.GetRegions();
+  ctx.fp = vm.GetFramePointer();
+  ctx.vm = &vm;
+  ctx.call = AotCall;
+  ctx.branches = BranchCounts(vm, source);
+  ctx.loops = vm.GetLoops();
+  ctx.entry = 0;
+
+  AotRun run = {&ctx, this, &vm, AOT_EXIT};
+  if (!vm.IsSandboxed())
+  {
+    Enter(&run);
+  }
+  else if (!SandboxCall(*vm.GetSandbox(), Enter, &run))
+  {
+    // registers were not spilled, only the fault is reported
+    vm.Fault(VM_ERR_ACCESS, VM_PC_UNKNOWN);
+    return ctx.regs[0];
+  }
+  uint32_t status = run.status;
+
+  vm.SetRegs(ctx.regs);
+  vm.SetLoops(ctx.loops);
+
+  if (status == AOT_FAULT)
+  {
+    vm.Fault(VM_ERR_ACCESS, ctx.faultPc);
+  }
+  else if (status == AOT_LOOP)
+  {
+    vm.Fault(VM_ERR_LOOP, ctx.faultPc);
+  }
+  else if (status == AOT_DIVZERO)
+  {
+    vm.Fault(VM_ERR_DIV_ZERO, ctx.faultPc);
+  }
+  else if (status == AOT_BADOP)
+  {
+    vm.Fault(VM_ERR_BAD_OPCODE, ctx.faultPc);
+  }
+  else if (status == AOT_TAILCALL)
+  {
+    // the target has no native code, interpret it from its start
+    return vm.Resume();
+  }
+
+  return ctx.regs[0];
+}
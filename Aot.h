@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Memory.h"
+
+class VM;
+
+// State shared between the VM and generated code.
+// The definition is pasted verbatim into every generated source file,
+// so changing it (or what the translation emits) changes
+// AOT_ABI_VERSION too.
+#define AOT_CONTEXT_DEF \
+  struct AotContext \
+  { \
+    uint64_t regs[11]; \
+    const MemRegion* regions; \
+    uint8_t* fp; \
+    void* vm; \
+    uint32_t (*call)(AotContext*, uint32_t); \
+    uint64_t faultPc; \
+    uint64_t* branches; \
+    uint64_t loops; \
+    uint64_t entry; \
+  }
+
+#define AOT_ABI_VERSION 10
+
+// Return codes of generated entry points and of AotContext::call
+#define AOT_EXIT     0 // program exited, R0 holds the result
+#define AOT_CONTINUE 0 // (call) helper returned, carry on
+#define AOT_TAILCALL 1 // a tail call replaced the program
+#define AOT_FAULT    2 // bad memory access at faultPc
+#define AOT_LOOP     3 // loop budget used up at faultPc
+#define AOT_ABORT    4 // (call) the helper ended the run, the VM has the error
+#define AOT_DIVZERO  5 // division or modulo by zero at faultPc
+#define AOT_BADOP    6 // unknown instruction (or, call, helper) at faultPc
+
+AOT_CONTEXT_DEF;
+
+typedef uint32_t (*AotEntry)(AotContext*);
+
+// Translate a program into a self-contained C++ source file that
+// defines the entry point, a content hash and the ABI version.
+// The entry point starts at instruction AotContext::entry, 0 or a
+// callback. Backward jumps count against AotContext::loops, and
+// bpf_loop runs its callbacks natively where they are known (loaded
+// with BPF_PSEUDO_FUNC).
+// With sandbox, stack accesses relative to R10 skip the bounds check
+// and rely on the guard pages of a sandboxed VM (see VM::SetSandbox).
+// Programs that write R10 are translated as without.
+// With profile, conditional jumps count where they went into
+// AotContext::branches when it is set (laid out as BranchProfile::counts).
+std::string AotTranslate(const std::vector<uint64_t>& program, bool sandbox = false,
+                         bool profile = false);
+
+// Directory of this user's own for compiled programs:
+// $XDG_CACHE_HOME/ebpf (~/.cache/ebpf), created if missing, else a new
+// one under /tmp. Empty if neither could be made.
+std::string AotCacheDir();
+
+// A program compiled ahead of time into a shared object.
+// The bytecode is kept alongside: it identifies the program as a tail
+// call target and lets the interpreter take over if a tail call lands
+// on a program without native code.
+class AotProgram
+{
+private:
+  const std::vector<uint64_t>* source;
+  void* handle;
+  AotEntry entry;
+  bool sandboxed;
+  bool tailCallTarget;
+
+  static void Enter(void*);
+  bool CanRun(const VM&, uint64_t r10) const;
+
+public:
+  // Programs that are not a tail call target stay out of the registry
+  // tail calls look up, which has room for a fixed number of programs
+  // over the lifetime of the process. Tail calls to them interpret.
+  AotProgram(bool tailCallTarget = true);
+  ~AotProgram();
+
+  // Translate program and build soPath with the system compiler
+  // ($CXX, c++ by default; run directly, not by a shell), replacing
+  // soPath and soPath.cpp, then Load() it. Code built with profile
+  // fills in the BranchProfile of the VM it runs on, see VM::SetProfile.
+  // Returns false, with the reason in error, if that fails.
+  bool Compile(const std::vector<uint64_t>& program, const std::string& soPath,
+               bool sandbox = false, bool profile = false,
+               std::string* error = nullptr);
+
+  // Load a previously compiled shared object. Fails if it was not
+  // built from exactly this program or for another ABI version, and
+  // without loading it if the file is not this user's, others can write
+  // it or a directory it is in (sticky ones aside). Returns false, with
+  // the reason in error, if it cannot be used.
+  bool Load(const std::vector<uint64_t>& program, const std::string& soPath,
+            std::string* error = nullptr);
+  void Unload();
+
+  bool IsLoaded() const {return entry != nullptr;};
+
+  // Same contract as VM::Run: runs from the first instruction on the
+  // VM's registers and memory and returns R0. Sandboxed code falls
+  // back to the interpreter on a VM that is not sandboxed.
+  uint64_t Run(VM&) const;
+  bool IsSandboxed() const {return sandboxed;};
+};
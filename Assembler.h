@@ -1,14 +1,22 @@
 # pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// Source file currently being assembled and the statement being parsed
+extern std::string filename;
+extern uint16_t curr_line;
 
+uint64_t parseReg(const std::string&);
+uint64_t parseOffset(const std::string&);
 uint64_t parsePktAccess(std::string&, std::string&, std::string&, std::string&);
 uint64_t parseLdx(std::string&, std::string&, std::string&, std::string&);
 uint64_t parseStSrc(std::string, std::string, std::string, std::string);
 uint64_t parseStImm(std::string, std::string, std::string, std::string);
+uint64_t parseAtomic(std::string, std::string, std::string, std::string);
 uint64_t parseBranch(std::string&, std::string&, std::string&, std::string&);
 uint16_t seekLabel(std::string&);
 uint64_t parseALU(std::string&, std::string&, std::string&);
 std::vector<uint64_t> assemble();
+std::vector<uint64_t> assemble(const std::string&);
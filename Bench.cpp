@@ -0,0 +1,924 @@
+// Benchmark driver for the VM.
+//
+// Micro-benchmarks exercise one opcode family each (straight-line
+// programs generated below), macro-benchmarks run the filter programs
+// found in the corpus directory (bench/*.bpf by default).
+// Every case is run by every available engine on the same register
+// inputs; results are checked against the interpreter before timing.
+//
+// Usage: ebpf_bench [-c cpu] [-s samples] [-w warmup] [-f filter] [-d dir]
+//                   [-a aotdir] [-p]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "VM.h"
+#include "Opcodes.h"
+#include "Assembler.h"
+#include "Helpers.h"
+#include "Maps.h"
+#include "Aot.h"
+#include "Layout.h"
+#include "StaticProgram.h"
+#include "PerfCounters.h"
+#include "Analysis.h"
+
+// Number of times each instruction pattern is repeated in a micro program
+#define MICRO_REPEAT 16
+
+// Minimum wall time of one sample, iterations are scaled up to reach it
+#define MIN_SAMPLE_NS 5000000.0
+
+// Clock the cost model is fitted for, as the presets in Analysis.cpp
+#define COST_MODEL_GHZ 3.0
+
+// A single benchmark: a program and the R1-R5 inputs it runs with.
+// Programs that tail call get a program array attached as map 0.
+struct BenchCase
+{
+  std::string name;
+  std::string family;
+  std::vector<uint64_t> prog;
+  uint64_t args[5];
+  std::shared_ptr<ProgArrayMap> progArray;
+};
+
+// Something that can execute a program. Prepare() is called once per
+// case outside of the timed region.
+class BenchEngine
+{
+public:
+  virtual ~BenchEngine() {};
+  virtual const char* Name() const = 0;
+  virtual bool Prepare(const BenchCase&) = 0;
+  virtual uint64_t Run(VM&, const BenchCase&) = 0;
+};
+
+// Fetch->Decode->Eval interpreter (VM::Run)
+class InterpEngine : public BenchEngine
+{
+public:
+  const char* Name() const {return "interp";};
+  bool Prepare(const BenchCase&) {return true;};
+
+  uint64_t Run(VM& vm, const BenchCase& bc)
+  {
+    vm.Reset();
+    vm.SetMap(0, bc.progArray.get());
+    vm.R1().Write64(bc.args[0]);
+    vm.R2().Write64(bc.args[1]);
+    vm.R3().Write64(bc.args[2]);
+    vm.R4().Write64(bc.args[3]);
+    vm.R5().Write64(bc.args[4]);
+    return vm.Run(bc.prog);
+  }
+};
+
+// Ahead-of-time compiled shared objects (AotProgram::Run). The
+// sandboxed variant runs code without stack bounds checks on a VM of
+// its own with a guarded stack.
+class AotEngine : public BenchEngine
+{
+private:
+  std::string dir;
+  std::vector<std::unique_ptr<AotProgram>> compiled;
+  const AotProgram* current;
+  std::unique_ptr<VM> sandbox;
+
+public:
+  AotEngine(const std::string& dir, bool sandboxed = false)
+  : dir(dir), current(nullptr)
+  {
+    if (sandboxed)
+    {
+      sandbox.reset(new VM());
+      sandbox->SetTrace(false);
+      sandbox->SetSandbox(true);
+    }
+  };
+  const char* Name() const {return sandbox ? "aot-sb" : "aot";};
+
+  bool Prepare(const BenchCase& bc)
+  {
+    // reuse the shared object of a previous run when the program
+    // did not change, Load() rejects stale ones and those of others
+    std::string name = bc.family + "_" + bc.name;
+    for (char& c : name)
+    {
+      c = (c == '/') ? '_' : c;
+    }
+    std::string so = dir + "/ebpf_bench_" + name + (sandbox ? "_sb.so" : ".so");
+
+    std::unique_ptr<AotProgram> aot(new AotProgram());
+    bool cached = access(so.c_str(), R_OK) == 0 && aot->Load(bc.prog, so);
+    std::string error;
+    if (!cached && !aot->Compile(bc.prog, so, sandbox != nullptr, false, &error))
+    {
+      printf("AOT compilation failed: %s\n", error.c_str());
+      return false;
+    }
+
+    current = aot.get();
+    compiled.push_back(std::move(aot));
+    return true;
+  }
+
+  uint64_t Run(VM& shared, const BenchCase& bc)
+  {
+    VM& vm = sandbox ? *sandbox : shared;
+    vm.Reset();
+    vm.SetMap(0, bc.progArray.get());
+    vm.R1().Write64(bc.args[0]);
+    vm.R2().Write64(bc.args[1]);
+    vm.R3().Write64(bc.args[2]);
+    vm.R4().Write64(bc.args[3]);
+    vm.R5().Write64(bc.args[4]);
+    return current->Run(vm);
+  }
+};
+
+// Another engine running each program with its blocks laid out for
+// the path the case takes (LayoutBlocks), profiled by interpreting it
+// PGO_TRAIN_RUNS times first
+#define PGO_TRAIN_RUNS 16
+
+class PgoEngine : public BenchEngine
+{
+private:
+  std::unique_ptr<BenchEngine> inner;
+  std::string name;
+  std::vector<std::unique_ptr<BenchCase>> laidOut;
+
+public:
+  PgoEngine(BenchEngine* inner)
+  : inner(inner), name(std::string(inner->Name()) + "-pgo") {};
+  const char* Name() const {return name.c_str();};
+
+  bool Prepare(const BenchCase& bc)
+  {
+    BranchProfile profile(bc.prog);
+    VM vm;
+    vm.SetTrace(false);
+    vm.SetProfile(&profile);
+    InterpEngine interp;
+    for (int i = 0; i < PGO_TRAIN_RUNS; i++)
+    {
+      interp.Run(vm, bc);
+    }
+
+    std::unique_ptr<BenchCase> laid(new BenchCase(bc));
+    laid->name += "_pgo";
+    laid->prog = LayoutBlocks(bc.prog, profile);
+    if (!inner->Prepare(*laid))
+    {
+      return false;
+    }
+    laidOut.push_back(std::move(laid));
+    return true;
+  }
+
+  uint64_t Run(VM& vm, const BenchCase&)
+  {
+    return inner->Run(vm, *laidOut.back());
+  }
+};
+
+// Corpus programs compiled into the binary for the static engine.
+// These must stay identical to what the assembler emits for the
+// corresponding bench/*.bpf file, otherwise the engine skips them.
+struct StaticPortFilter
+{
+  static constexpr uint64_t insns[] =
+  {
+    BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0x0),
+    BPF_INSN(BPF_JNE_IMM, 2, 0, 4, 0x6),
+    BPF_INSN(BPF_JEQ_IMM, 1, 0, 4, 0x16),
+    BPF_INSN(BPF_JEQ_IMM, 1, 0, 3, 0x50),
+    BPF_INSN(BPF_JEQ_IMM, 1, 0, 2, 0x1bb),
+    BPF_INSN(BPF_JEQ_IMM, 1, 0, 1, 0x1f90),
+    BPF_INSN(BPF_EXIT, 0, 0, 0, 0),
+    BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0x1),
+    BPF_INSN(BPF_EXIT, 0, 0, 0, 0),
+  };
+};
+constexpr uint64_t StaticPortFilter::insns[];
+
+struct StaticFlowHash
+{
+  static constexpr uint64_t insns[] =
+  {
+    BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0x9e3779b9),
+    BPF_INSN(BPF_LSH_IMM, 3, 0, 0, 0x10),
+    BPF_INSN(BPF_OR_SRC, 3, 4, 0, 0),
+    BPF_INSN(BPF_ADD_SRC, 1, 0, 0, 0),
+    BPF_INSN(BPF_ADD_SRC, 2, 0, 0, 0),
+    BPF_INSN(BPF_ADD_SRC, 3, 0, 0, 0),
+    BPF_INSN(BPF_SUB_SRC, 1, 3, 0, 0),
+    BPF_INSN(BPF_XOR_SRC, 1, 2, 0, 0),
+    BPF_INSN(BPF_RSH_IMM, 1, 0, 0, 0x4),
+    BPF_INSN(BPF_ADD_SRC, 3, 2, 0, 0),
+    BPF_INSN(BPF_SUB_SRC, 2, 1, 0, 0),
+    BPF_INSN(BPF_XOR_SRC, 2, 3, 0, 0),
+    BPF_INSN(BPF_LSH_IMM, 2, 0, 0, 0x6),
+    BPF_INSN(BPF_ADD_SRC, 1, 3, 0, 0),
+    BPF_INSN(BPF_SUB_SRC, 3, 2, 0, 0),
+    BPF_INSN(BPF_XOR_SRC, 3, 1, 0, 0),
+    BPF_INSN(BPF_RSH_IMM, 3, 0, 0, 0x8),
+    BPF_INSN(BPF_ADD_SRC, 2, 1, 0, 0),
+    BPF_INSN(BPF_XOR_SRC, 3, 5, 0, 0),
+    BPF_INSN(BPF_MUL_IMM, 3, 0, 0, 0x85ebca6b),
+    BPF_INSN(BPF_MOV_SRC, 0, 3, 0, 0),
+    BPF_INSN(BPF_RSH_IMM, 0, 0, 0, 0xd),
+    BPF_INSN(BPF_XOR_SRC, 0, 3, 0, 0),
+    BPF_INSN(BPF_MUL_IMM, 0, 0, 0, 0xc2b2ae35),
+    BPF_INSN(BPF_XOR_SRC, 0, 2, 0, 0),
+    BPF_INSN(BPF_XOR_SRC, 0, 1, 0, 0),
+    BPF_INSN(BPF_AND32_IMM, 0, 0, 0, 0xffffffff),
+    BPF_INSN(BPF_MOD_IMM, 0, 0, 0, 0x400),
+    BPF_INSN(BPF_EXIT, 0, 0, 0, 0),
+  };
+};
+constexpr uint64_t StaticFlowHash::insns[];
+
+// Programs specialised at compile time (StaticProgram<>::Run), only
+// available for the cases whose bytecode matches one of the above.
+// Sandboxed as for AotEngine.
+class StaticEngine : public BenchEngine
+{
+private:
+  struct Entry
+  {
+    const std::vector<uint64_t>* bytecode;
+    uint64_t (*run)(VM&);
+  };
+  std::vector<Entry> programs;
+  uint64_t (*current)(VM&);
+  std::unique_ptr<VM> sandbox;
+
+public:
+  StaticEngine(bool sandboxed = false) : current(nullptr)
+  {
+    if (sandboxed)
+    {
+      sandbox.reset(new VM());
+      sandbox->SetTrace(false);
+      sandbox->SetSandbox(true);
+    }
+    programs.push_back({&StaticProgram<StaticPortFilter>::Bytecode(),
+                        StaticProgram<StaticPortFilter>::Run});
+    programs.push_back({&StaticProgram<StaticFlowHash>::Bytecode(),
+                        StaticProgram<StaticFlowHash>::Run});
+  };
+  const char* Name() const {return sandbox ? "static-sb" : "static";};
+
+  bool Prepare(const BenchCase& bc)
+  {
+    for (const Entry& e : programs)
+    {
+      if (*e.bytecode == bc.prog)
+      {
+        current = e.run;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint64_t Run(VM& shared, const BenchCase& bc)
+  {
+    VM& vm = sandbox ? *sandbox : shared;
+    vm.Reset();
+    vm.SetMap(0, bc.progArray.get());
+    vm.R1().Write64(bc.args[0]);
+    vm.R2().Write64(bc.args[1]);
+    vm.R3().Write64(bc.args[2]);
+    vm.R4().Write64(bc.args[3]);
+    vm.R5().Write64(bc.args[4]);
+    return current(vm);
+  }
+};
+
+// Timing summary of one (case, engine) pair
+struct BenchResult
+{
+  double meanNs;   // per run
+  double stddevNs; // per run, across samples
+};
+
+/* ---------------------- Micro programs ------------------------ */
+
+static void Emit(std::vector<uint64_t>& prog, uint64_t instr)
+{
+  prog.push_back(instr);
+}
+
+// Set up r1-r5 with non-trivial values so no operation degenerates
+static void EmitPrologue(std::vector<uint64_t>& prog)
+{
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 1, 0, 0, 0x12345678));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 2, 0, 0, 0x9abcdef));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 3, 0, 0, 0x3));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 4, 0, 0, 0x7));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 5, 0, 0, 0x1));
+}
+
+static void EmitEpilogue(std::vector<uint64_t>& prog)
+{
+  Emit(prog, BPF_INSN(BPF_MOV_SRC, 0, 1, 0, 0));
+  Emit(prog, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+}
+
+static std::vector<uint64_t> MicroAlu64()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_ADD_SRC, 1, 2, 0, 0));
+    Emit(prog, BPF_INSN(BPF_SUB_IMM, 2, 0, 0, 0x11));
+    Emit(prog, BPF_INSN(BPF_MUL_SRC, 1, 4, 0, 0));
+    Emit(prog, BPF_INSN(BPF_DIV_IMM, 1, 0, 0, 0x3));
+    Emit(prog, BPF_INSN(BPF_OR_SRC, 2, 3, 0, 0));
+    Emit(prog, BPF_INSN(BPF_AND_IMM, 2, 0, 0, 0xffffff));
+    Emit(prog, BPF_INSN(BPF_LSH_SRC, 1, 5, 0, 0));
+    Emit(prog, BPF_INSN(BPF_RSH_IMM, 1, 0, 0, 0x2));
+    Emit(prog, BPF_INSN(BPF_MOD_SRC, 2, 4, 0, 0));
+    Emit(prog, BPF_INSN(BPF_XOR_SRC, 1, 2, 0, 0));
+    Emit(prog, BPF_INSN(BPF_ARSH_IMM, 1, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_MOV_SRC, 3, 1, 0, 0));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+static std::vector<uint64_t> MicroAlu32()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_ADD32_SRC, 1, 2, 0, 0));
+    Emit(prog, BPF_INSN(BPF_SUB32_IMM, 2, 0, 0, 0x11));
+    Emit(prog, BPF_INSN(BPF_MUL32_SRC, 1, 4, 0, 0));
+    Emit(prog, BPF_INSN(BPF_DIV32_IMM, 1, 0, 0, 0x3));
+    Emit(prog, BPF_INSN(BPF_OR32_SRC, 2, 3, 0, 0));
+    Emit(prog, BPF_INSN(BPF_AND32_IMM, 2, 0, 0, 0xffffff));
+    Emit(prog, BPF_INSN(BPF_LSH32_SRC, 1, 5, 0, 0));
+    Emit(prog, BPF_INSN(BPF_RSH32_IMM, 1, 0, 0, 0x2));
+    Emit(prog, BPF_INSN(BPF_MOD32_IMM, 2, 0, 0, 0x7));
+    Emit(prog, BPF_INSN(BPF_XOR32_SRC, 1, 2, 0, 0));
+    Emit(prog, BPF_INSN(BPF_ARSH32_IMM, 1, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_MOV32_SRC, 3, 1, 0, 0));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+static std::vector<uint64_t> MicroByteswap()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_BE, 1, 0, 0, 16));
+    Emit(prog, BPF_INSN(BPF_BE, 2, 0, 0, 32));
+    Emit(prog, BPF_INSN(BPF_BE, 3, 0, 0, 64));
+    Emit(prog, BPF_INSN(BPF_LE, 1, 0, 0, 16));
+    Emit(prog, BPF_INSN(BPF_LE, 2, 0, 0, 32));
+    Emit(prog, BPF_INSN(BPF_LE, 3, 0, 0, 64));
+    Emit(prog, BPF_INSN(BPF_ADD_SRC, 1, 2, 0, 0));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+// Mix of taken and not-taken conditional jumps. Offsets of 0 land on
+// the next instruction either way, offsets of 1 skip a marker add.
+static std::vector<uint64_t> MicroJumps()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_JEQ_IMM, 5, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_JNE_SRC, 3, 4, 1, 0));
+    Emit(prog, BPF_INSN(BPF_ADD_IMM, 0, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_JGT_SRC, 4, 3, 0, 0));
+    Emit(prog, BPF_INSN(BPF_JGE_IMM, 3, 0, 1, 0x4));
+    Emit(prog, BPF_INSN(BPF_ADD_IMM, 0, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_JSET_IMM, 4, 0, 0, 0x2));
+    Emit(prog, BPF_INSN(BPF_JSGT_SRC, 4, 5, 0, 0));
+    Emit(prog, BPF_INSN(BPF_JSGE_IMM, 5, 0, 0, 0x1));
+    Emit(prog, BPF_INSN(BPF_JA, 0, 0, 0, 0));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+static std::vector<uint64_t> MicroLoadStore()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_STXDW, 10, 2, -0x8, 0));
+    Emit(prog, BPF_INSN(BPF_LDXDW, 3, 10, -0x8, 0));
+    Emit(prog, BPF_INSN(BPF_STXW, 10, 4, -0x10, 0));
+    Emit(prog, BPF_INSN(BPF_LDXW, 3, 10, -0x10, 0));
+    Emit(prog, BPF_INSN(BPF_STH, 10, 0, -0x18, 0xbeef));
+    Emit(prog, BPF_INSN(BPF_LDXH, 4, 10, -0x18, 0));
+    Emit(prog, BPF_INSN(BPF_STB, 10, 0, -0x20, 0x7f));
+    Emit(prog, BPF_INSN(BPF_LDXB, 4, 10, -0x20, 0));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+// Back to back helper calls
+static std::vector<uint64_t> MicroCalls()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  for (int i = 0; i < MICRO_REPEAT * 4; i++)
+  {
+    Emit(prog, BPF_INSN(BPF_CALL_IMM, 0, 0, 0, BPF_FUNC_get_smp_processor_id));
+  }
+  EmitEpilogue(prog);
+  return prog;
+}
+
+// A counted loop, then bpf_loop running a callback
+static std::vector<uint64_t> MicroLoops()
+{
+  std::vector<uint64_t> prog;
+  EmitPrologue(prog);
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 6, 0, 0, MICRO_REPEAT * 4));
+  Emit(prog, BPF_INSN(BPF_ADD_SRC, 1, 3, 0, 0));
+  Emit(prog, BPF_INSN(BPF_XOR_SRC, 1, 4, 0, 0));
+  Emit(prog, BPF_INSN(BPF_SUB_IMM, 6, 0, 0, 0x1));
+  Emit(prog, BPF_INSN(BPF_JNE_IMM, 6, 0, (uint16_t)-4, 0));
+  Emit(prog, BPF_INSN(BPF_MOV_SRC, 7, 1, 0, 0));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 1, 0, 0, MICRO_REPEAT));
+  Emit(prog, BPF_INSN(BPF_LDDW, 2, BPF_PSEUDO_FUNC, 0, 0x7)); // callback
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 3, 0, 0, 0x0));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 4, 0, 0, 0x0));
+  Emit(prog, BPF_INSN(BPF_CALL_IMM, 0, 0, 0, BPF_FUNC_loop));
+  Emit(prog, BPF_INSN(BPF_ADD_SRC, 7, 0, 0, 0));
+  Emit(prog, BPF_INSN(BPF_MOV_SRC, 1, 7, 0, 0));
+  EmitEpilogue(prog);
+  Emit(prog, BPF_INSN(BPF_ADD_IMM, 1, 0, 0, 0x1));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0x0));
+  Emit(prog, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  return prog;
+}
+
+// A program that tail calls itself until MAX_TAIL_CALL_CNT is reached,
+// counting the number of times it ran in r6
+static std::vector<uint64_t> MicroTailCalls()
+{
+  std::vector<uint64_t> prog;
+  Emit(prog, BPF_INSN(BPF_ADD_IMM, 6, 0, 0, 0x1));
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 2, 0, 0, 0x0));  // map id
+  Emit(prog, BPF_INSN(BPF_MOV_IMM, 3, 0, 0, 0x0));  // slot
+  Emit(prog, BPF_INSN(BPF_CALL_IMM, 0, 0, 0, BPF_FUNC_tail_call));
+  Emit(prog, BPF_INSN(BPF_MOV_SRC, 0, 6, 0, 0));
+  Emit(prog, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  return prog;
+}
+
+static void AddMicro(std::vector<BenchCase>& cases, const char* name,
+                     std::vector<uint64_t> prog)
+{
+  BenchCase bc;
+  bc.name = name;
+  bc.family = "micro";
+  bc.prog = prog;
+  memset(bc.args, 0, sizeof(bc.args));
+  cases.push_back(bc);
+}
+
+/* ---------------------- Macro programs ------------------------ */
+
+// Register inputs for the corpus programs. Programs that do not read
+// some of r1-r5 simply ignore them.
+struct CorpusInput
+{
+  const char* label;
+  uint64_t args[5];
+};
+
+static const CorpusInput corpusInputs[] =
+{
+  // label      r1           r2           r3      r4      r5
+  {"accept",  {0x1bb,      0x6,         0xbb01, 0x1bb,  0x6}},
+  {"drop",    {0x0a000001, 0xc0a80101,  0x0,    0x35,   0x11}},
+  {"mixed",   {0x12,       0xac100a0b,  0x5000, 0x50,   0x6}},
+};
+
+static void AddCorpus(std::vector<BenchCase>& cases, const std::string& dir)
+{
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+  {
+    printf("Could not open corpus directory: %s\n", dir.c_str());
+    return;
+  }
+
+  std::vector<std::string> files;
+  while (struct dirent* ent = readdir(d))
+  {
+    std::string file = ent->d_name;
+    if (file.size() > 4 && file.compare(file.size() - 4, 4, ".bpf") == 0)
+    {
+      files.push_back(file);
+    }
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+
+  for (const std::string& file : files)
+  {
+    std::vector<uint64_t> prog = assemble(dir + "/" + file);
+    if (prog.empty())
+    {
+      continue;
+    }
+
+    for (const CorpusInput& in : corpusInputs)
+    {
+      BenchCase bc;
+      bc.name = file.substr(0, file.size() - 4) + "/" + in.label;
+      bc.family = "macro";
+      bc.prog = prog;
+      memcpy(bc.args, in.args, sizeof(bc.args));
+      cases.push_back(bc);
+    }
+  }
+}
+
+/* ------------------------- Timing ----------------------------- */
+
+static double NowNs()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+          steady_clock::now().time_since_epoch()).count();
+}
+
+static BenchResult Measure(BenchEngine& engine, VM& vm, const BenchCase& bc,
+                           unsigned samples, unsigned warmup)
+{
+  volatile uint64_t sink = 0;
+
+  for (unsigned i = 0; i < warmup; i++)
+  {
+    sink = engine.Run(vm, bc);
+  }
+
+  // scale the iteration count so a single sample is long enough
+  // to be well above clock resolution
+  uint64_t iters = 64;
+  for (;;)
+  {
+    double start = NowNs();
+    for (uint64_t i = 0; i < iters; i++)
+    {
+      sink = engine.Run(vm, bc);
+    }
+    if (NowNs() - start >= MIN_SAMPLE_NS || iters >= (1UL << 30))
+    {
+      break;
+    }
+    iters *= 2;
+  }
+
+  std::vector<double> perRun;
+  for (unsigned s = 0; s < samples; s++)
+  {
+    double start = NowNs();
+    for (uint64_t i = 0; i < iters; i++)
+    {
+      sink = engine.Run(vm, bc);
+    }
+    perRun.push_back((NowNs() - start) / iters);
+  }
+  (void)sink;
+
+  BenchResult res;
+  res.meanNs = 0;
+  for (double ns : perRun)
+  {
+    res.meanNs += ns;
+  }
+  res.meanNs /= perRun.size();
+
+  double var = 0;
+  for (double ns : perRun)
+  {
+    var += (ns - res.meanNs) * (ns - res.meanNs);
+  }
+  res.stddevNs = perRun.size() > 1 ? sqrt(var / (perRun.size() - 1)) : 0;
+
+  return res;
+}
+
+// Hardware events of runs runs, attributed to the case and engine
+static void Count(BenchEngine& engine, VM& vm, const BenchCase& bc,
+                  unsigned runs, const PerfCounters& counters,
+                  PerfProfile& profile)
+{
+  volatile uint64_t sink = 0;
+  PerfSample start, end;
+
+  counters.Read(start);
+  for (unsigned i = 0; i < runs; i++)
+  {
+    sink = engine.Run(vm, bc);
+  }
+  counters.Read(end);
+  (void)sink;
+
+  profile.Add(bc.family + "/" + bc.name, engine.Name(), runs, start, end);
+}
+
+/* ------------------------ Cost model -------------------------- */
+
+// One instruction of a cost model field, repeated MICRO_REPEAT * 4
+// times, each time followed by an ALU instruction that feeds the next
+// one, so native code cannot fold the chain. The inputs come in R1-R5
+// at run time.
+static BenchCase CostProbe(const char* name, uint64_t instr, uint64_t alu)
+{
+  BenchCase bc;
+  bc.name = name;
+  bc.family = "cost";
+  Emit(bc.prog, BPF_INSN(BPF_STXDW, 10, 2, -0x8, 0));
+  for (int i = 0; i < MICRO_REPEAT * 4 && instr; i++)
+  {
+    Emit(bc.prog, instr);
+    Emit(bc.prog, alu);
+  }
+  EmitEpilogue(bc.prog);
+  const uint64_t args[5] = {0x12345678, 0x9abcdef, 0x3, 0x7, 0x1};
+  memcpy(bc.args, args, sizeof(bc.args));
+  return bc;
+}
+
+// Fit the instruction fields of a CostModel to engine and print them
+// next to preset, ready to replace its values in Analysis.cpp. Each
+// field is what one instruction of its kind adds over the ALU
+// instruction following it; exit also takes the cost of starting a
+// run. Helpers are not measured, call is a call of
+// get_smp_processor_id less the preset cost of that helper. Native
+// numbers are a lower bound where the compiler still overlaps work.
+static bool FitCostModel(BenchEngine& engine, VM& vm, const CostModel& preset,
+                         unsigned samples, unsigned warmup)
+{
+  const uint64_t xor1 = BPF_INSN(BPF_XOR_SRC, 1, 2, 0, 0);
+  const uint64_t add6 = BPF_INSN(BPF_ADD_SRC, 6, 0, 0, 0);
+  const uint32_t getCpu = BPF_FUNC_get_smp_processor_id;
+  std::vector<BenchCase> probes = {
+    CostProbe("base", 0, 0),
+    CostProbe("alu", BPF_INSN(BPF_ADD_SRC, 1, 3, 0, 0), xor1),
+    CostProbe("mul", BPF_INSN(BPF_MUL_SRC, 1, 4, 0, 0), xor1),
+    CostProbe("div", BPF_INSN(BPF_DIV_SRC, 1, 4, 0, 0), xor1),
+    CostProbe("load", BPF_INSN(BPF_LDXDW, 1, 10, -0x8, 0), xor1),
+    CostProbe("store", BPF_INSN(BPF_STXDW, 10, 1, -0x8, 0), xor1),
+    CostProbe("atomic", BPF_INSN(BPF_ATOMIC_DW, 10, 1, -0x8, BPF_ATOMIC_ADD), xor1),
+    CostProbe("jump", BPF_INSN(BPF_JNE_SRC, 1, 3, 0, 0), xor1),
+    CostProbe("call", BPF_INSN(BPF_CALL_IMM, 0, 0, 0, getCpu), add6),
+  };
+
+  // cycles per run
+  std::vector<double> cycles;
+  for (const BenchCase& bc : probes)
+  {
+    if (!engine.Prepare(bc))
+    {
+      return false;
+    }
+    cycles.push_back(Measure(engine, vm, bc, samples, warmup).meanNs * COST_MODEL_GHZ);
+  }
+
+  // over the baseline, per pair of instructions
+  auto pair = [&](size_t i) {
+    return (cycles[i] - cycles[0]) / (MICRO_REPEAT * 4);
+  };
+  double alu = pair(1) / 2;
+  double store = pair(5) - alu;
+  struct Field
+  {
+    const char* name;
+    double cycles;
+    uint32_t preset;
+  };
+  const Field fields[] = {
+    {"alu", alu, preset.alu},
+    {"mul", pair(2) - alu, preset.mul},
+    {"div", pair(3) - alu, preset.div},
+    {"load", pair(4) - alu, preset.load},
+    {"store", store, preset.store},
+    {"atomic", pair(6) - alu, preset.atomic},
+    {"jump", pair(7) - alu, preset.jump},
+    {"exit", cycles[0] - store - alu, preset.exit},
+    {"call", pair(8) - alu - preset.helper[getCpu], preset.call},
+  };
+
+  printf("\n%s cost model, cycles at %.1f GHz\n", engine.Name(), COST_MODEL_GHZ);
+  for (const Field& f : fields)
+  {
+    char line[64];
+    snprintf(line, sizeof(line), "m.%s = %u;", f.name,
+             (unsigned)std::max(1.0, round(f.cycles)));
+    printf("  %-16s // preset %u\n", line, f.preset);
+  }
+  return true;
+}
+
+static bool PinToCpu(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void Usage(const char* argv0)
+{
+  printf("Usage: %s [-c cpu] [-s samples] [-w warmup] [-f filter] [-d dir]\n"
+         "       [-a aotdir] [-p] [-m]\n"
+         "  -c  CPU to pin the benchmark thread to (default: current)\n"
+         "  -s  timed samples per benchmark (default: 10)\n"
+         "  -w  warmup runs before timing (default: 10000)\n"
+         "  -f  only run benchmarks whose name contains filter\n"
+         "  -d  corpus directory of .bpf programs (default: bench)\n"
+         "  -a  where AOT shared objects are built and reused\n"
+         "      (default: $XDG_CACHE_HOME/ebpf)\n"
+         "  -p  count hardware events per run (perf_event_open, or rdtsc)\n"
+         "  -m  only fit the cost models of interp and aot (see Analysis.h)\n",
+         argv0);
+}
+
+int main(int argc, char** argv)
+{
+  int cpu = sched_getcpu();
+  unsigned samples = 10;
+  unsigned warmup = 10000;
+  std::string filter;
+  std::string dir = "bench";
+  std::string aotDir;
+  bool perf = false;
+  bool costModel = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:s:w:f:d:a:pmh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': cpu = atoi(optarg); break;
+      case 's': samples = strtoul(optarg, NULL, 10); break;
+      case 'w': warmup = strtoul(optarg, NULL, 10); break;
+      case 'f': filter = optarg; break;
+      case 'd': dir = optarg; break;
+      case 'a': aotDir = optarg; break;
+      case 'p': perf = true; break;
+      case 'm': costModel = true; break;
+      default: Usage(argv[0]); return 1;
+    }
+  }
+
+  if (samples == 0)
+  {
+    samples = 1;
+  }
+
+  if (aotDir.empty())
+  {
+    aotDir = AotCacheDir();
+    if (aotDir.empty())
+    {
+      printf("No directory for AOT shared objects, use -a\n");
+      return 1;
+    }
+  }
+
+  if (!PinToCpu(cpu))
+  {
+    printf("Warning: could not pin to CPU %d, results may be noisy\n", cpu);
+  }
+
+  if (costModel)
+  {
+    VM vm;
+    vm.SetTrace(false);
+    InterpEngine interp;
+    AotEngine aot(aotDir);
+    bool ok = FitCostModel(interp, vm, interpreterCost, samples, warmup)
+            && FitCostModel(aot, vm, nativeCost, samples, warmup);
+    return ok ? 0 : 1;
+  }
+
+  std::vector<BenchCase> cases;
+  AddMicro(cases, "alu64", MicroAlu64());
+  AddMicro(cases, "alu32", MicroAlu32());
+  AddMicro(cases, "byteswap", MicroByteswap());
+  AddMicro(cases, "jumps", MicroJumps());
+  AddMicro(cases, "ldst", MicroLoadStore());
+  AddMicro(cases, "calls", MicroCalls());
+  AddMicro(cases, "loops", MicroLoops());
+  AddMicro(cases, "tailcalls", MicroTailCalls());
+  cases.back().progArray = std::make_shared<ProgArrayMap>(1);
+  AddCorpus(cases, dir);
+  
+  // cases no longer move, so self tail calls can point at their program
+  for (BenchCase& bc : cases)
+  {
+    if (bc.progArray)
+    {
+      bc.progArray->Set(0, &bc.prog);
+    }
+  }
+
+  std::vector<std::unique_ptr<BenchEngine>> engines;
+  engines.push_back(std::unique_ptr<BenchEngine>(new InterpEngine()));
+  engines.push_back(std::unique_ptr<BenchEngine>(new AotEngine(aotDir)));
+  engines.push_back(std::unique_ptr<BenchEngine>(new StaticEngine()));
+  engines.push_back(std::unique_ptr<BenchEngine>(new AotEngine(aotDir, true)));
+  engines.push_back(std::unique_ptr<BenchEngine>(new StaticEngine(true)));
+  engines.push_back(std::unique_ptr<BenchEngine>(new PgoEngine(new InterpEngine())));
+  engines.push_back(std::unique_ptr<BenchEngine>(new PgoEngine(new AotEngine(aotDir))));
+
+  printf("cpu %d, %u samples, %u warmup runs\n\n", cpu, samples, warmup);
+  printf("%-24s %-10s %7s %10s %7s %8s %9s\n",
+         "benchmark", "engine", "insns", "ns/run", "+/-%", "ns/insn", "Minsn/s");
+
+  VM vm;
+  vm.SetTrace(false);
+  InterpEngine reference;
+
+  // opened after pinning, the counters follow this thread
+  std::unique_ptr<PerfCounters> counters(perf ? new PerfCounters() : nullptr);
+  PerfProfile profile;
+
+  for (const BenchCase& bc : cases)
+  {
+    std::string fullName = bc.family + "/" + bc.name;
+    if (!filter.empty() && fullName.find(filter) == std::string::npos)
+    {
+      continue;
+    }
+
+    // the interpreter is the reference for both the result and the
+    // dynamic instruction count
+    uint64_t expected = reference.Run(vm, bc);
+    uint64_t insns = vm.GetInsnCount();
+
+    for (auto& engine : engines)
+    {
+      if (!engine->Prepare(bc))
+      {
+        printf("%-24s %-10s %s\n", fullName.c_str(), engine->Name(),
+               "unsupported");
+        continue;
+      }
+
+      if (engine->Run(vm, bc) != expected)
+      {
+        printf("%-24s %-10s %s\n", fullName.c_str(), engine->Name(),
+               "MISMATCH");
+        continue;
+      }
+
+      BenchResult res = Measure(*engine, vm, bc, samples, warmup);
+      printf("%-24s %-10s %7lu %10.1f %7.2f %8.2f %9.1f\n",
+             fullName.c_str(), engine->Name(), (unsigned long)insns,
+             res.meanNs, 100.0 * res.stddevNs / res.meanNs,
+             res.meanNs / insns, insns * 1e3 / res.meanNs);
+
+      if (counters)
+      {
+        Count(*engine, vm, bc, std::max(warmup, 1u), *counters, profile);
+      }
+    }
+  }
+
+  if (counters)
+  {
+    printf("\n%s\n", counters->Hardware() ? "hardware counters"
+           : "perf_event_open not permitted, cycles are rdtsc ticks");
+    profile.Print(*counters);
+  }
+
+  return 0;
+}
@@ -0,0 +1,569 @@
+#include "ClassicBpf.h"
+#include "Layout.h"
+#include "Opcodes.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+// Fields of a classic instruction code
+#define CLASSIC_CLASS(code)  ((code) & 0x07)
+#define CLASSIC_SIZE(code)   ((code) & 0x18)
+#define CLASSIC_MODE(code)   ((code) & 0xe0)
+#define CLASSIC_OP(code)     ((code) & 0xf0)
+#define CLASSIC_SRC(code)    ((code) & 0x08)
+#define CLASSIC_RVAL(code)   ((code) & 0x18)
+#define CLASSIC_MISCOP(code) ((code) & 0xf8)
+
+// Classes
+#define CLASSIC_LD   0x00
+#define CLASSIC_LDX  0x01
+#define CLASSIC_ST   0x02
+#define CLASSIC_STX  0x03
+#define CLASSIC_ALU  0x04
+#define CLASSIC_JMP  0x05
+#define CLASSIC_RET  0x06
+#define CLASSIC_MISC 0x07
+
+// Sizes
+#define CLASSIC_W 0x00
+#define CLASSIC_H 0x08
+#define CLASSIC_B 0x10
+
+// Modes
+#define CLASSIC_IMM 0x00
+#define CLASSIC_ABS 0x20
+#define CLASSIC_IND 0x40
+#define CLASSIC_MEM 0x60
+#define CLASSIC_LEN 0x80
+#define CLASSIC_MSH 0xa0
+
+// Operands (ALU and jumps) and return values
+#define CLASSIC_K 0x00
+#define CLASSIC_X 0x08
+#define CLASSIC_A 0x10
+
+// ALU operations, the same codes as the ALU32 class of this VM
+#define CLASSIC_ADD  0x00
+#define CLASSIC_DIV  0x30
+#define CLASSIC_LSH  0x60
+#define CLASSIC_RSH  0x70
+#define CLASSIC_NEG  0x80
+#define CLASSIC_MOD  0x90
+#define CLASSIC_XOR  0xa0
+
+// Jumps, the same codes as this VM's
+#define CLASSIC_JA   0x00
+#define CLASSIC_JSET 0x40
+
+// Misc
+#define CLASSIC_TAX 0x00
+#define CLASSIC_TXA 0x80
+
+// Registers of the translation
+#define REG_A      0
+#define REG_PACKET 1
+#define REG_LEN    2
+#define REG_TMP    3
+#define REG_X      7
+
+static int16_t MemOffset(uint32_t k)
+{
+  return -(int16_t)(4 * (CLASSIC_MEMWORDS - k));
+}
+
+static uint32_t LoadBytes(uint16_t code)
+{
+  switch (CLASSIC_SIZE(code))
+  {
+    case CLASSIC_W: return 4;
+    case CLASSIC_H: return 2;
+    default: return 1;
+  }
+}
+
+static uint8_t LoadOp(uint16_t code)
+{
+  switch (CLASSIC_SIZE(code))
+  {
+    case CLASSIC_W: return BPF_LDXW;
+    case CLASSIC_H: return BPF_LDXH;
+    default: return BPF_LDXB;
+  }
+}
+
+static bool Refuse(std::string* error, size_t pc, const char* why)
+{
+  if (error)
+  {
+    *error = "insn " + std::to_string(pc) + ": " + why;
+  }
+  return false;
+}
+
+/* -------------------------- Checks ---------------------------- */
+
+// What is known on entry to an instruction on every path reaching it
+struct ClassicState
+{
+  bool reached;
+  uint64_t length; // the packet is at least this long
+  uint32_t stored; // bit k: M[k] holds a value
+};
+
+static void Join(ClassicState& into, const ClassicState& from)
+{
+  if (!into.reached)
+  {
+    into = from;
+    return;
+  }
+  into.length = std::min(into.length, from.length);
+  into.stored &= from.stored;
+}
+
+// Check filter[pc] on its own, false with the reason in error if it is
+// not a valid classic instruction
+static bool CheckInsn(const std::vector<ClassicInsn>& filter, size_t pc,
+                      std::string* error)
+{
+  const ClassicInsn& insn = filter[pc];
+  uint16_t code = insn.code;
+  size_t left = filter.size() - pc - 1; // instructions after this one
+  if (code > 0xff)
+  {
+    return Refuse(error, pc, "unknown instruction");
+  }
+
+  switch (CLASSIC_CLASS(code))
+  {
+    case CLASSIC_LD:
+    case CLASSIC_LDX:
+    {
+      bool x = CLASSIC_CLASS(code) == CLASSIC_LDX;
+      uint16_t mode = CLASSIC_MODE(code);
+      if (code & ~0xf9)
+      {
+        return Refuse(error, pc, "unknown load");
+      }
+      if (mode == CLASSIC_MEM && insn.k >= CLASSIC_MEMWORDS)
+      {
+        return Refuse(error, pc, "scratch memory index out of range");
+      }
+      if ((mode == CLASSIC_ABS || mode == CLASSIC_IND || mode == CLASSIC_MSH)
+          && (int32_t)insn.k < 0)
+      {
+        return Refuse(error, pc, "ancillary loads are not supported");
+      }
+      bool valid = x ? (code == (CLASSIC_LDX | CLASSIC_W | CLASSIC_IMM)
+                        || code == (CLASSIC_LDX | CLASSIC_W | CLASSIC_MEM)
+                        || code == (CLASSIC_LDX | CLASSIC_W | CLASSIC_LEN)
+                        || code == (CLASSIC_LDX | CLASSIC_B | CLASSIC_MSH))
+                     : (CLASSIC_SIZE(code) != 0x18
+                        && (mode == CLASSIC_ABS || mode == CLASSIC_IND
+                            || (CLASSIC_SIZE(code) == CLASSIC_W
+                                && (mode == CLASSIC_IMM || mode == CLASSIC_MEM
+                                    || mode == CLASSIC_LEN))));
+      return valid || Refuse(error, pc, "unknown load");
+    }
+    case CLASSIC_ST:
+    case CLASSIC_STX:
+      if (code != CLASSIC_ST && code != CLASSIC_STX)
+      {
+        return Refuse(error, pc, "unknown store");
+      }
+      if (insn.k >= CLASSIC_MEMWORDS)
+      {
+        return Refuse(error, pc, "scratch memory index out of range");
+      }
+      return true;
+    case CLASSIC_ALU:
+    {
+      uint16_t op = CLASSIC_OP(code);
+      if ((code & ~0xf8) != CLASSIC_ALU || op > CLASSIC_XOR
+          || (op == CLASSIC_NEG && CLASSIC_SRC(code)))
+      {
+        return Refuse(error, pc, "unknown ALU operation");
+      }
+      if (CLASSIC_SRC(code) == CLASSIC_K)
+      {
+        if ((op == CLASSIC_DIV || op == CLASSIC_MOD) && insn.k == 0)
+        {
+          return Refuse(error, pc, "division by zero");
+        }
+        if ((op == CLASSIC_LSH || op == CLASSIC_RSH) && insn.k >= 32)
+        {
+          return Refuse(error, pc, "shift out of range");
+        }
+      }
+      return true;
+    }
+    case CLASSIC_JMP:
+    {
+      uint16_t op = CLASSIC_OP(code);
+      if ((code & ~0xf8) != CLASSIC_JMP || op > CLASSIC_JSET
+          || (op == CLASSIC_JA && CLASSIC_SRC(code)))
+      {
+        return Refuse(error, pc, "unknown jump");
+      }
+      bool inRange = (op == CLASSIC_JA) ? insn.k < left
+                                        : insn.jt < left && insn.jf < left;
+      return inRange || Refuse(error, pc, "jump out of range");
+    }
+    case CLASSIC_RET:
+      if (code != (CLASSIC_RET | CLASSIC_K) && code != (CLASSIC_RET | CLASSIC_A))
+      {
+        return Refuse(error, pc, "unknown return");
+      }
+      return true;
+    default:
+      if (CLASSIC_MISCOP(code) != CLASSIC_TAX && CLASSIC_MISCOP(code) != CLASSIC_TXA)
+      {
+        return Refuse(error, pc, "unknown instruction");
+      }
+      return true;
+  }
+}
+
+/* ------------------------ Translation ------------------------- */
+
+class ClassicTranslator
+{
+private:
+  const std::vector<ClassicInsn>& filter;
+  std::vector<ClassicState> states;
+  std::vector<size_t> start; // where each instruction begins, then the fail block
+  std::vector<std::pair<size_t, size_t>> jumps; // at, to instruction
+
+  void Emit(uint64_t instr) {code.push_back(instr);};
+  void Jump(uint8_t op, unsigned dst, unsigned src, uint32_t imm, size_t to)
+  {
+    jumps.push_back(std::make_pair(code.size(), to));
+    Emit(BPF_INSN(op, dst, src, 0, imm));
+  };
+  size_t Fail() const {return filter.size();};
+
+  void Load(size_t pc, unsigned dst);
+  bool Translate(size_t pc, ClassicState& out);
+
+public:
+  std::vector<uint64_t> code;
+  std::string error;
+
+  ClassicTranslator(const std::vector<ClassicInsn>& filter)
+  : filter(filter), states(filter.size()), start(filter.size() + 1, 0) {};
+
+  bool Run();
+};
+
+// Load size bytes of the packet at k (ABS, MSH) or X + k (IND) into
+// dst, in host byte order, the filter returning 0 if they are not all
+// in the packet
+void ClassicTranslator::Load(size_t pc, unsigned dst)
+{
+  const ClassicInsn& insn = filter[pc];
+  uint32_t size = LoadBytes(insn.code);
+  uint8_t op = LoadOp(insn.code);
+  uint64_t end = (uint64_t)insn.k + size; // k < 2^31, fits an immediate
+
+  if (CLASSIC_MODE(insn.code) == CLASSIC_IND)
+  {
+    Emit(BPF_INSN(BPF_MOV_SRC, REG_TMP, REG_X, 0, 0));
+    Emit(BPF_INSN(BPF_ADD_IMM, REG_TMP, 0, 0, end));
+    Jump(BPF_JGT_SRC, REG_TMP, REG_LEN, 0, Fail());
+    Emit(BPF_INSN(BPF_ADD_SRC, REG_TMP, REG_PACKET, 0, 0));
+    Emit(BPF_INSN(op, dst, REG_TMP, -(int16_t)size, 0));
+  }
+  else
+  {
+    if (states[pc].length < end)
+    {
+      Emit(BPF_INSN(BPF_MOV32_IMM, REG_TMP, 0, 0, end));
+      Jump(BPF_JGT_SRC, REG_TMP, REG_LEN, 0, Fail());
+    }
+    if (insn.k <= INT16_MAX)
+    {
+      Emit(BPF_INSN(op, dst, REG_PACKET, insn.k, 0));
+    }
+    else
+    {
+      Emit(BPF_INSN(BPF_MOV_SRC, REG_TMP, REG_PACKET, 0, 0));
+      Emit(BPF_INSN(BPF_ADD_IMM, REG_TMP, 0, 0, insn.k));
+      Emit(BPF_INSN(op, dst, REG_TMP, 0, 0));
+    }
+  }
+
+  if (size > 1)
+  {
+    Emit(BPF_INSN(BPF_BE, dst, 0, 0, 8 * size));
+  }
+}
+
+// Translate filter[pc], out being what is known after it when it does
+// not jump. False if it reads scratch memory not stored to.
+bool ClassicTranslator::Translate(size_t pc, ClassicState& out)
+{
+  const ClassicInsn& insn = filter[pc];
+  uint16_t code = insn.code;
+  uint16_t mode = CLASSIC_MODE(code);
+  bool x = CLASSIC_SRC(code) == CLASSIC_X;
+
+  switch (CLASSIC_CLASS(code))
+  {
+    case CLASSIC_LD:
+    case CLASSIC_LDX:
+    {
+      unsigned dst = (CLASSIC_CLASS(code) == CLASSIC_LD) ? REG_A : REG_X;
+      switch (mode)
+      {
+        case CLASSIC_IMM:
+          Emit(BPF_INSN(BPF_MOV32_IMM, dst, 0, 0, insn.k));
+          break;
+        case CLASSIC_MEM:
+          if (!(out.stored & (1U << insn.k)))
+          {
+            return Refuse(&error, pc, "reads scratch memory not stored to");
+          }
+          Emit(BPF_INSN(BPF_LDXW, dst, 10, MemOffset(insn.k), 0));
+          break;
+        case CLASSIC_LEN:
+          Emit(BPF_INSN(BPF_MOV32_SRC, dst, REG_LEN, 0, 0));
+          break;
+        default:
+          Load(pc, dst);
+          // X >= 0, so any load covers k + size
+          out.length = std::max(out.length, (uint64_t)insn.k + LoadBytes(code));
+          if (mode == CLASSIC_MSH)
+          {
+            Emit(BPF_INSN(BPF_AND32_IMM, REG_X, 0, 0, 0xf));
+            Emit(BPF_INSN(BPF_LSH32_IMM, REG_X, 0, 0, 2));
+          }
+          break;
+      }
+      return true;
+    }
+    case CLASSIC_ST:
+    case CLASSIC_STX:
+    {
+      unsigned src = (CLASSIC_CLASS(code) == CLASSIC_ST) ? REG_A : REG_X;
+      Emit(BPF_INSN(BPF_STXW, 10, src, MemOffset(insn.k), 0));
+      out.stored |= 1U << insn.k;
+      return true;
+    }
+    case CLASSIC_ALU:
+    {
+      uint16_t op = CLASSIC_OP(code);
+      if (x && (op == CLASSIC_DIV || op == CLASSIC_MOD))
+      {
+        Jump(BPF_JEQ_IMM, REG_X, 0, 0, Fail());
+      }
+      // classic ALU codes are those of the ALU32 class
+      Emit(BPF_INSN(code, REG_A, x ? REG_X : 0, 0, x ? 0 : insn.k));
+      return true;
+    }
+    case CLASSIC_JMP:
+    {
+      if (CLASSIC_OP(code) == CLASSIC_JA)
+      {
+        Jump(BPF_JA, 0, 0, 0, pc + 1 + insn.k);
+        return true;
+      }
+      size_t taken = pc + 1 + insn.jt;
+      size_t other = pc + 1 + insn.jf;
+      if (taken == other)
+      {
+        Jump(BPF_JA, 0, 0, 0, taken);
+        return true;
+      }
+      // so are those of its jumps; A and X are zero-extended, so
+      // comparing all 64 bits compares the low 32
+      Jump(code, REG_A, x ? REG_X : 0, x ? 0 : insn.k, taken);
+      Jump(BPF_JA, 0, 0, 0, other);
+      return true;
+    }
+    case CLASSIC_RET:
+      if (CLASSIC_RVAL(code) == CLASSIC_K)
+      {
+        Emit(BPF_INSN(BPF_MOV32_IMM, REG_A, 0, 0, insn.k));
+      }
+      Emit(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+      return true;
+    default:
+      if (CLASSIC_MISCOP(code) == CLASSIC_TAX)
+      {
+        Emit(BPF_INSN(BPF_MOV32_SRC, REG_X, REG_A, 0, 0));
+      }
+      else
+      {
+        Emit(BPF_INSN(BPF_MOV32_SRC, REG_A, REG_X, 0, 0));
+      }
+      return true;
+  }
+}
+
+bool ClassicTranslator::Run()
+{
+  // A and X start out 0
+  Emit(BPF_INSN(BPF_MOV32_IMM, REG_A, 0, 0, 0));
+  Emit(BPF_INSN(BPF_MOV32_IMM, REG_X, 0, 0, 0));
+
+  // jumps go forward only, so every instruction is reached from ones
+  // translated before it
+  states[0] = ClassicState{true, 0, 0};
+  for (size_t pc = 0; pc < filter.size(); pc++)
+  {
+    start[pc] = code.size();
+    if (!states[pc].reached)
+    {
+      continue;
+    }
+
+    ClassicState out = states[pc];
+    if (!Translate(pc, out))
+    {
+      return false;
+    }
+
+    const ClassicInsn& insn = filter[pc];
+    uint16_t cls = CLASSIC_CLASS(insn.code);
+    if (cls == CLASSIC_RET)
+    {
+      continue;
+    }
+    if (cls != CLASSIC_JMP)
+    {
+      if (pc + 1 == filter.size())
+      {
+        return Refuse(&error, pc, "runs off the end");
+      }
+      Join(states[pc + 1], out);
+    }
+    else if (CLASSIC_OP(insn.code) == CLASSIC_JA)
+    {
+      Join(states[pc + 1 + insn.k], out);
+    }
+    else
+    {
+      Join(states[pc + 1 + insn.jt], out);
+      Join(states[pc + 1 + insn.jf], out);
+    }
+  }
+
+  // past the end of the packet, or division by 0
+  start[filter.size()] = code.size();
+  Emit(BPF_INSN(BPF_MOV32_IMM, REG_A, 0, 0, 0));
+  Emit(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+
+  for (const std::pair<size_t, size_t>& j : jumps)
+  {
+    size_t off = start[j.second] - j.first - 1;
+    if (off > INT16_MAX)
+    {
+      return Refuse(&error, j.first, "jump too far once translated");
+    }
+    code[j.first] |= (uint64_t)(uint16_t)off << SHL_OFF;
+  }
+  return true;
+}
+
+std::vector<uint64_t> TranslateClassic(const std::vector<ClassicInsn>& filter,
+                                       std::string* error)
+{
+  std::string unused;
+  error = error ? error : &unused;
+
+  if (filter.empty() || filter.size() > CLASSIC_MAX_INSNS)
+  {
+    *error = "1 to " + std::to_string(CLASSIC_MAX_INSNS) + " instructions";
+    return std::vector<uint64_t>();
+  }
+  for (size_t pc = 0; pc < filter.size(); pc++)
+  {
+    if (!CheckInsn(filter, pc, error))
+    {
+      return std::vector<uint64_t>();
+    }
+  }
+
+  ClassicTranslator translator(filter);
+  if (!translator.Run())
+  {
+    *error = translator.error;
+    return std::vector<uint64_t>();
+  }
+  return Peephole(translator.code);
+}
+
+/* -------------------------- Parsing --------------------------- */
+
+bool ParseClassic(const std::string& text, std::vector<ClassicInsn>& filter,
+                  std::string* error)
+{
+  std::string unused;
+  error = error ? error : &unused;
+  filter.clear();
+
+  std::istringstream lines(text);
+  std::string line;
+  size_t lineNo = 0;
+  long long count = -1; // as tcpdump -ddd gives it first
+  while (std::getline(lines, line))
+  {
+    lineNo++;
+    std::replace_if(line.begin(), line.end(),
+                    [](char c) {return c == '{' || c == '}' || c == ',';}, ' ');
+
+    std::vector<unsigned long long> fields;
+    const char* p = line.c_str();
+    char* end;
+    while (true)
+    {
+      while (*p == ' ' || *p == '\t' || *p == '\r')
+      {
+        p++;
+      }
+      if (!*p)
+      {
+        break;
+      }
+      fields.push_back(strtoull(p, &end, 0));
+      if (end == p)
+      {
+        *error = "line " + std::to_string(lineNo) + ": not a number";
+        return false;
+      }
+      p = end;
+    }
+
+    if (fields.empty())
+    {
+      continue;
+    }
+    if (fields.size() == 1 && count < 0 && filter.empty())
+    {
+      count = fields[0];
+      continue;
+    }
+    if (fields.size() != 4 || fields[0] > 0xffff || fields[1] > 0xff
+        || fields[2] > 0xff || fields[3] > 0xffffffffULL)
+    {
+      *error = "line " + std::to_string(lineNo) + ": expected code jt jf k";
+      return false;
+    }
+    filter.push_back(ClassicInsn{(uint16_t)fields[0], (uint8_t)fields[1],
+                                 (uint8_t)fields[2], (uint32_t)fields[3]});
+  }
+
+  if (count >= 0 && (size_t)count != filter.size())
+  {
+    *error = "count of " + std::to_string(count) + " but "
+           + std::to_string(filter.size()) + " instructions";
+    return false;
+  }
+  if (filter.empty())
+  {
+    *error = "no instructions";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Longest classic program accepted (the kernel's BPF_MAXINSNS)
+#define CLASSIC_MAX_INSNS 4096
+
+// Words of scratch memory, M[0] to M[15]
+#define CLASSIC_MEMWORDS 16
+
+// One instruction of a classic BPF program, laid out as the kernel's
+// struct sock_filter: what setsockopt(SO_ATTACH_FILTER) takes and
+// tcpdump -dd prints
+struct ClassicInsn
+{
+  uint16_t code;
+  uint8_t jt; // instructions skipped if the condition holds
+  uint8_t jf; // and if not
+  uint32_t k;
+};
+
+// Translate a classic BPF filter (as tcpdump compiles its expressions
+// to) into a program for this VM.
+//
+// The program takes the packet in R1 and its length in R2, as Pipeline
+// passes them, and returns what the filter returns: 0 to drop, else the
+// bytes to keep. A is R0, X is R7 and M[] the top CLASSIC_MEMWORDS
+// words of the stack. Loads check the length as classic BPF does,
+// making the filter return 0 past the end of the packet; a check that
+// the checks before it already cover on every path is left out, so the
+// header fields of a filter cost one check. Division by an X of 0 also
+// returns 0. The result goes through Peephole.
+//
+// Filters are checked as the kernel checks them: unknown instructions,
+// jumps out of the program, code running off its end, division by a
+// constant 0, shifts by 32 or more, and reading M[k] on a path that has
+// not stored to it are refused, with the reason in error. Ancillary
+// loads (the negative SKF_AD_OFF, SKF_NET_OFF and SKF_LL_OFF offsets)
+// refer to socket buffer fields there is no equivalent of and are
+// refused as well. Returns an empty program if refused.
+std::vector<uint64_t> TranslateClassic(const std::vector<ClassicInsn>& filter,
+                                       std::string* error = nullptr);
+
+// Read a classic filter as tcpdump -ddd (a count, then "code jt jf k"
+// in decimal per line) or -dd ("{ 0x28, 0, 0, 0x0000000c }," per line)
+// prints it. Returns false, with the line at fault in error, if text is
+// neither.
+bool ParseClassic(const std::string& text, std::vector<ClassicInsn>& filter,
+                  std::string* error = nullptr);
@@ -0,0 +1,1180 @@
+#include "Classifier.h"
+#include "Opcodes.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#define NONE 0xffffffffU
+
+// Registers of the merged program: R1 the packet, R2 its length, R0 and
+// R9 scratch, R3 to R8 hold values of expressions
+#define REG_PACKET  1
+#define REG_LEN     2
+#define REG_SCRATCH 9
+#define CACHE_FIRST 3
+#define CACHE_LAST  8
+#define CACHE_REGS  (CACHE_LAST - CACHE_FIRST + 1)
+
+// Jumps reach 32767 instructions ahead. Every ISLAND_GAP instructions
+// the emitter places an island of JAs, jumped over, that jumps still
+// waiting for a label ISLAND_REACH or more behind hop through.
+#define ISLAND_GAP   8192
+#define ISLAND_REACH 16384
+
+/* ---------------------- Expressions ---------------------------- */
+
+// A value filters compute, shared by all filters computing it
+struct Expr
+{
+  enum Kind : uint8_t
+  {
+    CONST, // imm
+    LEN,   // the packet length, in R2
+    LOAD,  // ldx op of packet + a + imm (a NONE for none)
+    ALU,   // op (the _SRC form) of a and b
+    UNARY, // op of a, with imm as its immediate
+  } kind;
+  uint8_t op;
+  uint32_t a, b;
+  uint64_t imm;
+  uint32_t need; // registers computing it takes
+};
+
+// A condition a filter took: whether op (the _SRC form of a jump, JNE
+// as JEQ not holding) of lhs and rhs held
+struct Test
+{
+  uint8_t op;
+  uint32_t lhs, rhs;
+  bool holds;
+};
+
+// A node of the trie, reached when the tests on the way there hold
+struct TrieNode
+{
+  uint32_t test;                       // NONE at the root
+  std::vector<uint32_t> children;      // in the order they were added
+  std::map<uint32_t, uint32_t> byTest; // child of each test
+  std::vector<uint32_t> matches;       // filters with a path ending here
+};
+
+// What a register of a filter holds while it is followed
+struct SymReg
+{
+  enum Kind : uint8_t
+  {
+    UNSET,
+    SCALAR, // expr
+    PACKET, // packet + expr (NONE for none) + off
+  } kind;
+  uint32_t expr;
+  int64_t off;
+};
+
+struct SymState
+{
+  SymReg r[11];
+  std::vector<uint32_t> path; // tests taken
+  uint64_t lenMin;            // the length known to be at least this
+};
+
+static bool IsAlu32(uint8_t op)
+{
+  return (op & 0x07) == 0x04;
+}
+
+static uint8_t ImmForm(uint8_t op)
+{
+  return op & ~0x08;
+}
+
+static uint8_t SrcForm(uint8_t op)
+{
+  return op | 0x08;
+}
+
+static uint32_t LoadSize(uint8_t op)
+{
+  switch (op)
+  {
+    case BPF_LDXB: return 1;
+    case BPF_LDXH: return 2;
+    case BPF_LDXW: return 4;
+    default: return 8;
+  }
+}
+
+// Set reg to value, immediates being 32 bits zero-extended
+static void EmitConst(std::vector<uint64_t>& p, unsigned reg, uint64_t value)
+{
+  if (value >> 32)
+  {
+    p.push_back(BPF_INSN(BPF_MOV_IMM, reg, 0, 0, value >> 32));
+    p.push_back(BPF_INSN(BPF_LSH_IMM, reg, 0, 0, 32));
+    if ((uint32_t)value)
+    {
+      p.push_back(BPF_INSN(BPF_OR_IMM, reg, 0, 0, (uint32_t)value));
+    }
+    return;
+  }
+  p.push_back(BPF_INSN(BPF_MOV_IMM, reg, 0, 0, value));
+}
+
+class Merger
+{
+private:
+  std::vector<Expr> exprs;
+  std::map<std::tuple<uint8_t, uint8_t, uint32_t, uint32_t, uint64_t>, uint32_t> exprIds;
+  std::vector<Test> tests;
+  std::map<std::tuple<uint8_t, uint32_t, uint32_t, bool>, uint32_t> testIds;
+  VM eval; // folds constants with the VM's own semantics
+
+  const std::vector<uint64_t>* prog;
+  uint32_t filter;
+  size_t followed; // paths of the filter so far
+
+  uint64_t Fold(const std::vector<uint64_t>& p);
+  uint32_t Make(Expr::Kind kind, uint8_t op, uint32_t a, uint32_t b, uint64_t imm);
+  uint32_t Const(uint64_t value) {return Make(Expr::CONST, 0, NONE, NONE, value);};
+  uint32_t Alu(uint8_t op, uint32_t a, uint32_t b);
+  uint32_t Unary(uint8_t op, uint32_t a, uint64_t imm);
+  bool Known(const SymState& s, uint32_t expr, uint64_t& value) const;
+  int Decide(const SymState& s, uint8_t op, uint32_t lhs, uint32_t rhs);
+  bool Assume(SymState& s, uint8_t op, uint32_t lhs, uint32_t rhs, bool holds);
+  bool Load(SymState& s, uint8_t op, const SymReg& base, int16_t off, uint32_t& expr);
+  bool Step(SymState& s, size_t& pc, bool& done);
+  bool Follow(SymState s, size_t pc);
+  bool Fail(size_t pc, const char* why);
+  void Insert(const std::vector<uint32_t>& path);
+
+public:
+  std::vector<TrieNode> trie;
+  std::string error;
+  size_t paths;
+
+  Merger();
+
+  bool Add(const std::vector<uint64_t>& program, uint32_t id);
+
+  const Expr& GetExpr(uint32_t id) const {return exprs[id];};
+  const Test& GetTest(uint32_t id) const {return tests[id];};
+};
+
+Merger::Merger()
+: prog(nullptr), filter(0), followed(0), paths(0)
+{
+  eval.SetTrace(false);
+  trie.push_back(TrieNode());
+  trie[0].test = NONE;
+  Make(Expr::LEN, 0, NONE, NONE, 0);
+}
+
+uint64_t Merger::Fold(const std::vector<uint64_t>& p)
+{
+  eval.SetRegs(std::vector<uint64_t>(11, 0).data());
+  return eval.Run(p);
+}
+
+uint32_t Merger::Make(Expr::Kind kind, uint8_t op, uint32_t a, uint32_t b,
+                      uint64_t imm)
+{
+  auto key = std::make_tuple((uint8_t)kind, op, a, b, imm);
+  auto found = exprIds.find(key);
+  if (found != exprIds.end())
+  {
+    return found->second;
+  }
+
+  Expr e;
+  e.kind = kind;
+  e.op = op;
+  e.a = a;
+  e.b = b;
+  e.imm = imm;
+  switch (kind)
+  {
+    case Expr::CONST: e.need = 1; break;
+    case Expr::LEN: e.need = 0; break;
+    case Expr::LOAD: e.need = (a == NONE) ? 1 : std::max(exprs[a].need, 2U); break;
+    case Expr::UNARY: e.need = std::max(exprs[a].need, 2U); break;
+    case Expr::ALU:
+    {
+      const Expr& rhs = exprs[b];
+      bool imm = rhs.kind == Expr::CONST && ((rhs.imm >> 32) == 0 || IsAlu32(op));
+      e.need = imm ? std::max(exprs[a].need, 2U)
+                   : std::max({exprs[a].need, rhs.need + 1, 3U});
+      break;
+    }
+  }
+
+  uint32_t id = exprs.size();
+  exprs.push_back(e);
+  exprIds[key] = id;
+  return id;
+}
+
+uint32_t Merger::Alu(uint8_t op, uint32_t a, uint32_t b)
+{
+  if (exprs[a].kind == Expr::CONST && exprs[b].kind == Expr::CONST)
+  {
+    std::vector<uint64_t> p;
+    EmitConst(p, 1, exprs[a].imm);
+    EmitConst(p, 2, exprs[b].imm);
+    p.push_back(BPF_INSN(op, 1, 2, 0, 0));
+    p.push_back(BPF_INSN(BPF_MOV_SRC, 0, 1, 0, 0));
+    p.push_back(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+    return Const(Fold(p));
+  }
+  return Make(Expr::ALU, op, a, b, 0);
+}
+
+uint32_t Merger::Unary(uint8_t op, uint32_t a, uint64_t imm)
+{
+  if (exprs[a].kind == Expr::CONST)
+  {
+    std::vector<uint64_t> p;
+    EmitConst(p, 1, exprs[a].imm);
+    p.push_back(BPF_INSN(op, 1, 1, 0, imm));
+    p.push_back(BPF_INSN(BPF_MOV_SRC, 0, 1, 0, 0));
+    p.push_back(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+    return Const(Fold(p));
+  }
+  return Make(Expr::UNARY, op, a, NONE, imm);
+}
+
+// Value of expr on the path of s, if it is a constant or was found
+// equal to one
+bool Merger::Known(const SymState& s, uint32_t expr, uint64_t& value) const
+{
+  if (exprs[expr].kind == Expr::CONST)
+  {
+    value = exprs[expr].imm;
+    return true;
+  }
+  for (uint32_t t : s.path)
+  {
+    const Test& test = tests[t];
+    if (test.op == BPF_JEQ_SRC && test.holds && test.lhs == expr
+            && exprs[test.rhs].kind == Expr::CONST)
+    {
+      value = exprs[test.rhs].imm;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the jump op of lhs and rhs is taken on the path of s: 1 if it
+// is, 0 if not, -1 if that depends on the packet
+int Merger::Decide(const SymState& s, uint8_t op, uint32_t lhs, uint32_t rhs)
+{
+  uint64_t a, b;
+  if (Known(s, lhs, a) && Known(s, rhs, b))
+  {
+    std::vector<uint64_t> p;
+    EmitConst(p, 1, a);
+    EmitConst(p, 2, b);
+    p.push_back(BPF_INSN(op, 1, 2, 2, 0));
+    p.push_back(BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0));
+    p.push_back(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+    p.push_back(BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 1));
+    p.push_back(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+    return Fold(p) ? 1 : 0;
+  }
+
+  // the same test taken before, either way
+  bool eq = (op == BPF_JEQ_SRC || op == BPF_JNE_SRC);
+  uint8_t canonical = eq ? BPF_JEQ_SRC : op;
+  for (uint32_t t : s.path)
+  {
+    const Test& test = tests[t];
+    if (test.op == canonical && test.lhs == lhs && test.rhs == rhs)
+    {
+      return (test.holds != (op == BPF_JNE_SRC)) ? 1 : 0;
+    }
+  }
+  if (op == BPF_JGE_SRC && lhs == 0 && exprs[rhs].kind == Expr::CONST
+          && s.lenMin >= exprs[rhs].imm)
+  {
+    return 1;
+  }
+  return -1;
+}
+
+// Add the test that op of lhs and rhs holds (or not) to the path of s,
+// false if the path cannot be taken
+bool Merger::Assume(SymState& s, uint8_t op, uint32_t lhs, uint32_t rhs,
+                    bool holds)
+{
+  int known = Decide(s, op, lhs, rhs);
+  if (known >= 0)
+  {
+    return known == (int)holds;
+  }
+
+  if (op == BPF_JNE_SRC)
+  {
+    op = BPF_JEQ_SRC;
+    holds = !holds;
+  }
+  auto key = std::make_tuple(op, lhs, rhs, holds);
+  auto found = testIds.find(key);
+  uint32_t id;
+  if (found != testIds.end())
+  {
+    id = found->second;
+  }
+  else
+  {
+    id = tests.size();
+    tests.push_back(Test{op, lhs, rhs, holds});
+    testIds[key] = id;
+  }
+  s.path.push_back(id);
+
+  if (op == BPF_JGE_SRC && holds && lhs == 0 && exprs[rhs].kind == Expr::CONST)
+  {
+    s.lenMin = std::max(s.lenMin, exprs[rhs].imm);
+  }
+  return true;
+}
+
+bool Merger::Fail(size_t pc, const char* why)
+{
+  char line[128];
+  snprintf(line, sizeof(line), "filter %u, insn %zu: %s", filter, pc, why);
+  error = line;
+  return false;
+}
+
+// The load op of base + off, with the tests that it lies within the
+// packet added to the path of s. False if it cannot be merged.
+bool Merger::Load(SymState& s, uint8_t op, const SymReg& base, int16_t off,
+                  uint32_t& expr)
+{
+  int64_t at = base.off + off;
+  int64_t end = at + LoadSize(op);
+  if (at < 0 || end > INT16_MAX)
+  {
+    return false;
+  }
+  expr = Make(Expr::LOAD, op, base.expr, NONE, at);
+
+  // length >= end, or length >= var and length - var >= end
+  const uint32_t len = 0;
+  if (base.expr == NONE)
+  {
+    return Assume(s, BPF_JGE_SRC, len, Const(end), true);
+  }
+  return Assume(s, BPF_JGE_SRC, len, base.expr, true)
+          && Assume(s, BPF_JGE_SRC, Alu(BPF_SUB_SRC, len, base.expr), Const(end), true);
+}
+
+// Carry out the instruction at pc. done is set at the end of a path;
+// returns false if the filter cannot be merged (with error set).
+bool Merger::Step(SymState& s, size_t& pc, bool& done)
+{
+  const std::vector<uint64_t>& p = *prog;
+  if (pc >= p.size())
+  {
+    return Fail(pc, "runs off the end");
+  }
+  uint64_t instr = p[pc];
+  uint8_t op = instr & OP_MASK;
+  unsigned dst = (instr & DST_MASK) >> SHL_DST;
+  unsigned src = (instr & SRC_MASK) >> SHL_SRC;
+  int16_t off = (instr & OFF_MASK) >> SHL_OFF;
+  uint32_t imm = (instr & IMM_MASK) >> SHL_IMM;
+  uint8_t cls = op & 0x07;
+  bool useSrc = (op & 0x08) != 0;
+  pc++;
+
+  if (dst > 10 || src > 10)
+  {
+    return Fail(pc - 1, "bad register");
+  }
+  SymReg& d = s.r[dst];
+  const SymReg& sr = s.r[src];
+
+  if (op == BPF_EXIT)
+  {
+    done = true;
+    const SymReg& r0 = s.r[0];
+    if (r0.kind != SymReg::SCALAR)
+    {
+      return Fail(pc - 1, "R0 is not a number on exit");
+    }
+    if (Assume(s, BPF_JEQ_SRC, r0.expr, Const(0), false))
+    {
+      Insert(s.path);
+    }
+    return true;
+  }
+
+  if (op == BPF_LDDW)
+  {
+    if (src != 0)
+    {
+      return Fail(pc - 1, "callbacks are not supported");
+    }
+    d = SymReg{SymReg::SCALAR, Const(imm), 0};
+    return true;
+  }
+
+  if (op == BPF_LDXB || op == BPF_LDXH || op == BPF_LDXW || op == BPF_LDXDW)
+  {
+    if (sr.kind != SymReg::PACKET)
+    {
+      return Fail(pc - 1, "loads from other than the packet");
+    }
+    uint32_t expr;
+    if (!Load(s, op, sr, off, expr))
+    {
+      return Fail(pc - 1, "load offset out of range");
+    }
+    d = SymReg{SymReg::SCALAR, expr, 0};
+    return true;
+  }
+
+  if (cls == 0x04 || cls == 0x07)
+  {
+    uint8_t base = op & 0xf0;
+    if (base == 0x30 || base == 0x90)
+    {
+      return Fail(pc - 1, "division and modulo are not supported");
+    }
+
+    // unary
+    if (op == BPF_NEG || op == BPF_NEG32 || op == BPF_LE || op == BPF_BE)
+    {
+      if (d.kind != SymReg::SCALAR)
+      {
+        return Fail(pc - 1, "operand is not a number");
+      }
+      d.expr = Unary(op, d.expr, (op == BPF_LE || op == BPF_BE) ? imm : 0);
+      return true;
+    }
+
+    if (useSrc && sr.kind == SymReg::UNSET)
+    {
+      return Fail(pc - 1, "reads a register before setting it");
+    }
+    uint32_t operand = useSrc ? sr.expr : Const(imm);
+
+    if (op == BPF_MOV_IMM || op == BPF_MOV32_IMM)
+    {
+      d = SymReg{SymReg::SCALAR, Const(imm), 0};
+      return true;
+    }
+    if (op == BPF_MOV_SRC)
+    {
+      d = sr;
+      return true;
+    }
+    if (op == BPF_MOV32_SRC)
+    {
+      if (sr.kind != SymReg::SCALAR)
+      {
+        return Fail(pc - 1, "truncates a pointer");
+      }
+      d = SymReg{SymReg::SCALAR, Unary(BPF_MOV32_SRC, sr.expr, 0), 0};
+      return true;
+    }
+
+    if (d.kind == SymReg::UNSET)
+    {
+      return Fail(pc - 1, "reads a register before setting it");
+    }
+
+    // pointer arithmetic: packet + number, number + packet, packet - constant
+    bool srcPacket = useSrc && sr.kind == SymReg::PACKET;
+    if (d.kind == SymReg::PACKET || srcPacket)
+    {
+      if (d.kind == SymReg::PACKET && srcPacket)
+      {
+        return Fail(pc - 1, "combines two pointers");
+      }
+      SymReg ptr = srcPacket ? sr : d;
+      uint32_t num = srcPacket ? d.expr : operand;
+      uint64_t value;
+      bool isConst = exprs[num].kind == Expr::CONST;
+      value = isConst ? exprs[num].imm : 0;
+      if (op == BPF_ADD_IMM || op == BPF_ADD_SRC)
+      {
+        if (isConst)
+        {
+          ptr.off += (int64_t)value;
+        }
+        else
+        {
+          ptr.expr = (ptr.expr == NONE) ? num : Alu(BPF_ADD_SRC, ptr.expr, num);
+        }
+      }
+      else if ((op == BPF_SUB_IMM || op == BPF_SUB_SRC) && !srcPacket && isConst)
+      {
+        ptr.off -= (int64_t)value;
+      }
+      else
+      {
+        return Fail(pc - 1, "pointer arithmetic other than adding");
+      }
+      if (ptr.off < INT32_MIN || ptr.off > INT32_MAX)
+      {
+        return Fail(pc - 1, "pointer out of range");
+      }
+      d = ptr;
+      return true;
+    }
+
+    d.expr = Alu(SrcForm(op), d.expr, operand);
+    return true;
+  }
+
+  if (op == BPF_JA)
+  {
+    if (off < 0)
+    {
+      return Fail(pc - 1, "loops are not supported");
+    }
+    pc += off;
+    return true;
+  }
+
+  if (cls == 0x05 && op != BPF_CALL_IMM)
+  {
+    if (off < 0)
+    {
+      return Fail(pc - 1, "loops are not supported");
+    }
+    if (d.kind != SymReg::SCALAR || (useSrc && sr.kind != SymReg::SCALAR))
+    {
+      return Fail(pc - 1, "compares other than numbers");
+    }
+    uint8_t jop = SrcForm(op);
+    uint32_t rhs = useSrc ? sr.expr : Const(imm);
+
+    int known = Decide(s, jop, d.expr, rhs);
+    if (known >= 0)
+    {
+      pc += known ? off : 0;
+      return true;
+    }
+
+    // the jump taken on a path of its own, this one falls through
+    SymState taken = s;
+    Assume(taken, jop, d.expr, rhs, true);
+    if (!Follow(taken, pc + off))
+    {
+      return false;
+    }
+    Assume(s, jop, d.expr, rhs, false);
+    return true;
+  }
+
+  switch (op)
+  {
+    case BPF_CALL_IMM: return Fail(pc - 1, "helper calls are not supported");
+    case BPF_STB: case BPF_STH: case BPF_STW: case BPF_STDW:
+    case BPF_STXB: case BPF_STXH: case BPF_STXW: case BPF_STXDW:
+    case BPF_ATOMIC_W: case BPF_ATOMIC_DW:
+      return Fail(pc - 1, "stores are not supported");
+    default:
+      return Fail(pc - 1, "instruction not supported");
+  }
+}
+
+// Follow the path of s from pc and all paths branching off it
+bool Merger::Follow(SymState s, size_t pc)
+{
+  if (++followed > CLASSIFIER_MAX_PATHS)
+  {
+    return Fail(pc, "too many paths");
+  }
+
+  bool done = false;
+  while (!done)
+  {
+    if (!Step(s, pc, done))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Merger::Insert(const std::vector<uint32_t>& path)
+{
+  uint32_t node = 0;
+  for (uint32_t t : path)
+  {
+    auto found = trie[node].byTest.find(t);
+    if (found != trie[node].byTest.end())
+    {
+      node = found->second;
+      continue;
+    }
+    uint32_t child = trie.size();
+    trie.push_back(TrieNode());
+    trie[child].test = t;
+    trie[node].children.push_back(child);
+    trie[node].byTest[t] = child;
+    node = child;
+  }
+
+  std::vector<uint32_t>& matches = trie[node].matches;
+  if (matches.empty() || matches.back() != filter)
+  {
+    matches.push_back(filter);
+  }
+  paths++;
+}
+
+bool Merger::Add(const std::vector<uint64_t>& program, uint32_t id)
+{
+  prog = &program;
+  filter = id;
+  followed = 0;
+
+  SymState s;
+  for (SymReg& r : s.r)
+  {
+    r = SymReg{SymReg::UNSET, NONE, 0};
+  }
+  s.r[1] = SymReg{SymReg::PACKET, NONE, 0};
+  s.lenMin = 0;
+
+  // nothing of the filter goes in unless all of it can
+  std::vector<TrieNode> before = trie;
+  size_t pathsBefore = paths;
+  if (!Follow(s, 0))
+  {
+    trie.swap(before);
+    paths = pathsBefore;
+    return false;
+  }
+
+  // the generator must find registers for every expression, and for
+  // the right side of a test with the left one held
+  bool fits = true;
+  for (const Expr& e : exprs)
+  {
+    fits = fits && e.need <= CACHE_REGS;
+  }
+  for (const Test& t : tests)
+  {
+    fits = fits && exprs[t.rhs].need < CACHE_REGS;
+  }
+  if (!fits)
+  {
+    trie.swap(before);
+    paths = pathsBefore;
+    error = "filter " + std::to_string(id) + ": expressions too deep";
+    return false;
+  }
+  return true;
+}
+
+/* ------------------------- Emitter ----------------------------- */
+
+// Code with jumps to labels, resolved once all labels are bound
+class Emitter
+{
+private:
+  std::vector<int64_t> labels; // position, -1 until bound
+  std::vector<std::pair<size_t, size_t>> fixups; // jump at, to label
+  size_t island; // where the last island was placed
+
+  void Island();
+
+public:
+  std::vector<uint64_t> code;
+
+  Emitter() : island(0) {};
+
+  size_t Label()
+  {
+    labels.push_back(-1);
+    return labels.size() - 1;
+  };
+  void Bind(size_t label) {labels[label] = code.size();};
+  void Emit(uint64_t instr)
+  {
+    if (code.size() - island >= ISLAND_GAP)
+    {
+      Island();
+    }
+    code.push_back(instr);
+  };
+  void Jump(uint8_t op, unsigned dst, unsigned src, uint32_t imm, size_t label)
+  {
+    Emit(BPF_INSN(op, dst, src, 0, imm));
+    fixups.push_back(std::make_pair(code.size() - 1, label));
+  };
+
+  // false if a jump is out of range
+  bool Resolve()
+  {
+    for (const std::pair<size_t, size_t>& f : fixups)
+    {
+      int64_t off = labels[f.second] - (int64_t)f.first - 1;
+      if (labels[f.second] < 0 || off < INT16_MIN || off > INT16_MAX)
+      {
+        return false;
+      }
+      code[f.first] = (code[f.first] & ~(uint64_t)OFF_MASK)
+              | ((uint64_t)(uint16_t)off << SHL_OFF);
+    }
+    return true;
+  };
+};
+
+// Jumps far behind that wait for a label hop through one JA here per
+// label, itself a jump waiting for the label
+void Emitter::Island()
+{
+  island = code.size();
+  size_t over = Label();
+  size_t waiting = fixups.size();
+  code.push_back(BPF_INSN(BPF_JA, 0, 0, 0, 0));
+  fixups.push_back(std::make_pair(island, over));
+
+  std::map<size_t, size_t> hops; // label, label of its hop
+  for (size_t i = 0; i < waiting; i++)
+  {
+    size_t label = fixups[i].second;
+    if (labels[label] >= 0 || fixups[i].first + ISLAND_REACH > island)
+    {
+      continue;
+    }
+    auto hop = hops.find(label);
+    if (hop == hops.end())
+    {
+      hop = hops.insert(std::make_pair(label, Label())).first;
+      Bind(hop->second);
+      fixups.push_back(std::make_pair(code.size(), label));
+      code.push_back(BPF_INSN(BPF_JA, 0, 0, 0, 0));
+    }
+    fixups[i].second = hop->second;
+  }
+  Bind(over);
+}
+
+/* ------------------------ Generator ---------------------------- */
+
+// Expressions held by the registers at some point of the merged
+// program, NONE for none
+struct RegCache
+{
+  uint32_t expr[11];
+  uint64_t used[11];
+};
+
+class Generator
+{
+private:
+  const Merger& m;
+  Emitter& out;
+  size_t words;
+  uint64_t clock;
+
+  unsigned Alloc(RegCache& c, uint32_t pinned, uint32_t& written);
+  unsigned Compute(uint32_t expr, RegCache& c, uint32_t pinned, uint32_t& written);
+  void SetBits(const std::vector<uint32_t>& filters);
+  void Skip(const Test& t, unsigned lhs, RegCache& c, uint32_t pinned,
+            uint32_t& written, size_t skip);
+  void Compare(uint8_t op, unsigned reg, uint64_t value, size_t label);
+  void Search(unsigned reg, const std::vector<std::pair<uint64_t, uint32_t>>& cases,
+              size_t lo, size_t hi, const RegCache& c, uint32_t& clobbered,
+              size_t done, bool last);
+
+public:
+  Generator(const Merger& m, Emitter& out, size_t words)
+  : m(m), out(out), words(words), clock(0) {};
+
+  uint32_t Node(uint32_t node, RegCache& c);
+};
+
+static int16_t WordOffset(size_t words, size_t w)
+{
+  return -(int16_t)(8 * (words - w));
+}
+
+// A register of R3 to R8 to compute into: a free one, else the one used
+// longest ago that is not pinned
+unsigned Generator::Alloc(RegCache& c, uint32_t pinned, uint32_t& written)
+{
+  unsigned best = 0;
+  for (unsigned r = CACHE_FIRST; r <= CACHE_LAST; r++)
+  {
+    if (pinned & (1U << r))
+    {
+      continue;
+    }
+    if (c.expr[r] == NONE)
+    {
+      best = r;
+      break;
+    }
+    if (!best || c.used[r] < c.used[best])
+    {
+      best = r;
+    }
+  }
+  c.expr[best] = NONE;
+  written |= 1U << best;
+  return best;
+}
+
+// Register holding expr, computed unless c has it already
+unsigned Generator::Compute(uint32_t expr, RegCache& c, uint32_t pinned,
+                            uint32_t& written)
+{
+  const Expr& e = m.GetExpr(expr);
+  if (e.kind == Expr::LEN)
+  {
+    return REG_LEN;
+  }
+  for (unsigned r = CACHE_FIRST; r <= CACHE_LAST; r++)
+  {
+    if (c.expr[r] == expr)
+    {
+      c.used[r] = ++clock;
+      return r;
+    }
+  }
+
+  unsigned rd;
+  switch (e.kind)
+  {
+    case Expr::CONST:
+      rd = Alloc(c, pinned, written);
+      EmitConst(out.code, rd, e.imm);
+      break;
+    case Expr::LOAD:
+      if (e.a == NONE)
+      {
+        rd = Alloc(c, pinned, written);
+        out.Emit(BPF_INSN(e.op, rd, REG_PACKET, e.imm, 0));
+      }
+      else
+      {
+        unsigned rv = Compute(e.a, c, pinned, written);
+        rd = Alloc(c, pinned | (1U << rv), written);
+        out.Emit(BPF_INSN(BPF_MOV_SRC, rd, REG_PACKET, 0, 0));
+        out.Emit(BPF_INSN(BPF_ADD_SRC, rd, rv, 0, 0));
+        out.Emit(BPF_INSN(e.op, rd, rd, e.imm, 0));
+      }
+      break;
+    case Expr::UNARY:
+    {
+      unsigned ra = Compute(e.a, c, pinned, written);
+      rd = Alloc(c, pinned | (1U << ra), written);
+      if (e.op == BPF_MOV32_SRC)
+      {
+        out.Emit(BPF_INSN(BPF_MOV32_SRC, rd, ra, 0, 0));
+        break;
+      }
+      out.Emit(BPF_INSN(BPF_MOV_SRC, rd, ra, 0, 0));
+      out.Emit(BPF_INSN(e.op, rd, 0, 0, e.imm));
+      break;
+    }
+    default:
+    {
+      unsigned ra = Compute(e.a, c, pinned, written);
+      const Expr& rhs = m.GetExpr(e.b);
+      if (rhs.kind == Expr::CONST && ((rhs.imm >> 32) == 0 || IsAlu32(e.op)))
+      {
+        rd = Alloc(c, pinned | (1U << ra), written);
+        out.Emit(BPF_INSN(BPF_MOV_SRC, rd, ra, 0, 0));
+        out.Emit(BPF_INSN(ImmForm(e.op), rd, 0, 0, (uint32_t)rhs.imm));
+        break;
+      }
+      unsigned rb = Compute(e.b, c, pinned | (1U << ra), written);
+      rd = Alloc(c, pinned | (1U << ra) | (1U << rb), written);
+      out.Emit(BPF_INSN(BPF_MOV_SRC, rd, ra, 0, 0));
+      out.Emit(BPF_INSN(e.op, rd, rb, 0, 0));
+      break;
+    }
+  }
+
+  c.expr[rd] = expr;
+  c.used[rd] = ++clock;
+  return rd;
+}
+
+// Set the bits of filters in the bitmap, one read-modify-write per 32
+// bits, and R0 if it says whether any filter matched
+void Generator::SetBits(const std::vector<uint32_t>& filters)
+{
+  if (filters.empty())
+  {
+    return;
+  }
+  std::map<size_t, uint32_t> halves; // bitmap words are little endian
+  for (uint32_t f : filters)
+  {
+    halves[f / 32] |= 1U << (f % 32);
+  }
+  for (const std::pair<const size_t, uint32_t>& h : halves)
+  {
+    int16_t at = WordOffset(words, h.first / 2) + 4 * (h.first % 2);
+    out.Emit(BPF_INSN(BPF_LDXW, REG_SCRATCH, 10, at, 0));
+    out.Emit(BPF_INSN(BPF_OR32_IMM, REG_SCRATCH, 0, 0, h.second));
+    out.Emit(BPF_INSN(BPF_STXW, 10, REG_SCRATCH, at, 0));
+  }
+  if (words > 1)
+  {
+    out.Emit(BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 1));
+  }
+}
+
+// Jump to skip unless test t holds, its left side being in lhs
+void Generator::Skip(const Test& t, unsigned lhs, RegCache& c, uint32_t pinned,
+                     uint32_t& written, size_t skip)
+{
+  const Expr& rhs = m.GetExpr(t.rhs);
+  bool imm = rhs.kind == Expr::CONST && (rhs.imm >> 32) == 0;
+  unsigned rr = imm ? 0 : Compute(t.rhs, c, pinned | (1U << lhs), written);
+  uint8_t op = imm ? ImmForm(t.op) : t.op;
+
+  if (!t.holds)
+  {
+    out.Jump(op, lhs, rr, rhs.imm, skip);
+  }
+  else if (t.op == BPF_JEQ_SRC)
+  {
+    out.Jump(imm ? BPF_JNE_IMM : BPF_JNE_SRC, lhs, rr, rhs.imm, skip);
+  }
+  else
+  {
+    // over the jump to skip
+    size_t holds = out.Label();
+    out.Jump(op, lhs, rr, rhs.imm, holds);
+    out.Jump(BPF_JA, 0, 0, 0, skip);
+    out.Bind(holds);
+  }
+}
+
+// Jump to label if op of reg and value holds
+void Generator::Compare(uint8_t op, unsigned reg, uint64_t value, size_t label)
+{
+  if (value >> 32)
+  {
+    EmitConst(out.code, REG_SCRATCH, value);
+    out.Jump(op, reg, REG_SCRATCH, 0, label);
+    return;
+  }
+  out.Jump(ImmForm(op), reg, 0, value, label);
+}
+
+// Run the child whose constant reg holds, of cases [lo, hi) (sorted),
+// and go to done, also if reg holds none of them. last if the code
+// after is done.
+void Generator::Search(unsigned reg,
+                       const std::vector<std::pair<uint64_t, uint32_t>>& cases,
+                       size_t lo, size_t hi, const RegCache& c,
+                       uint32_t& clobbered, size_t done, bool last)
+{
+  if (hi - lo < CLASSIFIER_SEARCH_MIN)
+  {
+    for (size_t i = lo; i < hi; i++)
+    {
+      size_t next = out.Label();
+      Compare(BPF_JNE_SRC, reg, cases[i].first, next);
+      RegCache inner = c;
+      clobbered |= Node(cases[i].second, inner);
+      if (!last || i + 1 < hi)
+      {
+        out.Jump(BPF_JA, 0, 0, 0, done);
+      }
+      out.Bind(next);
+    }
+    if (!last)
+    {
+      out.Jump(BPF_JA, 0, 0, 0, done);
+    }
+    return;
+  }
+
+  // the middle one, then the halves below and above it
+  size_t mid = lo + (hi - lo) / 2;
+  size_t lower = out.Label();
+  size_t upper = out.Label();
+  Compare(BPF_JGT_SRC, reg, cases[mid].first, upper);
+  Compare(BPF_JNE_SRC, reg, cases[mid].first, lower);
+  RegCache inner = c;
+  clobbered |= Node(cases[mid].second, inner);
+  out.Jump(BPF_JA, 0, 0, 0, done);
+  out.Bind(lower);
+  Search(reg, cases, lo, mid, c, clobbered, done, false);
+  out.Bind(upper);
+  Search(reg, cases, mid + 1, hi, c, clobbered, done, last);
+}
+
+// Code of node and everything below it, entered with the registers as
+// in c, which on return are as they are after it. Returns the
+// registers it wrote.
+uint32_t Generator::Node(uint32_t node, RegCache& c)
+{
+  const TrieNode& n = m.trie[node];
+  uint32_t written = 0;
+  SetBits(n.matches);
+
+  // children comparing the same value with constants form one group
+  std::vector<std::vector<uint32_t>> groups;
+  std::map<uint32_t, size_t> groupOf;
+  for (uint32_t child : n.children)
+  {
+    const Test& t = m.GetTest(m.trie[child].test);
+    bool eq = t.op == BPF_JEQ_SRC && t.holds
+            && m.GetExpr(t.rhs).kind == Expr::CONST;
+    auto found = eq ? groupOf.find(t.lhs) : groupOf.end();
+    if (found != groupOf.end())
+    {
+      groups[found->second].push_back(child);
+      continue;
+    }
+    if (eq)
+    {
+      groupOf[t.lhs] = groups.size();
+    }
+    groups.push_back(std::vector<uint32_t>(1, child));
+  }
+
+  for (const std::vector<uint32_t>& group : groups)
+  {
+    const Test& first = m.GetTest(m.trie[group[0]].test);
+    unsigned lhs = Compute(first.lhs, c, 0, written);
+    uint32_t clobbered = 0;
+
+    if (group.size() == 1)
+    {
+      size_t skip = out.Label();
+      Skip(first, lhs, c, 0, written, skip);
+      RegCache inner = c;
+      clobbered = Node(group[0], inner);
+      out.Bind(skip);
+    }
+    else
+    {
+      std::vector<std::pair<uint64_t, uint32_t>> cases;
+      for (uint32_t child : group)
+      {
+        cases.push_back(std::make_pair(m.GetExpr(m.GetTest(m.trie[child].test).rhs).imm, child));
+      }
+      std::sort(cases.begin(), cases.end());
+      size_t done = out.Label();
+      Search(lhs, cases, 0, cases.size(), c, clobbered, done, true);
+      out.Bind(done);
+    }
+
+    // what the children computed is only there if they ran
+    for (unsigned r = CACHE_FIRST; r <= CACHE_LAST; r++)
+    {
+      if (clobbered & (1U << r))
+      {
+        c.expr[r] = NONE;
+      }
+    }
+    written |= clobbered;
+  }
+  return written;
+}
+
+/* ------------------------ Classifier --------------------------- */
+
+Classifier::Classifier()
+: filters(0), nodes(0), paths(0)
+{
+
+}
+
+bool Classifier::Compile(const std::vector<std::vector<uint64_t>>& list,
+                         std::string* error)
+{
+  std::string unused;
+  error = error ? error : &unused;
+  program.clear();
+  filters = nodes = paths = 0;
+
+  if (list.empty() || list.size() > CLASSIFIER_MAX_FILTERS)
+  {
+    *error = "1 to " + std::to_string(CLASSIFIER_MAX_FILTERS) + " filters";
+    return false;
+  }
+
+  Merger merger;
+  for (size_t i = 0; i < list.size(); i++)
+  {
+    if (!merger.Add(list[i], i))
+    {
+      *error = merger.error;
+      return false;
+    }
+  }
+
+  Emitter out;
+  size_t words = (list.size() + 63) / 64;
+  for (size_t w = 0; w < words; w++)
+  {
+    out.Emit(BPF_INSN(BPF_STDW, 10, 0, WordOffset(words, w), 0));
+  }
+  if (words > 1)
+  {
+    out.Emit(BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0));
+  }
+
+  RegCache cache;
+  for (unsigned r = 0; r <= 10; r++)
+  {
+    cache.expr[r] = NONE;
+    cache.used[r] = 0;
+  }
+  Generator gen(merger, out, words);
+  gen.Node(0, cache);
+
+  if (words == 1)
+  {
+    out.Emit(BPF_INSN(BPF_LDXDW, 0, 10, WordOffset(words, 0), 0));
+  }
+  out.Emit(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+
+  if (!out.Resolve())
+  {
+    *error = "merged program too large for jump offsets";
+    return false;
+  }
+
+  program.swap(out.code);
+  filters = list.size();
+  nodes = merger.trie.size();
+  paths = merger.paths;
+  return true;
+}
+
+void Classifier::Matches(VM& vm, uint64_t* matches) const
+{
+  memcpy(matches, vm.GetFramePointer() - 8 * Words(), 8 * Words());
+}
+
+uint64_t Classifier::Run(VM& vm, const void* packet, uint64_t size,
+                         uint64_t* matches) const
+{
+  const uint64_t zero[11] = {0};
+  vm.SetRegs(zero);
+  vm.R1().Write64(vm.SetContext(const_cast<void*>(packet), size, false));
+  vm.R2().Write64(size);
+
+  uint64_t ret = vm.Run(program);
+  if (vm.GetError() != VM_OK)
+  {
+    memset(matches, 0, 8 * Words());
+    return ret;
+  }
+  Matches(vm, matches);
+  return ret;
+}
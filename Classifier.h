@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Memory.h"
+
+class VM;
+
+// Filters one classifier can merge: one bit each in the match bitmap,
+// which takes up the stack
+#define CLASSIFIER_MAX_FILTERS (MAX_BPF_STACK * 8)
+
+// Paths through one filter that are followed, beyond that the filter
+// is refused (every condition whose branches join again doubles them)
+#define CLASSIFIER_MAX_PATHS 1024
+
+// Children of a trie node testing one value against this many constants
+// or more are told apart by binary search, fewer one after the other
+#define CLASSIFIER_SEARCH_MIN 4
+
+// Many small filters merged into one program that runs them all.
+//
+// A filter is a program that looks at a packet (the context, R1) and
+// returns non-zero if it matches. Compile follows every path through
+// each filter, keeping the values it computes as expressions of loads
+// from the packet, and turns the paths ending in a non-zero return
+// into the list of conditions they take. The lists of all filters go
+// into one trie: conditions filters share, and the loads and header
+// arithmetic behind them, are evaluated once per packet however many
+// filters start with them. Where a node compares one value with many
+// constants (the address or port of every tenant), a binary search
+// finds the one child that can match, so the cost per packet grows
+// with the depth of the trie and the log of its fan-out rather than
+// with the number of filters.
+//
+// The merged program takes the packet in R1 and its length in R2 (as
+// Pipeline passes them) and checks every load against the length: a
+// filter that would read past the end of the packet does not match,
+// where on its own it would fault. It sets bit i % 64 of word i / 64
+// of a bitmap on top of the stack when filter i matches and returns
+// the bitmap itself for up to 64 filters, for more 1 if any filter
+// matched and 0 if none did.
+//
+// Filters may use ALU instructions other than division and modulo,
+// byteswaps, loads from the packet at constant offsets from R1 or from
+// a pointer computed from it (e.g. past a variable length IP header),
+// forward jumps and exit. The stack, stores, helper calls, tail calls
+// and loops are not supported.
+class Classifier
+{
+private:
+  std::vector<uint64_t> program;
+  size_t filters;
+  size_t nodes;
+  size_t paths;
+
+public:
+  Classifier();
+
+  // Merge filters, filter i reporting as bit i. Returns false, with the
+  // reason in error, if one of them cannot be merged.
+  bool Compile(const std::vector<std::vector<uint64_t>>& filters,
+               std::string* error = nullptr);
+
+  const std::vector<uint64_t>& Program() const {return program;};
+  size_t Filters() const {return filters;};
+  size_t Words() const {return (filters + 63) / 64;};
+  size_t Nodes() const {return nodes;};  // in the trie, the root included
+  size_t Paths() const {return paths;};  // matching paths of all filters
+
+  // Run the program on size bytes at packet and copy the bitmap into
+  // matches (Words() of them), all zero if the run faulted. Returns
+  // what the program did.
+  uint64_t Run(VM& vm, const void* packet, uint64_t size,
+               uint64_t* matches) const;
+
+  // The bitmap left by the last run of the program on vm, by whatever
+  // engine
+  void Matches(VM& vm, uint64_t* matches) const;
+};
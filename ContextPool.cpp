@@ -0,0 +1,122 @@
+#include "ContextPool.h"
+
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+void ExecContext::Start(const std::vector<uint64_t>& program)
+{
+  prog = &program;
+  pc = 0;
+  loops = VM_LOOP_BUDGET;
+  tailCallCnt = 0;
+  error = VM_OK;
+  suspended = false;
+  memset(samples, 0, sizeof(samples));
+  memset(sampleRings, 0, sizeof(sampleRings));
+  regs[10] = MemAddr(MEM_REGION_STACK, stackSize);
+}
+
+uint64_t ExecContext::SetContext(void* data, uint64_t size, bool writable)
+{
+  ctx.base = static_cast<uint8_t*>(data);
+  ctx.readSize = data ? size : 0;
+  ctx.writeSize = writable ? ctx.readSize : 0;
+
+  return MemAddr(MEM_REGION_CTX, 0);
+}
+
+static size_t AlignUp(size_t n, size_t align)
+{
+  return (n + align - 1) / align * align;
+}
+
+ContextPool::ContextPool(uint32_t stackSize, bool hugePages)
+: stackSize(AlignUp(stackSize < VM_STACK_SIZE ? stackSize : VM_STACK_SIZE, 8)),
+  slotSize(0), hugePages(hugePages), freeList(nullptr), inUse(0)
+{
+  // the stack follows the header in the same slot
+  slotSize = AlignUp(sizeof(ExecContext) + this->stackSize, CACHE_LINE_SZ);
+}
+
+ContextPool::~ContextPool()
+{
+  for (void* slab : slabs)
+  {
+    munmap(slab, CONTEXT_SLAB_SZ);
+  }
+}
+
+// Map another slab and put all its slots on the free list
+bool ContextPool::Grow()
+{
+  void* mem = MAP_FAILED;
+  if (hugePages)
+  {
+    mem = mmap(nullptr, CONTEXT_SLAB_SZ, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (mem == MAP_FAILED)
+  {
+    // over-allocate to trim to an aligned slab, transparent huge pages
+    // only back aligned ranges
+    size_t span = hugePages ? 2 * CONTEXT_SLAB_SZ : CONTEXT_SLAB_SZ;
+    mem = mmap(nullptr, span, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+      return false;
+    }
+    if (hugePages)
+    {
+      uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+      uintptr_t aligned = AlignUp(start, CONTEXT_SLAB_SZ);
+      if (aligned > start)
+      {
+        munmap(mem, aligned - start);
+      }
+      munmap(reinterpret_cast<void*>(aligned + CONTEXT_SLAB_SZ),
+             start + span - aligned - CONTEXT_SLAB_SZ);
+      mem = reinterpret_cast<void*>(aligned);
+      madvise(mem, CONTEXT_SLAB_SZ, MADV_HUGEPAGE);
+    }
+  }
+  slabs.push_back(mem);
+
+  // in address order, so fresh slots are handed out sequentially
+  uint8_t* base = static_cast<uint8_t*>(mem);
+  for (size_t n = CONTEXT_SLAB_SZ / slotSize; n > 0; n--)
+  {
+    FreeSlot* slot = reinterpret_cast<FreeSlot*>(base + (n - 1) * slotSize);
+    slot->next = freeList;
+    freeList = slot;
+  }
+  return true;
+}
+
+ExecContext* ContextPool::Acquire()
+{
+  if (!freeList && !Grow())
+  {
+    return nullptr;
+  }
+
+  FreeSlot* slot = freeList;
+  freeList = slot->next;
+  inUse++;
+
+  uint8_t* mem = reinterpret_cast<uint8_t*>(slot);
+  ExecContext* c = new (mem) ExecContext();
+  memset(mem + sizeof(ExecContext), 0, stackSize);
+  c->stackSize = stackSize;
+  c->stack = mem + sizeof(ExecContext);
+  return c;
+}
+
+void ContextPool::Release(ExecContext* c)
+{
+  FreeSlot* slot = reinterpret_cast<FreeSlot*>(c);
+  slot->next = freeList;
+  freeList = slot;
+  inUse--;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "VM.h"
+
+// Slabs are carved from mappings of this size, a huge page on x86-64
+#define CONTEXT_SLAB_SZ (2 * 1024 * 1024)
+
+#define CACHE_LINE_SZ 64
+
+// The state of one program execution outside of any VM: registers,
+// position and a stack of its own. A VM runs it after LoadContext()
+// and hands it back with SaveContext(), so a few VMs (one per thread)
+// can carry any number of suspended or queued executions, each
+// costing only the header and the stack its program needs.
+struct alignas(CACHE_LINE_SZ) ExecContext
+{
+  uint64_t regs[11];
+  const std::vector<uint64_t>* prog;
+  uint64_t pc;
+  uint64_t loops;      // loop budget left, see VM_LOOP_BUDGET
+  MemRegion ctx;       // context region of the run
+  // ring buffer samples the run holds, see VM::MapSample
+  MemRegion samples[MEM_SAMPLES];
+  Map* sampleRings[MEM_SAMPLES];
+  VMReadyFn readyFn;   // see VM::Suspend
+  void* readyArg;
+  uint32_t tailCallCnt;
+  uint32_t error;
+  uint32_t stackSize;
+  bool suspended;
+  uint8_t* stack;      // stackSize bytes, R10 starts at their end
+
+  // Set up to run program from its start. Registers other than R10
+  // are left as they are, so inputs can be placed before or after.
+  void Start(const std::vector<uint64_t>& program);
+
+  // As VM::SetContext, for this execution
+  uint64_t SetContext(void* data, uint64_t size, bool writable);
+
+  bool IsReady() const {return !suspended || !readyFn || readyFn(readyArg);};
+};
+
+// Fixed-size execution contexts for one program (or programs with the
+// same stack usage), allocated from slabs of cache-line-aligned slots.
+// Acquire and Release are O(1) pops and pushes on an intrusive free
+// list; memory is only mapped when all slabs are full and is returned
+// when the pool goes. With hugePages, slabs are backed by huge pages
+// if the system has any reserved, and by transparent huge pages
+// otherwise.
+//
+// Not thread safe, use one per thread.
+class ContextPool
+{
+private:
+  struct FreeSlot
+  {
+    FreeSlot* next;
+  };
+
+  uint32_t stackSize;
+  size_t slotSize;
+  bool hugePages;
+
+  FreeSlot* freeList;
+  std::vector<void*> slabs;
+  size_t inUse;
+
+  bool Grow();
+
+public:
+  // stackSize is usually StackUsage() of the program (Analysis.h)
+  ContextPool(uint32_t stackSize, bool hugePages = false);
+  ~ContextPool();
+
+  ContextPool(const ContextPool&) = delete;
+  ContextPool& operator=(const ContextPool&) = delete;
+
+  // A context with zeroed registers and stack, nullptr if out of memory
+  ExecContext* Acquire();
+  void Release(ExecContext*);
+
+  uint32_t StackSize() const {return stackSize;};
+  size_t SlotSize() const {return slotSize;};
+  size_t InUse() const {return inUse;};
+  size_t Capacity() const {return slabs.size() * (CONTEXT_SLAB_SZ / slotSize);};
+};
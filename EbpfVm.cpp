@@ -0,0 +1,484 @@
+#include "EbpfVm.h"
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Analysis.h"
+#include "Aot.h"
+#include "ClassicBpf.h"
+#include "LpmTrie.h"
+#include "MapPin.h"
+#include "Maps.h"
+#include "Opcodes.h"
+#include "RingBuffer.h"
+#include "VM.h"
+
+// The interface repeats the constants of the library, which C cannot
+// include; they have to stay in step
+static_assert(EBPF_MAP_HASH == BPF_MAP_TYPE_HASH
+              && EBPF_MAP_ARRAY == BPF_MAP_TYPE_ARRAY
+              && EBPF_MAP_PROG_ARRAY == BPF_MAP_TYPE_PROG_ARRAY
+              && EBPF_MAP_PERCPU_HASH == BPF_MAP_TYPE_PERCPU_HASH
+              && EBPF_MAP_PERCPU_ARRAY == BPF_MAP_TYPE_PERCPU_ARRAY
+              && EBPF_MAP_LRU_HASH == BPF_MAP_TYPE_LRU_HASH
+              && EBPF_MAP_LPM_TRIE == BPF_MAP_TYPE_LPM_TRIE
+              && EBPF_MAP_RINGBUF == BPF_MAP_TYPE_RINGBUF,
+              "map types differ");
+static_assert(EBPF_ANY == BPF_ANY && EBPF_NOEXIST == BPF_NOEXIST
+              && EBPF_EXIST == BPF_EXIST, "update flags differ");
+static_assert(EBPF_OK == VM_OK && EBPF_ERR_ACCESS == VM_ERR_ACCESS
+              && EBPF_ERR_LOOP == VM_ERR_LOOP
+              && EBPF_ERR_DIV_ZERO == VM_ERR_DIV_ZERO
+              && EBPF_ERR_BAD_OPCODE == VM_ERR_BAD_OPCODE,
+              "VM errors differ");
+static_assert(EBPF_MAX_MAPS == MAX_MEM_REGIONS - MEM_REGION_MAP0,
+              "maps past EBPF_MAX_MAPS would not be addressable");
+static_assert(sizeof(ebpf_classic_insn) == sizeof(ClassicInsn),
+              "classic instructions differ");
+
+struct ebpf_prog
+{
+  std::vector<uint64_t> bytecode;
+  std::unique_ptr<AotProgram> native;
+};
+
+struct ebpf_map
+{
+  std::unique_ptr<Map> map;
+};
+
+struct ebpf_vm
+{
+  VM vm;
+  bool writable;
+};
+
+static thread_local std::string lastError;
+
+// Record why a call failed, returns err
+static int Fail(int err, const std::string& why)
+{
+  lastError = why;
+  return err;
+}
+
+/* --------------------------- Programs ---------------------------- */
+
+static bool IsJump(uint8_t op)
+{
+  return (op & 0x07) == 0x05 && op != BPF_CALL_IMM && op != BPF_EXIT;
+}
+
+// Empty if the VM can run program without leaving it, else why not.
+// The interpreter does not check where jumps go, that is done here once.
+static std::string CheckProgram(const std::vector<uint64_t>& program)
+{
+  if (program.empty())
+  {
+    return "empty program";
+  }
+
+  int64_t size = program.size();
+  for (int64_t pc = 0; pc < size; pc++)
+  {
+    uint64_t instr = program[pc];
+    uint8_t op = instr & OP_MASK;
+    int64_t target = -1;
+    if (IsJump(op))
+    {
+      target = pc + 1 + (int16_t)((instr & OFF_MASK) >> SHL_OFF);
+    }
+    else if (op == BPF_LDDW && ((instr & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC)
+    {
+      target = pc + 1 + (int32_t)((instr & IMM_MASK) >> SHL_IMM);
+    }
+    if (target != -1 && (target < 0 || target >= size))
+    {
+      return "jump out of the program at " + std::to_string(pc);
+    }
+  }
+
+  uint8_t last = program.back() & OP_MASK;
+  if (last != BPF_EXIT && last != BPF_JA)
+  {
+    return "program does not end in exit or jump";
+  }
+
+  // as the kernel does, only loops known to end
+  if (!BoundLoops(program))
+  {
+    return "program has a loop that cannot be bounded";
+  }
+  return "";
+}
+
+static int LoadProgram(std::vector<uint64_t>&& bytecode, ebpf_prog** prog)
+{
+  std::string why = CheckProgram(bytecode);
+  if (!why.empty())
+  {
+    return Fail(-EINVAL, why);
+  }
+
+  ebpf_prog* p = new ebpf_prog;
+  p->bytecode = std::move(bytecode);
+  *prog = p;
+  return 0;
+}
+
+uint32_t ebpf_abi_version(void)
+{
+  return EBPF_ABI_VERSION;
+}
+
+const char* ebpf_last_error(void)
+{
+  return lastError.c_str();
+}
+
+int ebpf_prog_load(const uint64_t* insns, size_t count, ebpf_prog** prog)
+{
+  try
+  {
+    return LoadProgram(std::vector<uint64_t>(insns, insns + count), prog);
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+int ebpf_prog_load_classic(const struct ebpf_classic_insn* filter,
+                           size_t count, ebpf_prog** prog)
+{
+  try
+  {
+    const ClassicInsn* insns = reinterpret_cast<const ClassicInsn*>(filter);
+    std::string error;
+    std::vector<uint64_t> bytecode = TranslateClassic(
+            std::vector<ClassicInsn>(insns, insns + count), &error);
+    if (bytecode.empty())
+    {
+      return Fail(-EINVAL, error);
+    }
+    return LoadProgram(std::move(bytecode), prog);
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+int ebpf_prog_compile(ebpf_prog* prog, const char* so_path, uint32_t flags)
+{
+  try
+  {
+    std::unique_ptr<AotProgram> native(
+            new AotProgram((flags & EBPF_PROG_TAIL_CALL_TARGET) != 0));
+    std::string error;
+    if (!native->Compile(prog->bytecode, so_path, false, false, &error))
+    {
+      return Fail(-EINVAL, error);
+    }
+    prog->native = std::move(native);
+    return 0;
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+void ebpf_prog_free(ebpf_prog* prog)
+{
+  delete prog;
+}
+
+size_t ebpf_prog_insns(const ebpf_prog* prog)
+{
+  return prog->bytecode.size();
+}
+
+int ebpf_prog_is_native(const ebpf_prog* prog)
+{
+  return prog->native != nullptr;
+}
+
+/* ----------------------------- Maps ------------------------------ */
+
+// The map asked for, nullptr if the parameters do not make one
+static Map* NewMap(uint32_t type, uint32_t keySize, uint32_t valueSize,
+                   uint32_t maxEntries)
+{
+  if (type == BPF_MAP_TYPE_RINGBUF)
+  {
+    return (keySize == 0 && valueSize == 0 && maxEntries != 0)
+            ? new RingBufMap(maxEntries) : nullptr;
+  }
+  if (maxEntries == 0)
+  {
+    return nullptr;
+  }
+  if (type == BPF_MAP_TYPE_PROG_ARRAY)
+  {
+    return (keySize == sizeof(uint32_t)) ? new ProgArrayMap(maxEntries) : nullptr;
+  }
+  if (valueSize == 0)
+  {
+    return nullptr;
+  }
+
+  switch (type)
+  {
+    case BPF_MAP_TYPE_ARRAY:
+      return (keySize == sizeof(uint32_t)) ? new ArrayMap(valueSize, maxEntries) : nullptr;
+    case BPF_MAP_TYPE_PERCPU_ARRAY:
+      return (keySize == sizeof(uint32_t))
+              ? new PerCpuArrayMap(valueSize, maxEntries) : nullptr;
+    case BPF_MAP_TYPE_HASH:
+      return keySize ? new HashMap(keySize, valueSize, maxEntries) : nullptr;
+    case BPF_MAP_TYPE_PERCPU_HASH:
+      return keySize ? new PerCpuHashMap(keySize, valueSize, maxEntries) : nullptr;
+    case BPF_MAP_TYPE_LRU_HASH:
+      return keySize ? new LruHashMap(keySize, valueSize, maxEntries) : nullptr;
+    case BPF_MAP_TYPE_LPM_TRIE:
+      return (keySize > 4 && keySize - 4 <= LPM_MAX_DATA)
+              ? new LpmTrieMap(keySize, valueSize, maxEntries) : nullptr;
+    default:
+      return nullptr;
+  }
+}
+
+int ebpf_map_create(uint32_t type, uint32_t key_size, uint32_t value_size,
+                    uint32_t max_entries, ebpf_map** map)
+{
+  try
+  {
+    std::unique_ptr<Map> m(NewMap(type, key_size, value_size, max_entries));
+    if (!m)
+    {
+      return Fail(-EINVAL, "no map of this type and sizes");
+    }
+    ebpf_map* handle = new ebpf_map;
+    handle->map = std::move(m);
+    *map = handle;
+    return 0;
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+int ebpf_map_pin(const char* path, uint32_t type, uint32_t key_size,
+                 uint32_t value_size, uint32_t max_entries, ebpf_map** map,
+                 int* attached)
+{
+  try
+  {
+    int err = 0;
+    bool existing = false;
+    std::unique_ptr<Map> m(PinMap(path, type, key_size, value_size, max_entries,
+                                  &err, &existing));
+    if (!m)
+    {
+      return Fail(err, std::string("could not pin a map to ") + path
+                  + ": " + strerror(-err));
+    }
+    ebpf_map* handle = new ebpf_map;
+    handle->map = std::move(m);
+    *map = handle;
+    if (attached)
+    {
+      *attached = existing;
+    }
+    return 0;
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+void ebpf_map_free(ebpf_map* map)
+{
+  delete map;
+}
+
+uint32_t ebpf_map_type(const ebpf_map* map)
+{
+  return map->map->Type();
+}
+
+uint32_t ebpf_map_key_size(const ebpf_map* map)
+{
+  return map->map->KeySize();
+}
+
+uint32_t ebpf_map_value_size(const ebpf_map* map)
+{
+  return map->map->ValueSize();
+}
+
+uint32_t ebpf_map_max_entries(const ebpf_map* map)
+{
+  return map->map->MaxEntries();
+}
+
+uint32_t ebpf_map_cpus(const ebpf_map* map)
+{
+  return map->map->Cpus();
+}
+
+// Values of program arrays are programs of the library, only
+// ebpf_map_set_prog hands them over
+int ebpf_map_lookup(ebpf_map* map, const void* key, void* value)
+{
+  Map& m = *map->map;
+  if (m.Type() == BPF_MAP_TYPE_PROG_ARRAY || m.Type() == BPF_MAP_TYPE_RINGBUF)
+  {
+    return Fail(-EINVAL, "map has no values to look up");
+  }
+
+  const void* found = m.Lookup(key);
+  if (!found)
+  {
+    return -ENOENT;
+  }
+  memcpy(value, found, m.ValueSize());
+  return 0;
+}
+
+int ebpf_map_lookup_all(ebpf_map* map, const void* key, void* values)
+{
+  Map& m = *map->map;
+  if (m.Type() == BPF_MAP_TYPE_PROG_ARRAY || m.Type() == BPF_MAP_TYPE_RINGBUF)
+  {
+    return Fail(-EINVAL, "map has no values to look up");
+  }
+  return m.LookupAll(key, values);
+}
+
+int ebpf_map_update(ebpf_map* map, const void* key, const void* value,
+                    uint64_t flags)
+{
+  Map& m = *map->map;
+  if (m.Type() == BPF_MAP_TYPE_PROG_ARRAY)
+  {
+    return Fail(-EINVAL, "program arrays are set with ebpf_map_set_prog");
+  }
+  return m.Update(key, value, flags);
+}
+
+int ebpf_map_delete(ebpf_map* map, const void* key)
+{
+  return map->map->Delete(key);
+}
+
+int ebpf_map_set_prog(ebpf_map* map, uint32_t index, const ebpf_prog* prog)
+{
+  if (map->map->Type() != BPF_MAP_TYPE_PROG_ARRAY)
+  {
+    return Fail(-EINVAL, "not a program array");
+  }
+  return static_cast<ProgArrayMap&>(*map->map).Set(index, prog ? &prog->bytecode
+                                                             : nullptr);
+}
+
+int ebpf_map_poll(ebpf_map* map, ebpf_ringbuf_fn fn, void* ctx, int timeout_ms)
+{
+  if (map->map->Type() != BPF_MAP_TYPE_RINGBUF)
+  {
+    return Fail(-EINVAL, "not a ring buffer");
+  }
+  return static_cast<RingBufMap&>(*map->map).Poll(fn, ctx, timeout_ms);
+}
+
+/* ------------------------------ VMs ------------------------------ */
+
+int ebpf_vm_create(uint32_t flags, ebpf_vm** vm)
+{
+  try
+  {
+    std::unique_ptr<ebpf_vm> v(new ebpf_vm);
+    v->vm.SetTrace(false);
+    v->writable = (flags & EBPF_VM_WRITABLE) != 0;
+    if (flags & EBPF_VM_SANDBOX)
+    {
+      v->vm.SetSandbox(true);
+    }
+    *vm = v.release();
+    return 0;
+  }
+  catch (const std::exception&)
+  {
+    return Fail(-ENOMEM, "out of memory");
+  }
+}
+
+void ebpf_vm_free(ebpf_vm* vm)
+{
+  delete vm;
+}
+
+int ebpf_vm_set_map(ebpf_vm* vm, uint32_t id, ebpf_map* map)
+{
+  if (id >= EBPF_MAX_MAPS)
+  {
+    return Fail(-E2BIG, "map id " + std::to_string(id) + " out of range");
+  }
+  vm->vm.SetMap(id, map ? map->map.get() : nullptr);
+  return 0;
+}
+
+void ebpf_vm_set_cpu(ebpf_vm* vm, uint32_t cpu)
+{
+  vm->vm.SetCpu(cpu);
+}
+
+// One run as Pipeline does it: nothing of the previous run is left in
+// registers, the packet is the context region
+static inline uint64_t Run(ebpf_vm* vm, const ebpf_prog* prog, void* data,
+                           uint64_t size)
+{
+  static const uint64_t zero[11] = {0};
+  VM& v = vm->vm;
+
+  v.SetRegs(zero);
+  v.R1().Write64(v.SetContext(data, size, vm->writable));
+  v.R2().Write64(size);
+  return prog->native ? prog->native->Run(v) : v.Run(prog->bytecode);
+}
+
+uint64_t ebpf_vm_run(ebpf_vm* vm, const ebpf_prog* prog, void* data,
+                     uint64_t size)
+{
+  return Run(vm, prog, data, size);
+}
+
+uint32_t ebpf_vm_error(const ebpf_vm* vm)
+{
+  return vm->vm.GetError();
+}
+
+size_t ebpf_vm_run_batch(ebpf_vm* vm, const ebpf_prog* prog,
+                         struct ebpf_packet* packets, size_t count)
+{
+  size_t passed = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    ebpf_packet& pkt = packets[i];
+    pkt.verdict = Run(vm, prog, pkt.data, pkt.size);
+    pkt.error = vm->vm.GetError();
+    if (pkt.error != VM_OK)
+    {
+      pkt.verdict = 0;
+    }
+    passed += (pkt.verdict != 0);
+  }
+  return passed;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+// C interface of libebpfvm, for running programs inside another process
+// (a packet processor's data plane) without a process or IPC per call.
+//
+// Programs, maps and VMs are opaque handles created and freed through
+// these functions; their layout is not part of the interface, so the
+// library can change underneath without its users being rebuilt. Only
+// fixed width types and the structs below cross it. Functions returning
+// int give 0 or a negative errno value.
+//
+// Threads: a loaded program does not change and can be run by any
+// number of VMs at once. A VM runs one program at a time, so give every
+// worker thread VMs of its own (and its own CPU index, for per-CPU
+// maps). Maps can be used by programs and the host from any thread.
+//
+// Link with -lebpfvm, and for the static library also with -lstdc++
+// -ldl -pthread.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define EBPF_API __attribute__((visibility("default")))
+#else
+#define EBPF_API
+#endif
+
+// Bumped whenever a change would break users built against an earlier
+// version of this header: compare it with ebpf_abi_version()
+#define EBPF_ABI_VERSION 1
+
+// Map types, as the kernel's enum bpf_map_type
+#define EBPF_MAP_HASH         1
+#define EBPF_MAP_ARRAY        2
+#define EBPF_MAP_PROG_ARRAY   3
+#define EBPF_MAP_PERCPU_HASH  5
+#define EBPF_MAP_PERCPU_ARRAY 6
+#define EBPF_MAP_LRU_HASH     9
+#define EBPF_MAP_LPM_TRIE     11
+#define EBPF_MAP_RINGBUF      27
+
+// Update flags
+#define EBPF_ANY     0 // create or replace
+#define EBPF_NOEXIST 1 // create only
+#define EBPF_EXIST   2 // replace only
+
+// Maps a VM can have attached, ids 0 to EBPF_MAX_MAPS - 1
+#define EBPF_MAX_MAPS 56
+
+// Why a run stopped before reaching an exit, see ebpf_vm_error()
+#define EBPF_OK             0
+#define EBPF_ERR_ACCESS     1 // load or store outside the program's memory
+#define EBPF_ERR_LOOP       2 // loop budget used up
+#define EBPF_ERR_DIV_ZERO   3 // division or modulo by zero
+#define EBPF_ERR_BAD_OPCODE 4 // instruction the VM does not know
+
+// Flags of ebpf_vm_create
+#define EBPF_VM_SANDBOX  (1U << 0) // stack between guard pages
+#define EBPF_VM_WRITABLE (1U << 1) // programs may modify the packet
+
+// Flags of ebpf_prog_compile
+#define EBPF_PROG_TAIL_CALL_TARGET (1U << 0) // see ebpf_prog_compile
+
+typedef struct ebpf_prog ebpf_prog;
+typedef struct ebpf_map ebpf_map;
+typedef struct ebpf_vm ebpf_vm;
+
+// One instruction of a classic BPF filter, as struct sock_filter
+struct ebpf_classic_insn
+{
+  uint16_t code;
+  uint8_t jt;
+  uint8_t jf;
+  uint32_t k;
+};
+
+// A packet of a batch run: verdict is what the program returned, 0 if
+// the run stopped with error
+struct ebpf_packet
+{
+  void* data;
+  uint64_t size;
+  uint64_t verdict;
+  uint32_t error;
+  uint32_t reserved;
+};
+
+// Consumer of ring buffer records, returning non-zero stops the poll
+typedef int (*ebpf_ringbuf_fn)(void* ctx, const void* data, uint32_t size);
+
+// EBPF_ABI_VERSION of the library loaded
+EBPF_API uint32_t ebpf_abi_version(void);
+
+// Why the last call of this thread that failed did, as text. Stays
+// valid until the thread's next failing call.
+EBPF_API const char* ebpf_last_error(void);
+
+/* ----------------------------- Programs ---------------------------- */
+
+// Load count instructions (64 bits each, in this VM's encoding). The
+// program is refused with -EINVAL if a jump leaves it, its last
+// instruction can fall through past the end or it has a loop whose
+// trips cannot be bounded (see BoundLoops in Analysis.h); bpf_loop
+// takes loops of those.
+EBPF_API int ebpf_prog_load(const uint64_t* insns, size_t count,
+                            ebpf_prog** prog);
+
+// Load a classic BPF filter, translated as by ebpf_loadgen -b: it sees
+// the packet in R1 and its size in R2, as runs pass them. Filters the
+// kernel would refuse are refused with -EINVAL.
+EBPF_API int ebpf_prog_load_classic(const struct ebpf_classic_insn* filter,
+                                    size_t count, ebpf_prog** prog);
+
+// Compile prog ahead of time into the shared object so_path with the
+// system compiler ($CXX), so runs execute native code. Do it before
+// the program first runs. Files at so_path and so_path.cpp are
+// replaced; the object is only loaded while this user alone can write
+// it. Only programs compiled with EBPF_PROG_TAIL_CALL_TARGET run
+// natively when tail called into; a process can register a limited
+// number of them.
+EBPF_API int ebpf_prog_compile(ebpf_prog* prog, const char* so_path,
+                               uint32_t flags);
+
+// Once no VM runs it and no program array holds it any more
+EBPF_API void ebpf_prog_free(ebpf_prog* prog);
+
+EBPF_API size_t ebpf_prog_insns(const ebpf_prog* prog);
+EBPF_API int ebpf_prog_is_native(const ebpf_prog* prog);
+
+/* ------------------------------- Maps ------------------------------ */
+
+// Create a map of one of the EBPF_MAP_ types. Array maps have 4 byte
+// keys, LPM tries 4 plus an address of up to 16 bytes. Ring buffers
+// take no key or value size, max_entries is their size in bytes.
+// Per-CPU maps keep a copy of every value for each possible CPU.
+EBPF_API int ebpf_map_create(uint32_t type, uint32_t key_size,
+                             uint32_t value_size, uint32_t max_entries,
+                             ebpf_map** map);
+
+// A map whose state lives in the file at path and survives restarts:
+// created if the file does not exist, else attached to as it is (then
+// *attached, if given, is set). Array and hash maps, per-CPU and LRU
+// included. -EINVAL if the file holds another kind of map, -EPROTO if
+// another version of the library wrote it, -EBUSY if a map uses it.
+EBPF_API int ebpf_map_pin(const char* path, uint32_t type, uint32_t key_size,
+                          uint32_t value_size, uint32_t max_entries,
+                          ebpf_map** map, int* attached);
+
+// Once no VM has it attached any more
+EBPF_API void ebpf_map_free(ebpf_map* map);
+
+EBPF_API uint32_t ebpf_map_type(const ebpf_map* map);
+EBPF_API uint32_t ebpf_map_key_size(const ebpf_map* map);
+EBPF_API uint32_t ebpf_map_value_size(const ebpf_map* map);
+EBPF_API uint32_t ebpf_map_max_entries(const ebpf_map* map);
+EBPF_API uint32_t ebpf_map_cpus(const ebpf_map* map);
+
+// Copy the value of key out to value (value_size bytes), -ENOENT if
+// there is none. Per-CPU maps give the copy of CPU 0.
+EBPF_API int ebpf_map_lookup(ebpf_map* map, const void* key, void* value);
+
+// The copies of every CPU, one after another, each rounded up to 8
+// bytes: room for ebpf_map_cpus() of them
+EBPF_API int ebpf_map_lookup_all(ebpf_map* map, const void* key,
+                                 void* values);
+
+// Per-CPU maps set every copy
+EBPF_API int ebpf_map_update(ebpf_map* map, const void* key,
+                             const void* value, uint64_t flags);
+EBPF_API int ebpf_map_delete(ebpf_map* map, const void* key);
+
+// Put prog into slot index of a program array as a tail call target,
+// NULL to empty it. The slot can be replaced while programs run.
+EBPF_API int ebpf_map_set_prog(ebpf_map* map, uint32_t index,
+                               const ebpf_prog* prog);
+
+// Hand the records of a ring buffer to fn, waiting up to timeout_ms
+// (-1 forever) for any. Returns how many were seen. One consumer
+// thread per ring.
+EBPF_API int ebpf_map_poll(ebpf_map* map, ebpf_ringbuf_fn fn, void* ctx,
+                           int timeout_ms);
+
+/* -------------------------------- VMs ------------------------------ */
+
+// A VM with EBPF_VM_ flags
+EBPF_API int ebpf_vm_create(uint32_t flags, ebpf_vm** vm);
+EBPF_API void ebpf_vm_free(ebpf_vm* vm);
+
+// Make map visible to programs run on vm under id, NULL to detach
+EBPF_API int ebpf_vm_set_map(ebpf_vm* vm, uint32_t id, ebpf_map* map);
+
+// CPU index of the thread running vm: which copy of per-CPU map values
+// its programs see. Below ebpf_map_cpus() of the maps attached.
+EBPF_API void ebpf_vm_set_cpu(ebpf_vm* vm, uint32_t cpu);
+
+// Run prog on size bytes at data, passed in R1 and R2, and return what
+// it returned. If the run stopped on an error instead,
+// ebpf_vm_error() tells which.
+EBPF_API uint64_t ebpf_vm_run(ebpf_vm* vm, const ebpf_prog* prog,
+                              void* data, uint64_t size);
+
+// EBPF_OK or why the last run stopped
+EBPF_API uint32_t ebpf_vm_error(const ebpf_vm* vm);
+
+// Run prog on count packets, one after another, and set their verdicts
+// and errors. Returns how many got a non-zero verdict.
+EBPF_API size_t ebpf_vm_run_batch(ebpf_vm* vm, const ebpf_prog* prog,
+                                  struct ebpf_packet* packets, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,282 @@
+#include "Helpers.h"
+#include "Maps.h"
+#include "RingBuffer.h"
+#include "VM.h"
+
+#include <cerrno>
+
+// bpf_tail_call(ctx, prog_array, index)
+// On success execution continues at the start of the target program
+// and never returns to the caller; on failure the caller carries on
+// with the next instruction.
+static uint64_t bpf_tail_call(VM& vm, uint64_t ctx, uint64_t mapId,
+                              uint64_t index, uint64_t, uint64_t)
+{
+  Map* map = vm.GetMap(mapId);
+  if (!map || map->Type() != BPF_MAP_TYPE_PROG_ARRAY)
+  {
+    return -EINVAL;
+  }
+  
+  const std::vector<uint64_t>* next = 
+          static_cast<ProgArrayMap*>(map)->Get(index);
+  if (!next)
+  {
+    return -ENOENT;
+  }
+  
+  if (!vm.TailCall(*next))
+  {
+    return -E2BIG;
+  }
+  
+  return 0;
+}
+
+// bpf_get_smp_processor_id()
+// The worker index of the VM, see VM::SetCpu
+static uint64_t bpf_get_smp_processor_id(VM& vm, uint64_t, uint64_t,
+                                         uint64_t, uint64_t, uint64_t)
+{
+  return vm.GetCpu();
+}
+
+static RingBufMap* GetRingBuf(VM& vm, uint64_t mapId)
+{
+  Map* map = vm.GetMap(mapId);
+  if (!map || map->Type() != BPF_MAP_TYPE_RINGBUF)
+  {
+    return nullptr;
+  }
+  return static_cast<RingBufMap*>(map);
+}
+
+// bpf_ringbuf_output(ringbuf, data, size, flags)
+// Copies size bytes at data into a new record.
+static uint64_t bpf_ringbuf_output(VM& vm, uint64_t mapId, uint64_t data,
+                                   uint64_t size, uint64_t flags, uint64_t)
+{
+  RingBufMap* rb = GetRingBuf(vm, mapId);
+  if (!rb)
+  {
+    return -EINVAL;
+  }
+  
+  const uint8_t* src = MemLoadPtr(vm.GetRegions(), data, size);
+  if (!src)
+  {
+    return -EFAULT;
+  }
+  
+  return rb->Output(src, size, flags);
+}
+
+// bpf_ringbuf_reserve(ringbuf, size, flags)
+// Returns the sample to fill in, or 0 if the ring is full or the program
+// holds MEM_SAMPLES samples already. Until it is submitted or discarded
+// the sample is a region of its own (VM::MapSample).
+static uint64_t bpf_ringbuf_reserve(VM& vm, uint64_t mapId, uint64_t size,
+                                    uint64_t flags, uint64_t, uint64_t)
+{
+  RingBufMap* rb = GetRingBuf(vm, mapId);
+  if (!rb)
+  {
+    return 0;
+  }
+  
+  uint8_t* sample = static_cast<uint8_t*>(rb->Reserve(size, flags));
+  if (!sample)
+  {
+    return 0;
+  }
+  
+  // the program sees the sample and nothing else of the ring
+  uint64_t addr = vm.MapSample(rb, sample, size);
+  if (!addr)
+  {
+    rb->Discard(sample, BPF_RB_NO_WAKEUP);
+  }
+  return addr;
+}
+
+// Ring of a sample returned by bpf_ringbuf_reserve and its host pointer
+// in sample; the program cannot reach the sample any more
+static RingBufMap* RingBufSample(VM& vm, uint64_t addr, void*& sample)
+{
+  uint8_t* p;
+  RingBufMap* rb = static_cast<RingBufMap*>(vm.UnmapSample(addr, p));
+  sample = p;
+  return rb;
+}
+
+// bpf_ringbuf_submit(sample, flags)
+// Ignored unless sample is a record reserved and not yet committed
+static uint64_t bpf_ringbuf_submit(VM& vm, uint64_t addr, uint64_t flags,
+                                   uint64_t, uint64_t, uint64_t)
+{
+  void* sample;
+  RingBufMap* rb = RingBufSample(vm, addr, sample);
+  if (rb)
+  {
+    rb->Submit(sample, flags);
+  }
+  return 0;
+}
+
+// bpf_ringbuf_discard(sample, flags)
+static uint64_t bpf_ringbuf_discard(VM& vm, uint64_t addr, uint64_t flags,
+                                    uint64_t, uint64_t, uint64_t)
+{
+  void* sample;
+  RingBufMap* rb = RingBufSample(vm, addr, sample);
+  if (rb)
+  {
+    rb->Discard(sample, flags);
+  }
+  return 0;
+}
+
+// bpf_map_lookup_elem(map, key)
+// Returns the address of the value, or 0 if there is none (or the map
+// has no addressable values). Per-CPU maps return the VM's CPU's copy.
+static uint64_t bpf_map_lookup_elem(VM& vm, uint64_t mapId, uint64_t key,
+                                    uint64_t, uint64_t, uint64_t)
+{
+  Map* map = vm.GetMap(mapId);
+  if (!map || !map->Values() || mapId >= MAX_MEM_REGIONS - MEM_REGION_MAP0)
+  {
+    return 0;
+  }
+  
+  const uint8_t* k = MemLoadPtr(vm.GetRegions(), key, map->KeySize());
+  if (!k)
+  {
+    return 0;
+  }
+  
+  uint8_t* value = static_cast<uint8_t*>(map->LookupCpu(k, vm.GetCpu()));
+  if (!value)
+  {
+    return 0;
+  }
+  
+  return MemAddr(MEM_REGION_MAP0 + mapId, value - map->Values());
+}
+
+// bpf_map_update_elem(map, key, value, flags)
+// Per-CPU maps update the VM's CPU's copy only
+static uint64_t bpf_map_update_elem(VM& vm, uint64_t mapId, uint64_t key,
+                                    uint64_t value, uint64_t flags, uint64_t)
+{
+  Map* map = vm.GetMap(mapId);
+  if (!map)
+  {
+    return -EINVAL;
+  }
+  
+  const uint8_t* k = MemLoadPtr(vm.GetRegions(), key, map->KeySize());
+  const uint8_t* v = MemLoadPtr(vm.GetRegions(), value, map->ValueSize());
+  if (!k || !v)
+  {
+    return -EFAULT;
+  }
+  
+  return map->UpdateCpu(k, v, flags, vm.GetCpu());
+}
+
+// bpf_map_delete_elem(map, key)
+static uint64_t bpf_map_delete_elem(VM& vm, uint64_t mapId, uint64_t key,
+                                    uint64_t, uint64_t, uint64_t)
+{
+  Map* map = vm.GetMap(mapId);
+  if (!map)
+  {
+    return -EINVAL;
+  }
+  
+  const uint8_t* k = MemLoadPtr(vm.GetRegions(), key, map->KeySize());
+  if (!k)
+  {
+    return -EFAULT;
+  }
+  
+  return map->Delete(k);
+}
+
+// bpf_loop(nr_loops, callback, callback_ctx, flags)
+// Calls callback(i, callback_ctx) for i = 0 .. nr_loops - 1, stopping
+// early once it returns non-zero. callback is the position of its first
+// instruction, loaded with BPF_LDDW and BPF_PSEUDO_FUNC, and runs in a
+// stack frame of its own below the caller's. Returns the number of
+// calls made.
+static uint64_t bpf_loop(VM& vm, uint64_t n, uint64_t callback,
+                         uint64_t ctx, uint64_t flags, uint64_t)
+{
+  const std::vector<uint64_t>* prog = vm.GetProgram();
+  if (flags != 0 || !prog || callback >= prog->size())
+  {
+    return -EINVAL;
+  }
+  if (n > BPF_MAX_LOOPS)
+  {
+    return -E2BIG;
+  }
+
+  uint64_t i = 0;
+  while (i < n)
+  {
+    uint64_t ret;
+    if (!vm.Callback(callback, i, ctx, ret))
+    {
+      break; // the run is over anyway
+    }
+    i++;
+    if (ret != 0)
+    {
+      break;
+    }
+  }
+  return i;
+}
+
+static Helper* InitHelpers(Helper* table)
+{
+  table[BPF_FUNC_tail_call] = bpf_tail_call;
+  table[BPF_FUNC_get_smp_processor_id] = bpf_get_smp_processor_id;
+  table[BPF_FUNC_map_lookup_elem] = bpf_map_lookup_elem;
+  table[BPF_FUNC_map_update_elem] = bpf_map_update_elem;
+  table[BPF_FUNC_map_delete_elem] = bpf_map_delete_elem;
+  table[BPF_FUNC_ringbuf_output] = bpf_ringbuf_output;
+  table[BPF_FUNC_ringbuf_reserve] = bpf_ringbuf_reserve;
+  table[BPF_FUNC_ringbuf_submit] = bpf_ringbuf_submit;
+  table[BPF_FUNC_ringbuf_discard] = bpf_ringbuf_discard;
+  table[BPF_FUNC_loop] = bpf_loop;
+  
+  return table;
+}
+
+Helper helperTable[MAX_HELPERS];
+static Helper* helperTableInit = InitHelpers(helperTable);
+
+bool RegisterHelper(uint32_t id, Helper fn)
+{
+  if (id >= MAX_HELPERS)
+  {
+    return false;
+  }
+  
+  helperTable[id] = fn;
+  return true;
+}
+
+uint64_t CallHelper(Helper fn, VM& vm, uint64_t r1, uint64_t r2,
+                    uint64_t r3, uint64_t r4, uint64_t r5)
+{
+  uint64_t res = fn(vm, r1, r2, r3, r4, r5);
+  while (vm.IsSuspended())
+  {
+    vm.WaitReady();
+    res = fn(vm, r1, r2, r3, r4, r5);
+  }
+  return res;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+class VM;
+
+// Helper function ids, passed as the imm of BPF_CALL_IMM
+// (values follow the kernel's enum bpf_func_id)
+#define BPF_FUNC_map_lookup_elem         1
+#define BPF_FUNC_map_update_elem         2
+#define BPF_FUNC_map_delete_elem         3
+#define BPF_FUNC_get_smp_processor_id    8
+#define BPF_FUNC_tail_call               12
+#define BPF_FUNC_ringbuf_output          130
+#define BPF_FUNC_ringbuf_reserve         131
+#define BPF_FUNC_ringbuf_submit          132
+#define BPF_FUNC_ringbuf_discard         133
+#define BPF_FUNC_loop                    181
+
+// Most callbacks a single bpf_loop call may ask for
+#define BPF_MAX_LOOPS (1 << 23)
+
+#define MAX_HELPERS 256
+
+// Helpers receive R1-R5 and their return value is placed in R0.
+// Pointer arguments and results are VM addresses (see Memory.h).
+typedef uint64_t (*Helper)(VM&, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+// Fast lookup used by the execution engines, nullptr if unknown
+extern Helper helperTable[MAX_HELPERS];
+
+inline Helper GetHelper(uint32_t id)
+{
+  return (id < MAX_HELPERS) ? helperTable[id] : nullptr;
+}
+
+// Call a helper from an engine that cannot suspend a run: if the
+// helper suspends (see VM::Suspend), wait until it can complete and
+// call it again
+uint64_t CallHelper(Helper fn, VM& vm, uint64_t r1, uint64_t r2,
+                    uint64_t r3, uint64_t r4, uint64_t r5);
+
+// Install (or replace) a helper; returns false if id is out of range
+bool RegisterHelper(uint32_t id, Helper fn);
@@ -0,0 +1,480 @@
+#include "Layout.h"
+#include "Opcodes.h"
+
+#include <algorithm>
+
+BranchProfile::BranchProfile(const std::vector<uint64_t>& program)
+: program(&program), runs(0), counts(2 * program.size(), 0)
+{
+
+}
+
+void BranchProfile::Merge(const BranchProfile& other)
+{
+  if (other.counts.size() != counts.size())
+  {
+    return;
+  }
+
+  runs += other.runs;
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    counts[i] += other.counts[i];
+  }
+}
+
+void BranchProfile::Clear()
+{
+  runs = 0;
+  std::fill(counts.begin(), counts.end(), 0);
+}
+
+/* -------------------------- Layout ---------------------------- */
+
+#define NO_BLOCK ((size_t)-1)
+
+struct Block
+{
+  size_t start, end;  // instructions [start, end)
+  size_t taken, next; // jump target and fall-through successor
+  uint64_t takenCount, nextCount;
+  uint64_t count;     // times the block ran
+  unsigned preds;     // edges into the block
+};
+
+// An instruction of the new layout, jumping to block target if set
+struct Emitted
+{
+  uint64_t instr;
+  size_t target;
+};
+
+static bool IsJump(uint8_t op)
+{
+  return (op & 0x07) == 0x05 && op != BPF_CALL_IMM && op != BPF_EXIT;
+}
+
+static uint64_t WithOffset(uint64_t instr, uint64_t off)
+{
+  return (instr & ~(uint64_t)OFF_MASK) | (off << SHL_OFF);
+}
+
+// The conditional jump taken exactly when instr falls through, 0 if
+// there is none
+static uint64_t Inverse(uint64_t instr)
+{
+  uint8_t op = instr & OP_MASK;
+  uint64_t dst = (instr & DST_MASK) >> SHL_DST;
+  uint64_t src = (instr & SRC_MASK) >> SHL_SRC;
+  uint64_t rest = instr & ~(uint64_t)(OP_MASK | DST_MASK | SRC_MASK);
+
+  switch (op)
+  {
+    case BPF_JEQ_IMM: return rest | (instr & (DST_MASK | SRC_MASK)) | BPF_JNE_IMM;
+    case BPF_JNE_IMM: return rest | (instr & (DST_MASK | SRC_MASK)) | BPF_JEQ_IMM;
+    case BPF_JEQ_SRC: return rest | (instr & (DST_MASK | SRC_MASK)) | BPF_JNE_SRC;
+    case BPF_JNE_SRC: return rest | (instr & (DST_MASK | SRC_MASK)) | BPF_JEQ_SRC;
+    default: break;
+  }
+
+  // !(a > b) is b >= a, and so on
+  uint8_t inv;
+  switch (op)
+  {
+    case BPF_JGT_SRC:  inv = BPF_JGE_SRC; break;
+    case BPF_JGE_SRC:  inv = BPF_JGT_SRC; break;
+    case BPF_JSGT_SRC: inv = BPF_JSGE_SRC; break;
+    case BPF_JSGE_SRC: inv = BPF_JSGT_SRC; break;
+    default: return 0;
+  }
+  return rest | (src << SHL_DST) | (dst << SHL_SRC) | inv;
+}
+
+std::vector<uint64_t> LayoutBlocks(const std::vector<uint64_t>& program,
+                                   const BranchProfile& profile)
+{
+  size_t size = program.size();
+  if (size == 0 || profile.counts.size() != 2 * size)
+  {
+    return program;
+  }
+
+  // loops have no order with every block after its predecessors, and
+  // callbacks are entered at positions the layout would move
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    uint8_t op = program[pc] & OP_MASK;
+    int16_t off = (program[pc] & OFF_MASK) >> SHL_OFF;
+    if ((IsJump(op) && off < 0)
+        || (op == BPF_LDDW && ((program[pc] & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC))
+    {
+      return program;
+    }
+  }
+
+  // blocks start at the entry, at jump targets and after jumps; running
+  // off the end goes to a block of its own that exits
+  std::vector<bool> leader(size + 1, false);
+  leader[0] = true;
+  leader[size] = true;
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    uint8_t op = program[pc] & OP_MASK;
+    if (IsJump(op))
+    {
+      uint16_t off = (program[pc] & OFF_MASK) >> SHL_OFF;
+      leader[std::min(pc + 1 + off, size)] = true;
+    }
+    if (IsJump(op) || op == BPF_EXIT)
+    {
+      leader[pc + 1] = true;
+    }
+  }
+
+  std::vector<Block> blocks;
+  std::vector<size_t> blockAt(size + 1, NO_BLOCK);
+  for (size_t pc = 0; pc <= size; pc++)
+  {
+    if (leader[pc])
+    {
+      blockAt[pc] = blocks.size();
+      Block b = {pc, pc, NO_BLOCK, NO_BLOCK, 0, 0, 0, 0};
+      blocks.push_back(b);
+    }
+    blocks.back().end = std::min(pc + 1, size);
+  }
+
+  // successors and how often each edge was followed, in program order
+  // so every block has its count before its successors get theirs
+  blocks[0].count = profile.runs;
+  for (Block& b : blocks)
+  {
+    if (b.start == size)
+    {
+      break;
+    }
+
+    size_t last = b.end - 1;
+    uint8_t op = program[last] & OP_MASK;
+    uint16_t off = (program[last] & OFF_MASK) >> SHL_OFF;
+    if (op == BPF_EXIT)
+    {
+      continue;
+    }
+    if (IsJump(op))
+    {
+      b.taken = blockAt[std::min(last + 1 + off, size)];
+      b.takenCount = (op == BPF_JA) ? b.count : profile.Taken(last);
+    }
+    if (op != BPF_JA)
+    {
+      b.next = blockAt[b.end];
+      b.nextCount = IsJump(op) ? profile.FellThrough(last) : b.count;
+    }
+
+    if (b.taken != NO_BLOCK)
+    {
+      blocks[b.taken].preds++;
+      blocks[b.taken].count += b.takenCount;
+    }
+    if (b.next != NO_BLOCK)
+    {
+      blocks[b.next].preds++;
+      blocks[b.next].count += b.nextCount;
+    }
+  }
+
+  // place blocks once all their predecessors are, preferring the
+  // hottest successor of the block placed last and otherwise the
+  // hottest block that can go next
+  size_t exitBlock = blocks.size() - 1;
+  std::vector<unsigned> waiting(blocks.size());
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    waiting[i] = blocks[i].preds;
+    if (waiting[i] == 0 && i != 0 && i != exitBlock)
+    {
+      ready.push_back(i); // unreachable
+    }
+  }
+  ready.push_back(0);
+
+  std::vector<size_t> order;
+  size_t prev = NO_BLOCK;
+  while (!ready.empty())
+  {
+    size_t pick = ready.size() - 1; // the entry comes first
+    if (prev != NO_BLOCK)
+    {
+      const Block& p = blocks[prev];
+      size_t next = std::find(ready.begin(), ready.end(), p.next) - ready.begin();
+      size_t taken = std::find(ready.begin(), ready.end(), p.taken) - ready.begin();
+      if (taken < ready.size() && (next == ready.size() || p.takenCount > p.nextCount))
+      {
+        pick = taken;
+      }
+      else if (next < ready.size())
+      {
+        pick = next;
+      }
+      else
+      {
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+          const Block& c = blocks[ready[i]];
+          const Block& best = blocks[ready[pick]];
+          if (c.count > best.count || (c.count == best.count && ready[i] < ready[pick]))
+          {
+            pick = i;
+          }
+        }
+      }
+    }
+
+    size_t b = ready[pick];
+    ready.erase(ready.begin() + pick);
+    order.push_back(b);
+    prev = b;
+
+    size_t succ[2] = {blocks[b].taken, blocks[b].next};
+    for (size_t s : succ)
+    {
+      if (s != NO_BLOCK && --waiting[s] == 0)
+      {
+        ready.push_back(s);
+      }
+    }
+  }
+
+  // emit the blocks with their terminators fixed up for the new order,
+  // then resolve the jumps
+  std::vector<Emitted> out;
+  std::vector<size_t> addr(blocks.size(), 0);
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    const Block& b = blocks[order[i]];
+    size_t follow = (i + 1 < order.size()) ? order[i + 1] : NO_BLOCK;
+    addr[order[i]] = out.size();
+
+    if (b.start == size)
+    {
+      if (b.preds)
+      {
+        out.push_back({BPF_INSN(BPF_EXIT, 0, 0, 0, 0), NO_BLOCK});
+      }
+      continue;
+    }
+
+    for (size_t pc = b.start; pc + 1 < b.end; pc++)
+    {
+      out.push_back({program[pc], NO_BLOCK});
+    }
+
+    uint64_t last = program[b.end - 1];
+    uint8_t op = last & OP_MASK;
+    if (!IsJump(op))
+    {
+      out.push_back({last, NO_BLOCK});
+    }
+    else if (op == BPF_JA)
+    {
+      if (b.taken != follow)
+      {
+        out.push_back({last, b.taken});
+      }
+      continue;
+    }
+    else if (b.next == follow)
+    {
+      out.push_back({last, b.taken});
+      continue;
+    }
+    else if (b.taken == follow && Inverse(last))
+    {
+      out.push_back({Inverse(last), b.next});
+      continue;
+    }
+    else
+    {
+      out.push_back({last, b.taken});
+    }
+
+    if (b.next != NO_BLOCK && b.next != follow)
+    {
+      out.push_back({BPF_INSN(BPF_JA, 0, 0, 0, 0), b.next});
+    }
+  }
+
+  std::vector<uint64_t> result(out.size());
+  for (size_t pc = 0; pc < out.size(); pc++)
+  {
+    result[pc] = out[pc].instr;
+    if (out[pc].target != NO_BLOCK)
+    {
+      uint64_t off = addr[out[pc].target] - (pc + 1);
+      if (addr[out[pc].target] < pc + 1 || off > 0xFFFF)
+      {
+        return program;
+      }
+      result[pc] = WithOffset(result[pc], off);
+    }
+  }
+
+  return result;
+}
+
+/* ------------------------- Peephole --------------------------- */
+
+#define NO_TARGET ((size_t)-1)
+
+static bool IsReturn(const std::vector<uint64_t>& program, size_t pc)
+{
+  uint8_t op = program[pc] & OP_MASK;
+  return op == BPF_EXIT
+      || (pc + 1 < program.size() && (op == BPF_MOV_IMM || op == BPF_MOV32_IMM)
+          && ((program[pc] & DST_MASK) >> SHL_DST) == 0
+          && (program[pc + 1] & OP_MASK) == BPF_EXIT);
+}
+
+std::vector<uint64_t> Peephole(const std::vector<uint64_t>& program)
+{
+  size_t size = program.size();
+  if (size == 0)
+  {
+    return program;
+  }
+  std::vector<uint64_t> code(program);
+  std::vector<size_t> target(size, NO_TARGET);
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    uint8_t op = code[pc] & OP_MASK;
+    int16_t off = (code[pc] & OFF_MASK) >> SHL_OFF;
+    if ((IsJump(op) && off < 0)
+        || (op == BPF_LDDW && ((code[pc] & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC))
+    {
+      return program;
+    }
+    if (IsJump(op))
+    {
+      target[pc] = std::min(pc + 1 + off, size);
+    }
+  }
+
+  // thread jumps through unconditional ones, from the end so every
+  // target is already threaded
+  for (size_t pc = size; pc-- > 0;)
+  {
+    size_t t = target[pc];
+    if (t < size && (code[t] & OP_MASK) == BPF_JA)
+    {
+      target[pc] = target[t];
+    }
+  }
+
+  // a conditional jump over an unconditional one (which, threaded,
+  // nothing jumps to now) becomes the inverse jump, leaving the other
+  // one jumping to the next instruction
+  for (size_t pc = 0; pc + 1 < size; pc++)
+  {
+    uint8_t op = code[pc] & OP_MASK;
+    if (target[pc] == pc + 2 && op != BPF_JA && Inverse(code[pc])
+        && (code[pc + 1] & OP_MASK) == BPF_JA)
+    {
+      code[pc] = Inverse(code[pc]);
+      target[pc] = target[pc + 1];
+      target[pc + 1] = pc + 2;
+    }
+  }
+
+  // returns copied in place of the jumps to them (one instruction may
+  // become two: tail[pc] if an exit follows code[pc])
+  std::vector<bool> tail(size, false);
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    size_t t = target[pc];
+    if ((code[pc] & OP_MASK) == BPF_JA && t > pc + 1 && t < size && IsReturn(code, t))
+    {
+      code[pc] = code[t];
+      tail[pc] = (code[t] & OP_MASK) != BPF_EXIT;
+      target[pc] = NO_TARGET;
+    }
+  }
+
+  // what can run at all
+  std::vector<bool> keep(size, false);
+  keep[0] = true;
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    if (!keep[pc])
+    {
+      continue;
+    }
+    uint8_t op = code[pc] & OP_MASK;
+    if (target[pc] < size)
+    {
+      keep[target[pc]] = true;
+    }
+    if (op != BPF_JA && op != BPF_EXIT && !tail[pc] && pc + 1 < size)
+    {
+      keep[pc + 1] = true;
+    }
+  }
+
+  // from the end, knowing what runs after each instruction: drop jumps
+  // to where it falls through to anyway
+  size_t follow = size;
+  for (size_t pc = size; pc-- > 0;)
+  {
+    if (!keep[pc])
+    {
+      continue;
+    }
+    if (target[pc] != NO_TARGET && target[pc] <= follow
+        && std::find(keep.begin() + target[pc], keep.begin() + follow, true)
+           == keep.begin() + follow)
+    {
+      keep[pc] = false;
+      continue;
+    }
+    follow = pc;
+  }
+
+  // new positions, a dropped instruction taking that of the next one
+  // kept, then the jumps resolved
+  std::vector<size_t> addr(size + 1);
+  size_t n = 0;
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    addr[pc] = n;
+    n += keep[pc] ? 1 + tail[pc] : 0;
+  }
+  addr[size] = n;
+
+  std::vector<uint64_t> result;
+  for (size_t pc = 0; pc < size; pc++)
+  {
+    if (!keep[pc])
+    {
+      continue;
+    }
+    uint64_t instr = code[pc];
+    if (target[pc] != NO_TARGET)
+    {
+      uint64_t off = addr[target[pc]] - (result.size() + 1);
+      if (off > INT16_MAX)
+      {
+        return program;
+      }
+      instr = WithOffset(instr, off);
+    }
+    result.push_back(instr);
+    if (tail[pc])
+    {
+      result.push_back(BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+    }
+  }
+
+  // nothing but jumps off the end
+  return result.empty() ? program : result;
+}
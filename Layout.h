@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// How often each conditional jump of a program went which way.
+//
+// Attach one to a VM (VM::SetProfile) and both the interpreter and
+// native code compiled with profiling (AotProgram::Compile) count the
+// runs of program and the outcome of its conditional jumps. Counting
+// is not atomic: give every thread a profile of its own and Merge()
+// them.
+struct BranchProfile
+{
+  const std::vector<uint64_t>* program;
+  uint64_t runs;
+  std::vector<uint64_t> counts; // [2 * pc] fell through, [2 * pc + 1] taken
+
+  BranchProfile(const std::vector<uint64_t>& program);
+
+  void Record(uint64_t pc, bool taken) {counts[2 * pc + taken]++;};
+  uint64_t FellThrough(uint64_t pc) const {return counts[2 * pc];};
+  uint64_t Taken(uint64_t pc) const {return counts[2 * pc + 1];};
+
+  void Merge(const BranchProfile&);
+  void Clear();
+};
+
+// Reorder the basic blocks of program so the paths taken most often in
+// profile fall through and follow each other, and blocks that never
+// ran go last.
+//
+// Jumps go forward, so blocks stay in an order where every block
+// comes after all of its predecessors; within that, each block is
+// followed by its hottest successor where possible. Conditions are
+// inverted where the instruction set has the inverse (jeq/jne, and the
+// register forms of the ordered compares with their operands swapped)
+// and an unconditional jump is added where a block no longer falls
+// through to its successor. Running off the end of program becomes an
+// explicit exit.
+//
+// The result computes the same as program, but instruction positions
+// (e.g. in fault reports) refer to the new layout. Returns program
+// unchanged if it has loops or callbacks, or if a jump in the new
+// layout would be out of range.
+std::vector<uint64_t> LayoutBlocks(const std::vector<uint64_t>& program,
+                                   const BranchProfile& profile);
+
+// Tidy the jumps of program: jumps to jumps go straight to where the
+// chain ends, a jump to an exit (or to a return of a constant) becomes
+// the exit itself, a conditional jump over an unconditional one is
+// inverted where the instruction set has the inverse, and jumps to the
+// next instruction and unreachable code are dropped. Meant for code
+// produced by translation (e.g. TranslateClassic), whose blocks are laid
+// out one per source instruction.
+//
+// As with LayoutBlocks, instruction positions change and program is
+// returned unchanged if it has loops or callbacks.
+std::vector<uint64_t> Peephole(const std::vector<uint64_t>& program);
@@ -0,0 +1,866 @@
+// Synthetic load generator and end-to-end throughput harness.
+//
+// Builds a stream of Ethernet/IPv4 packets in memory (protocol mix,
+// packet sizes, number of flows and how skewed traffic is across them)
+// and pushes it through the ways the VM is driven in production: one
+// VM::Run per packet, Pipeline batches, and a pool of worker threads
+// each running its own pipeline over the shared program. Reports
+// packets per second, per packet latency percentiles and how the pool
+// scales from 1 to N cores.
+//
+// Packets get one flow each, drawn from a Zipf distribution of
+// exponent s over the flows (0 is uniform), so a few flows carry most
+// of the traffic as on real links. The protocol of a flow is drawn
+// from the mix, the packet mix printed follows the flows drawn.
+//
+// The program sees the packet as its context (R1) and returns its
+// verdict in R0, 0 dropping the packet. Without -f a built-in filter is
+// run: IPv4 only, drops telnet and NetBIOS, passes ICMP echo requests
+// and tags TCP SYNs with verdict 2. With -c n, n tenant filters (one
+// per destination address, each dropping telnet) are merged by
+// Classifier into the program run, to see how the merged program
+// scales with the number of tenants. With -b a classic BPF filter (as
+// tcpdump -dd or -ddd prints it) is translated and run.
+//
+// Usage: ebpf_loadgen [-n packets] [-F flows] [-z skew] [-m mix] [-l sizes]
+//                     [-t threads] [-d ms] [-f program] [-c tenants]
+//                     [-b filter] [-e engine] [-a aotdir] [-r seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "VM.h"
+#include "Opcodes.h"
+#include "Assembler.h"
+#include "Aot.h"
+#include "Classifier.h"
+#include "ClassicBpf.h"
+#include "Metrics.h"
+#include "Pipeline.h"
+
+// Packets handed to a path at once between checks of the clock
+#define LOADGEN_CHUNK (PIPELINE_BATCH * 16)
+
+#define ETH_HLEN  14
+#define IP_HLEN   20
+#define TCP_HLEN  20
+#define UDP_HLEN  8
+#define ICMP_HLEN 8
+
+#define ETH_P_IP 0x0800
+
+enum LoadProto
+{
+  PROTO_TCP,
+  PROTO_UDP,
+  PROTO_ICMP,
+  PROTOS
+};
+
+static const char* protoNames[PROTOS] = {"tcp", "udp", "icmp"};
+static const uint8_t protoNumbers[PROTOS] = {6, 17, 1};
+
+/* ------------------------ Generator --------------------------- */
+
+struct LoadConfig
+{
+  size_t packets;
+  size_t flows;
+  double skew;                // Zipf exponent, 0 for uniform
+  double mix[PROTOS];         // relative weights
+  std::vector<uint32_t> sizes; // frame sizes drawn from, uniformly
+  uint32_t minSize;
+  uint32_t maxSize;           // 0: use sizes
+  uint64_t seed;
+};
+
+struct LoadFlow
+{
+  LoadProto proto;
+  uint32_t saddr;
+  uint32_t daddr;
+  uint16_t sport;
+  uint16_t dport;   // ICMP: type in the high byte
+};
+
+// The packets of a stream live back to back in one buffer
+struct LoadStream
+{
+  std::vector<uint8_t> data;
+  std::vector<PipelinePacket> packets;
+  uint64_t bytes;
+  uint64_t perProto[PROTOS];
+};
+
+static void Put16(uint8_t* p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static void Put32(uint8_t* p, uint32_t v)
+{
+  Put16(p, v >> 16);
+  Put16(p + 2, v & 0xffff);
+}
+
+// Well known ports, picked often enough that the filter has something
+// to drop and pass
+static const uint16_t tcpPorts[] = {80, 443, 22, 23, 25, 8080};
+static const uint16_t udpPorts[] = {53, 123, 137, 138, 443, 5353};
+
+static LoadFlow MakeFlow(std::mt19937_64& rng, LoadProto proto)
+{
+  LoadFlow f;
+  f.proto = proto;
+  f.saddr = (uint32_t)rng();
+  f.daddr = 0xc0a80000 | (rng() & 0xffff); // 192.168.0.0/16
+  f.sport = 1024 + rng() % (65536 - 1024);
+  switch (proto)
+  {
+    case PROTO_TCP:
+      f.dport = tcpPorts[rng() % (sizeof(tcpPorts) / sizeof(tcpPorts[0]))];
+      break;
+    case PROTO_UDP:
+      f.dport = udpPorts[rng() % (sizeof(udpPorts) / sizeof(udpPorts[0]))];
+      break;
+    default:
+      // echo request, echo reply or destination unreachable
+      f.dport = (rng() % 4 == 0 ? 0 : rng() % 2 ? 8 : 3) << 8;
+      break;
+  }
+  return f;
+}
+
+static size_t HeaderLen(LoadProto proto)
+{
+  switch (proto)
+  {
+    case PROTO_TCP: return ETH_HLEN + IP_HLEN + TCP_HLEN;
+    case PROTO_UDP: return ETH_HLEN + IP_HLEN + UDP_HLEN;
+    default: return ETH_HLEN + IP_HLEN + ICMP_HLEN;
+  }
+}
+
+// Write one frame of size bytes of flow f at p. TCP flows send a SYN
+// now and then.
+static void WritePacket(uint8_t* p, uint32_t size, const LoadFlow& f,
+                        std::mt19937_64& rng)
+{
+  memset(p, 0, HeaderLen(f.proto));
+  for (uint32_t i = HeaderLen(f.proto); i < size; i++)
+  {
+    p[i] = (uint8_t)i;
+  }
+
+  // Ethernet
+  memcpy(p, "\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02", 12);
+  Put16(p + 12, ETH_P_IP);
+
+  // IPv4, no options
+  uint8_t* ip = p + ETH_HLEN;
+  ip[0] = 0x45;
+  Put16(ip + 2, size - ETH_HLEN);
+  ip[8] = 64;
+  ip[9] = protoNumbers[f.proto];
+  Put32(ip + 12, f.saddr);
+  Put32(ip + 16, f.daddr);
+
+  uint8_t* l4 = ip + IP_HLEN;
+  switch (f.proto)
+  {
+    case PROTO_TCP:
+      Put16(l4, f.sport);
+      Put16(l4 + 2, f.dport);
+      Put32(l4 + 4, (uint32_t)rng());
+      l4[12] = 5 << 4;
+      l4[13] = (rng() % 8 == 0) ? 0x02 : 0x10; // SYN or ACK
+      Put16(l4 + 14, 65535);
+      break;
+    case PROTO_UDP:
+      Put16(l4, f.sport);
+      Put16(l4 + 2, f.dport);
+      Put16(l4 + 4, size - ETH_HLEN - IP_HLEN);
+      break;
+    default:
+      l4[0] = f.dport >> 8;
+      Put16(l4 + 4, f.sport);
+      break;
+  }
+}
+
+// Zipf(skew) over n flows, flow 0 the most popular
+static std::vector<double> ZipfWeights(size_t n, double skew)
+{
+  std::vector<double> w(n);
+  for (size_t k = 0; k < n; k++)
+  {
+    w[k] = 1.0 / pow((double)(k + 1), skew);
+  }
+  return w;
+}
+
+static void Generate(const LoadConfig& cfg, LoadStream& stream)
+{
+  std::mt19937_64 rng(cfg.seed);
+
+  std::discrete_distribution<int> pickProto(cfg.mix, cfg.mix + PROTOS);
+  std::vector<LoadFlow> flows;
+  for (size_t i = 0; i < cfg.flows; i++)
+  {
+    flows.push_back(MakeFlow(rng, (LoadProto)pickProto(rng)));
+  }
+
+  std::vector<double> weights = ZipfWeights(cfg.flows, cfg.skew);
+  std::discrete_distribution<size_t> pickFlow(weights.begin(), weights.end());
+  std::uniform_int_distribution<uint32_t> pickSize(cfg.minSize, cfg.maxSize);
+
+  std::vector<uint32_t> sizes(cfg.packets);
+  std::vector<size_t> which(cfg.packets);
+  uint64_t total = 0;
+  for (size_t i = 0; i < cfg.packets; i++)
+  {
+    which[i] = pickFlow(rng);
+    sizes[i] = cfg.maxSize ? pickSize(rng) : cfg.sizes[rng() % cfg.sizes.size()];
+    sizes[i] = std::max(sizes[i], (uint32_t)HeaderLen(flows[which[i]].proto));
+    total += sizes[i];
+  }
+
+  // filled in before taking addresses, data does not move afterwards
+  stream.data.assign(total, 0);
+  stream.packets.resize(cfg.packets);
+  stream.bytes = total;
+  memset(stream.perProto, 0, sizeof(stream.perProto));
+
+  uint64_t offset = 0;
+  for (size_t i = 0; i < cfg.packets; i++)
+  {
+    const LoadFlow& f = flows[which[i]];
+    WritePacket(&stream.data[offset], sizes[i], f, rng);
+    stream.packets[i].data = &stream.data[offset];
+    stream.packets[i].size = sizes[i];
+    stream.packets[i].verdict = 0;
+    stream.perProto[f.proto]++;
+    offset += sizes[i];
+  }
+}
+
+/* ----------------------- Default filter ----------------------- */
+
+static void Emit(std::vector<uint64_t>& prog, uint64_t insn)
+{
+  prog.push_back(insn);
+}
+
+// r6 - packet, r7 - layer 4 header, r2 - destination port
+static std::vector<uint64_t> DefaultFilter()
+{
+  std::vector<uint64_t> p;
+  Emit(p, BPF_INSN(BPF_MOV_SRC, 6, 1, 0, 0));
+  Emit(p, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0));
+  // IPv4 only
+  Emit(p, BPF_INSN(BPF_LDXH, 2, 6, 12, 0));
+  Emit(p, BPF_INSN(BPF_BE, 2, 0, 0, 16));
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 2, 0, 24, ETH_P_IP));          // drop
+  // skip the IP header and its options
+  Emit(p, BPF_INSN(BPF_LDXB, 3, 6, ETH_HLEN, 0));
+  Emit(p, BPF_INSN(BPF_AND_IMM, 3, 0, 0, 0xf));
+  Emit(p, BPF_INSN(BPF_LSH_IMM, 3, 0, 0, 2));
+  Emit(p, BPF_INSN(BPF_MOV_SRC, 7, 6, 0, 0));
+  Emit(p, BPF_INSN(BPF_ADD_SRC, 7, 3, 0, 0));
+  Emit(p, BPF_INSN(BPF_LDXB, 4, 6, ETH_HLEN + 9, 0));
+  Emit(p, BPF_INSN(BPF_JEQ_IMM, 4, 0, 11, 1));                 // icmp
+  Emit(p, BPF_INSN(BPF_LDXH, 2, 7, ETH_HLEN + 2, 0));
+  Emit(p, BPF_INSN(BPF_BE, 2, 0, 0, 16));
+  Emit(p, BPF_INSN(BPF_JEQ_IMM, 4, 0, 5, 17));                 // udp
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 4, 0, 13, 6));                 // drop
+  // tcp: no telnet, tag SYNs
+  Emit(p, BPF_INSN(BPF_JEQ_IMM, 2, 0, 12, 23));                // drop
+  Emit(p, BPF_INSN(BPF_LDXB, 3, 7, ETH_HLEN + 13, 0));
+  Emit(p, BPF_INSN(BPF_JSET_IMM, 3, 0, 8, 0x02));              // tag
+  Emit(p, BPF_INSN(BPF_JA, 0, 0, 5, 0));                       // pass
+  // udp: no NetBIOS (137-139)
+  Emit(p, BPF_INSN(BPF_JGT_IMM, 2, 0, 4, 139));                // pass
+  Emit(p, BPF_INSN(BPF_JGE_IMM, 2, 0, 7, 137));                // drop
+  Emit(p, BPF_INSN(BPF_JA, 0, 0, 2, 0));                       // pass
+  // icmp: echo requests only
+  Emit(p, BPF_INSN(BPF_LDXB, 3, 7, ETH_HLEN, 0));
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 3, 0, 4, 8));                  // drop
+  // pass:
+  Emit(p, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 1));
+  Emit(p, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  // tag:
+  Emit(p, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 2));
+  Emit(p, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  // drop:
+  Emit(p, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  return p;
+}
+
+// Tenant i: IPv4 to 192.168.0.0 + i, anything but telnet
+static std::vector<uint64_t> TenantFilter(uint32_t i)
+{
+  std::vector<uint64_t> p;
+  Emit(p, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0));
+  Emit(p, BPF_INSN(BPF_LDXH, 2, 1, 12, 0));
+  Emit(p, BPF_INSN(BPF_BE, 2, 0, 0, 16));
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 2, 0, 14, ETH_P_IP));          // drop
+  Emit(p, BPF_INSN(BPF_LDXW, 3, 1, ETH_HLEN + 16, 0));
+  Emit(p, BPF_INSN(BPF_BE, 3, 0, 0, 32));
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 3, 0, 11, 0xc0a80000 + i));    // drop
+  Emit(p, BPF_INSN(BPF_LDXB, 4, 1, ETH_HLEN + 9, 0));
+  Emit(p, BPF_INSN(BPF_JNE_IMM, 4, 0, 7, 6));                  // pass
+  Emit(p, BPF_INSN(BPF_LDXB, 5, 1, ETH_HLEN, 0));
+  Emit(p, BPF_INSN(BPF_AND_IMM, 5, 0, 0, 0xf));
+  Emit(p, BPF_INSN(BPF_LSH_IMM, 5, 0, 0, 2));
+  Emit(p, BPF_INSN(BPF_ADD_SRC, 5, 1, 0, 0));
+  Emit(p, BPF_INSN(BPF_LDXH, 2, 5, ETH_HLEN + 2, 0));
+  Emit(p, BPF_INSN(BPF_BE, 2, 0, 0, 16));
+  Emit(p, BPF_INSN(BPF_JEQ_IMM, 2, 0, 2, 23));                 // drop
+  // pass:
+  Emit(p, BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 1));
+  Emit(p, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  // drop:
+  Emit(p, BPF_INSN(BPF_EXIT, 0, 0, 0, 0));
+  return p;
+}
+
+/* -------------------------- Paths ----------------------------- */
+
+// What one path over one stream did: packets, wall time, latencies
+struct LoadResult
+{
+  uint64_t packets;
+  uint64_t ns;
+  unsigned threads;
+  MetricsSnapshot metrics;
+};
+
+static void MergeSnapshot(MetricsSnapshot& into, const MetricsSnapshot& s)
+{
+  into.runs += s.runs;
+  for (size_t i = 0; i < METRICS_VERDICTS; i++)
+  {
+    into.verdicts[i] += s.verdicts[i];
+  }
+  for (size_t i = 0; i < VM_ERRORS; i++)
+  {
+    into.errors[i] += s.errors[i];
+  }
+  into.timed += s.timed;
+  for (size_t i = 0; i < METRICS_BUCKETS; i++)
+  {
+    into.latency[i] += s.latency[i];
+  }
+}
+
+// The program under test, native if compiled
+struct LoadProgram
+{
+  std::vector<uint64_t> bytecode;
+  std::unique_ptr<AotProgram> native;
+};
+
+static bool PinToCpu(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// CPUs this process may run on, in order
+static std::vector<int> AllowedCpus()
+{
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+  {
+    for (int c = 0; c < CPU_SETSIZE; c++)
+    {
+      if (CPU_ISSET(c, &set))
+      {
+        cpus.push_back(c);
+      }
+    }
+  }
+  if (cpus.empty())
+  {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
+// One VM::Run per packet, as a caller without batching would
+static LoadResult RunSingle(const LoadProgram& prog, const LoadStream& stream,
+                            uint64_t durationNs)
+{
+  VM vm;
+  vm.SetTrace(false);
+  ProgramMetrics metrics("single");
+  MetricsShard& m = metrics.Local();
+  const uint64_t zero[11] = {0};
+
+  const std::vector<PipelinePacket>& packets = stream.packets;
+  uint64_t done = 0;
+  size_t next = 0;
+  uint64_t start = MetricsNow();
+  uint64_t now = start;
+  while (now - start < durationNs)
+  {
+    for (size_t i = 0; i < LOADGEN_CHUNK; i++)
+    {
+      const PipelinePacket& pkt = packets[next];
+      next = (next + 1 == packets.size()) ? 0 : next + 1;
+
+      vm.SetRegs(zero);
+      vm.R1().Write64(vm.SetContext(pkt.data, pkt.size, false));
+      vm.R2().Write64(pkt.size);
+      uint64_t started = m.Timed() ? MetricsNow() : 0;
+      uint64_t verdict = prog.native ? prog.native->Run(vm) : vm.Run(prog.bytecode);
+      if (started)
+      {
+        m.RecordLatency(MetricsNow() - started);
+      }
+      m.Record(vm.GetError(), verdict);
+    }
+    done += LOADGEN_CHUNK;
+    now = MetricsNow();
+  }
+
+  LoadResult res;
+  res.packets = done;
+  res.ns = now - start;
+  res.threads = 1;
+  res.metrics = metrics.Snapshot();
+  return res;
+}
+
+// A pipeline of one stage over a private copy of the packet list (the
+// pipeline writes verdicts into it), starting at first
+struct LoadWorker
+{
+  Pipeline pipeline;
+  std::vector<PipelinePacket> packets;
+  size_t next;
+  uint64_t done;
+
+  LoadWorker(const LoadProgram& prog, const LoadStream& stream, size_t first)
+  : packets(stream.packets), next(first % stream.packets.size()), done(0)
+  {
+    pipeline.AddStage("filter", prog.bytecode, prog.native.get());
+  };
+
+  void Chunk()
+  {
+    size_t n = std::min((size_t)LOADGEN_CHUNK, packets.size() - next);
+    pipeline.Run(&packets[next], n);
+    next = (next + n == packets.size()) ? 0 : next + n;
+    done += n;
+  };
+};
+
+// Pipeline::Run on the calling thread
+static LoadResult RunBatch(const LoadProgram& prog, const LoadStream& stream,
+                           uint64_t durationNs)
+{
+  LoadWorker worker(prog, stream, 0);
+
+  uint64_t start = MetricsNow();
+  uint64_t now = start;
+  while (now - start < durationNs)
+  {
+    worker.Chunk();
+    now = MetricsNow();
+  }
+
+  LoadResult res;
+  res.packets = worker.done;
+  res.ns = now - start;
+  res.threads = 1;
+  res.metrics = worker.pipeline.Metrics(0).Snapshot();
+  return res;
+}
+
+// threads workers, each pinned to a CPU of its own (as far as there
+// are enough) and starting at a different point of the stream, run
+// until the main thread calls time
+static LoadResult RunPool(const LoadProgram& prog, const LoadStream& stream,
+                          uint64_t durationNs, unsigned threads,
+                          const std::vector<int>& cpus)
+{
+  std::vector<std::unique_ptr<LoadWorker>> workers;
+  for (unsigned t = 0; t < threads; t++)
+  {
+    size_t first = stream.packets.size() / threads * t;
+    workers.push_back(std::unique_ptr<LoadWorker>(new LoadWorker(prog, stream, first)));
+    workers.back()->pipeline.SetCpu(t);
+  }
+
+  std::atomic<unsigned> ready(0);
+  std::atomic<bool> go(false);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; t++)
+  {
+    pool.push_back(std::thread([&, t]()
+    {
+      PinToCpu(cpus[t % cpus.size()]);
+      LoadWorker& w = *workers[t];
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire))
+      {
+        sched_yield();
+      }
+      while (!stop.load(std::memory_order_relaxed))
+      {
+        w.Chunk();
+      }
+    }));
+  }
+
+  while (ready.load() < threads)
+  {
+    sched_yield();
+  }
+  uint64_t start = MetricsNow();
+  go.store(true, std::memory_order_release);
+  usleep(durationNs / 1000);
+  stop.store(true);
+  for (std::thread& th : pool)
+  {
+    th.join();
+  }
+  uint64_t end = MetricsNow();
+
+  LoadResult res;
+  res.packets = 0;
+  res.ns = end - start;
+  res.threads = threads;
+  memset(&res.metrics, 0, sizeof(res.metrics));
+  for (const std::unique_ptr<LoadWorker>& w : workers)
+  {
+    res.packets += w->done;
+    MergeSnapshot(res.metrics, w->pipeline.Metrics(0).Snapshot());
+  }
+  return res;
+}
+
+/* ------------------------- Reports ---------------------------- */
+
+static void PrintHeader()
+{
+  printf("%-8s %7s %12s %9s %8s %7s %7s %7s %8s\n", "path", "threads",
+         "packets", "Mpps", "ns/pkt", "p50", "p99", "p999", "speedup");
+}
+
+// ns/pkt is CPU time per packet: wall time times threads. Latencies
+// are of single runs, including reading the clock.
+static void PrintResult(const char* path, const LoadResult& res, double basePps)
+{
+  double pps = res.ns ? res.packets * 1e9 / res.ns : 0.0;
+  const MetricsSnapshot& m = res.metrics;
+  char speedup[16] = "-";
+  if (basePps > 0)
+  {
+    snprintf(speedup, sizeof(speedup), "%.2fx", pps / basePps);
+  }
+  printf("%-8s %7u %12lu %9.2f %8.1f %7lu %7lu %7lu %8s\n", path, res.threads,
+         (unsigned long)res.packets, pps / 1e6,
+         res.packets ? (double)res.ns * res.threads / res.packets : 0.0,
+         (unsigned long)m.Percentile(0.5), (unsigned long)m.Percentile(0.99),
+         (unsigned long)m.Percentile(0.999), speedup);
+}
+
+static void PrintVerdicts(const MetricsSnapshot& m)
+{
+  printf("verdicts:");
+  for (size_t i = 0; i < METRICS_VERDICTS; i++)
+  {
+    if (m.verdicts[i])
+    {
+      printf(" %zu%s %.1f%%", i, i == METRICS_VERDICTS - 1 ? "+" : "",
+             100.0 * m.verdicts[i] / m.runs);
+    }
+  }
+  uint64_t faults = m.runs - m.errors[VM_OK];
+  printf(", faults %.1f%%\n\n", m.runs ? 100.0 * faults / m.runs : 0.0);
+}
+
+/* -------------------------- Options --------------------------- */
+
+// "tcp:70,udp:25,icmp:5"
+static bool ParseMix(const char* arg, double* mix)
+{
+  std::fill(mix, mix + PROTOS, 0.0);
+  std::string s = arg;
+  size_t pos = 0;
+  while (pos < s.size())
+  {
+    size_t end = s.find(',', pos);
+    std::string item = s.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    pos = (end == std::string::npos) ? s.size() : end + 1;
+
+    size_t colon = item.find(':');
+    if (colon == std::string::npos)
+    {
+      return false;
+    }
+    std::string name = item.substr(0, colon);
+    int p = 0;
+    while (p < PROTOS && name != protoNames[p])
+    {
+      p++;
+    }
+    if (p == PROTOS)
+    {
+      return false;
+    }
+    mix[p] = atof(item.c_str() + colon + 1);
+  }
+  return mix[PROTO_TCP] + mix[PROTO_UDP] + mix[PROTO_ICMP] > 0;
+}
+
+// "64-1500", "512" or "imix" (7:4:1 of 64, 576 and 1500 byte frames)
+static bool ParseSizes(const char* arg, LoadConfig& cfg)
+{
+  cfg.sizes.clear();
+  cfg.maxSize = 0;
+  if (strcmp(arg, "imix") == 0)
+  {
+    cfg.sizes.insert(cfg.sizes.end(), 7, 64);
+    cfg.sizes.insert(cfg.sizes.end(), 4, 576);
+    cfg.sizes.insert(cfg.sizes.end(), 1, 1500);
+    return true;
+  }
+  unsigned lo, hi;
+  int n = sscanf(arg, "%u-%u", &lo, &hi);
+  if (n == 1)
+  {
+    hi = lo;
+  }
+  if (n < 1 || lo < 64 || hi < lo || hi > 9000)
+  {
+    return false;
+  }
+  cfg.minSize = lo;
+  cfg.maxSize = hi;
+  return true;
+}
+
+static void Usage(const char* argv0)
+{
+  printf("Usage: %s [-n packets] [-F flows] [-z skew] [-m mix] [-l sizes]\n"
+         "       [-t threads] [-d ms] [-f program] [-c tenants] [-b filter]\n"
+         "       [-e engine] [-a aotdir] [-r seed]\n"
+         "  -n  packets in the stream, replayed in a loop (default: 65536)\n"
+         "  -F  distinct flows (default: 1024)\n"
+         "  -z  Zipf exponent of traffic over flows, 0 is uniform (default: 1.0)\n"
+         "  -m  protocol mix (default: tcp:70,udp:25,icmp:5)\n"
+         "  -l  frame sizes: min-max, one size or imix (default: 64-1500)\n"
+         "  -t  most worker threads in the pool (default: CPUs available)\n"
+         "  -d  run time of each measurement in ms (default: 500)\n"
+         "  -f  program to run on packets, assembly (default: built-in filter)\n"
+         "  -c  run this many tenant filters merged into one program instead\n"
+         "  -b  run a classic BPF filter instead, as tcpdump -dd or -ddd prints it\n"
+         "  -e  engine: interp or aot (default: interp)\n"
+         "  -a  directory for compiled programs (default: $XDG_CACHE_HOME/ebpf)\n"
+         "  -r  random seed (default: 1)\n", argv0);
+}
+
+int main(int argc, char** argv)
+{
+  LoadConfig cfg;
+  cfg.packets = 65536;
+  cfg.flows = 1024;
+  cfg.skew = 1.0;
+  ParseMix("tcp:70,udp:25,icmp:5", cfg.mix);
+  ParseSizes("64-1500", cfg);
+  cfg.seed = 1;
+
+  std::vector<int> cpus = AllowedCpus();
+  unsigned maxThreads = cpus.size();
+  uint64_t durationMs = 500;
+  std::string source;
+  std::string engine = "interp";
+  std::string aotDir;
+  size_t tenants = 0;
+  std::string classic;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:F:z:m:l:t:d:f:c:b:e:a:r:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': cfg.packets = strtoul(optarg, NULL, 10); break;
+      case 'F': cfg.flows = strtoul(optarg, NULL, 10); break;
+      case 'z': cfg.skew = atof(optarg); break;
+      case 'm':
+        if (!ParseMix(optarg, cfg.mix))
+        {
+          printf("Bad protocol mix: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'l':
+        if (!ParseSizes(optarg, cfg))
+        {
+          printf("Bad frame sizes: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 't': maxThreads = strtoul(optarg, NULL, 10); break;
+      case 'd': durationMs = strtoul(optarg, NULL, 10); break;
+      case 'f': source = optarg; break;
+      case 'c': tenants = strtoul(optarg, NULL, 10); break;
+      case 'b': classic = optarg; break;
+      case 'e': engine = optarg; break;
+      case 'a': aotDir = optarg; break;
+      case 'r': cfg.seed = strtoull(optarg, NULL, 10); break;
+      default: Usage(argv[0]); return 1;
+    }
+  }
+
+  if (cfg.packets == 0 || cfg.flows == 0 || maxThreads == 0
+          || (engine != "interp" && engine != "aot")
+          || (!source.empty() + !classic.empty() + (tenants > 0) > 1))
+  {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  LoadProgram prog;
+  Classifier classifier;
+  if (tenants)
+  {
+    std::vector<std::vector<uint64_t>> filters;
+    for (size_t i = 0; i < tenants; i++)
+    {
+      filters.push_back(TenantFilter(i));
+    }
+    std::string error;
+    if (!classifier.Compile(filters, &error))
+    {
+      printf("Could not merge the tenant filters: %s\n", error.c_str());
+      return 1;
+    }
+    prog.bytecode = classifier.Program();
+  }
+  else if (!classic.empty())
+  {
+    std::ifstream in(classic);
+    std::stringstream text;
+    text << in.rdbuf();
+    std::vector<ClassicInsn> filter;
+    std::string error = "cannot read it";
+    if (in && ParseClassic(text.str(), filter, &error))
+    {
+      prog.bytecode = TranslateClassic(filter, &error);
+    }
+    if (prog.bytecode.empty())
+    {
+      printf("Could not load %s: %s\n", classic.c_str(), error.c_str());
+      return 1;
+    }
+  }
+  else
+  {
+    prog.bytecode = source.empty() ? DefaultFilter() : assemble(source);
+  }
+  if (prog.bytecode.empty())
+  {
+    printf("No program to run\n");
+    return 1;
+  }
+  if (engine == "aot")
+  {
+    if (aotDir.empty())
+    {
+      aotDir = AotCacheDir();
+    }
+    prog.native.reset(new AotProgram());
+    std::string error = "no directory for it";
+    if (aotDir.empty() || !prog.native->Compile(prog.bytecode, aotDir + "/ebpf_loadgen.so",
+                                                false, false, &error))
+    {
+      printf("Could not compile the program: %s\n", error.c_str());
+      return 1;
+    }
+  }
+
+  LoadStream stream;
+  Generate(cfg, stream);
+
+  printf("stream: %zu packets, %zu flows, zipf %.2f, %.1f bytes/packet,",
+         cfg.packets, cfg.flows, cfg.skew, (double)stream.bytes / cfg.packets);
+  for (int p = 0; p < PROTOS; p++)
+  {
+    printf(" %s %.1f%%", protoNames[p], 100.0 * stream.perProto[p] / cfg.packets);
+  }
+  if (tenants)
+  {
+    printf("\nprogram: %zu tenant filters merged, %zu insns, %zu trie nodes, "
+           "%zu paths, %s\n", classifier.Filters(), prog.bytecode.size(),
+           classifier.Nodes(), classifier.Paths(), engine.c_str());
+  }
+  else if (!classic.empty())
+  {
+    printf("\nprogram: %s, classic, %zu insns, %s\n", classic.c_str(),
+           prog.bytecode.size(), engine.c_str());
+  }
+  else
+  {
+    printf("\nprogram: %s, %zu insns, %s\n",
+           source.empty() ? "built-in filter" : source.c_str(),
+           prog.bytecode.size(), engine.c_str());
+  }
+
+  uint64_t durationNs = durationMs * 1000000;
+
+  // a pass over the stream to fault in its pages and warm the caches
+  PinToCpu(cpus[0]);
+  RunBatch(prog, stream, durationNs / 10);
+
+  LoadResult single = RunSingle(prog, stream, durationNs);
+  PrintVerdicts(single.metrics);
+
+  PrintHeader();
+  PrintResult("single", single, 0);
+  PrintResult("batch", RunBatch(prog, stream, durationNs), 0);
+
+  // 1, 2, 4, ... threads and maxThreads, against one worker
+  double basePps = 0;
+  for (unsigned t = 1; ; t = std::min(t * 2, maxThreads))
+  {
+    LoadResult res = RunPool(prog, stream, durationNs, t, cpus);
+    if (t == 1)
+    {
+      basePps = res.ns ? res.packets * 1e9 / res.ns : 0.0;
+    }
+    PrintResult("pool", res, basePps);
+    if (t == maxThreads)
+    {
+      break;
+    }
+  }
+  if (maxThreads > cpus.size())
+  {
+    printf("\n%u threads on %zu CPUs, threads share CPUs\n", maxThreads, cpus.size());
+  }
+
+  return 0;
+}
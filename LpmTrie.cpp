@@ -0,0 +1,190 @@
+#include "LpmTrie.h"
+
+#include <cerrno>
+#include <cstring>
+
+LpmTrieMap::Node::Node()
+{
+  for (Slot& s : slots)
+  {
+    s.child.store(nullptr, std::memory_order_relaxed);
+    s.leaf.store(NIL, std::memory_order_relaxed);
+  }
+  for (uint32_t& p : prefixes)
+  {
+    p = NIL;
+  }
+}
+
+LpmTrieMap::LpmTrieMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries)
+: Map(BPF_MAP_TYPE_LPM_TRIE, keySize, valueSize, maxEntries),
+  dataSize(keySize > 4 && keySize - 4 <= LPM_MAX_DATA ? keySize - 4 : 0),
+  stride((valueSize + 7) & ~7ULL),
+  values(stride / sizeof(uint64_t) * maxEntries, 0)
+{
+  // handed out from the back, lowest index first
+  for (uint32_t i = maxEntries; i > 0; i--)
+  {
+    freeList.push_back(i - 1);
+  }
+  nodes.push_back(std::unique_ptr<Node>(new Node()));
+  root = nodes[0].get();
+  writer.store(0, std::memory_order_relaxed);
+}
+
+LpmTrieMap::~LpmTrieMap()
+{
+
+}
+
+bool LpmTrieMap::Parse(const void* key, const uint8_t*& data,
+                       uint32_t& prefixLen) const
+{
+  const uint8_t* k = static_cast<const uint8_t*>(key);
+  memcpy(&prefixLen, k, sizeof(prefixLen));
+  data = k + sizeof(prefixLen);
+  return dataSize && prefixLen <= dataSize * 8;
+}
+
+// Node of the level levels down the path of data, nullptr if there is
+// none yet and create is not set. Caller holds the writer lock.
+LpmTrieMap::Node* LpmTrieMap::Walk(const uint8_t* data, uint32_t levels,
+                                   bool create)
+{
+  Node* node = root;
+  for (uint32_t level = 0; level < levels && node; level++)
+  {
+    Slot& s = node->slots[data[level]];
+    Node* child = s.child.load(std::memory_order_relaxed);
+    if (!child && create)
+    {
+      nodes.push_back(std::unique_ptr<Node>(new Node()));
+      child = nodes.back().get();
+      // the node is complete before readers can reach it
+      s.child.store(child, std::memory_order_release);
+    }
+    node = child;
+  }
+  return node;
+}
+
+// Refill the slots covered by the prefix at index of node, each with
+// the longest prefix of the node that still covers it
+void LpmTrieMap::Expand(Node& node, uint32_t bits, uint32_t index)
+{
+  uint32_t span = 1U << (LPM_STRIDE - bits);
+  uint32_t first = (index & ((1U << bits) - 1)) << (LPM_STRIDE - bits);
+
+  for (uint32_t slot = first; slot < first + span; slot++)
+  {
+    uint32_t best = NIL;
+    for (int len = LPM_STRIDE; len >= 0 && best == NIL; len--)
+    {
+      best = node.prefixes[(1U << len) | (slot >> (LPM_STRIDE - len))];
+    }
+    node.slots[slot].leaf.store(best, std::memory_order_release);
+  }
+}
+
+// The stride splits a prefix into the levels it passes through whole
+// and the bits it ends with, 1 to LPM_STRIDE of them (0 only for /0).
+// Returns its index in the prefixes of the node it ends in.
+static uint32_t Split(const uint8_t* data, uint32_t prefixLen,
+                      uint32_t& levels, uint32_t& bits)
+{
+  levels = prefixLen ? (prefixLen - 1) / LPM_STRIDE : 0;
+  bits = prefixLen - levels * LPM_STRIDE;
+  return (1U << bits) | (data[levels] >> (LPM_STRIDE - bits));
+}
+
+void* LpmTrieMap::Lookup(const void* key)
+{
+  if (!dataSize)
+  {
+    return nullptr;
+  }
+  const uint8_t* data = static_cast<const uint8_t*>(key) + sizeof(uint32_t);
+
+  uint32_t best = NIL;
+  const Node* node = root;
+  for (uint32_t level = 0; level < dataSize && node; level++)
+  {
+    // deeper levels hold longer prefixes
+    const Slot& s = node->slots[data[level]];
+    uint32_t leaf = s.leaf.load(std::memory_order_acquire);
+    if (leaf != NIL)
+    {
+      best = leaf;
+    }
+    node = s.child.load(std::memory_order_acquire);
+  }
+
+  return (best != NIL) ? ValueAt(best) : nullptr;
+}
+
+int LpmTrieMap::Update(const void* key, const void* value, uint64_t flags)
+{
+  const uint8_t* data;
+  uint32_t prefixLen;
+  if (flags > BPF_EXIST || !Parse(key, data, prefixLen))
+  {
+    return -EINVAL;
+  }
+  uint32_t levels, bits;
+  uint32_t index = Split(data, prefixLen, levels, bits);
+
+  SpinLock lock(writer);
+  Node* node = Walk(data, levels, false);
+  uint32_t i = node ? node->prefixes[index] : NIL;
+  if (i != NIL)
+  {
+    if (flags == BPF_NOEXIST)
+    {
+      return -EEXIST;
+    }
+    memcpy(ValueAt(i), value, valueSize);
+    return 0;
+  }
+  if (flags == BPF_EXIST)
+  {
+    return -ENOENT;
+  }
+  if (freeList.empty())
+  {
+    return -E2BIG;
+  }
+
+  i = freeList.back();
+  freeList.pop_back();
+  memcpy(ValueAt(i), value, valueSize);
+
+  node = Walk(data, levels, true);
+  node->prefixes[index] = i;
+  Expand(*node, bits, index);
+  return 0;
+}
+
+int LpmTrieMap::Delete(const void* key)
+{
+  const uint8_t* data;
+  uint32_t prefixLen;
+  if (!Parse(key, data, prefixLen))
+  {
+    return -EINVAL;
+  }
+  uint32_t levels, bits;
+  uint32_t index = Split(data, prefixLen, levels, bits);
+
+  SpinLock lock(writer);
+  Node* node = Walk(data, levels, false);
+  uint32_t i = node ? node->prefixes[index] : NIL;
+  if (i == NIL)
+  {
+    return -ENOENT;
+  }
+
+  node->prefixes[index] = NIL;
+  Expand(*node, bits, index);
+  freeList.push_back(i);
+  return 0;
+}
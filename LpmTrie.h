@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Maps.h"
+
+// Longest address a key can hold (IPv6), in bytes
+#define LPM_MAX_DATA 16
+
+// Address bits consumed by each level of the trie
+#define LPM_STRIDE 8
+#define LPM_FANOUT (1 << LPM_STRIDE)
+
+// Longest prefix match over addresses, for ACLs and routing tables.
+//
+// Keys are laid out as in the kernel's struct bpf_lpm_trie_key:
+//   uint32_t prefixlen - in bits, host byte order
+//   uint8_t  data[]    - the address, network byte order
+// so keySize is 4 plus the address size (8 for IPv4, 20 for IPv6).
+// Update and Delete act on the prefix data/prefixlen; Lookup returns
+// the value of the longest stored prefix covering data, whatever the
+// key's prefixlen (programs pass full addresses).
+//
+// A multibit trie of LPM_STRIDE bits per level with prefixes expanded
+// into the slots they cover, so a lookup reads one slot of every level
+// it passes through and takes no branch per bit: at most 4 slots for
+// IPv4 and 16 for IPv6, each within one cache line. Every slot holds
+// the best prefix ending at its level and the next level's node.
+//
+// Lookups take no lock and can run while the host updates the map.
+// Writers are serialised by a spin lock and publish a value before the
+// slots pointing at it. Nodes emptied by Delete stay in place for later
+// prefixes and are freed with the map. Values live in one preallocated
+// region of maxEntries slots; as with HashMap a value handed out by
+// Lookup may be reused once its prefix is deleted.
+class LpmTrieMap : public Map
+{
+private:
+  static const uint32_t NIL = 0xffffffff;
+
+  struct Node;
+
+  struct Slot
+  {
+    std::atomic<Node*> child;
+    std::atomic<uint32_t> leaf; // value index, NIL if no prefix
+  };
+
+  struct Node
+  {
+    Slot slots[LPM_FANOUT];
+    // Writer only: prefixes ending at this level, by (1 << bits) |
+    // their last bits bits (0 to LPM_STRIDE of them)
+    uint32_t prefixes[2 * LPM_FANOUT];
+
+    Node();
+  };
+
+  uint32_t dataSize;  // address bytes, 0 if keySize is not supported
+  uint64_t stride;
+  std::vector<uint64_t> values;
+  std::vector<uint32_t> freeList; // value indices not in use
+
+  Node* root;
+  std::vector<std::unique_ptr<Node>> nodes; // writer only, owns them all
+  std::atomic<uint32_t> writer;
+
+  uint8_t* ValueAt(uint32_t i)
+  {
+    return reinterpret_cast<uint8_t*>(values.data()) + i * stride;
+  };
+  bool Parse(const void* key, const uint8_t*& data, uint32_t& prefixLen) const;
+  Node* Walk(const uint8_t* data, uint32_t levels, bool create);
+  void Expand(Node&, uint32_t bits, uint32_t index);
+
+public:
+  LpmTrieMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries);
+  ~LpmTrieMap();
+
+  void* Lookup(const void* key);
+  int Update(const void* key, const void* value, uint64_t flags);
+  int Delete(const void* key);
+
+  uint8_t* Values() {return reinterpret_cast<uint8_t*>(values.data());};
+  uint64_t ValuesSize() const {return stride * maxEntries;};
+
+  size_t Nodes() const {return nodes.size();};
+};
@@ -0,0 +1,194 @@
+#include "MapPin.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+// Copies of every value and memory size of a map of type, 0 if it
+// cannot be pinned
+static uint64_t PinnedSize(uint32_t type, uint32_t keySize, uint32_t valueSize,
+                           uint32_t maxEntries, uint32_t& cpus)
+{
+  switch (type)
+  {
+    case BPF_MAP_TYPE_ARRAY:
+    case BPF_MAP_TYPE_PERCPU_ARRAY:
+      cpus = (type == BPF_MAP_TYPE_PERCPU_ARRAY) ? PossibleCpus() : 1;
+      if (keySize != sizeof(uint32_t))
+      {
+        return 0;
+      }
+      return ArrayMap::MemorySize(valueSize, maxEntries, cpus);
+    case BPF_MAP_TYPE_HASH:
+    case BPF_MAP_TYPE_PERCPU_HASH:
+    case BPF_MAP_TYPE_LRU_HASH:
+      cpus = (type == BPF_MAP_TYPE_PERCPU_HASH) ? PossibleCpus() : 1;
+      if (keySize == 0)
+      {
+        return 0;
+      }
+      return HashMap::MemorySize(keySize, valueSize, maxEntries, cpus);
+    default:
+      return 0;
+  }
+}
+
+// 0 if header describes the map asked for, -EPROTO if it is of another
+// layout version
+static int CheckHeader(const MapPinHeader& header, uint32_t type,
+                       uint32_t keySize, uint32_t valueSize,
+                       uint32_t maxEntries, uint32_t cpus, uint64_t size)
+{
+  if (header.magic != MAP_PIN_MAGIC)
+  {
+    return -EINVAL;
+  }
+  if (header.version != MAP_PIN_VERSION)
+  {
+    return -EPROTO;
+  }
+  if (header.type != type || header.keySize != keySize
+          || header.valueSize != valueSize || header.maxEntries != maxEntries
+          || header.cpus != cpus || header.size != size)
+  {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static Map* NewMap(uint32_t type, uint32_t keySize, uint32_t valueSize,
+                   uint32_t maxEntries, uint32_t cpus, MapMemory&& memory)
+{
+  switch (type)
+  {
+    case BPF_MAP_TYPE_ARRAY:
+      return new ArrayMap(valueSize, maxEntries, std::move(memory));
+    case BPF_MAP_TYPE_PERCPU_ARRAY:
+      return new PerCpuArrayMap(valueSize, maxEntries, cpus, std::move(memory));
+    case BPF_MAP_TYPE_HASH:
+      return new HashMap(keySize, valueSize, maxEntries, std::move(memory));
+    case BPF_MAP_TYPE_PERCPU_HASH:
+      return new PerCpuHashMap(keySize, valueSize, maxEntries, cpus,
+                               std::move(memory));
+    default:
+      return new LruHashMap(keySize, valueSize, maxEntries, PossibleCpus(),
+                            std::move(memory));
+  }
+}
+
+// Open and lock the file and read its header and length, attached if
+// it holds a finished header; otherwise make it fileSize bytes of zeroes
+static int OpenFile(const std::string& path, uint64_t fileSize, int& fd,
+                    MapPinHeader& header, uint64_t& length, bool& attached)
+{
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    return -errno;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    return (errno == EWOULDBLOCK) ? -EBUSY : -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    return -errno;
+  }
+  memset(&header, 0, sizeof(header));
+  if (st.st_size > 0 && pread(fd, &header, sizeof(header), 0) < 0)
+  {
+    return -errno;
+  }
+  length = st.st_size;
+  attached = (header.magic != 0);
+  if (attached)
+  {
+    return 0;
+  }
+
+  // new, or left unfinished: start from zeroes, with the blocks
+  // allocated so a full disk fails here rather than on a store
+  if (ftruncate(fd, 0) != 0)
+  {
+    return -errno;
+  }
+  return -posix_fallocate(fd, 0, fileSize);
+}
+
+Map* PinMap(const std::string& path, uint32_t type, uint32_t keySize,
+            uint32_t valueSize, uint32_t maxEntries, int* err, bool* attached)
+{
+  int unused;
+  bool existing = false;
+  err = err ? err : &unused;
+
+  uint32_t cpus;
+  uint64_t size = PinnedSize(type, keySize, valueSize, maxEntries, cpus);
+  if (size == 0)
+  {
+    *err = -EINVAL;
+    return nullptr;
+  }
+  uint64_t fileSize = MAP_PIN_HEADER_SZ + size;
+
+  int fd = -1;
+  MapPinHeader found;
+  uint64_t length = 0;
+  *err = OpenFile(path, fileSize, fd, found, length, existing);
+  if (*err == 0 && existing)
+  {
+    *err = CheckHeader(found, type, keySize, valueSize, maxEntries, cpus, size);
+    if (*err == 0 && length != fileSize)
+    {
+      *err = -EINVAL; // truncated, would fault on access
+    }
+  }
+  void* mem = MAP_FAILED;
+  if (*err == 0)
+  {
+    mem = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | (existing ? MAP_POPULATE : 0), fd, 0);
+    *err = (mem == MAP_FAILED) ? -errno : 0;
+  }
+  if (*err != 0)
+  {
+    if (mem != MAP_FAILED)
+    {
+      munmap(mem, fileSize);
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return nullptr;
+  }
+
+  MapPinHeader* header = static_cast<MapPinHeader*>(mem);
+  Map* map = NewMap(type, keySize, valueSize, maxEntries, cpus,
+                    MapMemory(fd, static_cast<uint8_t*>(mem), fileSize,
+                              MAP_PIN_HEADER_SZ, existing));
+  if (!existing)
+  {
+    // the map has set up its memory, the file is complete
+    header->version = MAP_PIN_VERSION;
+    header->type = type;
+    header->keySize = keySize;
+    header->valueSize = valueSize;
+    header->maxEntries = maxEntries;
+    header->cpus = cpus;
+    header->size = size;
+    __atomic_store_n(&header->magic, MAP_PIN_MAGIC, __ATOMIC_RELEASE);
+  }
+  if (attached)
+  {
+    *attached = existing;
+  }
+  return map;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "Maps.h"
+
+// Version of the layout of pinned map files. Bump it whenever the memory
+// layout of a map that can be pinned, or the hash of HashMap, changes,
+// so files written by another build are refused instead of misread.
+#define MAP_PIN_VERSION 1
+#define MAP_PIN_MAGIC   0x0050414d46504245ULL // "EBPFMAP"
+
+// The header fills a page, the map's memory follows page aligned
+#define MAP_PIN_HEADER_SZ 4096
+
+// Start of a pinned map file
+struct MapPinHeader
+{
+  uint64_t magic;   // written last, a file without it is created anew
+  uint32_t version;
+  uint32_t type;
+  uint32_t keySize;
+  uint32_t valueSize;
+  uint32_t maxEntries;
+  uint32_t cpus;    // copies of every value
+  uint64_t size;    // bytes of map memory after the header
+};
+
+// Map of type whose state lives in the file at path, so it survives
+// restarts and upgrades of the process. The file is created if it does
+// not exist yet; otherwise the map attaches to it as it is, without
+// copying or rebuilding anything, if its header matches the version
+// and the parameters (per-CPU maps have PossibleCpus() copies).
+// Attaching maps the file in whole, so lookups do not fault later.
+//
+// Array, hash, per-CPU and LRU hash maps can be pinned. A file is used
+// by one map at a time, held with an flock. Its contents are as fresh
+// as the page cache: they survive the process exiting or crashing
+// (hash chains are checked on attach), not a crash of the machine.
+// Remove the file to start over.
+//
+// Returns nullptr and a negative errno value in err on failure: EINVAL
+// if the file is not a map file of this type and parameters, EPROTO if
+// it has another layout version, EBUSY if another map uses it. attached
+// tells whether an existing map was attached.
+Map* PinMap(const std::string& path, uint32_t type, uint32_t keySize,
+            uint32_t valueSize, uint32_t maxEntries, int* err = nullptr,
+            bool* attached = nullptr);
@@ -0,0 +1,846 @@
+#include "Maps.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+// Buckets for a hash map, a power of two with one per entry or more
+static uint32_t BucketCount(uint32_t maxEntries)
+{
+  uint32_t n = 1;
+  while (n < maxEntries)
+  {
+    n <<= 1;
+  }
+  return n;
+}
+
+// The CPU a lookup or update from a program refers to, cpus if none
+static uint32_t CopyOf(uint32_t cpu, uint32_t cpus)
+{
+  if (cpus == 1)
+  {
+    return 0;
+  }
+  return (cpu < cpus) ? cpu : cpus;
+}
+
+// Update of every copy at once
+static const uint32_t ALL_CPUS = 0xffffffff;
+
+// Offset of an array of size bytes placed at end of a map's memory,
+// which it moves past the array. Arrays start on lines of their own.
+static uint64_t Carve(uint64_t& end, uint64_t size)
+{
+  uint64_t at = end;
+  end = (end + size + MAP_CPU_ALIGN - 1) & ~(uint64_t)(MAP_CPU_ALIGN - 1);
+  return at;
+}
+
+uint32_t PossibleCpus()
+{
+  long n = sysconf(_SC_NPROCESSORS_CONF);
+  return n > 0 ? n : 1;
+}
+
+Map::Map(uint32_t type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries)
+: type(type), keySize(keySize), valueSize(valueSize), maxEntries(maxEntries),
+  cpus(1)
+{
+  
+}
+
+Map::~Map()
+{
+  
+}
+
+int Map::LookupAll(const void* key, void* out)
+{
+  uint64_t stride = (valueSize + 7) & ~7ULL;
+  uint8_t* dst = static_cast<uint8_t*>(out);
+  for (uint32_t cpu = 0; cpu < cpus; cpu++)
+  {
+    const void* value = LookupCpu(key, cpu);
+    if (!value)
+    {
+      return -ENOENT;
+    }
+    memcpy(dst + cpu * stride, value, valueSize);
+    memset(dst + cpu * stride + valueSize, 0, stride - valueSize);
+  }
+  return 0;
+}
+
+int Map::Sum(const void* key, uint64_t* out)
+{
+  uint32_t words = (valueSize + 7) / 8;
+  memset(out, 0, words * sizeof(uint64_t));
+  for (uint32_t cpu = 0; cpu < cpus; cpu++)
+  {
+    const uint8_t* value = static_cast<const uint8_t*>(LookupCpu(key, cpu));
+    if (!value)
+    {
+      return -ENOENT;
+    }
+    // a partial last word counts its valueSize bytes only
+    for (uint32_t w = 0; w < words; w++)
+    {
+      uint64_t v = 0;
+      memcpy(&v, value + w * 8, std::min(valueSize - w * 8, 8U));
+      out[w] += v;
+    }
+  }
+  return 0;
+}
+
+/* ------------------------- Memory ---------------------------- */
+
+MapMemory::MapMemory(uint64_t size)
+: mapping(nullptr), mappingSize(size), base(nullptr), size(size), fd(-1),
+  attached(false)
+{
+  if (size == 0)
+  {
+    return;
+  }
+  void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    throw std::bad_alloc();
+  }
+  mapping = base = static_cast<uint8_t*>(mem);
+}
+
+MapMemory::MapMemory(int fd, uint8_t* mapping, uint64_t mappingSize,
+                     uint64_t offset, bool attached)
+: mapping(mapping), mappingSize(mappingSize), base(mapping + offset),
+  size(mappingSize - offset), fd(fd), attached(attached)
+{
+  
+}
+
+MapMemory::MapMemory(MapMemory&& other)
+: mapping(other.mapping), mappingSize(other.mappingSize), base(other.base),
+  size(other.size), fd(other.fd), attached(other.attached)
+{
+  other.mapping = nullptr;
+  other.fd = -1;
+}
+
+MapMemory::~MapMemory()
+{
+  if (mapping)
+  {
+    munmap(mapping, mappingSize);
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+/* ------------------------- Values ---------------------------- */
+
+MapValues::MapValues(uint32_t valueSize, uint32_t maxEntries, uint32_t cpus)
+: stride((valueSize + 7) & ~7ULL), cpus(cpus), base(nullptr)
+{
+  // a single copy keeps its exact size, so accesses past the last
+  // value fault
+  cpuStride = stride * maxEntries;
+  if (cpus > 1)
+  {
+    cpuStride = (cpuStride + MAP_CPU_ALIGN - 1) & ~(uint64_t)(MAP_CPU_ALIGN - 1);
+  }
+}
+
+/* ---------------------- Program array ------------------------ */
+
+ProgArrayMap::ProgArrayMap(uint32_t maxEntries)
+: Map(BPF_MAP_TYPE_PROG_ARRAY, sizeof(uint32_t), 
+        sizeof(const std::vector<uint64_t>*), maxEntries),
+  progs(maxEntries)
+{
+  for (auto& slot : progs)
+  {
+    slot.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+// Returns nullptr for empty slots, so the result is never
+// a pointer to a null program
+void* ProgArrayMap::Lookup(const void* key)
+{
+  uint32_t index = *static_cast<const uint32_t*>(key);
+  if (index >= maxEntries || !progs[index].load(std::memory_order_acquire))
+  {
+    return nullptr;
+  }
+  
+  return &progs[index];
+}
+
+int ProgArrayMap::Update(const void* key, const void* value, uint64_t flags)
+{
+  uint32_t index = *static_cast<const uint32_t*>(key);
+  const std::vector<uint64_t>* prog = 
+          *static_cast<const std::vector<uint64_t>* const*>(value);
+  
+  return Set(index, prog);
+}
+
+int ProgArrayMap::Delete(const void* key)
+{
+  uint32_t index = *static_cast<const uint32_t*>(key);
+  
+  return Set(index, nullptr);
+}
+
+int ProgArrayMap::Set(uint32_t index, const std::vector<uint64_t>* prog)
+{
+  if (index >= maxEntries)
+  {
+    return -E2BIG;
+  }
+  
+  progs[index].store(prog, std::memory_order_release);
+  return 0;
+}
+
+/* -------------------------- Array ---------------------------- */
+
+ArrayMap::ArrayMap(uint32_t valueSize, uint32_t maxEntries)
+: ArrayMap(valueSize, maxEntries,
+           MapMemory(MemorySize(valueSize, maxEntries, 1)))
+{
+  
+}
+
+ArrayMap::ArrayMap(uint32_t valueSize, uint32_t maxEntries, MapMemory&& memory)
+: ArrayMap(BPF_MAP_TYPE_ARRAY, valueSize, maxEntries, 1, std::move(memory))
+{
+  
+}
+
+ArrayMap::ArrayMap(uint32_t type, uint32_t valueSize, uint32_t maxEntries,
+                   uint32_t cpus, MapMemory&& memory)
+: Map(type, sizeof(uint32_t), valueSize, maxEntries),
+  memory(std::move(memory)),
+  values(valueSize, maxEntries, cpus)
+{
+  this->cpus = cpus;
+  values.Place(this->memory.Base());
+}
+
+uint64_t ArrayMap::MemorySize(uint32_t valueSize, uint32_t maxEntries,
+                              uint32_t cpus)
+{
+  return MapValues(valueSize, maxEntries, cpus).Size();
+}
+
+void* ArrayMap::Lookup(const void* key)
+{
+  return LookupCpu(key, 0);
+}
+
+void* ArrayMap::LookupCpu(const void* key, uint32_t cpu)
+{
+  uint32_t index = *static_cast<const uint32_t*>(key);
+  cpu = CopyOf(cpu, cpus);
+  if (index >= maxEntries || cpu == cpus)
+  {
+    return nullptr;
+  }
+  
+  return values.At(index, cpu);
+}
+
+int ArrayMap::Update(const void* key, const void* value, uint64_t flags)
+{
+  return UpdateCpu(key, value, flags, ALL_CPUS);
+}
+
+int ArrayMap::UpdateCpu(const void* key, const void* value, uint64_t flags,
+                        uint32_t cpu)
+{
+  uint32_t index = *static_cast<const uint32_t*>(key);
+  if (index >= maxEntries)
+  {
+    return -E2BIG;
+  }
+  if (flags == BPF_NOEXIST)
+  {
+    // every element always exists
+    return -EEXIST;
+  }
+  
+  if (cpu == ALL_CPUS)
+  {
+    for (uint32_t c = 0; c < cpus; c++)
+    {
+      memcpy(values.At(index, c), value, valueSize);
+    }
+    return 0;
+  }
+  cpu = CopyOf(cpu, cpus);
+  if (cpu == cpus)
+  {
+    return -EINVAL;
+  }
+  memcpy(values.At(index, cpu), value, valueSize);
+  return 0;
+}
+
+int ArrayMap::Delete(const void*)
+{
+  return -EINVAL;
+}
+
+PerCpuArrayMap::PerCpuArrayMap(uint32_t valueSize, uint32_t maxEntries,
+                               uint32_t cpus)
+: PerCpuArrayMap(valueSize, maxEntries, cpus,
+                 MapMemory(MemorySize(valueSize, maxEntries, cpus ? cpus : 1)))
+{
+  
+}
+
+PerCpuArrayMap::PerCpuArrayMap(uint32_t valueSize, uint32_t maxEntries,
+                               uint32_t cpus, MapMemory&& memory)
+: ArrayMap(BPF_MAP_TYPE_PERCPU_ARRAY, valueSize, maxEntries, cpus ? cpus : 1,
+           std::move(memory))
+{
+  
+}
+
+/* --------------------------- Hash ---------------------------- */
+
+HashMap::Layout::Layout(uint32_t keySize, uint32_t valueSize,
+                        uint32_t maxEntries, uint32_t cpus)
+{
+  size = 0;
+  buckets = Carve(size, sizeof(Bucket) * BucketCount(maxEntries));
+  next = Carve(size, sizeof(std::atomic<uint32_t>) * maxEntries);
+  hashes = Carve(size, sizeof(uint64_t) * maxEntries);
+  keys = Carve(size, ((keySize + 7) & ~7ULL) * maxEntries);
+  values = Carve(size, MapValues(valueSize, maxEntries, cpus).Size());
+}
+
+uint64_t HashMap::MemorySize(uint32_t keySize, uint32_t valueSize,
+                             uint32_t maxEntries, uint32_t cpus)
+{
+  return Layout(keySize, valueSize, maxEntries, cpus).size;
+}
+
+HashMap::HashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries)
+: HashMap(keySize, valueSize, maxEntries,
+          MapMemory(MemorySize(keySize, valueSize, maxEntries, 1)))
+{
+  
+}
+
+HashMap::HashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+                 MapMemory&& memory)
+: HashMap(BPF_MAP_TYPE_HASH, keySize, valueSize, maxEntries, 1,
+          std::move(memory))
+{
+  
+}
+
+HashMap::HashMap(uint32_t type, uint32_t keySize, uint32_t valueSize,
+                 uint32_t maxEntries, uint32_t cpus, MapMemory&& memory)
+: Map(type, keySize, valueSize, maxEntries),
+  keyStride((keySize + 7) & ~7ULL),
+  bucketMask(BucketCount(maxEntries) - 1),
+  memory(std::move(memory)),
+  values(valueSize, maxEntries, cpus),
+  freeHead(NIL)
+{
+  this->cpus = cpus;
+  
+  Layout layout(keySize, valueSize, maxEntries, cpus);
+  uint8_t* base = this->memory.Base();
+  buckets = reinterpret_cast<Bucket*>(base + layout.buckets);
+  next = reinterpret_cast<std::atomic<uint32_t>*>(base + layout.next);
+  hashes = reinterpret_cast<uint64_t*>(base + layout.hashes);
+  keys = base + layout.keys;
+  values.Place(base + layout.values);
+  
+  if (!this->memory.Attached())
+  {
+    for (uint32_t b = 0; b <= bucketMask; b++)
+    {
+      buckets[b].head.store(NIL, std::memory_order_relaxed);
+    }
+  }
+  RebuildFree();
+  freeLock.store(0, std::memory_order_relaxed);
+}
+
+// Reset the locks and put every entry that is in no chain on the free
+// list. The chains of attached memory are checked on the way: a link to
+// an entry out of range, of another bucket or seen before ends the
+// chain, so a file left damaged costs entries, not consistency.
+void HashMap::RebuildFree()
+{
+  std::vector<uint8_t> linked(maxEntries, 0);
+  for (uint32_t b = 0; b <= bucketMask; b++)
+  {
+    Bucket& bucket = buckets[b];
+    bucket.lock.store(0, std::memory_order_relaxed);
+    bucket.seq.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint32_t>* link = &bucket.head; link->load(std::memory_order_relaxed) != NIL;
+         link = &next[link->load(std::memory_order_relaxed)])
+    {
+      uint32_t i = link->load(std::memory_order_relaxed);
+      if (i >= maxEntries || linked[i] || (hashes[i] & bucketMask) != b)
+      {
+        link->store(NIL, std::memory_order_relaxed);
+        break;
+      }
+      linked[i] = 1;
+    }
+  }
+  
+  // handed out lowest index first
+  freeHead = NIL;
+  for (uint32_t i = maxEntries; i > 0; i--)
+  {
+    if (!linked[i - 1])
+    {
+      next[i - 1].store(freeHead, std::memory_order_relaxed);
+      freeHead = i - 1;
+    }
+  }
+}
+
+// FNV-1a, keys are small and hashed whole
+uint64_t HashMap::Hash(const void* key) const
+{
+  const uint8_t* p = static_cast<const uint8_t*>(key);
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < keySize; i++)
+  {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Entry holding key in bucket b, NIL if none. Caller holds b's lock.
+uint32_t HashMap::Find(const Bucket& b, uint64_t hash, const void* key)
+{
+  for (uint32_t i = b.head.load(std::memory_order_relaxed); i != NIL;
+       i = next[i].load(std::memory_order_relaxed))
+  {
+    if (hashes[i] == hash && memcmp(KeyAt(i), key, keySize) == 0)
+    {
+      return i;
+    }
+  }
+  return NIL;
+}
+
+// The same without the lock. What the walk read only counts if b's
+// sequence did not change meanwhile; an entry deleted under it can
+// move to another chain, so walks are cut off after maxEntries steps.
+uint32_t HashMap::FindLockFree(const Bucket& b, uint64_t hash, const void* key)
+{
+  for (;;)
+  {
+    uint32_t seq = b.seq.load(std::memory_order_acquire);
+    if (seq & 1)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+      continue;
+    }
+    
+    uint32_t found = NIL;
+    uint32_t steps = 0;
+    for (uint32_t i = b.head.load(std::memory_order_relaxed);
+         i != NIL && steps <= maxEntries;
+         i = next[i].load(std::memory_order_relaxed), steps++)
+    {
+      if (hashes[i] == hash && memcmp(KeyAt(i), key, keySize) == 0)
+      {
+        found = i;
+        break;
+      }
+    }
+    
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (b.seq.load(std::memory_order_relaxed) == seq)
+    {
+      return found;
+    }
+  }
+}
+
+// Open and close a change to b's chain, the lock is held
+static void BeginChange(std::atomic<uint32_t>& seq)
+{
+  seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void EndChange(std::atomic<uint32_t>& seq)
+{
+  seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void* HashMap::Lookup(const void* key)
+{
+  return LookupCpu(key, 0);
+}
+
+uint32_t HashMap::LookupEntry(const void* key)
+{
+  uint64_t hash = Hash(key);
+  return FindLockFree(BucketOf(hash), hash, key);
+}
+
+void* HashMap::LookupCpu(const void* key, uint32_t cpu)
+{
+  cpu = CopyOf(cpu, cpus);
+  if (cpu == cpus)
+  {
+    return nullptr;
+  }
+  
+  uint32_t i = LookupEntry(key);
+  return (i != NIL) ? values.At(i, cpu) : nullptr;
+}
+
+// The host counts as CPU 0
+int HashMap::Update(const void* key, const void* value, uint64_t flags)
+{
+  return Upsert(key, value, flags, ALL_CPUS, 0);
+}
+
+int HashMap::UpdateCpu(const void* key, const void* value, uint64_t flags,
+                       uint32_t cpu)
+{
+  uint32_t copy = CopyOf(cpu, cpus);
+  if (copy == cpus)
+  {
+    return -EINVAL;
+  }
+  return Upsert(key, value, flags, cpus == 1 ? ALL_CPUS : copy, cpu);
+}
+
+uint32_t HashMap::Alloc(uint32_t)
+{
+  uint32_t i;
+  return TakeFree(&i, 1) ? i : NIL;
+}
+
+void HashMap::Free(uint32_t i)
+{
+  SpinLock freeList(freeLock);
+  next[i].store(freeHead, std::memory_order_relaxed);
+  freeHead = i;
+}
+
+uint32_t HashMap::TakeFree(uint32_t* out, uint32_t n)
+{
+  SpinLock freeList(freeLock);
+  uint32_t taken = 0;
+  while (taken < n && freeHead != NIL)
+  {
+    out[taken++] = freeHead;
+    freeHead = next[freeHead].load(std::memory_order_relaxed);
+  }
+  return taken;
+}
+
+// Set the copy of CPU copy, or every copy with ALL_CPUS, in an update
+// made on cpu
+int HashMap::Upsert(const void* key, const void* value, uint64_t flags,
+                    uint32_t copy, uint32_t cpu)
+{
+  if (flags > BPF_EXIST)
+  {
+    return -EINVAL;
+  }
+  
+  uint64_t hash = Hash(key);
+  Bucket& b = BucketOf(hash);
+  
+  // an entry for a new key is taken before locking the bucket, making
+  // room for it may need to lock others
+  uint32_t fresh = NIL;
+  for (;;)
+  {
+    {
+      SpinLock lock(b.lock);
+      uint32_t i = Find(b, hash, key);
+      if (i != NIL)
+      {
+        if (fresh != NIL)
+        {
+          Free(fresh); // inserted by someone else meanwhile
+        }
+        if (flags == BPF_NOEXIST)
+        {
+          return -EEXIST;
+        }
+        for (uint32_t c = 0; c < cpus; c++)
+        {
+          if (copy == ALL_CPUS || copy == c)
+          {
+            memcpy(values.At(i, c), value, valueSize);
+          }
+        }
+        return 0;
+      }
+      if (flags == BPF_EXIST)
+      {
+        return -ENOENT;
+      }
+      
+      if (fresh != NIL)
+      {
+        BeginChange(b.seq);
+        hashes[fresh] = hash;
+        memcpy(KeyAt(fresh), key, keySize);
+        next[fresh].store(b.head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        b.head.store(fresh, std::memory_order_relaxed);
+        EndChange(b.seq);
+        return 0;
+      }
+    }
+    
+    fresh = Alloc(cpu);
+    if (fresh == NIL)
+    {
+      return -E2BIG;
+    }
+    // the copies of other CPUs start out zeroed
+    for (uint32_t c = 0; c < cpus; c++)
+    {
+      if (copy == ALL_CPUS || copy == c)
+      {
+        memcpy(values.At(fresh, c), value, valueSize);
+      }
+      else
+      {
+        memset(values.At(fresh, c), 0, valueSize);
+      }
+    }
+  }
+}
+
+bool HashMap::Unlink(uint32_t i)
+{
+  Bucket& b = BucketOf(hashes[i]);
+  
+  SpinLock lock(b.lock);
+  for (std::atomic<uint32_t>* link = &b.head; link->load(std::memory_order_relaxed) != NIL;
+       link = &next[link->load(std::memory_order_relaxed)])
+  {
+    if (link->load(std::memory_order_relaxed) == i)
+    {
+      BeginChange(b.seq);
+      link->store(next[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      EndChange(b.seq);
+      return true;
+    }
+  }
+  return false;
+}
+
+int HashMap::Delete(const void* key)
+{
+  uint64_t hash = Hash(key);
+  Bucket& b = BucketOf(hash);
+  
+  SpinLock lock(b.lock);
+  for (std::atomic<uint32_t>* link = &b.head; link->load(std::memory_order_relaxed) != NIL;
+       link = &next[link->load(std::memory_order_relaxed)])
+  {
+    uint32_t i = link->load(std::memory_order_relaxed);
+    if (hashes[i] == hash && memcmp(KeyAt(i), key, keySize) == 0)
+    {
+      BeginChange(b.seq);
+      link->store(next[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      EndChange(b.seq);
+      
+      Free(i);
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+PerCpuHashMap::PerCpuHashMap(uint32_t keySize, uint32_t valueSize,
+                             uint32_t maxEntries, uint32_t cpus)
+: PerCpuHashMap(keySize, valueSize, maxEntries, cpus,
+                MapMemory(MemorySize(keySize, valueSize, maxEntries,
+                                     cpus ? cpus : 1)))
+{
+  
+}
+
+PerCpuHashMap::PerCpuHashMap(uint32_t keySize, uint32_t valueSize,
+                             uint32_t maxEntries, uint32_t cpus,
+                             MapMemory&& memory)
+: HashMap(BPF_MAP_TYPE_PERCPU_HASH, keySize, valueSize, maxEntries,
+          cpus ? cpus : 1, std::move(memory))
+{
+  
+}
+
+/* ---------------------------- LRU ---------------------------- */
+
+LruHashMap::LruHashMap(uint32_t keySize, uint32_t valueSize,
+                       uint32_t maxEntries, uint32_t cpus)
+: LruHashMap(keySize, valueSize, maxEntries, cpus,
+             MapMemory(MemorySize(keySize, valueSize, maxEntries, 1)))
+{
+  
+}
+
+LruHashMap::LruHashMap(uint32_t keySize, uint32_t valueSize,
+                       uint32_t maxEntries, uint32_t cpus, MapMemory&& memory)
+: HashMap(BPF_MAP_TYPE_LRU_HASH, keySize, valueSize, maxEntries, 1,
+          std::move(memory)),
+  referenced(maxEntries),
+  locals(nullptr),
+  localCount(cpus ? cpus : 1),
+  hand(0)
+{
+  for (std::atomic<uint8_t>& r : referenced)
+  {
+    r.store(0, std::memory_order_relaxed);
+  }
+  
+  // operator new does not align beyond 16 bytes before C++17
+  void* mem;
+  if (posix_memalign(&mem, alignof(LocalFree), localCount * sizeof(LocalFree)))
+  {
+    throw std::bad_alloc();
+  }
+  locals = static_cast<LocalFree*>(mem);
+  for (uint32_t c = 0; c < localCount; c++)
+  {
+    LocalFree* local = new (&locals[c]) LocalFree();
+    local->lock.store(0, std::memory_order_relaxed);
+    local->count = 0;
+  }
+  clockLock.store(0, std::memory_order_relaxed);
+  evictions.store(0, std::memory_order_relaxed);
+}
+
+LruHashMap::~LruHashMap()
+{
+  for (uint32_t c = 0; c < localCount; c++)
+  {
+    locals[c].~LocalFree();
+  }
+  free(locals);
+}
+
+void* LruHashMap::LookupCpu(const void* key, uint32_t)
+{
+  uint32_t i = LookupEntry(key);
+  if (i == NIL)
+  {
+    return nullptr;
+  }
+  
+  if (!referenced[i].load(std::memory_order_relaxed))
+  {
+    referenced[i].store(1, std::memory_order_relaxed);
+  }
+  return ValueAt(i, 0);
+}
+
+uint32_t LruHashMap::Alloc(uint32_t cpu)
+{
+  LocalFree& local = locals[cpu % localCount];
+  
+  SpinLock lock(local.lock);
+  if (local.count == 0)
+  {
+    local.count = TakeFree(local.entries, LRU_BATCH);
+  }
+  if (local.count == 0)
+  {
+    local.count = Steal(cpu % localCount, local.entries);
+  }
+  if (local.count == 0)
+  {
+    local.count = Evict(local.entries, LRU_BATCH);
+  }
+  if (local.count == 0)
+  {
+    return NIL;
+  }
+  
+  uint32_t i = local.entries[--local.count];
+  referenced[i].store(0, std::memory_order_relaxed);
+  return i;
+}
+
+// Take half the entries of the first other CPU free list holding any.
+// Lists locked right now are passed over rather than waited for: their
+// CPU may be stealing too, and waiting on each other would deadlock.
+uint32_t LruHashMap::Steal(uint32_t self, uint32_t* out)
+{
+  for (uint32_t k = 1; k < localCount; k++)
+  {
+    LocalFree& other = locals[(self + k) % localCount];
+    if (other.lock.exchange(1, std::memory_order_acquire))
+    {
+      continue;
+    }
+    uint32_t n = (other.count + 1) / 2;
+    other.count -= n;
+    memcpy(out, other.entries + other.count, n * sizeof(uint32_t));
+    other.lock.store(0, std::memory_order_release);
+    if (n)
+    {
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Move the hand until n entries are evicted into out or it went round
+// once; a second turn only if the first evicted nothing, which it may
+// when it just cleared referenced bits. Entries in no chain, such as
+// ones in the free lists of CPUs, are passed over.
+uint32_t LruHashMap::Evict(uint32_t* out, uint32_t n)
+{
+  SpinLock lock(clockLock);
+  
+  uint32_t evicted = 0;
+  for (uint64_t steps = 0; evicted < n && steps < 2ULL * maxEntries; steps++)
+  {
+    if (steps == maxEntries && evicted > 0)
+    {
+      break;
+    }
+    uint32_t i = hand;
+    hand = (hand + 1 == maxEntries) ? 0 : hand + 1;
+    
+    if (referenced[i].load(std::memory_order_relaxed))
+    {
+      referenced[i].store(0, std::memory_order_relaxed);
+    }
+    else if (Unlink(i))
+    {
+      out[evicted++] = i;
+    }
+  }
+  
+  evictions.fetch_add(evicted, std::memory_order_relaxed);
+  return evicted;
+}
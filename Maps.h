@@ -0,0 +1,411 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Map types (values follow the kernel's enum bpf_map_type)
+#define BPF_MAP_TYPE_HASH       1
+#define BPF_MAP_TYPE_ARRAY      2
+#define BPF_MAP_TYPE_PROG_ARRAY 3
+#define BPF_MAP_TYPE_PERCPU_HASH  5
+#define BPF_MAP_TYPE_PERCPU_ARRAY 6
+#define BPF_MAP_TYPE_LRU_HASH   9
+#define BPF_MAP_TYPE_LPM_TRIE   11
+#define BPF_MAP_TYPE_RINGBUF    27
+
+// Update flags
+#define BPF_ANY     0 // create or replace
+#define BPF_NOEXIST 1 // create only
+#define BPF_EXIST   2 // replace only
+
+// Upper bound on chained tail calls within a single run, as in the kernel
+#define MAX_TAIL_CALL_CNT 33
+
+// The values of every CPU of a per-CPU map start on a line of their own
+#define MAP_CPU_ALIGN 64
+
+// Entries an LRU map moves at once from its shared pool, or evicts, into
+// the free list of a CPU
+#define LRU_BATCH 32
+
+// CPUs the system can have, the default size of per-CPU maps
+uint32_t PossibleCpus();
+
+// Common interface of all maps.
+// Maps are created by the host and shared by every VM they are attached
+// to; programs refer to them by the id they were attached under.
+// Update/Delete return 0 or a negative errno value.
+//
+// Per-CPU maps keep a copy of every value for each of cpus CPUs.
+// Programs see the copy of the CPU their VM is on (VM::SetCpu), the
+// host one CPU's copy (LookupCpu) or all of them (LookupAll, Sum).
+// Other maps have a single copy and ignore the CPU.
+class Map
+{
+protected:
+  uint32_t type;
+  uint32_t keySize;
+  uint32_t valueSize;
+  uint32_t maxEntries;
+  uint32_t cpus;
+  
+public:
+  Map(uint32_t type, uint32_t keySize, uint32_t valueSize, uint32_t maxEntries);
+  virtual ~Map();
+  
+  virtual void* Lookup(const void* key) = 0;
+  virtual int Update(const void* key, const void* value, uint64_t flags) = 0;
+  virtual int Delete(const void* key) = 0;
+  
+  // The copy of cpu, as seen by programs. Update of a per-CPU map sets
+  // every copy, UpdateCpu only the one of cpu (other copies of a new
+  // entry start zeroed).
+  virtual void* LookupCpu(const void* key, uint32_t) {return Lookup(key);};
+  virtual int UpdateCpu(const void* key, const void* value, uint64_t flags,
+                        uint32_t)
+  {
+    return Update(key, value, flags);
+  };
+  
+  // Every CPU's copy, one after another, each rounded up to 8 bytes as
+  // the kernel hands them out; out has room for cpus of them
+  int LookupAll(const void* key, void* out);
+  
+  // The copies summed up as arrays of uint64_t counters, into
+  // (valueSize + 7) / 8 of them at out
+  int Sum(const void* key, uint64_t* out);
+  
+  // Memory holding every value, exposed to programs as one region so
+  // lookups can hand out addresses into it. Lookup results of maps
+  // without one are not addressable.
+  virtual uint8_t* Values() {return nullptr;};
+  virtual uint64_t ValuesSize() const {return 0;};
+  
+  uint32_t Type() const {return type;};
+  uint32_t KeySize() const {return keySize;};
+  uint32_t ValueSize() const {return valueSize;};
+  uint32_t MaxEntries() const {return maxEntries;};
+  uint32_t Cpus() const {return cpus;};
+};
+
+// Array of programs used as tail call targets.
+// Key is a uint32_t slot index, value is the program to run. Programs
+// are owned by the host and must outlive the map.
+// Slots can be replaced while VMs are running; a tail call sees either
+// the old or the new program.
+class ProgArrayMap : public Map
+{
+private:
+  std::vector<std::atomic<const std::vector<uint64_t>*>> progs;
+  
+public:
+  ProgArrayMap(uint32_t maxEntries);
+  
+  void* Lookup(const void* key);
+  int Update(const void* key, const void* value, uint64_t flags);
+  int Delete(const void* key);
+  
+  // Typed accessors, Update/Lookup work on a pointer to the program pointer
+  int Set(uint32_t index, const std::vector<uint64_t>* prog);
+  
+  // O(1) lookup of a tail call target, nullptr if the slot is empty
+  const std::vector<uint64_t>* Get(uint32_t index) const
+  {
+    if (index >= maxEntries)
+    {
+      return nullptr;
+    }
+    return progs[index].load(std::memory_order_acquire);
+  };
+};
+
+// Busy-wait lock for the short critical sections of map updates
+class SpinLock
+{
+private:
+  std::atomic<uint32_t>& word;
+  
+public:
+  SpinLock(std::atomic<uint32_t>& w) : word(w)
+  {
+    while (word.exchange(1, std::memory_order_acquire))
+    {
+      while (word.load(std::memory_order_relaxed))
+      {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+    }
+  };
+  ~SpinLock()
+  {
+    word.store(0, std::memory_order_release);
+  };
+};
+
+// Memory holding the state of a map, in one block: private anonymous
+// pages, or the part after offset of a shared mapping of a file (see
+// PinMap) that outlives the process. Fresh memory is zeroed.
+class MapMemory
+{
+private:
+  uint8_t* mapping;
+  uint64_t mappingSize;
+  uint8_t* base;
+  uint64_t size;
+  int fd;        // of the file, -1 if anonymous
+  bool attached; // holds the state of an earlier map
+  
+public:
+  explicit MapMemory(uint64_t size);
+  // Takes over the mapping and fd, both released with the memory
+  MapMemory(int fd, uint8_t* mapping, uint64_t mappingSize, uint64_t offset,
+            bool attached);
+  MapMemory(MapMemory&&);
+  ~MapMemory();
+  
+  MapMemory(const MapMemory&) = delete;
+  MapMemory& operator=(const MapMemory&) = delete;
+  
+  uint8_t* Base() {return base;};
+  uint64_t Size() const {return size;};
+  bool Attached() const {return attached;};
+};
+
+// Layout of the values of a map: maxEntries slots of valueSize bytes
+// rounded up to 8, once per CPU. The copies of one CPU are contiguous
+// and the ones of every CPU start on a MAP_CPU_ALIGN boundary, so CPUs
+// updating their own values never write to the same cache line.
+class MapValues
+{
+private:
+  uint64_t stride;
+  uint64_t cpuStride;
+  uint32_t cpus;
+  uint8_t* base; // MAP_CPU_ALIGN aligned, in the map's memory
+  
+public:
+  MapValues(uint32_t valueSize, uint32_t maxEntries, uint32_t cpus);
+  
+  MapValues(const MapValues&) = delete;
+  MapValues& operator=(const MapValues&) = delete;
+  
+  void Place(uint8_t* at) {base = at;};
+  
+  uint8_t* At(uint32_t index, uint32_t cpu)
+  {
+    return base + cpu * cpuStride + index * stride;
+  };
+  uint8_t* Base() {return base;};
+  uint64_t Size() const {return cpuStride * cpus;};
+};
+
+// Fixed size array indexed by a uint32_t key; every slot always exists
+// and starts zeroed. Values are updated in place, without locking.
+class ArrayMap : public Map
+{
+private:
+  MapMemory memory;
+  MapValues values;
+  
+protected:
+  ArrayMap(uint32_t type, uint32_t valueSize, uint32_t maxEntries,
+           uint32_t cpus, MapMemory&& memory);
+  
+public:
+  ArrayMap(uint32_t valueSize, uint32_t maxEntries);
+  // In memory of at least MemorySize() bytes, kept as it is if attached
+  ArrayMap(uint32_t valueSize, uint32_t maxEntries, MapMemory&& memory);
+  
+  static uint64_t MemorySize(uint32_t valueSize, uint32_t maxEntries,
+                             uint32_t cpus);
+  
+  void* Lookup(const void* key);
+  int Update(const void* key, const void* value, uint64_t flags);
+  int Delete(const void* key);
+  void* LookupCpu(const void* key, uint32_t cpu);
+  int UpdateCpu(const void* key, const void* value, uint64_t flags,
+                uint32_t cpu);
+  
+  uint8_t* Values() {return values.Base();};
+  uint64_t ValuesSize() const {return values.Size();};
+};
+
+// Array with a copy of every value per CPU, for counters that many
+// workers bump: each updates its own copy with plain loads and stores
+// and the host adds them up (Sum).
+class PerCpuArrayMap : public ArrayMap
+{
+public:
+  PerCpuArrayMap(uint32_t valueSize, uint32_t maxEntries,
+                 uint32_t cpus = PossibleCpus());
+  PerCpuArrayMap(uint32_t valueSize, uint32_t maxEntries, uint32_t cpus,
+                 MapMemory&& memory);
+};
+
+// Hash table with all maxEntries entries preallocated, so values live
+// in one region and updates never allocate. Buckets are chained through
+// entry indices. Writers take the bucket's spin lock; lookups take
+// none, they walk the chain and retry if the bucket's sequence count
+// shows a writer changed it meanwhile. Values handed out by Lookup stay
+// valid memory but may be reused once deleted, as with the kernel's
+// preallocated maps.
+class HashMap : public Map
+{
+private:
+  struct Bucket
+  {
+    std::atomic<uint32_t> lock;
+    std::atomic<uint32_t> seq;  // odd while the chain is changed
+    std::atomic<uint32_t> head;
+  };
+  
+  // Offsets of the arrays below in the map's memory, and its size
+  struct Layout
+  {
+    uint64_t buckets;
+    uint64_t next;
+    uint64_t hashes;
+    uint64_t keys;
+    uint64_t values;
+    uint64_t size;
+    
+    Layout(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+           uint32_t cpus);
+  };
+  
+  uint64_t keyStride;
+  uint32_t bucketMask;             // buckets, a power of two, minus one
+  MapMemory memory;
+  Bucket* buckets;
+  std::atomic<uint32_t>* next;     // chain, or free list
+  uint64_t* hashes;
+  uint8_t* keys;
+  MapValues values;
+  
+  std::atomic<uint32_t> freeLock;
+  uint32_t freeHead;
+  
+  uint64_t Hash(const void* key) const;
+  Bucket& BucketOf(uint64_t hash)
+  {
+    return buckets[hash & bucketMask];
+  };
+  uint8_t* KeyAt(uint32_t i)
+  {
+    return keys + i * keyStride;
+  };
+  void RebuildFree();
+  uint32_t Find(const Bucket&, uint64_t hash, const void* key);
+  uint32_t FindLockFree(const Bucket&, uint64_t hash, const void* key);
+  int Upsert(const void* key, const void* value, uint64_t flags,
+             uint32_t copy, uint32_t cpu);
+  
+protected:
+  static const uint32_t NIL = 0xffffffff;
+  
+  HashMap(uint32_t type, uint32_t keySize, uint32_t valueSize,
+          uint32_t maxEntries, uint32_t cpus, MapMemory&& memory);
+  
+  // Entry for a new key, taken by an update on cpu, NIL if the map is
+  // full. Called without any bucket lock held.
+  virtual uint32_t Alloc(uint32_t cpu);
+  // Give back an entry that is in no chain
+  virtual void Free(uint32_t i);
+  
+  // Up to n entries off the shared free list into out, how many
+  uint32_t TakeFree(uint32_t* out, uint32_t n);
+  // Remove entry i from its chain, false if it was in none
+  bool Unlink(uint32_t i);
+  // Entry holding key, NIL if none, without locking
+  uint32_t LookupEntry(const void* key);
+  uint8_t* ValueAt(uint32_t i, uint32_t cpu) {return values.At(i, cpu);};
+  
+public:
+  HashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries);
+  // In memory of at least MemorySize() bytes. The entries of attached
+  // memory are kept; its chains are checked and locks reset, so it must
+  // not be in use by anyone else.
+  HashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+          MapMemory&& memory);
+  
+  static uint64_t MemorySize(uint32_t keySize, uint32_t valueSize,
+                             uint32_t maxEntries, uint32_t cpus);
+  
+  void* Lookup(const void* key);
+  int Update(const void* key, const void* value, uint64_t flags);
+  int Delete(const void* key);
+  void* LookupCpu(const void* key, uint32_t cpu);
+  int UpdateCpu(const void* key, const void* value, uint64_t flags,
+                uint32_t cpu);
+  
+  uint8_t* Values() {return values.Base();};
+  uint64_t ValuesSize() const {return values.Size();};
+};
+
+// Hash table with a copy of every value per CPU, see PerCpuArrayMap.
+// Keys are shared: an entry exists, or is deleted, for all CPUs.
+class PerCpuHashMap : public HashMap
+{
+public:
+  PerCpuHashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+                uint32_t cpus = PossibleCpus());
+  PerCpuHashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+                uint32_t cpus, MapMemory&& memory);
+};
+
+// Hash table of fixed capacity that makes room for new keys by evicting
+// ones not used lately, so e.g. connection tracking keeps a bounded
+// footprint under churn.
+//
+// Recency is approximated with a clock: lookups set the entry's
+// referenced bit (a plain store, and only if it was clear, so hot
+// entries cause no writes) and the hand sweeping over all entries
+// clears set bits and evicts entries whose bit stayed clear since its
+// last turn. New entries start unreferenced, so keys that are never
+// looked up again go before ones in use; as slots are refilled just
+// behind the hand, a new entry still has most of a turn to be used.
+//
+// Updates take entries from a free list of their CPU (the VM's, see
+// VM::SetCpu; the host counts as CPU 0), refilled LRU_BATCH at a time
+// from the shared free list, then from what other CPUs hold in theirs
+// and only then by the clock, so shared locks are taken once per batch
+// and entries parked on an idle CPU are not lost to the others. Lookups take no lock. Values
+// of evicted entries may be reused right away, as with deleted ones.
+class LruHashMap : public HashMap
+{
+private:
+  struct alignas(64) LocalFree
+  {
+    std::atomic<uint32_t> lock;
+    uint32_t count;
+    uint32_t entries[LRU_BATCH];
+  };
+  
+  std::vector<std::atomic<uint8_t>> referenced;
+  LocalFree* locals;             // one per CPU, on lines of their own
+  uint32_t localCount;
+  std::atomic<uint32_t> clockLock;
+  uint32_t hand;
+  std::atomic<uint64_t> evictions;
+  
+  uint32_t Steal(uint32_t self, uint32_t* out);
+  uint32_t Evict(uint32_t* out, uint32_t n);
+  
+protected:
+  uint32_t Alloc(uint32_t cpu);
+  
+public:
+  LruHashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+             uint32_t cpus = PossibleCpus());
+  // Values have a single copy, memory is sized for cpus 1
+  LruHashMap(uint32_t keySize, uint32_t valueSize, uint32_t maxEntries,
+             uint32_t cpus, MapMemory&& memory);
+  ~LruHashMap();
+  
+  void* LookupCpu(const void* key, uint32_t cpu);
+  
+  uint64_t Evictions() const {return evictions.load(std::memory_order_relaxed);};
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Programs address memory through a small table of regions. An address
+// carries the region number in its upper 32 bits and the offset into
+// the region in the lower 32 bits, so resolving it is one table lookup
+// and one range check against the readable or writable size of the
+// region. Region numbers are masked, offsets that under- or overflow
+// end up in another region or far outside this one and fail the check.
+//
+// Both definitions below are pasted verbatim into AOT generated code,
+// so changing them changes AOT_ABI_VERSION too.
+#define MEM_REGION_DEF \
+  struct MemRegion \
+  { \
+    uint8_t* base; \
+    uint64_t readSize; \
+    uint64_t writeSize; \
+  }
+
+#define MEM_REGION_SHIFT 32
+#define MEM_OFFSET_MASK  0xffffffffULL
+#define MAX_MEM_REGIONS  64 // power of two
+
+// Host pointer for size bytes at addr, nullptr unless they all lie
+// within the region (writeSize is 0 for read-only regions)
+#define MEM_TRANSLATE_DEF \
+  static inline uint8_t* MemLoadPtr(const MemRegion* regions, uint64_t addr, \
+                                    uint64_t size) \
+  { \
+    const MemRegion* r = &regions[(addr >> MEM_REGION_SHIFT) & (MAX_MEM_REGIONS - 1)]; \
+    uint64_t off = addr & MEM_OFFSET_MASK; \
+    return (off + size <= r->readSize) ? r->base + off : nullptr; \
+  } \
+  static inline uint8_t* MemStorePtr(const MemRegion* regions, uint64_t addr, \
+                                     uint64_t size) \
+  { \
+    const MemRegion* r = &regions[(addr >> MEM_REGION_SHIFT) & (MAX_MEM_REGIONS - 1)]; \
+    uint64_t off = addr & MEM_OFFSET_MASK; \
+    return (off + size <= r->writeSize) ? r->base + off : nullptr; \
+  }
+
+MEM_REGION_DEF;
+MEM_TRANSLATE_DEF
+
+// Fixed region numbers. Region 0 stays empty so null pointers fault.
+#define MEM_REGION_NULL  0
+#define MEM_REGION_STACK 1 // per VM, R10 points at its top
+#define MEM_REGION_CTX   2 // set by the host, see VM::SetContext
+#define MEM_REGION_SAMPLE0 3 // ring buffer samples reserved by the running
+#define MEM_SAMPLES        4 // program, one region each, see VM::MapSample
+#define MEM_REGION_MAP0  8 // values of the map attached under id n are
+                           // region MEM_REGION_MAP0 + n
+
+#define MAX_BPF_STACK 512
+
+// bpf_loop callbacks run in frames of their own, each MAX_BPF_STACK
+// below that of their caller; a VM's stack has room for this many
+#define VM_STACK_FRAMES 4
+#define VM_STACK_SIZE   (MAX_BPF_STACK * VM_STACK_FRAMES)
+
+inline uint64_t MemAddr(uint32_t region, uint64_t offset)
+{
+  return ((uint64_t)region << MEM_REGION_SHIFT) | offset;
+}
+
+// Width-correct accesses, false if the address does not resolve.
+// Loads zero extend into the 64-bit destination.
+template <typename T>
+inline bool MemLoad(const MemRegion* regions, uint64_t addr, uint64_t& val)
+{
+  const uint8_t* p = MemLoadPtr(regions, addr, sizeof(T));
+  if (!p)
+  {
+    return false;
+  }
+  T v;
+  memcpy(&v, p, sizeof(v));
+  val = v;
+  return true;
+}
+
+template <typename T>
+inline bool MemStore(const MemRegion* regions, uint64_t addr, uint64_t val)
+{
+  uint8_t* p = MemStorePtr(regions, addr, sizeof(T));
+  if (!p)
+  {
+    return false;
+  }
+  T v = (T)val;
+  memcpy(p, &v, sizeof(v));
+  return true;
+}
@@ -0,0 +1,251 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sched.h>
+
+static const char* errorNames[VM_ERRORS] =
+{
+  "ok", "access", "loop", "div_zero", "bad_opcode",
+};
+
+uint64_t MetricsNow()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/* ------------------------ Histogram --------------------------- */
+
+size_t LatencyBucket(uint64_t ns)
+{
+  const uint64_t sub = 1ULL << METRICS_SUB_BITS;
+  if (ns < sub)
+  {
+    return ns;
+  }
+  unsigned top = 63 - __builtin_clzll(ns);
+  if (top > METRICS_MAX_BITS)
+  {
+    return METRICS_BUCKETS - 1;
+  }
+  unsigned shift = top - METRICS_SUB_BITS;
+  return ((shift + 1) << METRICS_SUB_BITS) + ((ns >> shift) & (sub - 1));
+}
+
+uint64_t BucketValue(size_t bucket)
+{
+  const uint64_t sub = 1ULL << METRICS_SUB_BITS;
+  if (bucket < sub)
+  {
+    return bucket;
+  }
+  unsigned shift = (bucket >> METRICS_SUB_BITS) - 1;
+  return (sub + (bucket & (sub - 1))) << shift;
+}
+
+uint64_t MetricsSnapshot::Percentile(double p) const
+{
+  if (timed == 0)
+  {
+    return 0;
+  }
+  uint64_t rank = std::min((uint64_t)(p * timed), timed - 1);
+  uint64_t seen = 0;
+  for (size_t b = 0; b < METRICS_BUCKETS; b++)
+  {
+    seen += latency[b];
+    if (seen > rank)
+    {
+      return BucketValue(b);
+    }
+  }
+  return BucketValue(METRICS_BUCKETS - 1);
+}
+
+/* ------------------------- Shards ----------------------------- */
+
+MetricsShard::MetricsShard()
+: runs(0)
+{
+  for (std::atomic<uint64_t>& c : verdicts)
+  {
+    c.store(0, std::memory_order_relaxed);
+  }
+  for (std::atomic<uint64_t>& c : errors)
+  {
+    c.store(0, std::memory_order_relaxed);
+  }
+  for (std::atomic<uint64_t>& c : latency)
+  {
+    c.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Slot of each thread in every ProgramMetrics. A slot given back by a
+// thread that exited goes to the next one, which carries on counting
+// in the same shards.
+static std::atomic<bool> slotUsed[METRICS_MAX_THREADS];
+
+struct MetricsThread
+{
+  int slot;
+
+  MetricsThread() : slot(-1) {};
+  ~MetricsThread()
+  {
+    if (slot >= 0)
+    {
+      slotUsed[slot].store(false, std::memory_order_release);
+    }
+  };
+};
+
+static thread_local MetricsThread metricsThread;
+
+static int MetricsSlot()
+{
+  MetricsThread& self = metricsThread;
+  while (self.slot < 0)
+  {
+    for (int i = 0; i < METRICS_MAX_THREADS && self.slot < 0; i++)
+    {
+      bool used = false;
+      if (!slotUsed[i].load(std::memory_order_relaxed)
+              && slotUsed[i].compare_exchange_strong(used, true))
+      {
+        self.slot = i;
+      }
+    }
+    if (self.slot < 0)
+    {
+      // more threads than slots, wait for one to exit
+      sched_yield();
+    }
+  }
+  return self.slot;
+}
+
+/* ------------------------- Metrics ---------------------------- */
+
+ProgramMetrics::ProgramMetrics(const std::string& name)
+: name(name), created(MetricsNow())
+{
+  for (std::atomic<MetricsShard*>& s : shards)
+  {
+    s.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+// Recording threads must be done
+ProgramMetrics::~ProgramMetrics()
+{
+  for (std::atomic<MetricsShard*>& s : shards)
+  {
+    MetricsShard* shard = s.load(std::memory_order_relaxed);
+    if (shard)
+    {
+      shard->~MetricsShard();
+      free(shard);
+    }
+  }
+}
+
+MetricsShard& ProgramMetrics::Local()
+{
+  std::atomic<MetricsShard*>& slot = shards[MetricsSlot()];
+  MetricsShard* shard = slot.load(std::memory_order_acquire);
+  if (!shard)
+  {
+    // only this thread fills in its slot. operator new does not align
+    // beyond 16 bytes before C++17.
+    void* mem;
+    if (posix_memalign(&mem, alignof(MetricsShard), sizeof(MetricsShard)) != 0)
+    {
+      throw std::bad_alloc();
+    }
+    shard = new (mem) MetricsShard();
+    slot.store(shard, std::memory_order_release);
+  }
+  return *shard;
+}
+
+MetricsSnapshot ProgramMetrics::Snapshot() const
+{
+  MetricsSnapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  snap.ns = MetricsNow();
+
+  for (const std::atomic<MetricsShard*>& slot : shards)
+  {
+    const MetricsShard* shard = slot.load(std::memory_order_acquire);
+    if (!shard)
+    {
+      continue;
+    }
+    snap.runs += shard->runs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < METRICS_VERDICTS; i++)
+    {
+      snap.verdicts[i] += shard->verdicts[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < VM_ERRORS; i++)
+    {
+      snap.errors[i] += shard->errors[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < METRICS_BUCKETS; i++)
+    {
+      uint64_t n = shard->latency[i].load(std::memory_order_relaxed);
+      snap.latency[i] += n;
+      snap.timed += n;
+    }
+  }
+
+  return snap;
+}
+
+std::string ProgramMetrics::Text(const MetricsSnapshot* since) const
+{
+  MetricsSnapshot snap = Snapshot();
+  uint64_t fromRuns = since ? since->runs : 0;
+  uint64_t fromNs = since ? since->ns : created;
+  double secs = (snap.ns - fromNs) / 1e9;
+
+  char line[256];
+  std::string out;
+
+  snprintf(line, sizeof(line), "%s runs %lu rate %.1f/s\n", name.c_str(),
+           (unsigned long)snap.runs,
+           secs > 0 ? (snap.runs - fromRuns) / secs : 0.0);
+  out += line;
+
+  out += name + " verdicts";
+  for (size_t i = 0; i < METRICS_VERDICTS; i++)
+  {
+    snprintf(line, sizeof(line), " %zu%s=%lu", i,
+             i == METRICS_VERDICTS - 1 ? "+" : "", (unsigned long)snap.verdicts[i]);
+    out += line;
+  }
+  out += "\n";
+
+  out += name + " errors";
+  for (size_t i = 1; i < VM_ERRORS; i++)
+  {
+    snprintf(line, sizeof(line), " %s=%lu", errorNames[i], (unsigned long)snap.errors[i]);
+    out += line;
+  }
+  out += "\n";
+
+  snprintf(line, sizeof(line),
+           "%s latency_ns timed %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+           name.c_str(), (unsigned long)snap.timed,
+           (unsigned long)snap.Percentile(0.5), (unsigned long)snap.Percentile(0.9),
+           (unsigned long)snap.Percentile(0.99), (unsigned long)snap.Percentile(0.999),
+           (unsigned long)snap.Percentile(1.0));
+  out += line;
+
+  return out;
+}
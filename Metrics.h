@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "VM.h"
+
+// Threads that may record into the same ProgramMetrics
+#define METRICS_MAX_THREADS 256
+
+// Verdicts (R0 on exit) counted one by one, larger ones count as the last
+#define METRICS_VERDICTS 8
+
+// One run in this many of a thread is timed, so the clock stays off the
+// common path; the latency histogram is a sample of all runs
+#define METRICS_TIME_EVERY 16
+
+// Latency histogram buckets: values below 2^METRICS_SUB_BITS get a bucket
+// each, above that every power of two is split into 2^METRICS_SUB_BITS
+// buckets (within 1/16 = 6% of the value). Values of 2^(METRICS_MAX_BITS
+// + 1) ns (about 37 minutes) and more share the last bucket.
+#define METRICS_SUB_BITS 4
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS  ((METRICS_MAX_BITS - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS)
+
+// Bucket of a latency of ns nanoseconds, and the smallest value in a bucket
+size_t LatencyBucket(uint64_t ns);
+uint64_t BucketValue(size_t bucket);
+
+// What the threads recording into a ProgramMetrics have counted, merged
+struct MetricsSnapshot
+{
+  uint64_t ns;       // when it was taken, steady clock
+  uint64_t runs;
+  uint64_t verdicts[METRICS_VERDICTS];
+  uint64_t errors[VM_ERRORS]; // by VM error, [VM_OK] is runs without one
+  uint64_t timed;             // runs in latency
+  uint64_t latency[METRICS_BUCKETS];
+
+  // Latency below which fraction p (0 to 1) of the timed runs stayed,
+  // to the precision of the buckets; 0 if nothing was timed
+  uint64_t Percentile(double p) const;
+};
+
+// Counters of one thread, on cache lines of their own. Only the owning
+// thread writes them: relaxed loads and stores, no read-modify-write.
+struct alignas(64) MetricsShard
+{
+  std::atomic<uint64_t> runs;
+  std::atomic<uint64_t> verdicts[METRICS_VERDICTS];
+  std::atomic<uint64_t> errors[VM_ERRORS];
+  std::atomic<uint64_t> latency[METRICS_BUCKETS];
+
+  MetricsShard();
+
+  // Whether the run about to be recorded should be timed
+  bool Timed() const
+  {
+    return runs.load(std::memory_order_relaxed) % METRICS_TIME_EVERY == 0;
+  };
+
+  // Count one run that ended with VM error err (VM_OK if none) and left
+  // verdict in R0, and its latency if it was timed
+  void Record(uint32_t err, uint64_t verdict)
+  {
+    Bump(runs);
+    Bump(errors[err < VM_ERRORS ? err : VM_OK]);
+    if (err == VM_OK)
+    {
+      Bump(verdicts[verdict < METRICS_VERDICTS ? verdict : METRICS_VERDICTS - 1]);
+    }
+  };
+  void RecordLatency(uint64_t ns) {Bump(latency[LatencyBucket(ns)]);};
+
+private:
+  static void Bump(std::atomic<uint64_t>& c)
+  {
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  };
+};
+
+// Run metrics of one program: runs, verdicts, errors and a latency
+// histogram. Every thread records into a shard of its own, found with
+// one thread local lookup, and readers merge all shards on demand, so
+// recording takes no lock and no atomic instruction. Counts read
+// while threads record are each exact, but not a consistent cut
+// across counters.
+//
+// Typical use, once per batch:
+//
+//   MetricsShard& m = metrics.Local();
+//   for each packet:
+//     uint64_t start = m.Timed() ? MetricsNow() : 0;
+//     uint64_t verdict = vm.Run(program);
+//     if (start) m.RecordLatency(MetricsNow() - start);
+//     m.Record(vm.GetError(), verdict);
+class ProgramMetrics
+{
+private:
+  std::string name;
+  uint64_t created; // ns, steady clock
+  std::atomic<MetricsShard*> shards[METRICS_MAX_THREADS];
+
+public:
+  ProgramMetrics(const std::string& name);
+  ~ProgramMetrics();
+
+  ProgramMetrics(const ProgramMetrics&) = delete;
+  ProgramMetrics& operator=(const ProgramMetrics&) = delete;
+
+  // The calling thread's shard, created on first use
+  MetricsShard& Local();
+
+  const std::string& Name() const {return name;};
+  MetricsSnapshot Snapshot() const;
+
+  // Human readable summary: runs, runs/s since since (or since the
+  // metrics were created), verdicts, errors and latency percentiles
+  std::string Text(const MetricsSnapshot* since = nullptr) const;
+};
+
+// Steady clock in nanoseconds
+uint64_t MetricsNow();
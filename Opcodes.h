@@ -13,6 +13,15 @@
 #define OFF_MASK 0xFFFF0000
 #define IMM_MASK 0xFFFFFFFF00000000
 
+// Build a whole instruction from its fields (useful when emitting
+// bytecode from C++ rather than through the assembler)
+#define BPF_INSN(op, dst, src, off, imm) \
+  ((uint64_t)(op) \
+   | ((uint64_t)(dst) << SHL_DST) \
+   | ((uint64_t)(src) << SHL_SRC) \
+   | ((uint64_t)(uint16_t)(off) << SHL_OFF) \
+   | ((uint64_t)(uint32_t)(imm) << SHL_IMM))
+
 /* --------------------- ALU 64-bit -------------------------- */
 #define BPF_ADD_IMM  0x07
 #define BPF_ADD_SRC  0x0f
@@ -103,7 +112,27 @@
 #define BPF_STXB    0x73 // *(uint8_t *) (dst + off) = src
 #define BPF_STXDW   0x7b // *(uint64_t *) (dst + off) = src
 
+// src of BPF_LDDW: dst = pc + 1 + imm, the position of a callback
+// (e.g. for bpf_loop) rather than a constant
+#define BPF_PSEUDO_FUNC 4
+
+/* ------------------- Atomic Instructions --------------- */
+// Read-modify-write of *(dst + off) with src, the operation is in imm.
+// Sequentially consistent, the address must be naturally aligned.
+#define BPF_ATOMIC_W  0xc3 // uint32_t
+#define BPF_ATOMIC_DW 0xdb // uint64_t
+
+// Operations (imm)
+#define BPF_ATOMIC_ADD   0x00 // *(dst + off) += src
+#define BPF_ATOMIC_OR    0x40 // *(dst + off) |= src
+#define BPF_ATOMIC_AND   0x50 // *(dst + off) &= src
+#define BPF_ATOMIC_XOR   0xa0 // *(dst + off) ^= src
+#define BPF_ATOMIC_FETCH 0x01 // modifier: src = old *(dst + off)
+#define BPF_ATOMIC_XCHG    0xe1 // src = xchg(dst + off, src)
+#define BPF_ATOMIC_CMPXCHG 0xf1 // r0 = cmpxchg(dst + off, r0, src)
+
 /* ------------------- Branch Instructions --------------- */
+// Jump offsets are signed, backward jumps form loops (see VM_LOOP_BUDGET)
 #define BPF_JA       0x05
 #define BPF_JEQ_IMM  0x15
 #define BPF_JEQ_SRC  0x1d
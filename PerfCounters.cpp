@@ -0,0 +1,246 @@
+#include "PerfCounters.h"
+
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+static uint64_t ReadTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static int OpenEvent(uint32_t type, uint64_t config, int group)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group < 0);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+          | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#define CACHE_READ_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+PerfCounters::PerfCounters()
+: leader(-1), opened(0), hardware(false)
+{
+  for (int& fd : fds)
+  {
+    fd = -1;
+  }
+
+  leader = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (leader < 0)
+  {
+    return;
+  }
+  fds[PERF_CYCLES] = leader;
+  opened = 1;
+  hardware = true;
+
+  const struct
+  {
+    PerfEvent event;
+    uint32_t type;
+    uint64_t config;
+  } events[] =
+  {
+    {PERF_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_L1D_MISSES, PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  };
+  for (const auto& e : events)
+  {
+    fds[e.event] = OpenEvent(e.type, e.config, leader);
+    opened += (fds[e.event] >= 0);
+  }
+
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::~PerfCounters()
+{
+  for (int fd : fds)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+}
+
+void PerfCounters::Read(PerfSample& sample) const
+{
+  memset(&sample, 0, sizeof(sample));
+  if (!hardware)
+  {
+    sample.count[PERF_CYCLES] = ReadTsc();
+    sample.valid = true;
+    return;
+  }
+
+  // nr, time enabled, time running, then one value per event
+  uint64_t buf[3 + PERF_EVENTS];
+  if (read(leader, buf, sizeof(buf)) < (ssize_t)((3 + opened) * sizeof(uint64_t)))
+  {
+    return;
+  }
+  sample.enabled = buf[1];
+  sample.running = buf[2];
+
+  size_t value = 3;
+  for (int e = 0; e < PERF_EVENTS; e++)
+  {
+    if (fds[e] >= 0)
+    {
+      sample.count[e] = buf[value++];
+    }
+  }
+  sample.valid = true;
+}
+
+/* ------------------------- Profile ---------------------------- */
+
+// Counts between start and end into delta. When the kernel multiplexed
+// the group only part of that time was counted: the counts of that
+// part are scaled up to all of it. False if there is nothing to scale.
+static bool PerfDelta(const PerfSample& start, const PerfSample& end,
+                      uint64_t* delta)
+{
+  if (!start.valid || !end.valid || end.enabled < start.enabled
+          || end.running < start.running)
+  {
+    return false;
+  }
+  uint64_t enabled = end.enabled - start.enabled;
+  uint64_t running = end.running - start.running;
+  if (enabled && !running)
+  {
+    return false;
+  }
+
+  for (int e = 0; e < PERF_EVENTS; e++)
+  {
+    if (end.count[e] < start.count[e])
+    {
+      return false;
+    }
+    delta[e] = end.count[e] - start.count[e];
+    if (running < enabled)
+    {
+      delta[e] = (uint64_t)((double)delta[e] * enabled / running);
+    }
+  }
+  return true;
+}
+
+void PerfProfile::Add(const std::string& program, const std::string& engine,
+                      uint64_t runs, const PerfSample& start,
+                      const PerfSample& end)
+{
+  uint64_t delta[PERF_EVENTS];
+  if (!PerfDelta(start, end, delta))
+  {
+    return;
+  }
+
+  PerfStats* stats = nullptr;
+  for (PerfStats& s : entries)
+  {
+    if (s.program == program && s.engine == engine)
+    {
+      stats = &s;
+      break;
+    }
+  }
+  if (!stats)
+  {
+    PerfStats s;
+    s.program = program;
+    s.engine = engine;
+    s.runs = 0;
+    memset(s.total, 0, sizeof(s.total));
+    entries.push_back(s);
+    stats = &entries.back();
+  }
+
+  stats->runs += runs;
+  for (int e = 0; e < PERF_EVENTS; e++)
+  {
+    stats->total[e] += delta[e];
+  }
+}
+
+void PerfProfile::Merge(const PerfProfile& other)
+{
+  // other's totals are scaled already: a reading of them as they are
+  PerfSample zero, total;
+  memset(&zero, 0, sizeof(zero));
+  zero.valid = true;
+  for (const PerfStats& s : other.entries)
+  {
+    total = zero;
+    memcpy(total.count, s.total, sizeof(total.count));
+    Add(s.program, s.engine, s.runs, zero, total);
+  }
+}
+
+void PerfProfile::Print(const PerfCounters& counters) const
+{
+  printf("%-24s %-10s %10s %10s %10s %6s %10s %10s %10s\n",
+         "program", "engine", "runs",
+         counters.Hardware() ? "cycles/run" : "tsc/run",
+         "insns/run", "IPC", "brmiss/run", "l1d/run", "llc/run");
+  for (const PerfStats& s : entries)
+  {
+    double runs = s.runs ? (double)s.runs : 1.0;
+    const uint64_t* c = s.total;
+
+    char cols[PERF_EVENTS][32];
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+      if (counters.Has((PerfEvent)e))
+      {
+        snprintf(cols[e], sizeof(cols[e]), "%.1f", c[e] / runs);
+      }
+      else
+      {
+        strcpy(cols[e], "-");
+      }
+    }
+    char ipc[16] = "-";
+    if (counters.Has(PERF_INSTRUCTIONS) && c[PERF_CYCLES])
+    {
+      snprintf(ipc, sizeof(ipc), "%.2f", (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    }
+
+    printf("%-24s %-10s %10lu %10s %10s %6s %10s %10s %10s\n",
+           s.program.c_str(), s.engine.c_str(), (unsigned long)s.runs,
+           cols[PERF_CYCLES], cols[PERF_INSTRUCTIONS], ipc,
+           cols[PERF_BRANCH_MISSES], cols[PERF_L1D_MISSES], cols[PERF_LLC_MISSES]);
+  }
+}
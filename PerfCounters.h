@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Events counted around program runs
+enum PerfEvent
+{
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES, // L1 data cache read misses
+  PERF_LLC_MISSES, // last level cache misses
+  PERF_EVENTS
+};
+
+// Counter values at one point, as read: multiplexing is corrected for
+// on the difference between two samples (see PerfProfile::Add), not on
+// each of them
+struct PerfSample
+{
+  uint64_t count[PERF_EVENTS];
+  uint64_t enabled; // ns the group was enabled, 0 for rdtsc
+  uint64_t running; // ns of those it was counting
+  bool valid;       // false if the counters could not be read
+};
+
+// Hardware counters of the calling thread, opened with perf_event_open
+// as one group so all events cover the same instructions. User space
+// only, the kernel's share of helpers (e.g. futex wakeups) is left out.
+//
+// Where the kernel does not allow them (perf_event_paranoid, containers,
+// no PMU) PERF_CYCLES falls back to the time stamp counter and the
+// other events are not available. Events the PMU lacks are left out on
+// their own. Counts are scaled if the kernel had to multiplex the group.
+//
+// Counters follow the thread that created them: Read() on another
+// thread reads this one's counts.
+class PerfCounters
+{
+private:
+  int fds[PERF_EVENTS]; // -1 for events not counted
+  int leader;
+  size_t opened;        // events in the group, in PerfEvent order
+  bool hardware;
+
+public:
+  PerfCounters();
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Whether the kernel counters are in use rather than rdtsc
+  bool Hardware() const {return hardware;};
+  bool Has(PerfEvent e) const {return fds[e] >= 0 || (e == PERF_CYCLES && !hardware);};
+
+  // Current totals, events not counted read 0
+  void Read(PerfSample&) const;
+};
+
+// Counts of one program on one engine, summed over the runs measured
+struct PerfStats
+{
+  std::string program;
+  std::string engine;
+  uint64_t runs;
+  uint64_t total[PERF_EVENTS];
+};
+
+// Counts attributed to programs and engines, e.g. around every batch a
+// pipeline stage runs. Not thread safe: give every thread its own
+// profile (and counters) and Merge() them.
+class PerfProfile
+{
+private:
+  std::vector<PerfStats> entries;
+
+public:
+  // Add the difference between two readings taken around runs runs of
+  // program on engine, scaled by the share of the time between them
+  // the group was counting. Measurements with a failed reading, or
+  // none of the time counted, are left out, runs included.
+  void Add(const std::string& program, const std::string& engine,
+           uint64_t runs, const PerfSample& start, const PerfSample& end);
+
+  void Merge(const PerfProfile&);
+  void Clear() {entries.clear();};
+  const std::vector<PerfStats>& Entries() const {return entries;};
+
+  // Per run averages, one line per program and engine. Events counters
+  // does not have are printed as "-".
+  void Print(const PerfCounters& counters) const;
+};
@@ -0,0 +1,201 @@
+#include "Pipeline.h"
+#include "Aot.h"
+#include "PerfCounters.h"
+#include "ProgramHandle.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+Pipeline::Pipeline(bool writable)
+: writable(writable), perf(nullptr), perfProfile(nullptr)
+{
+
+}
+
+VM& Pipeline::Append(const std::string& name,
+                     const std::vector<uint64_t>* program,
+                     const AotProgram* native, ProgramHandle* handle)
+{
+  Stage stage;
+  stage.name = name;
+  stage.program = program;
+  stage.native = native;
+  stage.handle = handle;
+  stage.vm.reset(new VM());
+  stage.vm->SetTrace(false);
+  memset(&stage.stats, 0, sizeof(stage.stats));
+  stage.metrics.reset(new ProgramMetrics(name));
+
+  stages.push_back(std::move(stage));
+  return *stages.back().vm;
+}
+
+VM& Pipeline::AddStage(const std::string& name,
+                       const std::vector<uint64_t>& program,
+                       const AotProgram* native)
+{
+  return Append(name, &program, native, nullptr);
+}
+
+VM& Pipeline::AddStage(const std::string& name, ProgramHandle& handle)
+{
+  return Append(name, nullptr, nullptr, &handle);
+}
+
+// Run one stage over the live packets of a batch and keep the ones it
+// passes, in order
+void Pipeline::RunStage(Stage& stage, PipelinePacket* packets,
+                        uint16_t* live, size_t& count)
+{
+  VM& vm = *stage.vm;
+  const uint64_t zero[11] = {0};
+
+  // one version for the whole batch, held by the caller's EpochGuard
+  const std::vector<uint64_t>* program = stage.program;
+  const AotProgram* native = stage.native;
+  if (stage.handle)
+  {
+    const ProgramVersion* version = stage.handle->Get();
+    program = &version->bytecode;
+    native = version->native.get();
+  }
+  uint64_t insns = vm.GetInsnCount();
+  size_t kept = 0;
+  MetricsShard& metrics = stage.metrics->Local();
+
+  PerfSample before;
+  if (perf)
+  {
+    perf->Read(before);
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < count; i++)
+  {
+    PipelinePacket& pkt = packets[live[i]];
+
+    // nothing of the previous packet is left in registers
+    vm.SetRegs(zero);
+    vm.R1().Write64(vm.SetContext(pkt.data, pkt.size, writable));
+    vm.R2().Write64(pkt.size);
+
+    uint64_t started = metrics.Timed() ? MetricsNow() : 0;
+    pkt.verdict = native ? native->Run(vm) : vm.Run(*program);
+    // a stage cannot hand the packet back half way: wait for a helper
+    // that suspended the run, R0 is no verdict until it exited
+    while (vm.IsSuspended())
+    {
+      vm.WaitReady();
+      pkt.verdict = vm.Resume();
+    }
+    if (started)
+    {
+      metrics.RecordLatency(MetricsNow() - started);
+    }
+    metrics.Record(vm.GetError(), pkt.verdict);
+    if (vm.GetError() != VM_OK)
+    {
+      stage.stats.faults++;
+      pkt.verdict = PIPELINE_DROP;
+    }
+
+    if (pkt.verdict != PIPELINE_DROP)
+    {
+      live[kept++] = live[i];
+    }
+  }
+
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+  if (perf)
+  {
+    PerfSample after;
+    perf->Read(after);
+    perfProfile->Add(stage.name, native ? "aot" : "interp", count, before, after);
+  }
+
+  stage.stats.packets += count;
+  stage.stats.passed += kept;
+  stage.stats.dropped += count - kept;
+  stage.stats.insns += vm.GetInsnCount() - insns;
+  stage.stats.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+  count = kept;
+}
+
+size_t Pipeline::Run(PipelinePacket* packets, size_t count)
+{
+  size_t passed = 0;
+  uint16_t live[PIPELINE_BATCH];
+
+  for (size_t first = 0; first < count; first += PIPELINE_BATCH)
+  {
+    PipelinePacket* batch = packets + first;
+    size_t n = std::min(count - first, (size_t)PIPELINE_BATCH);
+    for (size_t i = 0; i < n; i++)
+    {
+      live[i] = i;
+    }
+
+    // stop early once the whole batch is dropped. Programs of stages
+    // that can be replaced stay alive until the batch is through.
+    EpochGuard guard;
+    for (size_t s = 0; s < stages.size() && n; s++)
+    {
+      RunStage(stages[s], batch, live, n);
+    }
+    passed += n;
+  }
+
+  return passed;
+}
+
+void Pipeline::SetPerf(PerfCounters* counters, PerfProfile* profile)
+{
+  perf = (counters && profile) ? counters : nullptr;
+  perfProfile = profile;
+}
+
+void Pipeline::SetCpu(uint32_t index)
+{
+  for (Stage& stage : stages)
+  {
+    stage.vm->SetCpu(index);
+  }
+}
+
+void Pipeline::ResetStats()
+{
+  for (Stage& stage : stages)
+  {
+    memset(&stage.stats, 0, sizeof(stage.stats));
+  }
+}
+
+void Pipeline::PrintStats() const
+{
+  printf("%-16s %10s %10s %10s %8s %10s %9s\n",
+         "stage", "packets", "passed", "dropped", "faults", "insns", "ns/pkt");
+  for (const Stage& stage : stages)
+  {
+    const PipelineStats& s = stage.stats;
+    printf("%-16s %10lu %10lu %10lu %8lu %10lu %9.1f\n", stage.name.c_str(),
+           (unsigned long)s.packets, (unsigned long)s.passed,
+           (unsigned long)s.dropped, (unsigned long)s.faults,
+           (unsigned long)s.insns,
+           s.packets ? (double)s.ns / s.packets : 0.0);
+  }
+}
+
+std::string Pipeline::MetricsText() const
+{
+  std::string text;
+  for (const Stage& stage : stages)
+  {
+    text += stage.metrics->Text();
+  }
+  return text;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Metrics.h"
+#include "VM.h"
+
+class AotProgram;
+class PerfCounters;
+class PerfProfile;
+class ProgramHandle;
+
+// Packets are handed through the pipeline in batches of at most this many
+#define PIPELINE_BATCH 64
+
+// A stage returning this verdict in R0 drops the packet
+#define PIPELINE_DROP 0
+
+// One packet: its data is exposed to every stage as the context region,
+// R1 holds its address and R2 its size. verdict is R0 of the last stage that ran,
+// PIPELINE_DROP if a stage dropped the packet or faulted on it.
+struct PipelinePacket
+{
+  void* data;
+  uint64_t size;
+  uint64_t verdict;
+};
+
+// Per-stage counters, cumulative until ResetStats()
+struct PipelineStats
+{
+  uint64_t packets; // entered the stage
+  uint64_t passed;  // went on to the next stage
+  uint64_t dropped; // dropped here, faults included
+  uint64_t faults;  // runs that ended with a VM error
+  uint64_t insns;   // instructions interpreted, native code counts none
+  uint64_t ns;      // wall time spent in the stage
+};
+
+// Programs chained one after another, e.g. parse -> ACL -> rate limit
+// -> tag. Each packet runs through the stages in order and leaves the
+// pipeline as soon as one of them drops it.
+//
+// Stages are run over a whole batch before the next stage starts, so
+// the code and maps of one stage stay in cache for all the packets of
+// a batch instead of being evicted by the stages in between. Every
+// stage has its own VM, whose maps are attached once when the pipeline
+// is set up; registers are cleared between packets, the stack is not.
+class Pipeline
+{
+private:
+  struct Stage
+  {
+    std::string name;
+    const std::vector<uint64_t>* program;
+    const AotProgram* native;
+    ProgramHandle* handle; // replaces the two above if set
+    std::unique_ptr<VM> vm;
+    PipelineStats stats;
+    std::unique_ptr<ProgramMetrics> metrics; // named after the stage
+  };
+
+  std::vector<Stage> stages;
+  bool writable;
+  PerfCounters* perf;
+  PerfProfile* perfProfile;
+
+  VM& Append(const std::string& name, const std::vector<uint64_t>* program,
+             const AotProgram* native, ProgramHandle* handle);
+  void RunStage(Stage&, PipelinePacket* packets, uint16_t* live, size_t& count);
+
+public:
+  // With writable, stages may modify packet data (e.g. to tag it)
+  Pipeline(bool writable = false);
+
+  // Append a stage running program, or native if given (compiled from
+  // the same program). Returns the stage's VM to attach maps to. Both
+  // must outlive the pipeline.
+  VM& AddStage(const std::string& name, const std::vector<uint64_t>& program,
+               const AotProgram* native = nullptr);
+
+  // Append a stage running the current version of handle, which is
+  // looked up once per batch so it can be replaced while packets flow
+  VM& AddStage(const std::string& name, ProgramHandle& handle);
+
+  // Run count packets through all stages and set their verdicts.
+  // Returns how many passed every stage.
+  size_t Run(PipelinePacket* packets, size_t count);
+
+  // Count hardware events around every batch of every stage into
+  // profile, by stage name and engine ("interp" or "aot"). counters
+  // have to belong to the thread calling Run(). nullptr turns it off.
+  void SetPerf(PerfCounters* counters, PerfProfile* profile);
+
+  // Worker index for the VMs of the stages added so far (VM::SetCpu),
+  // one per thread running a pipeline of its own
+  void SetCpu(uint32_t index);
+
+  size_t Stages() const {return stages.size();};
+  const std::string& StageName(size_t i) const {return stages[i].name;};
+  const PipelineStats& Stats(size_t i) const {return stages[i].stats;};
+  void ResetStats();
+  void PrintStats() const;
+
+  // Run metrics of every stage, kept from the start and readable while
+  // other threads run the pipeline
+  const ProgramMetrics& Metrics(size_t i) const {return *stages[i].metrics;};
+  std::string MetricsText() const;
+};
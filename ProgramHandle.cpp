@@ -0,0 +1,230 @@
+#include "ProgramHandle.h"
+#include "Aot.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+/* ------------------------- Epochs ----------------------------- */
+
+// A reader's epoch while it is inside a guard, 0 outside
+struct alignas(64) EpochSlot
+{
+  std::atomic<uint64_t> epoch;
+  std::atomic<bool> used;
+};
+
+static EpochSlot epochSlots[EPOCH_MAX_READERS];
+
+// Advanced by every retirement, starts at 1 so 0 can mean "idle"
+static std::atomic<uint64_t> globalEpoch(1);
+
+// The slot of this thread, claimed on first use and given back when
+// the thread exits
+struct EpochThread
+{
+  int slot;
+  unsigned depth;
+
+  EpochThread() : slot(-1), depth(0) {};
+  ~EpochThread()
+  {
+    if (slot >= 0)
+    {
+      epochSlots[slot].used.store(false, std::memory_order_release);
+    }
+  };
+};
+
+static thread_local EpochThread epochThread;
+
+static int ClaimSlot()
+{
+  for (;;)
+  {
+    for (int i = 0; i < EPOCH_MAX_READERS; i++)
+    {
+      bool used = false;
+      if (!epochSlots[i].used.load(std::memory_order_relaxed)
+              && epochSlots[i].used.compare_exchange_strong(used, true))
+      {
+        return i;
+      }
+    }
+    // more threads than slots, wait for one to exit
+    sched_yield();
+  }
+}
+
+EpochGuard::EpochGuard()
+{
+  EpochThread& self = epochThread;
+  if (self.depth++ > 0)
+  {
+    return;
+  }
+  if (self.slot < 0)
+  {
+    self.slot = ClaimSlot();
+  }
+
+  // announce the epoch before reading any pointer, so that either the
+  // writer sees us or we see its new version
+  epochSlots[self.slot].epoch.store(globalEpoch.load(std::memory_order_acquire),
+                                    std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+EpochGuard::~EpochGuard()
+{
+  EpochThread& self = epochThread;
+  if (--self.depth == 0)
+  {
+    epochSlots[self.slot].epoch.store(0, std::memory_order_release);
+  }
+}
+
+// Oldest epoch a reader is still in, UINT64_MAX if none is
+static uint64_t OldestReader()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < EPOCH_MAX_READERS; i++)
+  {
+    uint64_t e = epochSlots[i].epoch.load(std::memory_order_acquire);
+    if (e != 0 && e < oldest)
+    {
+      oldest = e;
+    }
+  }
+  return oldest;
+}
+
+/* ------------------------ Versions ---------------------------- */
+
+ProgramVersion::ProgramVersion()
+: version(0)
+{
+
+}
+
+ProgramVersion::~ProgramVersion()
+{
+
+}
+
+ProgramHandle::ProgramHandle(const std::vector<uint64_t>& program)
+: current(nullptr), versions(1), budget()
+{
+  ProgramVersion* v = new ProgramVersion();
+  v->bytecode = program;
+  v->version = versions;
+  current.store(v, std::memory_order_release);
+}
+
+// Readers must be gone by now
+ProgramHandle::~ProgramHandle()
+{
+  for (const RetiredVersion& r : retired)
+  {
+    delete r.version;
+  }
+  delete current.load(std::memory_order_relaxed);
+}
+
+uint64_t ProgramHandle::Publish(const std::vector<uint64_t>& program,
+                                const std::string& soPath, ProgramCost* cost)
+{
+  CostBudget limit;
+  {
+    std::lock_guard<std::mutex> lock(writer);
+    limit = budget;
+  }
+  ProgramCost found;
+  bool admitted = Admit(program, limit, soPath.empty() ? interpreterCost : nativeCost,
+                        &found);
+  if (cost)
+  {
+    *cost = found;
+  }
+  if (!admitted)
+  {
+    return 0;
+  }
+
+  // everything expensive happens before taking the lock
+  std::unique_ptr<ProgramVersion> v(new ProgramVersion());
+  v->bytecode = program;
+  if (!soPath.empty())
+  {
+    // a path of its own, dlopen() would hand back the loaded old one
+    static std::atomic<uint64_t> builds(0);
+    std::string so = soPath + ".v" + std::to_string(builds.fetch_add(1) + 1);
+
+    // versions are replaced too often to be tail call targets
+    v->native.reset(new AotProgram(false));
+    bool ok = v->native->Compile(v->bytecode, so);
+    unlink(so.c_str());
+    unlink((so + ".cpp").c_str());
+    if (!ok)
+    {
+      return 0;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(writer);
+  v->version = ++versions;
+  ProgramVersion* old = current.exchange(v.release(), std::memory_order_acq_rel);
+
+  // readers entering from here on see the new version
+  uint64_t epoch = globalEpoch.fetch_add(1, std::memory_order_acq_rel);
+  retired.push_back({old, epoch});
+
+  ReclaimLocked();
+  return versions;
+}
+
+size_t ProgramHandle::ReclaimLocked()
+{
+  if (retired.empty())
+  {
+    return 0;
+  }
+
+  // a version retired in epoch e can only be held by readers that
+  // entered in e or before
+  uint64_t oldest = OldestReader();
+  size_t kept = 0;
+  for (size_t i = 0; i < retired.size(); i++)
+  {
+    if (retired[i].epoch < oldest)
+    {
+      delete retired[i].version;
+    }
+    else
+    {
+      retired[kept++] = retired[i];
+    }
+  }
+  retired.resize(kept);
+
+  return kept;
+}
+
+size_t ProgramHandle::Reclaim()
+{
+  std::lock_guard<std::mutex> lock(writer);
+  return ReclaimLocked();
+}
+
+size_t ProgramHandle::Retired()
+{
+  std::lock_guard<std::mutex> lock(writer);
+  return retired.size();
+}
+
+void ProgramHandle::SetBudget(const CostBudget& b)
+{
+  std::lock_guard<std::mutex> lock(writer);
+  budget = b;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Analysis.h"
+
+class AotProgram;
+
+// Threads that may be inside an EpochGuard at the same time
+#define EPOCH_MAX_READERS 256
+
+// Read-side critical section of the epoch scheme ProgramHandle frees
+// old versions with. While a thread holds a guard, nothing retired
+// after it entered is freed. Entering costs one store and a fence,
+// leaving one store; guards nest.
+class EpochGuard
+{
+public:
+  EpochGuard();
+  ~EpochGuard();
+
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// One published program, immutable until it is freed
+struct ProgramVersion
+{
+  std::vector<uint64_t> bytecode;
+  std::unique_ptr<AotProgram> native; // if compiled
+  uint64_t version;                   // 1 for the first, then counting up
+
+  ProgramVersion();
+  ~ProgramVersion();
+};
+
+// A program that can be replaced while it is running.
+//
+// Workers enter an EpochGuard, Get() the current version once and run
+// a whole batch with it. Publish() swaps in a new version with a single
+// atomic store, so every Get() after it sees the new program and none
+// sees a mix; the old version is retired and freed once every thread
+// that could still be running it has left its guard. Readers take no
+// locks and never wait, writers serialise on a mutex.
+//
+// Maps are attached to the VMs that run the program, not to the
+// program, so their state carries over from one version to the next.
+class ProgramHandle
+{
+private:
+  struct RetiredVersion
+  {
+    ProgramVersion* version;
+    uint64_t epoch; // freed once every reader is past it
+  };
+
+  std::atomic<ProgramVersion*> current;
+  std::mutex writer;
+  std::vector<RetiredVersion> retired;
+  uint64_t versions;
+  CostBudget budget;
+
+  size_t ReclaimLocked();
+
+public:
+  ProgramHandle(const std::vector<uint64_t>& program);
+  ~ProgramHandle();
+
+  ProgramHandle(const ProgramHandle&) = delete;
+  ProgramHandle& operator=(const ProgramHandle&) = delete;
+
+  // The current version, only valid until the caller's EpochGuard ends
+  const ProgramVersion* Get() const
+  {
+    return current.load(std::memory_order_acquire);
+  };
+
+  // Make program the current version and return its number. With
+  // soPath, it is compiled ahead of time first (to soPath.v<n>, removed
+  // again once loaded) and not published if that fails, returning 0.
+  // Programs over the budget are not published either; cost, if given,
+  // is set to what the program was measured at, to tell why.
+  uint64_t Publish(const std::vector<uint64_t>& program,
+                   const std::string& soPath = "", ProgramCost* cost = nullptr);
+
+  // Free the retired versions no reader can hold any more, returns how
+  // many are left. Publish() does this too.
+  size_t Reclaim();
+  size_t Retired();
+
+  // Limit the worst case cost (see WorstCaseCost) of versions published
+  // from now on, for the engine they will run on
+  void SetBudget(const CostBudget&);
+};
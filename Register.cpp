@@ -15,14 +15,14 @@ uint64_t Register::Read64() const
 
 uint32_t Register::Read32() const
 {
-  uint32_t ls = data & (0x0f << 28);
+  uint32_t ls = data & 0xffffffff;
   
   return ls;
 }
 
 uint32_t Register::ReadMS32() const
 {
-  uint32_t ms = (data & (0xf << 28)) >> 32;
+  uint32_t ms = data >> 32;
   
   return ms;
 }
@@ -37,8 +37,8 @@ void Register::Write32(uint32_t newVal)
   data = newVal;
 }
 
+// Replaces the upper half only, the lower 32 bits are kept
 void Register::WriteMS32(uint32_t newVal)
 {
-  data = newVal;
-  data <<= 32;
+  data = (data & 0xffffffff) | ((uint64_t)newVal << 32);
 }
\ No newline at end of file
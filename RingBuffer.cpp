@@ -0,0 +1,292 @@
+#include "RingBuffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <ctime>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+
+// The control block and the headers are padded to pages so the data
+// area stays aligned
+static const size_t CONTROL_SZ = 4096;
+
+static uint64_t RecordSpan(uint64_t size)
+{
+  return size ? (size + RINGBUF_ALIGN - 1) & ~(uint64_t)(RINGBUF_ALIGN - 1)
+              : RINGBUF_ALIGN;
+}
+
+static uint64_t HeadersSize(uint64_t capacity)
+{
+  uint64_t size = capacity / RINGBUF_ALIGN * sizeof(uint32_t);
+  return (size + CONTROL_SZ - 1) & ~(uint64_t)(CONTROL_SZ - 1);
+}
+
+static long Futex(std::atomic<uint32_t>* word, int op, uint32_t val,
+                  const struct timespec* timeout)
+{
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, val,
+                 timeout, nullptr, 0);
+}
+
+RingBufMap::RingBufMap(uint32_t size, uint32_t wakeupBatch)
+: Map(BPF_MAP_TYPE_RINGBUF, 0, 0, 0), ctl(nullptr), headers(nullptr),
+  data(nullptr),
+  mapSize(0), mask(0), wakeupBatch(wakeupBatch ? wakeupBatch : 1)
+{
+  uint64_t capacity = CONTROL_SZ;
+  while (capacity < size)
+  {
+    capacity <<= 1;
+  }
+  maxEntries = capacity;
+  mask = capacity - 1;
+
+  // fresh anonymous pages are zero, which the record protocol relies on
+  uint64_t headersSize = HeadersSize(capacity);
+  mapSize = CONTROL_SZ + headersSize + capacity;
+  void* mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    throw std::bad_alloc();
+  }
+
+  ctl = new (mem) Control();
+  ctl->consumerPos.store(0, std::memory_order_relaxed);
+  ctl->producerPos.store(0, std::memory_order_relaxed);
+  ctl->dropped.store(0, std::memory_order_relaxed);
+  ctl->wakeSeq.store(0, std::memory_order_relaxed);
+  ctl->waiting.store(0, std::memory_order_relaxed);
+  ctl->pending.store(0, std::memory_order_relaxed);
+  headers = reinterpret_cast<std::atomic<uint32_t>*>(
+          static_cast<uint8_t*>(mem) + CONTROL_SZ);
+  data = static_cast<uint8_t*>(mem) + CONTROL_SZ + headersSize;
+}
+
+RingBufMap::~RingBufMap()
+{
+  ctl->~Control();
+  munmap(ctl, mapSize);
+}
+
+void* RingBufMap::Lookup(const void*)
+{
+  return nullptr;
+}
+
+int RingBufMap::Update(const void*, const void*, uint64_t)
+{
+  return -EOPNOTSUPP;
+}
+
+int RingBufMap::Delete(const void*)
+{
+  return -EOPNOTSUPP;
+}
+
+/* ------------------------ Producer ----------------------------- */
+
+// A record never wraps: if it does not fit before the end of the data
+// area, the tail is claimed along with it and filled with a discarded
+// padding record.
+void* RingBufMap::Reserve(uint64_t size, uint64_t)
+{
+  uint64_t need = RecordSpan(size);
+  if (size > RINGBUF_LEN_MASK || need > Capacity())
+  {
+    ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  uint64_t prod = ctl->producerPos.load(std::memory_order_relaxed);
+  uint64_t pad;
+  do
+  {
+    uint64_t cons = ctl->consumerPos.load(std::memory_order_acquire);
+    uint64_t off = prod & mask;
+    pad = (off + need > Capacity()) ? Capacity() - off : 0;
+    if (prod + pad + need - cons > Capacity())
+    {
+      ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  } while (!ctl->producerPos.compare_exchange_weak(prod, prod + pad + need,
+          std::memory_order_acq_rel, std::memory_order_relaxed));
+
+  if (pad)
+  {
+    Header(prod)->store(pad | RINGBUF_BUSY_BIT | RINGBUF_COMMIT_BIT
+                        | RINGBUF_DISCARD_BIT, std::memory_order_release);
+    prod += pad;
+  }
+
+  // the commit bit stays clear until Submit/Discard
+  Header(prod)->store(size | RINGBUF_BUSY_BIT, std::memory_order_relaxed);
+
+  return data + (prod & mask);
+}
+
+// Only the first commit of a reserved record takes effect. The sample
+// may come from a program, so its header is found from its offset and
+// nothing in the data area is trusted.
+int RingBufMap::Commit(void* sample, uint32_t bits, uint64_t flags)
+{
+  uint64_t off = static_cast<uint8_t*>(sample) - data;
+  if (static_cast<uint8_t*>(sample) < data || off >= Capacity()
+      || off % RINGBUF_ALIGN != 0)
+  {
+    return -EINVAL;
+  }
+
+  // seq_cst pairs with the consumer announcing itself in Poll(), so
+  // either it sees this record or we see it waiting
+  std::atomic<uint32_t>* hdr = Header(off);
+  uint32_t len = hdr->load(std::memory_order_relaxed);
+  do
+  {
+    if ((len & (RINGBUF_BUSY_BIT | RINGBUF_COMMIT_BIT)) != RINGBUF_BUSY_BIT)
+    {
+      return -EINVAL;
+    }
+  } while (!hdr->compare_exchange_weak(len, len | bits, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed));
+
+  // a busy consumer will find the record anyway, only a sleeping one
+  // needs counting and waking
+  if ((flags & BPF_RB_NO_WAKEUP) || !ctl->waiting.load(std::memory_order_seq_cst))
+  {
+    return 0;
+  }
+
+  uint32_t pending = ctl->pending.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (!(flags & BPF_RB_FORCE_WAKEUP) && pending < wakeupBatch)
+  {
+    return 0;
+  }
+
+  ctl->pending.store(0, std::memory_order_relaxed);
+  ctl->wakeSeq.fetch_add(1, std::memory_order_release);
+  Futex(&ctl->wakeSeq, FUTEX_WAKE, 1, nullptr);
+  return 0;
+}
+
+int RingBufMap::Submit(void* sample, uint64_t flags)
+{
+  return Commit(sample, RINGBUF_COMMIT_BIT, flags);
+}
+
+int RingBufMap::Discard(void* sample, uint64_t flags)
+{
+  return Commit(sample, RINGBUF_COMMIT_BIT | RINGBUF_DISCARD_BIT, flags);
+}
+
+int RingBufMap::Output(const void* src, uint64_t size, uint64_t flags)
+{
+  void* sample = Reserve(size, 0);
+  if (!sample)
+  {
+    return -EAGAIN;
+  }
+
+  memcpy(sample, src, size);
+  return Submit(sample, flags);
+}
+
+/* ------------------------ Consumer ----------------------------- */
+
+uint64_t RingBufMap::Available() const
+{
+  return ctl->producerPos.load(std::memory_order_acquire)
+          - ctl->consumerPos.load(std::memory_order_relaxed);
+}
+
+// Headers of consumed records are zeroed before the space is handed
+// back to producers, so a header without the busy bit always means
+// "not reserved" rather than a stale record.
+int RingBufMap::Consume(RingBufCallback fn, void* ctx)
+{
+  uint64_t cons = ctl->consumerPos.load(std::memory_order_relaxed);
+  int count = 0;
+
+  while (cons != ctl->producerPos.load(std::memory_order_acquire))
+  {
+    uint32_t len = Header(cons)->load(std::memory_order_acquire);
+    if (!(len & RINGBUF_COMMIT_BIT))
+    {
+      break;
+    }
+
+    uint32_t size = len & RINGBUF_LEN_MASK;
+    int stop = 0;
+    if (!(len & RINGBUF_DISCARD_BIT))
+    {
+      count++;
+      stop = fn(ctx, data + (cons & mask), size);
+    }
+
+    Header(cons)->store(0, std::memory_order_relaxed);
+    cons += RecordSpan(size);
+    ctl->consumerPos.store(cons, std::memory_order_release);
+
+    if (stop)
+    {
+      break;
+    }
+  }
+
+  return count;
+}
+
+// Sleeps in slices of RINGBUF_WAKEUP_MS: producers only wake a full
+// batch, the slices bound how long a partial one waits
+int RingBufMap::Poll(RingBufCallback fn, void* ctx, int timeoutMs)
+{
+  int count = Consume(fn, ctx);
+  if (count || timeoutMs == 0)
+  {
+    return count;
+  }
+
+  using namespace std::chrono;
+  steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeoutMs);
+
+  ctl->pending.store(0, std::memory_order_relaxed);
+  ctl->waiting.store(1, std::memory_order_seq_cst);
+  while (!count)
+  {
+    // recheck after announcing ourselves (and after reading the
+    // sequence), a commit may have just missed us
+    uint32_t seq = ctl->wakeSeq.load(std::memory_order_acquire);
+    uint64_t cons = ctl->consumerPos.load(std::memory_order_relaxed);
+    bool ready = cons != ctl->producerPos.load(std::memory_order_acquire)
+            && (Header(cons)->load(std::memory_order_seq_cst) & RINGBUF_COMMIT_BIT);
+    if (!ready)
+    {
+      int64_t sliceMs = RINGBUF_WAKEUP_MS;
+      if (timeoutMs > 0)
+      {
+        int64_t leftMs = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        if (leftMs <= 0)
+        {
+          break;
+        }
+        sliceMs = std::min(sliceMs, leftMs);
+      }
+      struct timespec ts;
+      ts.tv_sec = sliceMs / 1000;
+      ts.tv_nsec = (sliceMs % 1000) * 1000000L;
+      Futex(&ctl->wakeSeq, FUTEX_WAIT, seq, &ts);
+    }
+    // discarded records count as none, keep waiting after them
+    count = Consume(fn, ctx);
+  }
+  ctl->waiting.store(0, std::memory_order_relaxed);
+
+  return count;
+}
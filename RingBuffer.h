@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "Maps.h"
+
+// Flags of bpf_ringbuf_output/submit/discard (as in the kernel)
+#define BPF_RB_NO_WAKEUP    (1ULL << 0)
+#define BPF_RB_FORCE_WAKEUP (1ULL << 1)
+
+// Record header: payload size | RINGBUF_BUSY_BIT (reserved), then
+// | RINGBUF_COMMIT_BIT (submitted or discarded) | RINGBUF_DISCARD_BIT.
+// A record is visible to the consumer once the commit bit is set.
+#define RINGBUF_COMMIT_BIT  (1U << 31)
+#define RINGBUF_DISCARD_BIT (1U << 30)
+#define RINGBUF_BUSY_BIT    (1U << 29)
+#define RINGBUF_LEN_MASK    (RINGBUF_BUSY_BIT - 1)
+
+// Records start on this boundary, and take up at least this much
+#define RINGBUF_ALIGN 8
+
+// Wake the consumer after this many records unless told otherwise
+#define RINGBUF_WAKEUP_BATCH 64
+
+// A sleeping consumer looks for a partial batch this often
+#define RINGBUF_WAKEUP_MS 10
+
+// Consumer callback, returning non-zero stops the current Consume()
+typedef int (*RingBufCallback)(void* ctx, const void* data, uint32_t size);
+
+// Multi-producer single-consumer ring of variable sized records, used
+// by programs to send events to the host.
+//
+// Producers claim space with a CAS on the producer position, fill the
+// record in place and commit it by setting the header's commit bit, so
+// no lock is taken and nothing is allocated per event. When the ring is
+// full the record is dropped and counted. Records are consumed in
+// reservation order; one that is reserved but not committed holds back
+// the ones behind it.
+//
+// The consumer sleeps on a futex and is woken once RINGBUF_WAKEUP_BATCH
+// records are pending (or on BPF_RB_FORCE_WAKEUP), which keeps syscalls
+// off the producers' fast path. A partial batch is picked up by the
+// consumer waking on its own every RINGBUF_WAKEUP_MS, so it waits at
+// most that long, whatever the timeout given to Poll().
+//
+// The ring lives in a MAP_SHARED mapping. maxEntries is the size of the
+// data area in bytes, rounded up to a power of two of at least a page.
+// Programs only see the samples they reserved (see VM::MapSample), the
+// ring is not addressable as a whole. Headers live in an array of their
+// own in front of the data area, one per RINGBUF_ALIGN bytes, and
+// Submit/Discard accept only the start of a record that is reserved and
+// not committed yet.
+class RingBufMap : public Map
+{
+private:
+  // Shared state in front of the data area. Positions are free running
+  // byte counts; producer and consumer sides sit on separate lines.
+  struct Control
+  {
+    alignas(64) std::atomic<uint64_t> consumerPos;
+    alignas(64) std::atomic<uint64_t> producerPos;
+    std::atomic<uint64_t> dropped;
+    alignas(64) std::atomic<uint32_t> wakeSeq; // futex word
+    std::atomic<uint32_t> waiting;             // consumer is asleep
+    std::atomic<uint32_t> pending;             // commits since last wakeup
+  };
+
+  Control* ctl;
+  std::atomic<uint32_t>* headers;
+  uint8_t* data;
+  size_t mapSize;
+  uint64_t mask;
+  uint32_t wakeupBatch;
+
+  std::atomic<uint32_t>* Header(uint64_t pos) const
+  {
+    return &headers[(pos & mask) / RINGBUF_ALIGN];
+  };
+  int Commit(void* sample, uint32_t bits, uint64_t flags);
+
+public:
+  RingBufMap(uint32_t size, uint32_t wakeupBatch = RINGBUF_WAKEUP_BATCH);
+  ~RingBufMap();
+
+  // Not keyed, these fail as in the kernel
+  void* Lookup(const void* key);
+  int Update(const void* key, const void* value, uint64_t flags);
+  int Delete(const void* key);
+
+  // Producer side, any number of threads.
+  // Reserve returns the sample to fill, nullptr if the ring is full.
+  // Submit and Discard return -EINVAL for anything but a sample of this
+  // ring that is still reserved.
+  void* Reserve(uint64_t size, uint64_t flags);
+  int Submit(void* sample, uint64_t flags);
+  int Discard(void* sample, uint64_t flags);
+  int Output(const void* src, uint64_t size, uint64_t flags);
+
+  // Consumer side, a single thread.
+  // Consume hands every committed record to fn and returns how many
+  // were seen; Poll first waits up to timeoutMs (-1 forever) for any.
+  int Consume(RingBufCallback fn, void* ctx);
+  int Poll(RingBufCallback fn, void* ctx, int timeoutMs);
+
+  uint64_t Capacity() const {return mask + 1;};
+  uint64_t Available() const;
+  uint64_t Dropped() const {return ctl->dropped.load(std::memory_order_relaxed);};
+};
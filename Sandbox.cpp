@@ -0,0 +1,107 @@
+#include "Sandbox.h"
+
+#include <csetjmp>
+#include <csignal>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+SandboxMemory::SandboxMemory(size_t bytes)
+: reservation(nullptr), reservationSize(0), base(nullptr), size(0)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size = (bytes + page - 1) / page * page;
+  reservationSize = SANDBOX_GUARD_SZ + size + SANDBOX_GUARD_SZ;
+
+  // reserve everything inaccessible, then open up the middle
+  void* mem = mmap(nullptr, reservationSize, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    throw std::bad_alloc();
+  }
+  reservation = static_cast<uint8_t*>(mem);
+  base = reservation + SANDBOX_GUARD_SZ;
+
+  if (mprotect(base, size, PROT_READ | PROT_WRITE) != 0)
+  {
+    munmap(reservation, reservationSize);
+    throw std::bad_alloc();
+  }
+}
+
+SandboxMemory::~SandboxMemory()
+{
+  munmap(reservation, reservationSize);
+}
+
+/* ---------------------- Fault recovery ------------------------- */
+
+struct SandboxJump
+{
+  sigjmp_buf buf;
+  const SandboxMemory* mem;
+};
+
+// Innermost SandboxCall on this thread
+static thread_local SandboxJump* activeJump = nullptr;
+
+static struct sigaction previousAction;
+
+static void SandboxHandler(int sig, siginfo_t* info, void* uctx)
+{
+  SandboxJump* jump = activeJump;
+  if (jump && jump->mem->Contains(info->si_addr))
+  {
+    // SA_NODEFER left SIGSEGV unblocked, so no mask to restore
+    siglongjmp(jump->buf, 1);
+  }
+
+  // not ours
+  if (previousAction.sa_flags & SA_SIGINFO)
+  {
+    previousAction.sa_sigaction(sig, info, uctx);
+    return;
+  }
+  if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN)
+  {
+    previousAction.sa_handler(sig);
+    return;
+  }
+
+  // put the default back, returning re-runs the access and kills us
+  sigaction(SIGSEGV, &previousAction, nullptr);
+}
+
+static bool InstallHandler()
+{
+  struct sigaction sa;
+  sa.sa_sigaction = SandboxHandler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+
+  return sigaction(SIGSEGV, &sa, &previousAction) == 0;
+}
+
+bool SandboxCall(const SandboxMemory& mem, void (*fn)(void*), void* arg)
+{
+  static bool installed = InstallHandler();
+  (void)installed;
+
+  SandboxJump jump;
+  jump.mem = &mem;
+  SandboxJump* outer = activeJump;
+
+  // no signal mask is saved, which keeps this free of system calls
+  if (sigsetjmp(jump.buf, 0))
+  {
+    activeJump = outer;
+    return false;
+  }
+
+  activeJump = &jump;
+  fn(arg);
+  activeJump = outer;
+
+  return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Opcodes.h"
+
+// Guard area on either side of sandboxed memory. Accesses relative to
+// the frame pointer carry a signed 16-bit offset, so this covers every
+// one of them that misses the stack.
+#define SANDBOX_GUARD_SZ (64 * 1024)
+
+// Memory surrounded by PROT_NONE guard pages, so that accesses which
+// stay within the guards need no bounds check: a miss faults instead.
+// The usable size is rounded up to whole pages.
+class SandboxMemory
+{
+private:
+  uint8_t* reservation;
+  size_t reservationSize;
+  uint8_t* base;
+  size_t size;
+
+public:
+  SandboxMemory(size_t size);
+  ~SandboxMemory();
+
+  SandboxMemory(const SandboxMemory&) = delete;
+  SandboxMemory& operator=(const SandboxMemory&) = delete;
+
+  uint8_t* Base() const {return base;};
+  size_t Size() const {return size;};
+
+  // Whether addr is in this block or its guards
+  bool Contains(const void* addr) const
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(addr);
+    return p >= reservation && p < reservation + reservationSize;
+  };
+};
+
+// Calls fn(arg) and returns true, or returns false as soon as fn
+// touches the guard pages of mem. A process wide SIGSEGV handler jumps
+// back here, so fn must not hold locks or own resources that need
+// unwinding at the time. Faults anywhere else are passed on to the
+// handler that was installed before.
+bool SandboxCall(const SandboxMemory& mem, void (*fn)(void*), void* arg);
+
+// Whether insn may change R10. Compiled code only accesses the stack
+// through the frame pointer without checks if no instruction of the
+// program does, as R10 then always holds the top of the stack.
+constexpr bool WritesFramePointer(uint64_t insn)
+{
+  return (((insn & DST_MASK) >> SHL_DST) == 10
+          && ((insn & 0x07) == 0x07 || (insn & 0x07) == 0x04
+              || (insn & 0x07) == 0x01 || (insn & OP_MASK) == BPF_LDDW))
+      || (((insn & OP_MASK) == BPF_ATOMIC_W || (insn & OP_MASK) == BPF_ATOMIC_DW)
+          && ((insn & SRC_MASK) >> SHL_SRC) == 10
+          && (((insn & IMM_MASK) >> SHL_IMM) & BPF_ATOMIC_FETCH));
+}
@@ -0,0 +1,108 @@
+#include "Scheduler.h"
+#include "VM.h"
+#include "ContextPool.h"
+
+#include <sched.h>
+
+Scheduler::Scheduler()
+: worker(new VM()), started(0), suspensions(0)
+{
+  worker->SetTrace(false);
+}
+
+Scheduler::~Scheduler()
+{
+
+}
+
+Scheduler& Scheduler::ThisThread()
+{
+  static thread_local Scheduler scheduler;
+  return scheduler;
+}
+
+void Scheduler::Start(VM& vm, const std::vector<uint64_t>& program,
+                      SchedDoneFn done, void* arg)
+{
+  vm.Load(program);
+  ready.push_back({&vm, nullptr, done, arg});
+  started++;
+}
+
+void Scheduler::Start(ExecContext& ctx, const std::vector<uint64_t>& program,
+                      SchedDoneFn done, void* arg)
+{
+  ctx.Start(program);
+  ready.push_back({worker.get(), &ctx, done, arg});
+  started++;
+}
+
+bool Scheduler::IsReady(const Task& task) const
+{
+  return task.ctx ? task.ctx->IsReady() : task.vm->IsReady();
+}
+
+void Scheduler::Step(const Task& task)
+{
+  if (task.ctx)
+  {
+    task.vm->LoadContext(*task.ctx);
+  }
+  uint64_t ret = task.vm->Resume();
+  if (task.ctx)
+  {
+    task.vm->SaveContext(*task.ctx);
+  }
+
+  if (task.vm->IsSuspended())
+  {
+    suspensions++;
+    waiting.push_back(task);
+    return;
+  }
+
+  if (task.done)
+  {
+    task.done(task.arg, *task.vm, ret);
+  }
+}
+
+size_t Scheduler::Poll()
+{
+  // only what is queued now, done callbacks may start more
+  for (size_t n = ready.size(); n > 0; n--)
+  {
+    Task task = ready.front();
+    ready.pop_front();
+    Step(task);
+  }
+
+  // wake up the ones that can go on, in the order they suspended
+  size_t kept = 0;
+  for (size_t i = 0; i < waiting.size(); i++)
+  {
+    if (IsReady(waiting[i]))
+    {
+      ready.push_back(waiting[i]);
+    }
+    else
+    {
+      waiting[kept++] = waiting[i];
+    }
+  }
+  waiting.resize(kept);
+
+  return InFlight();
+}
+
+void Scheduler::Run()
+{
+  while (Poll())
+  {
+    // all blocked, let whoever fetches their data run
+    if (ready.empty())
+    {
+      sched_yield();
+    }
+  }
+}
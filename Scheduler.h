@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+class VM;
+struct ExecContext;
+
+// Called once a program has run to completion (exit or fault), with
+// its return value
+typedef void (*SchedDoneFn)(void* arg, VM& vm, uint64_t ret);
+
+// Interleaves many program executions on one thread.
+//
+// Every execution has a VM of its own, which holds all of its state
+// (pc, registers, stack), so a run that stops at a helper call is
+// resumed later with nothing saved or restored: each VM is a stackless
+// coroutine. When a helper suspends (see VM::Suspend) the scheduler
+// parks that VM and goes on with the others; it is resumed once its
+// helper reports ready. Slow lookups of thousands of executions in
+// flight thereby overlap instead of running one after another.
+//
+// Executions started with an ExecContext (see ContextPool.h) share the
+// scheduler's own VM instead, which is switched to each of them in
+// turn; attach the maps they use to Worker().
+//
+// Not thread safe, use one per thread (ThisThread()).
+class Scheduler
+{
+private:
+  struct Task
+  {
+    VM* vm;
+    ExecContext* ctx; // run on worker if set
+    SchedDoneFn done;
+    void* arg;
+  };
+
+  std::unique_ptr<VM> worker;
+
+  std::deque<Task> ready;    // can run
+  std::vector<Task> waiting; // suspended in a helper
+
+  uint64_t started;
+  uint64_t suspensions;
+
+  void Step(const Task&);
+  bool IsReady(const Task&) const;
+
+public:
+  Scheduler();
+  ~Scheduler();
+
+  static Scheduler& ThisThread();
+
+  // Load program into vm and queue it. Inputs (R1-R5, context) are set
+  // on vm beforehand; vm must not be used otherwise until done runs.
+  void Start(VM& vm, const std::vector<uint64_t>& program,
+             SchedDoneFn done, void* arg);
+
+  // The same for an execution context. done gets the worker VM, still
+  // switched to ctx, and may release ctx.
+  void Start(ExecContext& ctx, const std::vector<uint64_t>& program,
+             SchedDoneFn done, void* arg);
+  VM& Worker() {return *worker;};
+
+  // Run every queued execution until it completes or suspends, then
+  // queue the suspended ones whose helper is ready. Returns how many
+  // executions are still in flight.
+  size_t Poll();
+
+  // Poll until everything has completed
+  void Run();
+
+  size_t InFlight() const {return ready.size() + waiting.size();};
+  uint64_t Started() const {return started;};
+  uint64_t Suspensions() const {return suspensions;};
+};
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <endian.h>
+
+#include "VM.h"
+#include "Opcodes.h"
+#include "Helpers.h"
+#include "Sandbox.h"
+
+// Compile-time specialisation of programs that are known at build time.
+//
+// A program is a type holding a constexpr array of instructions, built
+// with BPF_INSN() and the encodings in Opcodes.h:
+//
+//   struct Filter
+//   {
+//     static constexpr uint64_t insns[] =
+//     {
+//       BPF_INSN(BPF_MOV_IMM, 0, 0, 0, 0x1),
+//       BPF_INSN(BPF_EXIT, 0, 0, 0, 0),
+//     };
+//   };
+//   constexpr uint64_t Filter::insns[]; // out-of-line definition (C++14)
+//
+//   uint64_t ret = StaticProgram<Filter>::Run(vm);
+//
+// Every instruction is expanded into its own StaticStep instance whose
+// operands are template constants, so decode and dispatch are folded
+// away by the compiler. Falling through is a call to the next step and
+// a jump is a call to the step of its target, which the optimiser turns
+// into straight-line code and plain branches. Nothing is generated at
+// runtime, so no executable memory is needed.
+//
+// Semantics are those of VM::Eval. Programs are limited by the
+// compiler's template instantiation depth (900 instructions for GCC).
+// Programs with loops or bpf_loop callbacks are interpreted.
+
+#define STATIC_EXIT     0
+#define STATIC_TAILCALL 1
+#define STATIC_FAULT    2
+#define STATIC_DIVZERO  3
+#define STATIC_BADOP    4
+
+// Registers and environment of a running static program
+struct StaticState
+{
+  uint64_t r[11];
+  const MemRegion* regions;
+  uint8_t* fp; // top of the guarded stack, for SB steps
+  VM* vm;
+  uint64_t faultPc;
+};
+
+template <typename P>
+constexpr size_t StaticSize()
+{
+  return sizeof(P::insns) / sizeof(P::insns[0]);
+}
+
+template <typename P>
+constexpr bool StaticWritesFp()
+{
+  for (size_t pc = 0; pc < StaticSize<P>(); pc++)
+  {
+    if (WritesFramePointer(P::insns[pc]))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Backward jumps or callbacks, which run in the interpreter: a loop of
+// steps would be a recursion as deep as the loop runs
+template <typename P>
+constexpr bool StaticHasLoops()
+{
+  for (size_t pc = 0; pc < StaticSize<P>(); pc++)
+  {
+    uint8_t op = P::insns[pc] & OP_MASK;
+    if (((op & 0x07) == 0x05 && op != BPF_CALL_IMM && op != BPF_EXIT
+            && (int16_t)((P::insns[pc] & OFF_MASK) >> SHL_OFF) < 0)
+        || (op == BPF_LDDW
+            && ((P::insns[pc] & SRC_MASK) >> SHL_SRC) == BPF_PSEUDO_FUNC))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Out of range register numbers read and write R0, as with VM::GetReg
+constexpr unsigned StaticReg(unsigned num)
+{
+  return (num <= 10) ? num : 0;
+}
+
+// Instruction classes that need different control flow
+enum StaticKind
+{
+  KIND_ALU64, KIND_ALU32, KIND_ENDIAN, KIND_JA, KIND_JMP, KIND_CALL,
+  KIND_EXIT, KIND_LDDW, KIND_LDX, KIND_ST, KIND_STX, KIND_ATOMIC, KIND_PKT,
+  KIND_BAD
+};
+
+constexpr StaticKind StaticKindOf(uint8_t op)
+{
+  return (op == BPF_LE || op == BPF_BE) ? KIND_ENDIAN
+       : (op == BPF_JA) ? KIND_JA
+       : (op == BPF_CALL_IMM) ? KIND_CALL
+       : (op == BPF_EXIT) ? KIND_EXIT
+       : (op == BPF_LDDW) ? KIND_LDDW
+       : (op == BPF_LDXW || op == BPF_LDXH || op == BPF_LDXB || op == BPF_LDXDW) ? KIND_LDX
+       : (op == BPF_STW || op == BPF_STH || op == BPF_STB || op == BPF_STDW) ? KIND_ST
+       : (op == BPF_STXW || op == BPF_STXH || op == BPF_STXB || op == BPF_STXDW) ? KIND_STX
+       : (op == BPF_ATOMIC_W || op == BPF_ATOMIC_DW) ? KIND_ATOMIC
+       : ((op & 0x07) == 0x00 && op >= BPF_LDABSW && op <= BPF_LDINDDW) ? KIND_PKT
+       : ((op & 0x07) == 0x05 && op >= BPF_JEQ_IMM && op <= BPF_JSGE_SRC) ? KIND_JMP
+       : ((op & 0x07) == 0x07 && (op & 0xf0) <= 0xc0 && (op & 0xf0) != 0x80) ? KIND_ALU64
+       : ((op & 0x07) == 0x04 && (op & 0xf0) <= 0xc0 && (op & 0xf0) != 0x80) ? KIND_ALU32
+       : (op == BPF_NEG) ? KIND_ALU64
+       : (op == BPF_NEG32) ? KIND_ALU32
+       : KIND_BAD;
+}
+
+// Decoded fields of instruction pc, all compile-time constants
+template <typename P, size_t PC>
+struct StaticInsn
+{
+  static constexpr uint64_t raw = P::insns[PC];
+  static constexpr uint8_t op = raw & OP_MASK;
+  static constexpr unsigned dst = StaticReg((raw & DST_MASK) >> SHL_DST);
+  static constexpr unsigned src = StaticReg((raw & SRC_MASK) >> SHL_SRC);
+  static constexpr uint16_t off = (raw & OFF_MASK) >> SHL_OFF;
+  static constexpr uint32_t imm = (raw & IMM_MASK) >> SHL_IMM;
+  static constexpr bool useSrc = (op & 0x08) != 0;
+  static constexpr StaticKind kind = StaticKindOf(op);
+  static constexpr bool divides = (op & 0xf0) == 0x30 || (op & 0xf0) == 0x90;
+};
+
+// 64-bit ALU operation, OP is a constant so the switch folds away
+template <uint8_t OP>
+inline uint64_t StaticAlu64(uint64_t d, uint64_t s)
+{
+  switch (OP & 0xf0)
+  {
+    case 0x00: return d + s;
+    case 0x10: return d - s;
+    case 0x20: return d * s;
+    case 0x30: return d / s;
+    case 0x40: return d | s;
+    case 0x50: return d & s;
+    case 0x60: return d << (s & 63);
+    case 0x70: return d >> (s & 63);
+    case 0x80: return -d;
+    case 0x90: return d % s;
+    case 0xa0: return d ^ s;
+    case 0xb0: return s;
+    default:   return (uint64_t)((int64_t)d >> (s & 63));
+  }
+}
+
+// 32-bit ALU operation, the result is zero extended
+template <uint8_t OP>
+inline uint64_t StaticAlu32(uint64_t dst, uint64_t src)
+{
+  uint32_t d = dst;
+  uint32_t s = src;
+  switch (OP & 0xf0)
+  {
+    case 0x00: return (uint32_t)(d + s);
+    case 0x10: return (uint32_t)(d - s);
+    case 0x20: return (uint32_t)(d * s);
+    case 0x30: return d / s;
+    case 0x40: return d | s;
+    case 0x50: return d & s;
+    case 0x60: return (uint32_t)(d << (s & 31));
+    case 0x70: return d >> (s & 31);
+    case 0x80: return (uint32_t)-d;
+    case 0x90: return d % s;
+    case 0xa0: return d ^ s;
+    case 0xb0: return s;
+    default:   return (uint32_t)((int32_t)d >> (s & 31));
+  }
+}
+
+template <uint8_t OP, uint32_t IMM>
+inline uint64_t StaticEndian(uint64_t d)
+{
+  if (OP == BPF_LE)
+  {
+    return (IMM == 16) ? htole16((uint16_t)d)
+         : (IMM == 32) ? htole32((uint32_t)d) : htole64(d);
+  }
+  return (IMM == 16) ? htobe16((uint16_t)d)
+       : (IMM == 32) ? htobe32((uint32_t)d) : htobe64(d);
+}
+
+template <uint8_t OP>
+inline bool StaticCond(uint64_t d, uint64_t s)
+{
+  switch (OP & 0xf0)
+  {
+    case 0x10: return d == s;
+    case 0x20: return d > s;
+    case 0x30: return d >= s;
+    case 0x40: return (d & s) != 0;
+    case 0x50: return d != s;
+    case 0x60: return (int64_t)d > (int64_t)s;
+    default:   return (int64_t)d >= (int64_t)s;
+  }
+}
+
+// Access width of a load or store
+template <uint8_t OP>
+struct StaticWidth
+{
+  typedef typename std::conditional<
+          OP == BPF_LDXW || OP == BPF_STW || OP == BPF_STXW || OP == BPF_ATOMIC_W, uint32_t,
+          typename std::conditional<OP == BPF_LDXH || OP == BPF_STH || OP == BPF_STXH, uint16_t,
+          typename std::conditional<OP == BPF_LDXB || OP == BPF_STB || OP == BPF_STXB, uint8_t,
+          uint64_t>::type>::type>::type type;
+};
+
+// Atomic read-modify-write, see BPF_ATOMIC_* in Opcodes.h.
+// Returns false for an unknown operation.
+template <typename T, uint32_t OP>
+inline bool StaticAtomic(T* p, uint64_t& src, uint64_t& r0)
+{
+  T old;
+  switch (OP)
+  {
+    case BPF_ATOMIC_ADD:
+    case BPF_ATOMIC_ADD | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_add(p, (T)src, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_OR:
+    case BPF_ATOMIC_OR | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_or(p, (T)src, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_AND:
+    case BPF_ATOMIC_AND | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_and(p, (T)src, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_XOR:
+    case BPF_ATOMIC_XOR | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_xor(p, (T)src, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_XCHG:
+      old = __atomic_exchange_n(p, (T)src, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_CMPXCHG:
+      old = (T)r0;
+      __atomic_compare_exchange_n(p, &old, (T)src, false,
+              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      r0 = old;
+      return true;
+    default:
+      return false;
+  }
+  if (OP & BPF_ATOMIC_FETCH)
+  {
+    src = old;
+  }
+  return true;
+}
+
+// Runs one instruction and continues with the next one it leads to.
+// Returns STATIC_EXIT, STATIC_TAILCALL or why the run stopped early.
+// SB steps access the stack relative to R10 at s.fp without checks,
+// for programs that never write R10 running on a sandboxed VM.
+template <typename P, size_t PC, bool SB, bool End = (PC >= StaticSize<P>())>
+struct StaticStep
+{
+  typedef StaticInsn<P, PC> I;
+
+  // where control goes when a jump is taken
+  static constexpr size_t Target = (I::kind == KIND_JA || I::kind == KIND_JMP)
+          ? PC + 1 + I::off : PC + 1;
+
+  static inline uint32_t Exec(StaticState& s)
+  {
+    uint64_t& d = s.r[I::dst];
+    uint64_t src = I::useSrc ? s.r[I::src] : (uint64_t)I::imm;
+
+    switch (I::kind)
+    {
+      case KIND_ALU64:
+        if (I::divides && src == 0)
+        {
+          s.faultPc = PC;
+          return STATIC_DIVZERO;
+        }
+        d = StaticAlu64<I::op>(d, src);
+        break;
+      case KIND_ALU32:
+        if (I::divides && (uint32_t)src == 0)
+        {
+          s.faultPc = PC;
+          return STATIC_DIVZERO;
+        }
+        d = StaticAlu32<I::op>(d, src);
+        break;
+      case KIND_ENDIAN:
+        d = StaticEndian<I::op, I::imm>(d);
+        break;
+      case KIND_JA:
+        return StaticStep<P, Target, SB>::Exec(s);
+      case KIND_JMP:
+        if (StaticCond<I::op>(d, src))
+        {
+          return StaticStep<P, Target, SB>::Exec(s);
+        }
+        break;
+      case KIND_CALL:
+      {
+        Helper fn = GetHelper(I::imm);
+        if (!fn)
+        {
+          s.faultPc = PC;
+          return STATIC_BADOP;
+        }
+        uint32_t tailCalls = s.vm->GetTailCallCnt();
+        s.r[0] = CallHelper(fn, *s.vm, s.r[1], s.r[2], s.r[3], s.r[4], s.r[5]);
+        if (s.vm->GetTailCallCnt() != tailCalls)
+        {
+          return STATIC_TAILCALL;
+        }
+        break;
+      }
+      case KIND_EXIT:
+        return STATIC_EXIT;
+      case KIND_LDDW:
+        d = I::imm;
+        break;
+      // memory, through the region table as in VM::Eval
+      case KIND_LDX:
+        if (SB && I::src == 10)
+        {
+          typename StaticWidth<I::op>::type v;
+          memcpy(&v, s.fp + (int16_t)I::off, sizeof(v));
+          d = v;
+        }
+        else if (!MemLoad<typename StaticWidth<I::op>::type>(s.regions,
+                s.r[I::src] + (int16_t)I::off, d))
+        {
+          s.faultPc = PC;
+          return STATIC_FAULT;
+        }
+        break;
+      case KIND_ST:
+      case KIND_STX:
+        if (SB && I::dst == 10)
+        {
+          typename StaticWidth<I::op>::type v =
+                  (I::kind == KIND_STX) ? s.r[I::src] : I::imm;
+          memcpy(s.fp + (int16_t)I::off, &v, sizeof(v));
+        }
+        else if (!MemStore<typename StaticWidth<I::op>::type>(s.regions,
+                d + (int16_t)I::off, (I::kind == KIND_STX) ? s.r[I::src] : I::imm))
+        {
+          s.faultPc = PC;
+          return STATIC_FAULT;
+        }
+        break;
+      case KIND_ATOMIC:
+      {
+        // atomics also need natural alignment
+        typedef typename StaticWidth<I::op>::type T;
+        uint8_t* p = (SB && I::dst == 10) ? s.fp + (int16_t)I::off
+                   : MemStorePtr(s.regions, d + (int16_t)I::off, sizeof(T));
+        if (!p || reinterpret_cast<uintptr_t>(p) % sizeof(T) != 0)
+        {
+          s.faultPc = PC;
+          return STATIC_FAULT;
+        }
+        bool ok = StaticAtomic<T, I::imm>(reinterpret_cast<T*>(p),
+                                          s.r[I::src], s.r[0]);
+        if (!ok)
+        {
+          s.faultPc = PC;
+          return STATIC_BADOP;
+        }
+        break;
+      }
+      case KIND_PKT:
+      case KIND_BAD:
+        s.faultPc = PC;
+        return STATIC_BADOP;
+    }
+
+    return StaticStep<P, PC + 1, SB>::Exec(s);
+  }
+};
+
+// Running off the end of the program behaves like an exit
+template <typename P, size_t PC, bool SB>
+struct StaticStep<P, PC, SB, true>
+{
+  static inline uint32_t Exec(StaticState&)
+  {
+    return STATIC_EXIT;
+  }
+};
+
+template <typename P>
+struct StaticProgram
+{
+  // The program as ordinary bytecode, e.g. to run it on another engine
+  // or to continue in the interpreter after a tail call
+  static const std::vector<uint64_t>& Bytecode()
+  {
+    static const std::vector<uint64_t> prog(std::begin(P::insns),
+                                            std::end(P::insns));
+    return prog;
+  }
+
+  // Same contract as VM::Run: runs on the VM's registers and memory
+  // and returns R0
+  static uint64_t Run(VM& vm)
+  {
+    if (StaticHasLoops<P>())
+    {
+      return vm.Run(Bytecode());
+    }
+    vm.Load(Bytecode());
+
+    StaticState s;
+    vm.GetRegs(s.r);
+    s.regions = vm.GetRegions();
+    s.fp = vm.GetFramePointer();
+    s.vm = &vm;
+
+    uint32_t status;
+    if (!vm.IsSandboxed() || StaticWritesFp<P>())
+    {
+      status = StaticStep<P, 0, false>::Exec(s);
+    }
+    else
+    {
+      std::pair<StaticState*, uint32_t> run(&s, STATIC_EXIT);
+      if (!SandboxCall(*vm.GetSandbox(), [](void* arg)
+          {
+            auto* run = static_cast<std::pair<StaticState*, uint32_t>*>(arg);
+            run->second = StaticStep<P, 0, true>::Exec(*run->first);
+          }, &run))
+      {
+        vm.Fault(VM_ERR_ACCESS, VM_PC_UNKNOWN);
+        return s.r[0];
+      }
+      status = run.second;
+    }
+    vm.SetRegs(s.r);
+
+    if (status == STATIC_FAULT)
+    {
+      vm.Fault(VM_ERR_ACCESS, s.faultPc);
+    }
+    else if (status == STATIC_DIVZERO)
+    {
+      vm.Fault(VM_ERR_DIV_ZERO, s.faultPc);
+    }
+    else if (status == STATIC_BADOP)
+    {
+      vm.Fault(VM_ERR_BAD_OPCODE, s.faultPc);
+    }
+    else if (status == STATIC_TAILCALL)
+    {
+      // tail call targets are bytecode, the interpreter takes over
+      return vm.Resume();
+    }
+
+    return s.r[0];
+  }
+};
@@ -1,17 +1,37 @@
 #include "VM.h"
 #include "Opcodes.h"
+#include "Helpers.h"
+#include "Maps.h"
+#include "Sandbox.h"
+#include "ContextPool.h"
+#include "Layout.h"
 #include <cstdio>
-#include <arpa/inet.h>
+#include <cstring>
+#include <endian.h>
+#include <sched.h>
 
 
 // Default constructor
 VM::VM()
-: pc(0), running(false), _opcode(0), _dst(0),
-        _src(0), _offset(0), _imm(0)
+: pc(0), running(false), trace(true), insnCount(0), prog(nullptr),
+        tailCallCnt(0), loops(VM_LOOP_BUDGET), callbackDepth(0), cpu(0), _opcode(0), _dst(0), _src(0), _offset(0), _imm(0),
+        error(VM_OK), faultPc(0), suspended(false), readyFn(nullptr), readyArg(nullptr),
+        profile(nullptr)
 {
- 
+  memset(stack, 0, sizeof(stack));
+  memset(regions, 0, sizeof(regions));
+  memset(sampleRings, 0, sizeof(sampleRings));
+  AttachStack();
 }
 
+VM::~VM()
+{
+  
+}
+
+VM::VM(VM&&) = default;
+VM& VM::operator=(VM&&) = default;
+
 // Registers struct default constructor
 VM::Registers::Registers()
 : R0(0),R1(0),R2(0),R3(0),R4(0),R5(0),R6(0),
@@ -32,6 +52,89 @@ void VM::Decode(const uint64_t instr)
   _imm    = (instr & IMM_MASK) >> SHL_IMM;
 }
 
+// Take the jump of the current instruction. Loops can only iterate
+// through a backward jump, so that is the one place they are counted.
+inline void VM::Jump()
+{
+  if ((int16_t)_offset < 0)
+  {
+    if (loops == 0)
+    {
+      Fault(VM_ERR_LOOP, pc - 1);
+      return;
+    }
+    loops--;
+  }
+  pc += (int16_t)_offset;
+}
+
+// Conditional jump of the current instruction, counted if profiling
+inline void VM::Branch(bool taken)
+{
+  if (profile && profile->program == prog)
+  {
+    profile->Record(pc - 1, taken);
+  }
+  if (taken)
+  {
+    Jump();
+  }
+}
+
+// Atomic read-modify-write of *p for BPF_ATOMIC_W/DW.
+// Returns false for an unknown operation (imm).
+//
+// p   - naturally aligned target
+// op  - operation, see Opcodes.h
+// src - operand, receives the old value for fetching forms
+// r0  - expected value for cmpxchg, receives the old value
+template <typename T>
+static bool AtomicEval(T* p, uint32_t op, Register& src, Register& r0)
+{
+  T val = (T)src.Read64();
+  T old;
+  
+  switch (op)
+  {
+    case BPF_ATOMIC_ADD:
+    case BPF_ATOMIC_ADD | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_add(p, val, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_OR:
+    case BPF_ATOMIC_OR | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_or(p, val, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_AND:
+    case BPF_ATOMIC_AND | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_and(p, val, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_XOR:
+    case BPF_ATOMIC_XOR | BPF_ATOMIC_FETCH:
+      old = __atomic_fetch_xor(p, val, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_XCHG:
+      old = __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
+      break;
+    case BPF_ATOMIC_CMPXCHG:
+    {
+      // on failure the current value is written back into old
+      old = (T)r0.Read64();
+      __atomic_compare_exchange_n(p, &old, val, false,
+              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      r0.Write64(old);
+      return true;
+    }
+    default:
+      return false;
+  }
+  
+  if (op & BPF_ATOMIC_FETCH)
+  {
+    src.Write64(old);
+  }
+  return true;
+}
+
 // Evaluate instruction using the set state
 // A return value of 0 signifies no 
 // program return -> carry on with next instruction
@@ -78,12 +181,22 @@ uint64_t VM::Eval()
     }
     case BPF_DIV_IMM:
     {
+      if (_imm == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint64_t res = GetReg(_dst).Read64() / _imm;
       GetReg(_dst).Write64(res);
       break;
     }
     case BPF_DIV_SRC:
     {
+      if (GetReg(_src).Read64() == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint64_t res = GetReg(_dst).Read64() / GetReg(_src).Read64();
       GetReg(_dst).Write64(res);
       break;
@@ -138,18 +251,28 @@ uint64_t VM::Eval()
     }
     case BPF_NEG:
     {
-     uint64_t res = ~(GetReg(_dst).Read64());
-     GetReg(_dst).Write64(res);
-     break;
+      uint64_t res = -(GetReg(_dst).Read64());
+      GetReg(_dst).Write64(res);
+      break;
     }
     case BPF_MOD_IMM:
     {
+      if (_imm == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint64_t res = GetReg(_dst).Read64() % _imm;
       GetReg(_dst).Write64(res);
       break;
     }
     case BPF_MOD_SRC:
     {
+      if (GetReg(_src).Read64() == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint64_t res = GetReg(_dst).Read64() % GetReg(_src).Read64();
       GetReg(_dst).Write64(res);
       break;
@@ -226,12 +349,22 @@ uint64_t VM::Eval()
     }
     case BPF_DIV32_IMM:
     {
+      if (_imm == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint32_t res = GetReg(_dst).Read32() / _imm;
       GetReg(_dst).Write32(res);
       break;
     }
     case BPF_DIV32_SRC:
     {
+      if (GetReg(_src).Read32() == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint32_t res = GetReg(_dst).Read32() / GetReg(_src).Read32();
       GetReg(_dst).Write32(res);
       break;
@@ -286,18 +419,28 @@ uint64_t VM::Eval()
     }
     case BPF_NEG32:
     {
-      uint32_t res = ~(GetReg(_dst).Read32());
+      uint32_t res = -(GetReg(_dst).Read32());
       GetReg(_dst).Write32(res);
       break;
     }
     case BPF_MOD32_IMM:
     {
+      if (_imm == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint32_t res = GetReg(_dst).Read32() % _imm;
       GetReg(_dst).Write32(res);
       break;
     }
     case BPF_MOD32_SRC:
     {
+      if (GetReg(_src).Read32() == 0)
+      {
+        Fault(VM_ERR_DIV_ZERO, pc - 1);
+        break;
+      }
       uint32_t res = GetReg(_dst).Read32() % GetReg(_src).Read32();
       GetReg(_dst).Write32(res);
       break;
@@ -343,7 +486,7 @@ uint64_t VM::Eval()
         case 16:
         {
           uint16_t lsHw = (GetReg(_dst).Read64() & 0xffff);
-          lsHw = ntohs(lsHw);
+          lsHw = htole16(lsHw);
           uint32_t res = lsHw;
           GetReg(_dst).Write32(res);
           break;
@@ -351,15 +494,14 @@ uint64_t VM::Eval()
         case 32:
         {
           uint32_t res = GetReg(_dst).Read32();
-          res = ntohl(res);
+          res = htole32(res);
           GetReg(_dst).Write32(res);
           break;
         }
         case 64:
         default:
         {
-          uint64_t res = ntohl(GetReg(_dst).ReadMS32());
-          res = (res << 32) | ntohl(GetReg(_dst).Read32());
+          uint64_t res = htole64(GetReg(_dst).Read64());
           GetReg(_dst).Write64(res);
           break;
         }
@@ -373,7 +515,7 @@ uint64_t VM::Eval()
         case 16:
         {
           uint16_t lsHw = (GetReg(_dst).Read64() & 0xffff);
-          lsHw = htons(lsHw);
+          lsHw = htobe16(lsHw);
           uint32_t res = lsHw;
           GetReg(_dst).Write32(res);
           break;
@@ -381,15 +523,14 @@ uint64_t VM::Eval()
         case 32:
         {
           uint32_t res = GetReg(_dst).Read32();
-          res = htonl(res);
+          res = htobe32(res);
           GetReg(_dst).Write32(res);
           break;
         }
         case 64:
         default:
         {
-          uint64_t res = htonl(GetReg(_dst).ReadMS32());
-          res = (res << 32) | htonl(GetReg(_dst).Read32());
+          uint64_t res = htobe64(GetReg(_dst).Read64());
           GetReg(_dst).Write64(res);
           break;
         }
@@ -398,231 +539,257 @@ uint64_t VM::Eval()
     }
     case BPF_JA:
     {
-      pc += _offset;
+      Jump();
       break;
     }
     case BPF_JEQ_IMM:
     {
-      if (GetReg(_dst).Read64() == _imm)
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() == _imm);
       break;
     }
     case BPF_JEQ_SRC:
     {
-      if (GetReg(_dst).Read64() == GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() == GetReg(_src).Read64());
       break;
     }
     case BPF_JGT_IMM:
     {
-      if (GetReg(_dst).Read64() > _imm)
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() > _imm);
       break;
     }
     case BPF_JGT_SRC:
     {
-      if (GetReg(_dst).Read64() > GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() > GetReg(_src).Read64());
       break;
     }
     case BPF_JGE_IMM:
     {
-      if (GetReg(_dst).Read64() >= _imm)
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() >= _imm);
       break;
     }
     case BPF_JGE_SRC:
     {
-      if (GetReg(_dst).Read64() >= GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() >= GetReg(_src).Read64());
       break;
     }
     case BPF_JSET_IMM:
     {
-      if (GetReg(_dst).Read64() & _imm)
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() & _imm);
       break;
     }
     case BPF_JSET_SRC:
     {
-      if (GetReg(_dst).Read64() & GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() & GetReg(_src).Read64());
       break;
     }
     case BPF_JNE_IMM:
     {
-      if (GetReg(_dst).Read64() != _imm)
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() != _imm);
       break;
     }
     case BPF_JNE_SRC:
     {
-      if (GetReg(_dst).Read64() != GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch(GetReg(_dst).Read64() != GetReg(_src).Read64());
       break;
     }
     case BPF_JSGT_IMM:
     {
-      if ((int64_t)GetReg(_dst).Read64() > _imm)
-      {
-        pc += _offset;
-      }
+      Branch((int64_t)GetReg(_dst).Read64() > _imm);
       break;
     }
     case BPF_JSGT_SRC:
     {
-      if ((int64_t)GetReg(_dst).Read64() > (int64_t)GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch((int64_t)GetReg(_dst).Read64() > (int64_t)GetReg(_src).Read64());
       break;
     }
     case BPF_JSGE_IMM:
     {
-      if ((int64_t)GetReg(_dst).Read64() >= _imm)
-      {
-        pc += _offset;
-      }
+      Branch((int64_t)GetReg(_dst).Read64() >= _imm);
       break;
     }
     case BPF_JSGE_SRC:
     {
-      if ((int64_t)GetReg(_dst).Read64() >= (int64_t)GetReg(_src).Read64())
-      {
-        pc += _offset;
-      }
+      Branch((int64_t)GetReg(_dst).Read64() >= (int64_t)GetReg(_src).Read64());
       break;
     }
     case BPF_CALL_IMM:
     {
-      pc = _imm;
+      Helper fn = GetHelper(_imm);
+      if (!fn)
+      {
+        Fault(VM_ERR_BAD_OPCODE, pc - 1);
+        return 1;
+      }
+      
+      // a callback cannot stop half way, its helpers block instead
+      uint64_t res = callbackDepth
+              ? CallHelper(fn, *this, R1().Read64(), R2().Read64(), R3().Read64(),
+                           R4().Read64(), R5().Read64())
+              : fn(*this, R1().Read64(), R2().Read64(), R3().Read64(),
+                   R4().Read64(), R5().Read64());
+      if (suspended)
+      {
+        // stop in front of the call, Resume() makes it again
+        pc--;
+        running = false;
+        return 1;
+      }
+      R0().Write64(res);
       break;
     }
     case BPF_EXIT:
     {
-      // caller loaded R0
+      // caller loaded R0, which may well be 0 -> halt here rather
+      // than relying on a non-zero return
+      running = false;
       return R0().Read64();
       break;
     }
     case BPF_LDDW:
     {
-      GetReg(_dst).Write64(_imm);
+      GetReg(_dst).Write64(_src == BPF_PSEUDO_FUNC ? pc + (int32_t)_imm : _imm);
       break;
     }
+    // Memory: dst/src hold addresses, see Memory.h
     case BPF_LDXW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _src + _offset;
-      uint32_t offWord = *((uint32_t*)pByte);
-      GetReg(_dst).Write32(offWord);
+      uint64_t val;
+      if (!MemLoad<uint32_t>(regions, GetReg(_src).Read64() + (int16_t)_offset, val))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      GetReg(_dst).Write64(val);
       break;
     }
     case BPF_LDXH:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _src + _offset;
-      uint32_t offWord = *((uint16_t*)pByte);
-      GetReg(_dst).Write32(offWord);
+      uint64_t val;
+      if (!MemLoad<uint16_t>(regions, GetReg(_src).Read64() + (int16_t)_offset, val))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      GetReg(_dst).Write64(val);
       break;
     }
     case BPF_LDXB:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _src + _offset;
-      uint32_t offWord = *((uint8_t*)pByte);
-      GetReg(_dst).Write32(offWord);
+      uint64_t val;
+      if (!MemLoad<uint8_t>(regions, GetReg(_src).Read64() + (int16_t)_offset, val))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      GetReg(_dst).Write64(val);
       break;
     }
     case BPF_LDXDW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _src + _offset;
-      uint64_t offWord = *((uint64_t*)pByte);
-      GetReg(_dst).Write64(offWord);
+      uint64_t val;
+      if (!MemLoad<uint64_t>(regions, GetReg(_src).Read64() + (int16_t)_offset, val))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      GetReg(_dst).Write64(val);
       break;
     }
     case BPF_STW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint32_t stWord = _imm & 0xffffffff;
-      *pByte = stWord;
+      if (!MemStore<uint32_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset, _imm))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STH:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint16_t stHword = _imm & 0xffff;
-      *pByte = stHword;
+      if (!MemStore<uint16_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset, _imm))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STB:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint8_t stByte = _imm & 0xff;
-      *pByte = stByte;
+      if (!MemStore<uint8_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset, _imm))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STDW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint64_t stDword = _imm;
-      *pByte = stDword;
+      if (!MemStore<uint64_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset, _imm))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STXW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint32_t stWord = GetReg(_src).Read32();
-      *pByte = stWord;
+      if (!MemStore<uint32_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset,
+              GetReg(_src).Read64()))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STXH:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint16_t stHword = GetReg(_src).Read32() & 0xffff;
-      *pByte = stHword;
+      if (!MemStore<uint16_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset,
+              GetReg(_src).Read64()))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STXB:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint8_t stByte = GetReg(_src).Read32() & 0xff;
-      *pByte = stByte;
+      if (!MemStore<uint8_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset,
+              GetReg(_src).Read64()))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_STXDW:
     {
-      unsigned char *pByte = reinterpret_cast<unsigned char*>(_mem);
-      pByte += _dst + _offset;
-      uint64_t stDword = GetReg(_src).Read64();
-      *pByte = stDword;
+      if (!MemStore<uint64_t>(regions, GetReg(_dst).Read64() + (int16_t)_offset,
+              GetReg(_src).Read64()))
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      break;
+    }
+    case BPF_ATOMIC_W:
+    case BPF_ATOMIC_DW:
+    {
+      // atomics also need natural alignment
+      size_t size = (_opcode == BPF_ATOMIC_W) ? sizeof(uint32_t) : sizeof(uint64_t);
+      uint8_t* p = MemStorePtr(regions, GetReg(_dst).Read64() + (int16_t)_offset, size);
+      if (!p || reinterpret_cast<uintptr_t>(p) % size != 0)
+      {
+        Fault(VM_ERR_ACCESS, pc - 1);
+        return 1;
+      }
+      bool ok = (_opcode == BPF_ATOMIC_W)
+              ? AtomicEval(reinterpret_cast<uint32_t*>(p), _imm, GetReg(_src), Regs.R0)
+              : AtomicEval(reinterpret_cast<uint64_t*>(p), _imm, GetReg(_src), Regs.R0);
+      if (!ok)
+      {
+        Fault(VM_ERR_BAD_OPCODE, pc - 1);
+        return 1;
+      }
       break;
     }
     case BPF_LDABSW:
@@ -633,15 +800,11 @@ uint64_t VM::Eval()
     case BPF_LDINDH:
     case BPF_LDINDB:
     case BPF_LDINDDW:
-    {
-      printf("Unsupported instruction: LDIND | LDABS\n");
-      break;
-    }
     default:
     {
-      printf("Could not evaluate instruction: %016X\n", _opcode);
-      return 0;
-      break;
+      // legacy packet loads are not supported either
+      Fault(VM_ERR_BAD_OPCODE, pc - 1);
+      return 1;
     }
   }
   
@@ -670,6 +833,239 @@ Register& VM::GetReg(const unsigned num)
   }
 }
 
+// Return the VM to its just-constructed state so the same
+// instance can run another program (or the same one again).
+// The trace setting is kept.
+void VM::Reset()
+{
+  pc = 0;
+  running = false;
+  insnCount = 0;
+  prog = nullptr;
+  tailCallCnt = 0;
+  loops = VM_LOOP_BUDGET;
+  callbackDepth = 0;
+  _opcode = 0;
+  _dst = 0;
+  _src = 0;
+  _offset = 0;
+  _imm = 0;
+  error = VM_OK;
+  faultPc = 0;
+  suspended = false;
+  memset(GetStack(), 0, regions[MEM_REGION_STACK].writeSize);
+  Regs = Registers();
+}
+
+// Replace the running program with another one, reusing the current
+// registers and stack (no new frame). Execution continues at its first
+// instruction. Fails once MAX_TAIL_CALL_CNT tail calls have been taken,
+// and in callbacks.
+bool VM::TailCall(const std::vector<uint64_t>& next)
+{
+  if (tailCallCnt >= MAX_TAIL_CALL_CNT || callbackDepth)
+  {
+    return false;
+  }
+  
+  tailCallCnt++;
+  prog = &next;
+  pc = 0;
+  return true;
+}
+
+bool VM::Callback(uint64_t target, uint64_t r1, uint64_t r2, uint64_t& ret)
+{
+  if (loops == 0)
+  {
+    Fault(VM_ERR_LOOP, pc - 1);
+    return false;
+  }
+  loops--;
+  
+  // the callback's frame has to fit below the caller's
+  uint64_t fp = Regs.R10.Read64();
+  if ((fp & MEM_OFFSET_MASK) < 2 * MAX_BPF_STACK)
+  {
+    Fault(VM_ERR_ACCESS, pc - 1);
+    return false;
+  }
+  
+  // like a call of another function: R6-R10 survive it, and the
+  // caller carries on after the helper call that got here
+  Registers saved = Regs;
+  uint64_t savedPc = pc;
+  
+  pc = target;
+  R1().Write64(r1);
+  R2().Write64(r2);
+  Regs.R10.Write64(fp - MAX_BPF_STACK);
+  running = true;
+  callbackDepth++;
+  Interpret();
+  callbackDepth--;
+  ret = R0().Read64();
+  
+  if (error != VM_OK)
+  {
+    return false;
+  }
+  
+  Regs = saved;
+  pc = savedPc;
+  running = true;
+  return true;
+}
+
+// Make a map visible to programs under the given id
+void VM::SetMap(const uint32_t id, Map* map)
+{
+  if (id >= maps.size())
+  {
+    maps.resize(id + 1, nullptr);
+  }
+  
+  maps[id] = map;
+  
+  // map values become addressable, so lookups can return pointers
+  if (id < MAX_MEM_REGIONS - MEM_REGION_MAP0)
+  {
+    MemRegion& r = regions[MEM_REGION_MAP0 + id];
+    r.base = map ? map->Values() : nullptr;
+    r.readSize = r.base ? map->ValuesSize() : 0;
+    r.writeSize = r.readSize;
+  }
+}
+
+uint64_t VM::SetContext(void* data, uint64_t size, bool writable)
+{
+  MemRegion& r = regions[MEM_REGION_CTX];
+  r.base = static_cast<uint8_t*>(data);
+  r.readSize = data ? size : 0;
+  r.writeSize = writable ? r.readSize : 0;
+  
+  return MemAddr(MEM_REGION_CTX, 0);
+}
+
+uint64_t VM::MapSample(Map* ring, uint8_t* sample, uint64_t size)
+{
+  for (uint32_t i = 0; i < MEM_SAMPLES; i++)
+  {
+    if (!sampleRings[i])
+    {
+      MemRegion& r = regions[MEM_REGION_SAMPLE0 + i];
+      r.base = sample;
+      r.readSize = size;
+      r.writeSize = size;
+      sampleRings[i] = ring;
+      return MemAddr(MEM_REGION_SAMPLE0 + i, 0);
+    }
+  }
+  return 0;
+}
+
+Map* VM::UnmapSample(uint64_t addr, uint8_t*& sample)
+{
+  uint64_t i = (addr >> MEM_REGION_SHIFT) - MEM_REGION_SAMPLE0;
+  if (i >= MEM_SAMPLES || (addr & MEM_OFFSET_MASK) || !sampleRings[i])
+  {
+    return nullptr;
+  }
+  
+  Map* ring = sampleRings[i];
+  sample = regions[MEM_REGION_SAMPLE0 + i].base;
+  memset(&regions[MEM_REGION_SAMPLE0 + i], 0, sizeof(MemRegion));
+  sampleRings[i] = nullptr;
+  return ring;
+}
+
+void VM::Suspend(VMReadyFn ready, void* arg)
+{
+  suspended = true;
+  readyFn = ready;
+  readyArg = arg;
+}
+
+void VM::LoadContext(const ExecContext& c)
+{
+  prog = c.prog;
+  pc = c.pc;
+  loops = c.loops;
+  callbackDepth = 0;
+  tailCallCnt = c.tailCallCnt;
+  error = c.error;
+  suspended = c.suspended;
+  readyFn = c.readyFn;
+  readyArg = c.readyArg;
+  SetRegs(c.regs);
+  
+  // the next Load() puts the VM's own stack back
+  MemRegion& stackRegion = regions[MEM_REGION_STACK];
+  stackRegion.base = c.stack;
+  stackRegion.readSize = c.stackSize;
+  stackRegion.writeSize = c.stackSize;
+  regions[MEM_REGION_CTX] = c.ctx;
+  memcpy(&regions[MEM_REGION_SAMPLE0], c.samples, sizeof(c.samples));
+  memcpy(sampleRings, c.sampleRings, sizeof(sampleRings));
+}
+
+void VM::SaveContext(ExecContext& c) const
+{
+  c.pc = pc;
+  c.loops = loops;
+  c.prog = prog;
+  c.tailCallCnt = tailCallCnt;
+  c.error = error;
+  c.suspended = suspended;
+  c.readyFn = readyFn;
+  c.readyArg = readyArg;
+  memcpy(c.samples, &regions[MEM_REGION_SAMPLE0], sizeof(c.samples));
+  memcpy(c.sampleRings, sampleRings, sizeof(c.sampleRings));
+  GetRegs(c.regs);
+}
+
+// Block until a suspended helper can complete, then clear the
+// suspension so that it can be called again
+void VM::WaitReady()
+{
+  while (!IsReady())
+  {
+    sched_yield();
+  }
+  suspended = false;
+}
+
+// Faults end the run; R0 is left as it was, callers check GetError()
+void VM::Fault(uint32_t err, uint64_t at)
+{
+  error = err;
+  faultPc = at;
+  running = false;
+}
+
+// Copy all 11 registers out to / in from a plain array, in register
+// order. Used by engines that keep registers in their own storage.
+void VM::GetRegs(uint64_t* out) const
+{
+  static_assert(sizeof(Registers) == 11 * sizeof(Register),
+                "registers are expected to be laid out back to back");
+  
+  const Register* regs = &Regs.R0;
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    out[i] = regs[i].Read64();
+  }
+}
+
+void VM::SetRegs(const uint64_t* in)
+{
+  Register* regs = &Regs.R0;
+  for (unsigned i = 0; i <= 10; i++)
+  {
+    regs[i].Write64(in[i]);
+  }
+}
+
 bool VM::IsRunning() const
 {
   return running;
@@ -710,19 +1106,98 @@ void VM::DisplayAll() const
   DisplayRegs();
 }
 
+// Make program the current one, starting at its first instruction.
+// Engines other than the interpreter use this so helpers (tail calls
+// in particular) see the same state as under Run().
+void VM::Load(const std::vector<uint64_t>& program)
+{
+  prog = &program;
+  pc = 0;
+  tailCallCnt = 0;
+  loops = VM_LOOP_BUDGET;
+  callbackDepth = 0;
+  error = VM_OK;
+  faultPc = 0;
+  suspended = false;
+  memset(&regions[MEM_REGION_SAMPLE0], 0, MEM_SAMPLES * sizeof(MemRegion));
+  memset(sampleRings, 0, sizeof(sampleRings));
+  if (profile && profile->program == prog)
+  {
+    profile->runs++;
+  }
+  
+  // refreshed on every run so a moved VM addresses its own stack
+  AttachStack();
+  Regs.R10.Write64(MemAddr(MEM_REGION_STACK, regions[MEM_REGION_STACK].writeSize));
+}
+
+// Point the stack region at the guarded stack in sandbox mode, at the
+// VM's own otherwise
+void VM::AttachStack()
+{
+  MemRegion& r = regions[MEM_REGION_STACK];
+  r.base = sandbox ? sandbox->Base() : stack;
+  r.readSize = sandbox ? sandbox->Size() : sizeof(stack);
+  r.writeSize = r.readSize;
+}
+
+// The guarded stack is a whole page, so checked and unchecked accesses
+// agree on what is in bounds
+void VM::SetSandbox(bool on)
+{
+  if (on && !sandbox)
+  {
+    sandbox.reset(new SandboxMemory(VM_STACK_SIZE));
+  }
+  else if (!on)
+  {
+    sandbox.reset();
+  }
+  AttachStack();
+}
+
 // "main" run routine for the VM
 // Kicks off the Fetch->Decode->Eval
 uint64_t VM::Run(const std::vector<uint64_t>& program)
+{
+  Load(program);
+  
+  return Resume();
+}
+
+// Carry on interpreting the current program from the current pc
+uint64_t VM::Resume()
 {
   running = true;
+  suspended = false;
+  
+  if (!sandbox)
+  {
+    Interpret();
+  }
+  else if (!SandboxCall(*sandbox, [](void* vm) {static_cast<VM*>(vm)->Interpret();}, this))
+  {
+    Fault(VM_ERR_ACCESS, pc - 1);
+  }
   
+  // pass ret value
+  return R0().Read64();
+}
+
+// Fetch->Decode->Eval until the program exits or faults
+void VM::Interpret()
+{
   while (IsRunning())
   {
     // display register contents
-    DisplayRegs();
+    if (trace)
+    {
+      DisplayRegs();
+    }
     
     // fetch next instruction
-    uint64_t instr = program[pc++];
+    uint64_t instr = (*prog)[pc++];
+    insnCount++;
     
     // decode fetched instruction
     Decode(instr);
@@ -734,7 +1209,4 @@ uint64_t VM::Run(const std::vector<uint64_t>& program)
       running = false;
     }
   }
-  
-  // pass ret value
-  return R0().Read64();
-}
\ No newline at end of file
+}
@@ -1,11 +1,35 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include "Registers.h"
+#include "Memory.h"
+
+class Map;
+class SandboxMemory;
+struct BranchProfile;
+struct ExecContext;
 
 #define NUM_REGS 10
-#define NUM_MEMSLOTS 16
+
+// Why the last run stopped before reaching an exit, see GetError()
+#define VM_OK             0
+#define VM_ERR_ACCESS     1 // load or store outside the program's regions
+#define VM_ERR_LOOP       2 // loop budget used up, see VM_LOOP_BUDGET
+#define VM_ERR_DIV_ZERO   3 // division or modulo by zero
+#define VM_ERR_BAD_OPCODE 4 // instruction the VM does not know
+#define VM_ERRORS         5
+
+// Loop iterations a run may take: every backward jump taken and every
+// bpf_loop callback uses up one, straight-line code none
+#define VM_LOOP_BUDGET (1 << 23)
+
+// Fault position of accesses caught by the sandbox's guard pages
+#define VM_PC_UNKNOWN (~0ULL)
+
+// Whether a suspended run may be resumed, see VM::Suspend
+typedef bool (*VMReadyFn)(void* arg);
 
 class VM
 {
@@ -13,6 +37,16 @@ private:
   /* --------------- State -----------------*/
   uint64_t pc;  // program counter
   bool running; // running/halt flag
+  bool trace;   // dump registers before every instruction
+  uint64_t insnCount; // instructions executed since last Reset()
+  
+  const std::vector<uint64_t>* prog; // program being run
+  uint32_t tailCallCnt;               // tail calls taken in this run
+  uint64_t loops;                     // loop iterations left in this run
+  uint32_t callbackDepth;             // nested Callback() runs
+  uint32_t cpu;                       // see SetCpu()
+  std::vector<Map*> maps;             // maps visible to programs, by id
+  Map* sampleRings[MEM_SAMPLES];      // ring of each sample region
   
   uint8_t _opcode;  // instruction opcode
   uint8_t _dst;     // destination
@@ -20,7 +54,18 @@ private:
   uint16_t _offset; // offset
   uint32_t _imm;    // immediate
   
-  uint64_t _mem[NUM_MEMSLOTS];   // scratch memory
+  uint32_t error;    // VM_OK or the reason the run stopped
+  uint64_t faultPc;  // where it did, see Fault()
+  
+  bool suspended;    // stopped before a helper call, see Suspend()
+  VMReadyFn readyFn; // when to call it again
+  void* readyArg;
+  
+  BranchProfile* profile; // jumps of its program counted here, if set
+  
+  alignas(8) uint8_t stack[VM_STACK_SIZE];
+  MemRegion regions[MAX_MEM_REGIONS];  // what programs can address
+  std::unique_ptr<SandboxMemory> sandbox; // guarded stack, if enabled
   
   struct Registers
   {
@@ -49,18 +94,117 @@ private:
   } Regs;
   
   void Decode(const uint64_t);
+  void Jump();
+  void Branch(bool taken);
   uint64_t Eval();
+  void Interpret();
+  void AttachStack();
   
 public:
   VM();
+  ~VM();
+  VM(VM&&);
+  VM& operator=(VM&&);
   uint64_t Run(const std::vector<uint64_t>&);
+  void Load(const std::vector<uint64_t>&);
+  uint64_t Resume();
+  void Reset();
   bool IsRunning() const;
+  void SetTrace(bool on) {trace = on;};
+  
+  bool TailCall(const std::vector<uint64_t>&);
+  void SetMap(const uint32_t, Map*);
+  Map* GetMap(const uint64_t id) const
+  {
+    return (id < maps.size()) ? maps[id] : nullptr;
+  };
+  // CPU index of the worker running this VM: what programs get from
+  // bpf_get_smp_processor_id, and whose copy of per-CPU map values
+  // they see. Give every worker thread its own VMs and index, below
+  // the Cpus() of the per-CPU maps attached. Kept across Reset().
+  void SetCpu(uint32_t index) {cpu = index;};
+  uint32_t GetCpu() const {return cpu;};
+  
+  // Expose size bytes at data to programs as the context region.
+  // Returns its address, which hosts usually pass in R1.
+  uint64_t SetContext(void* data, uint64_t size, bool writable);
+  
+  // Ring buffer samples: a reserved sample of ring is exposed to the
+  // program as a region of its own, size bytes at sample, so it cannot
+  // reach the rest of the ring. Returns its address, 0 if the program
+  // holds MEM_SAMPLES samples already. UnmapSample takes the region of
+  // the sample at addr away again and returns its ring and host pointer
+  // (nullptr unless addr is the start of a sample). Runs start with none.
+  uint64_t MapSample(Map* ring, uint8_t* sample, uint64_t size);
+  Map* UnmapSample(uint64_t addr, uint8_t*& sample);
+  
+  // Sandbox mode: the stack is a page surrounded by guard pages, which
+  // lets compiled code access it relative to R10 without bounds checks.
+  // Faults in the guards end the run with VM_ERR_ACCESS.
+  void SetSandbox(bool on);
+  bool IsSandboxed() const {return sandbox != nullptr;};
+  const SandboxMemory* GetSandbox() const {return sandbox.get();};
+  
+  // Suspension: a helper that cannot complete yet (e.g. its data is
+  // still being paged in) calls Suspend() and returns. The interpreter
+  // then stops in front of the call, IsSuspended() is true and a later
+  // Resume() calls the helper again, once ready(arg) says it can
+  // complete. Engines that cannot stop mid-program wait for ready and
+  // call again right away (CallHelper in Helpers.h).
+  void Suspend(VMReadyFn ready, void* arg);
+  bool IsSuspended() const {return suspended;};
+  bool IsReady() const {return !suspended || !readyFn || readyFn(readyArg);};
+  void WaitReady();
+  
+  // Run the callback at instruction target of the current program, with
+  // R1 and R2 as given and a stack frame of its own MAX_BPF_STACK below
+  // the caller's, until it exits. The caller's registers and position
+  // are restored afterwards and ret is the callback's R0. Uses up one
+  // loop iteration; false if the run faulted instead (out of loop
+  // budget, or of stack for another frame) and has to end.
+  // Helpers called from a callback cannot suspend or tail call.
+  bool Callback(uint64_t target, uint64_t r1, uint64_t r2, uint64_t& ret);
+  void EnterCallback() {callbackDepth++;};
+  void LeaveCallback() {callbackDepth--;};
+  bool InCallback() const {return callbackDepth != 0;};
+  uint64_t GetLoops() const {return loops;};
+  void SetLoops(uint64_t n) {loops = n;};
+  
+  // Count the runs of profile->program and where its conditional jumps
+  // went into profile (see Layout.h), nullptr to stop
+  void SetProfile(BranchProfile* p) {profile = p;};
+  BranchProfile* GetProfile() const {return profile;};
+  
+  // Switch to an execution kept outside the VM (see ContextPool.h):
+  // Load takes over its registers, position, stack and context region,
+  // Save writes them back after Resume() returned
+  void LoadContext(const ExecContext&);
+  void SaveContext(ExecContext&) const;
+  
+  // Stop the current run because of a fault in instruction pc
+  // (VM_PC_UNKNOWN if it is not known). Nothing is printed: callers
+  // look at GetError() and GetFaultPc() (and Metrics count errors).
+  void Fault(uint32_t err, uint64_t pc);
+  uint32_t GetError() const {return error;};
+  uint64_t GetFaultPc() const {return faultPc;};
+  
   void DisplayRegs() const;
   void DisplayState() const;
   void DisplayAll() const;
   
   uint64_t GetPc() const {return pc;};
+  uint64_t GetInsnCount() const {return insnCount;};
+  uint32_t GetTailCallCnt() const {return tailCallCnt;};
+  const std::vector<uint64_t>* GetProgram() const {return prog;};
+  uint8_t* GetStack() {return regions[MEM_REGION_STACK].base;};
+  uint8_t* GetFramePointer()
+  {
+    return regions[MEM_REGION_STACK].base + regions[MEM_REGION_STACK].writeSize;
+  };
+  const MemRegion* GetRegions() const {return regions;};
   Register& GetReg(const unsigned);
+  void GetRegs(uint64_t*) const;
+  void SetRegs(const uint64_t*);
   Register& R0() {return Regs.R0;};
   Register& R1() {return Regs.R1;};
   Register& R2() {return Regs.R2;};
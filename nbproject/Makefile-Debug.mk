@@ -35,8 +35,26 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
+	${OBJECTDIR}/Analysis.o \
+	${OBJECTDIR}/Aot.o \
 	${OBJECTDIR}/Assembler.o \
+	${OBJECTDIR}/ClassicBpf.o \
+	${OBJECTDIR}/Classifier.o \
+	${OBJECTDIR}/ContextPool.o \
+	${OBJECTDIR}/EbpfVm.o \
+	${OBJECTDIR}/Helpers.o \
+	${OBJECTDIR}/Layout.o \
+	${OBJECTDIR}/LpmTrie.o \
+	${OBJECTDIR}/MapPin.o \
+	${OBJECTDIR}/Maps.o \
+	${OBJECTDIR}/Metrics.o \
+	${OBJECTDIR}/PerfCounters.o \
+	${OBJECTDIR}/Pipeline.o \
+	${OBJECTDIR}/ProgramHandle.o \
 	${OBJECTDIR}/Register.o \
+	${OBJECTDIR}/RingBuffer.o \
+	${OBJECTDIR}/Sandbox.o \
+	${OBJECTDIR}/Scheduler.o \
 	${OBJECTDIR}/VM.o \
 	${OBJECTDIR}/main.o
 
@@ -55,7 +73,7 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=
+LDLIBSOPTIONS=-ldl
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
@@ -65,16 +83,106 @@ ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/ebpf_vm: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
 	${LINK.cc} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/ebpf_vm ${OBJECTFILES} ${LDLIBSOPTIONS}
 
+${OBJECTDIR}/Analysis.o: Analysis.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Analysis.o Analysis.cpp
+
+${OBJECTDIR}/Aot.o: Aot.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Aot.o Aot.cpp
+
 ${OBJECTDIR}/Assembler.o: Assembler.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Assembler.o Assembler.cpp
 
+${OBJECTDIR}/ClassicBpf.o: ClassicBpf.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ClassicBpf.o ClassicBpf.cpp
+
+${OBJECTDIR}/Classifier.o: Classifier.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Classifier.o Classifier.cpp
+
+${OBJECTDIR}/ContextPool.o: ContextPool.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ContextPool.o ContextPool.cpp
+
+${OBJECTDIR}/EbpfVm.o: EbpfVm.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/EbpfVm.o EbpfVm.cpp
+
+${OBJECTDIR}/Helpers.o: Helpers.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Helpers.o Helpers.cpp
+
+${OBJECTDIR}/Layout.o: Layout.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Layout.o Layout.cpp
+
+${OBJECTDIR}/LpmTrie.o: LpmTrie.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/LpmTrie.o LpmTrie.cpp
+
+${OBJECTDIR}/MapPin.o: MapPin.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/MapPin.o MapPin.cpp
+
+${OBJECTDIR}/Maps.o: Maps.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Maps.o Maps.cpp
+
+${OBJECTDIR}/Metrics.o: Metrics.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Metrics.o Metrics.cpp
+
+${OBJECTDIR}/PerfCounters.o: PerfCounters.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/PerfCounters.o PerfCounters.cpp
+
+${OBJECTDIR}/Pipeline.o: Pipeline.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Pipeline.o Pipeline.cpp
+
+${OBJECTDIR}/ProgramHandle.o: ProgramHandle.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ProgramHandle.o ProgramHandle.cpp
+
 ${OBJECTDIR}/Register.o: Register.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Register.o Register.cpp
 
+${OBJECTDIR}/RingBuffer.o: RingBuffer.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/RingBuffer.o RingBuffer.cpp
+
+${OBJECTDIR}/Sandbox.o: Sandbox.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Sandbox.o Sandbox.cpp
+
+${OBJECTDIR}/Scheduler.o: Scheduler.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -std=c++14 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Scheduler.o Scheduler.cpp
+
 ${OBJECTDIR}/VM.o: VM.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"